@@ -0,0 +1,95 @@
+﻿#ifndef _LOAD_GENERATOR_HPP_
+#define _LOAD_GENERATOR_HPP_
+
+#include "../common-test/asio_header.hpp"
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+namespace jw {
+
+    // 压测工具，在本机对服务器发起大量连接
+    class LoadGenerator {
+    public:
+        LoadGenerator(const LoadGenerator &) = delete;
+        LoadGenerator &operator=(const LoadGenerator &) = delete;
+
+        LoadGenerator(const char *ip, unsigned short port)
+            : _endpoint(asio::ip::address::from_string(ip), port) {
+        }
+
+        // 连接风暴：同时保持concurrency个进行中的connect，直到建立count个连接
+        // 全部建立后统计耗时和每个connect的延迟，然后断开所有连接
+        void runConnectStorm(size_t count, size_t concurrency) {
+            asio::io_service service;
+            std::vector<std::unique_ptr<asio::ip::tcp::socket> > sockets;
+            sockets.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                sockets.push_back(std::unique_ptr<asio::ip::tcp::socket>(new asio::ip::tcp::socket(service)));
+            }
+            std::vector<double> latencies(count);
+            std::atomic<size_t> next{ 0 };
+            std::atomic<size_t> failed{ 0 };
+
+            std::function<void ()> connectOne = [&]() {
+                size_t i = next++;
+                if (i >= count) {
+                    return;
+                }
+                std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+                sockets[i]->async_connect(_endpoint, [&, i, begin](std::error_code ec) {
+                    latencies[i] = std::chrono::duration_cast<std::chrono::duration<double, std::micro> >(std::chrono::high_resolution_clock::now() - begin).count();
+                    if (ec) {
+                        ++failed;
+                    }
+                    connectOne();
+                });
+            };
+
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < concurrency; ++i) {
+                connectOne();
+            }
+            _runThreads(service);
+            double seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::high_resolution_clock::now() - begin).count();
+
+            std::sort(latencies.begin(), latencies.end());
+            printf("connect-storm: %lu connections (%lu failed) in %.3f s, %.0f conn/s, latency p50 %.0f us p99 %.0f us max %.0f us\n",
+                (unsigned long)count, (unsigned long)failed, seconds, count / seconds,
+                _percentile(latencies, 0.50), _percentile(latencies, 0.99), latencies.empty() ? 0.0 : latencies.back());
+
+            for (size_t i = 0; i < count; ++i) {
+                std::error_code ec;
+                sockets[i]->close(ec);
+            }
+        }
+
+    private:
+        // 用所有核运行service，直到没有待处理的操作
+        static void _runThreads(asio::io_service &service) {
+            size_t hc = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < hc; ++i) {
+                threads.push_back(std::thread([&service]() { service.run(); }));
+            }
+            std::for_each(threads.begin(), threads.end(), [](std::thread &t) { t.join(); });
+        }
+
+        static double _percentile(const std::vector<double> &sorted, double p) {
+            if (sorted.empty()) {
+                return 0.0;
+            }
+            return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * p))];
+        }
+
+        asio::ip::tcp::endpoint _endpoint;
+    };
+}
+
+#endif
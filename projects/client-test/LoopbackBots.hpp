@@ -0,0 +1,125 @@
+﻿#ifndef _LOOPBACK_BOTS_HPP_
+#define _LOOPBACK_BOTS_HPP_
+
+#include "../common-test/LoopbackTransport.hpp"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <functional>
+
+namespace jw {
+
+    // 机器人：在一个进程里经共享内存（见LoopbackTransport.hpp）连接同一台机器上的游戏服（game-server --shm <name>）
+    // 每个机器人进入房间后每秒发一条聊天，统计收到的包数，用来在不经过网络协议栈的情况下压测房间的广播
+    // 机器人与其他客户端一样受游戏服的限流，发送速率在默认限流之内
+    class LoopbackBots {
+    public:
+        LoopbackBots(const LoopbackBots &) = delete;
+        LoopbackBots &operator=(const LoopbackBots &) = delete;
+
+        explicit LoopbackBots(const std::string &name) : _name(name) { }
+
+        // 连接count个机器人，运行seconds秒，每秒输出一次统计，结束时断开
+        void run(size_t count, size_t seconds) {
+            std::shared_ptr<LoopbackRegion> region = LoopbackRegion::openShared(_name);
+            if (region == nullptr) {
+                printf("shm-bots: failed to open %s\n", _name.c_str());
+                return;
+            }
+            std::vector<std::unique_ptr<LoopbackClient> > bots;
+            for (size_t i = 0; i < count; ++i) {
+                std::unique_ptr<LoopbackClient> bot = LoopbackClient::connect(region, std::function<void ()>());
+                if (bot == nullptr) {
+                    break;
+                }
+                bots.push_back(std::move(bot));
+            }
+            printf("shm-bots: %lu of %lu bot(s) connected to %s\n", (unsigned long)bots.size(), (unsigned long)count, _name.c_str());
+
+            typedef std::chrono::steady_clock Clock;
+            Clock::time_point begin = Clock::now();
+            Clock::time_point end = begin + std::chrono::seconds(seconds);
+            Clock::time_point nextReport = begin + std::chrono::seconds(1);
+            std::vector<Clock::time_point> nextChat(bots.size());
+            for (size_t i = 0; i < bots.size(); ++i) {
+                // 进入房间，聊天错开在一秒之内
+                _send(*bots[i], 3000, (unsigned)i + 1, "{}");
+                nextChat[i] = begin + std::chrono::milliseconds(1000 * i / bots.size());
+            }
+
+            uint64_t sent = bots.size(), received = 0, receivedBytes = 0, lastReceived = 0, lastBytes = 0;
+            size_t closed = 0;
+            std::vector<bool> closedFlags(bots.size(), false);
+            for (Clock::time_point now = Clock::now(); now < end; now = Clock::now()) {
+                size_t packets = 0;
+                for (size_t i = 0; i < bots.size(); ++i) {
+                    bool pinged = false;
+                    packets += bots[i]->receive([&receivedBytes, &pinged](const char *data, size_t length) {
+                        receivedBytes += length + 4;
+                        if (jw::JsonPacketSplitter::peekCommand(data, length) == CMD_PING) {
+                            pinged = true;
+                        }
+                    });
+                    if (pinged) {
+                        // 服务端认为连接空闲时发来的ping，不回应会被断开
+                        sent += _send(*bots[i], CMD_PING, 0, "{}") ? 1 : 0;
+                    }
+                    if (bots[i]->isClosed()) {
+                        if (!closedFlags[i]) {
+                            closedFlags[i] = true;
+                            ++closed;
+                        }
+                        continue;
+                    }
+                    if (now >= nextChat[i]) {
+                        nextChat[i] += std::chrono::seconds(1);
+                        char json[64];
+                        snprintf(json, sizeof(json), "{\"content\":\"bot %lu\"}", (unsigned long)i);
+                        sent += _send(*bots[i], 3004, 0, json) ? 1 : 0;
+                    }
+                }
+                received += packets;
+                if (now >= nextReport) {
+                    nextReport += std::chrono::seconds(1);
+                    printf("shm-bots: %lu open, sent %llu, received %llu packet(s)/s, %.1f MB/s\n", (unsigned long)(bots.size() - closed),
+                        (unsigned long long)sent, (unsigned long long)(received - lastReceived), (receivedBytes - lastBytes) / 1048576.0);
+                    lastReceived = received;
+                    lastBytes = receivedBytes;
+                }
+                if (packets == 0) {
+                    // 游戏服在同一台机器上，没有数据时不空转
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+
+            double elapsed = std::chrono::duration_cast<std::chrono::duration<double> >(Clock::now() - begin).count();
+            printf("shm-bots: %lu bot(s), %lu closed by server, sent %llu, received %llu packet(s) in %.1f s, %.0f packet(s)/s\n",
+                (unsigned long)bots.size(), (unsigned long)closed, (unsigned long long)sent, (unsigned long long)received, elapsed, received / elapsed);
+            bots.clear();
+        }
+
+    private:
+        // 包格式与TCP客户端相同：4字节包体长度 + 4字节cmd + 4字节tag + JSON
+        static bool _send(LoopbackClient &bot, unsigned cmd, unsigned tag, const char *json) {
+            std::vector<char> buf(12);
+            buf.insert(buf.end(), json, json + strlen(json));
+            size_t length = buf.size() - 4;
+            for (int i = 0; i < 4; ++i) {
+                buf[i] = (char)((length >> (i * 8)) & 0xFF);
+                buf[4 + i] = (char)((cmd >> (i * 8)) & 0xFF);
+                buf[8 + i] = (char)((tag >> (i * 8)) & 0xFF);
+            }
+            return bot.deliver(buf.data(), buf.size());
+        }
+
+        std::string _name;
+    };
+}
+
+#endif
@@ -1,11 +1,16 @@
 ﻿#include "ClientConnection.h"
+#include "LoadGenerator.hpp"
+#include "LoopbackBots.hpp"
 
 #include <iostream>
+#include <string.h>
+#include <mutex>
 
 #undef min
 #undef max
 
 #include "../json-test/cppJSON.hpp"
+#include "../common-test/PacketSplitter.hpp"
 
 static const char *debugString(unsigned ca) {
     const char *table[5][11] = {
@@ -21,13 +26,34 @@ static const char *debugString(unsigned ca) {
     return suit < 5 ? table[suit - 1][rank - 5] : table[4][rank - 14];
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    // client-test connect-storm [ip] [port] [count] [concurrency]
+    if (argc > 1 && strcmp(argv[1], "connect-storm") == 0) {
+        const char *ip = argc > 2 ? argv[2] : "127.0.0.1";
+        unsigned short port = argc > 3 ? (unsigned short)atoi(argv[3]) : 8899;
+        size_t count = argc > 4 ? (size_t)atoi(argv[4]) : 10000;
+        size_t concurrency = argc > 5 ? (size_t)atoi(argv[5]) : 512;
+        jw::LoadGenerator(ip, port).runConnectStorm(count, concurrency);
+        return 0;
+    }
+
+    // client-test shm-bots [name] [count] [seconds]：经共享内存连接game-server --shm <name>
+    if (argc > 1 && strcmp(argv[1], "shm-bots") == 0) {
+        const char *name = argc > 2 ? argv[2] : "game-server";
+        size_t count = argc > 3 ? (size_t)atoi(argv[3]) : 100;
+        size_t seconds = argc > 4 ? (size_t)atoi(argv[4]) : 10;
+        jw::LoopbackBots(name).run(count, seconds);
+        return 0;
+    }
+
     system("chcp 65001");
     jw::ClientConnection cc;
     //cc.connentToServer("192.168.0.104", 8899);
     cc.connentToServer("127.0.0.1", 8899);
 
-    std::thread t([&cc]() {
+    // 接收线程回应ping，与输入线程共用发送缓冲区
+    std::mutex sendMutex;
+    std::thread t([&cc, &sendMutex]() {
         char head[4];
         char buf[1024];
         while (1) {
@@ -41,6 +67,13 @@ int main() {
                 length <<= 8;
                 length |= (unsigned char)head[0];
                 ret = cc.readBuf(buf, length);
+                if (ret > 0 && jw::JsonPacketSplitter::peekCommand(buf, (size_t)ret) == CMD_PING) {
+                    // 服务端认为连接空闲时发来的ping，不回应会被断开
+                    std::vector<char> pong = jw::JsonPacketSplitter::encodeSendPacket(CMD_PING, 0, jw::cppJSON(jw::cppJSON::ValueType::Object));
+                    std::lock_guard<std::mutex> g(sendMutex); (void)g;
+                    cc.writeBuf(&pong.at(0), (int)pong.size());
+                    continue;
+                }
                 printf("%.*s\n", ret, buf);
 
                 try {
@@ -94,6 +127,7 @@ int main() {
                 buf.push_back((length >> 16) & 0xFF);
                 buf.push_back((length >> 24) & 0xFF);
                 std::copy(s.begin(), s.end(), std::back_inserter(buf));
+                std::lock_guard<std::mutex> g(sendMutex); (void)g;
                 cc.writeBuf(&buf.at(0), buf.size());
             }
             catch (std::exception &e) {
@@ -105,3 +139,5 @@ int main() {
 
     return 0;
 }
+
+#include "../common-test/LogUtil.cpp"
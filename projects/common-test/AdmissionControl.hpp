@@ -0,0 +1,279 @@
+﻿#ifndef _ADMISSION_CONTROL_HPP_
+#define _ADMISSION_CONTROL_HPP_
+
+#include "asio_header.hpp"
+#include "QuickMutex.h"
+#include "RateLimiter.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace jw {
+
+    // 超过速率或握手数上限时如何处理新连接
+    enum class OverloadAction {
+        Queue = 0,  // 暂不交给上层，排队等有名额时再交
+        Reject  // 直接断开
+    };
+
+    // 接纳新连接的限制，各上限为0表示不限
+    struct AdmissionPolicy {
+        RateLimit acceptRate;  // 每秒交给上层的新连接数
+        size_t maxPending;  // 已交给上层但还未完成握手的连接数上限
+        size_t maxPerAddress;  // 同一IP同时在线（含排队）的连接数上限，超过的直接断开
+        OverloadAction overloadAction;
+        size_t maxQueued;  // 排队的连接数上限，超过的直接断开
+        std::chrono::milliseconds maxQueueWait;  // 排队超过这个时间的直接断开
+
+        AdmissionPolicy() : maxPending(0), maxPerAddress(0), overloadAction(OverloadAction::Queue), maxQueued(4096U), maxQueueWait(10000) { }
+    };
+
+    // 接纳新连接的统计
+    struct AdmissionStats {
+        uint64_t accepted;  // accept到的连接数
+        uint64_t admitted;  // 交给上层的连接数（含排队后交出的）
+        uint64_t queued;  // 排过队的连接数
+        uint64_t rejectedOverload;  // 因超过上限且排队已满（或不排队）被断开的连接数
+        uint64_t rejectedPerAddress;  // 因同一IP连接数超限被断开的连接数
+        uint64_t expired;  // 排队超时被断开的连接数
+        uint64_t abandoned;  // 排队期间客户端已断开的连接数
+        size_t pending;  // 当前未完成握手的连接数
+        size_t queueDepth;  // 当前排队的连接数
+        size_t addresses;  // 当前在线的IP数
+    };
+
+    class AdmissionControl;
+
+    // 一个被接纳的连接占用的名额，连接断开时须调用release()（或销毁最后一个副本）归还
+    // 复制的副本共享同一份名额
+    class AdmissionTicket {
+    public:
+        AdmissionTicket() { }
+
+        // 握手完成（如收到进入房间的请求），归还握手名额，可以重复调用
+        void completeHandshake();
+
+        // 是否还未完成握手
+        bool isPending() const {
+            return _slot && _slot->pending;
+        }
+
+        // 连接断开，归还所有名额，可以重复调用
+        void release() {
+            _slot.reset();
+        }
+
+    private:
+        friend class AdmissionControl;
+
+        struct _Slot {
+            std::shared_ptr<AdmissionControl> control;
+            asio::ip::address address;
+            std::atomic<bool> pending{ true };
+
+            ~_Slot();
+        };
+
+        std::shared_ptr<_Slot> _slot;
+    };
+
+    // 新连接的接纳控制：速率、未完成握手数、同一IP连接数，线程安全
+    // 连接的排队由BasicServer负责，这里只做计数和判定
+    class AdmissionControl : public std::enable_shared_from_this<AdmissionControl> {
+    public:
+        AdmissionControl(const AdmissionControl &) = delete;
+        AdmissionControl &operator=(const AdmissionControl &) = delete;
+
+        enum class Decision {
+            Admit = 0,  // 交给上层，须接着调用makeTicket
+            Queue,  // 排队，之后用tryAdmitQueued取名额或用dropQueued放弃
+            Reject  // 断开
+        };
+
+        explicit AdmissionControl(const AdmissionPolicy &policy) : _policy(policy) {
+        }
+
+        void setPolicy(const AdmissionPolicy &policy) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _policy = policy;
+        }
+
+        AdmissionPolicy getPolicy() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _policy;
+        }
+
+        // 对刚accept到的连接做判定，排队的连接按先来先出，有连接在排队时新连接不插队
+        Decision onAccept(const asio::ip::address &address) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            ++_stats.accepted;
+            size_t &count = _addressCounts[address];
+            if (_policy.maxPerAddress != 0 && count >= _policy.maxPerAddress) {
+                if (count == 0) {
+                    _addressCounts.erase(address);
+                }
+                ++_stats.rejectedPerAddress;
+                return Decision::Reject;
+            }
+
+            if (_stats.queueDepth == 0 && _takeBudget()) {
+                ++count;
+                ++_stats.admitted;
+                return Decision::Admit;
+            }
+            if (_policy.overloadAction == OverloadAction::Queue && _stats.queueDepth < _policy.maxQueued) {
+                ++count;
+                ++_stats.queued;
+                ++_stats.queueDepth;
+                return Decision::Queue;
+            }
+
+            if (count == 0) {
+                _addressCounts.erase(address);
+            }
+            ++_stats.rejectedOverload;
+            return Decision::Reject;
+        }
+
+        // 对无连接的传输上的新客户端（如可靠UDP的握手）做判定，不排队：取不到名额时返回false，由客户端重发握手
+        // 返回true时须接着调用makeTicket
+        bool onHandshake(const asio::ip::address &address) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            ++_stats.accepted;
+            std::map<asio::ip::address, size_t>::iterator it = _addressCounts.find(address);
+            if (_policy.maxPerAddress != 0 && it != _addressCounts.end() && it->second >= _policy.maxPerAddress) {
+                ++_stats.rejectedPerAddress;
+                return false;
+            }
+            if (_stats.queueDepth != 0 || !_takeBudget()) {
+                ++_stats.rejectedOverload;
+                return false;
+            }
+            ++_addressCounts[address];
+            ++_stats.admitted;
+            return true;
+        }
+
+        // 为排在队首的连接取名额，取到时返回true，须接着调用makeTicket
+        bool tryAdmitQueued() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            if (!_takeBudget()) {
+                return false;
+            }
+            --_stats.queueDepth;
+            ++_stats.admitted;
+            return true;
+        }
+
+        // 放弃排队的连接（超时或已断开）
+        void dropQueued(const asio::ip::address &address, bool expired) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            --_stats.queueDepth;
+            if (expired) {
+                ++_stats.expired;
+            }
+            else {
+                ++_stats.abandoned;
+            }
+            _releaseAddress(address);
+        }
+
+        // 登记一个从别的进程接管来的连接（热重启），不受速率和上限约束，须接着调用makeTicket
+        void onInherited(const asio::ip::address &address) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            ++_addressCounts[address];
+            ++_stats.admitted;
+            ++_stats.pending;
+        }
+
+        // 被接纳的连接的名额，交给上层保存到连接断开
+        AdmissionTicket makeTicket(const asio::ip::address &address) {
+            AdmissionTicket ticket;
+            ticket._slot = std::make_shared<AdmissionTicket::_Slot>();
+            ticket._slot->control = shared_from_this();
+            ticket._slot->address = address;
+            return ticket;
+        }
+
+        std::chrono::milliseconds getMaxQueueWait() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _policy.maxQueueWait;
+        }
+
+        AdmissionStats getStats() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            AdmissionStats stats = _stats;
+            stats.addresses = _addressCounts.size();
+            return stats;
+        }
+
+    private:
+        friend class AdmissionTicket;
+
+        // 握手名额和速率都有余量时占用它们
+        bool _takeBudget() {
+            if (_policy.maxPending != 0 && _stats.pending >= _policy.maxPending) {
+                return false;
+            }
+            if (!_acceptBucket.consume(_policy.acceptRate, rateLimiterNow())) {
+                return false;
+            }
+            ++_stats.pending;
+            return true;
+        }
+
+        void _releaseAddress(const asio::ip::address &address) {
+            std::map<asio::ip::address, size_t>::iterator it = _addressCounts.find(address);
+            if (it != _addressCounts.end() && --it->second == 0) {
+                _addressCounts.erase(it);
+            }
+        }
+
+        void _handshakeDone() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            --_stats.pending;
+        }
+
+        void _release(const asio::ip::address &address, bool pending) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            if (pending) {
+                --_stats.pending;
+            }
+            _releaseAddress(address);
+        }
+
+        AdmissionPolicy _policy;
+        TokenBucket _acceptBucket;
+        std::map<asio::ip::address, size_t> _addressCounts;  // 各IP在线和排队的连接数
+        AdmissionStats _stats = AdmissionStats();
+        jw::QuickMutex _mutex;
+    };
+
+    inline void AdmissionTicket::completeHandshake() {
+        std::shared_ptr<_Slot> slot = _slot;
+        if (slot && slot->pending.exchange(false)) {
+            slot->control->_handshakeDone();
+        }
+    }
+
+    inline AdmissionTicket::_Slot::~_Slot() {
+        control->_release(address, pending);
+    }
+}
+
+#endif
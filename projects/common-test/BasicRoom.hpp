@@ -11,24 +11,25 @@ namespace gs {
     public:
         typedef _GameTable TableType;
         typedef typename _GameTable::UserType UserType;
+        typedef typename _GameTable::UserPtr UserPtr;
         static const size_t TableCount = _TableCount;
 
-        //void deliver(const std::shared_ptr<UserType> &user, const jw::cppJSON &json) { }
+        //void deliver(const UserPtr &user, const jw::cppJSON &json) { }
 
-        //void addUser(const std::shared_ptr<UserType> &user) {
+        //void addUser(const UserPtr &user) {
         //    std::lock_guard<jw::QuickMutex> g(_mutex);
         //    (void)g;
         //    _userSet.insert(user);
         //}
 
-        //void removeUser(const std::shared_ptr<UserType> &user) {
+        //void removeUser(const UserPtr &user) {
         //    std::lock_guard<jw::QuickMutex> g(_mutex);
         //    (void)g;
         //    _userSet.erase(user);
         //}
 
     protected:
-        std::unordered_set<std::shared_ptr<UserType> > _userSet;
+        std::unordered_set<UserPtr, jw::IntrusivePtrHash> _userSet;
         _GameTable _table[_TableCount];
         jw::QuickMutex _mutex;
     };
@@ -3,18 +3,47 @@
 
 #include "asio_header.hpp"
 #include "DebugConfig.h"
+#include "IOServicePool.hpp"
+#include "UringService.hpp"
+#include "AdmissionControl.hpp"
+#include "QuickMutex.h"
 #include <stddef.h>
 #include <memory>
 #include <functional>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <atomic>
 
 namespace jw {
     struct ProxyExample {
-        void acceptCallback(asio::ip::tcp::socket &&socket) {
+        AdmissionPolicy getAdmissionPolicy() const {
+            return AdmissionPolicy();
+        }
+
+        void attachService(asio::io_service &service) {
+        }
+
+        void acceptCallback(asio::ip::tcp::socket &&socket, const AdmissionTicket &ticket) {
         }
     };
 
-    // _ServerProxy须要一个void acceptCallback(asio::ip::tcp::socket &&socket)作为成员函数
+    // _ServerProxy须要以下成员函数：
+    //   AdmissionPolicy getAdmissionPolicy() const，构造时取一次，之后可用setAdmissionPolicy修改
+    //   void attachService(asio::io_service &service)，构造时对每个运行连接的io_service调用一次，可在上面挂定时器等
+    //   void acceptCallback(asio::ip::tcp::socket &&socket, const AdmissionTicket &ticket)，
+    //     ticket须保存到连接断开时release，握手完成时completeHandshake
     // _MaxAccept为同时发起的Accept数量
+    // 用IOServicePool构造时，accept在第0个io_service上进行，新连接的socket轮询创建在池中各个io_service上
+    // 若reusePort为true且系统支持SO_REUSEPORT（Linux），则每个io_service各有一个监听socket，由内核分配新连接，
+    // 新连接的socket直接创建在接受它的io_service上
+    // 新连接先经过AdmissionControl：超过速率或握手数上限的排队（或断开），排队的连接由定时器按名额陆续交给上层
+    // listenHandles不为空时不新建监听socket，而是接管这些已在监听的socket（热重启时从旧进程收到的），每个一个acceptor，
+    // 此时构造后处于停止accept的状态，由resumeAccept开始
+    // 监听socket所属的io_service启用了io_uring（见IOServicePool::enableUring）时，这个监听socket改用一个多发accept，
+    // 新连接同样经过AdmissionControl
     template <class _ServerProxy, size_t _MaxAccept>
     class BasicServer : public _ServerProxy {
     public:
@@ -22,36 +51,390 @@ namespace jw {
         BasicServer<_ServerProxy, _MaxAccept> &operator=(const BasicServer<_ServerProxy, _MaxAccept> &) = delete;
 
         BasicServer<_ServerProxy, _MaxAccept>(asio::io_service &service, unsigned short port)
-            : _acceptor(service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)) {
+            : _admission(std::make_shared<AdmissionControl>(_ServerProxy::getAdmissionPolicy())), _queueTimer(service) {
+            _acceptors.push_back(std::unique_ptr<asio::ip::tcp::acceptor>(new asio::ip::tcp::acceptor(service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))));
             for (size_t i = 0; i < _MaxAccept; ++i) {
                 _sockets[i] = std::make_shared<asio::ip::tcp::socket>(service);
             }
+            _ServerProxy::attachService(service);
+            _initUringAccepts();
+            _doAccept();
+        }
+
+        BasicServer<_ServerProxy, _MaxAccept>(IOServicePool &pool, unsigned short port, bool reusePort = false,
+            const std::vector<asio::ip::tcp::acceptor::native_handle_type> &listenHandles = std::vector<asio::ip::tcp::acceptor::native_handle_type>())
+            : _pool(&pool), _admission(std::make_shared<AdmissionControl>(_ServerProxy::getAdmissionPolicy())), _queueTimer(pool.getService(0)) {
+            asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+            size_t acceptorCount = 1;
+            if (!listenHandles.empty()) {
+                acceptorCount = std::min(listenHandles.size(), _MaxAccept);
+            }
+            else if (reusePort) {
+#ifdef SO_REUSEPORT
+                acceptorCount = std::min(pool.size(), _MaxAccept);
+#else
+                LOG_WARN("SO_REUSEPORT is not supported, fall back to a single acceptor");
+#endif
+            }
+
+            for (size_t i = 0; i < acceptorCount; ++i) {
+                _acceptors.push_back(std::unique_ptr<asio::ip::tcp::acceptor>(new asio::ip::tcp::acceptor(pool.getService(i % pool.size()))));
+                asio::ip::tcp::acceptor &acceptor = *_acceptors.back();
+                if (!listenHandles.empty()) {
+                    acceptor.assign(endpoint.protocol(), listenHandles[i]);
+                    continue;
+                }
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+                if (acceptorCount > 1) {
+                    acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                }
+#endif
+                acceptor.bind(endpoint);
+                acceptor.listen();
+            }
+
+            for (size_t i = 0; i < _MaxAccept; ++i) {
+                _sockets[i] = std::make_shared<asio::ip::tcp::socket>(_isSharded() ? _getAcceptor(i).get_io_service() : pool.getNextService());
+            }
+            for (size_t i = 0, cnt = pool.size(); i < cnt; ++i) {
+                _ServerProxy::attachService(pool.getService(i));
+            }
+            _initUringAccepts();
+            LOG_INFO("BasicServer listening on port %hu with %lu acceptor(s)", port, (unsigned long)acceptorCount);
+            if (!listenHandles.empty()) {
+                // 接管的监听socket等交接确认后（resumeAccept）才accept，交接中止时旧进程照常accept
+                _acceptPaused = true;
+                return;
+            }
             _doAccept();
         }
 
         ~BasicServer<_ServerProxy, _MaxAccept>() {
+            // 还在途的多发accept取消后由它最后一个完成项释放，之后accept到的连接直接关闭
+            for (size_t i = 0; i < _uringAccepts.size(); ++i) {
+                _UringAccept *op = _uringAccepts[i];
+                if (op != nullptr) {
+                    op->server = nullptr;
+                    if (op->refs > 1) {
+                        op->uring->cancel(op);
+                    }
+                    op->unref();
+                }
+            }
             LOG_INFO("BasicServer<_ServerProxy, _MaxAccept>::~BasicServer<_ServerProxy, _MaxAccept>");
         }
 
+        void setAdmissionPolicy(const AdmissionPolicy &policy) { _admission->setPolicy(policy); }
+        AdmissionStats getAdmissionStats() { return _admission->getStats(); }
+
+        // 以下用于热重启
+
+        // 监听socket的句柄，交接时由调用者复制
+        std::vector<asio::ip::tcp::acceptor::native_handle_type> getListenHandles() {
+            std::vector<asio::ip::tcp::acceptor::native_handle_type> handles;
+            for (size_t i = 0; i < _acceptors.size(); ++i) {
+                handles.push_back(_acceptors[i]->native_handle());
+            }
+            return handles;
+        }
+
+        // 停止accept：取消挂起的accept，排队的连接也不再交给上层，新连接留在内核的监听队列中
+        // 挂起的accept都结束后isAcceptPaused()为true，此前accept到的连接照常交给上层
+        void pauseAccept() {
+            _acceptPaused = true;
+            for (size_t i = 0; i < _acceptors.size(); ++i) {
+                asio::ip::tcp::acceptor *acceptor = _acceptors[i].get();
+                _UringAccept *op = _uringAccepts[i];
+                acceptor->get_io_service().dispatch([acceptor, op]() {
+                    if (op != nullptr) {
+                        op->uring->cancel(op);
+                        return;
+                    }
+                    std::error_code ec;
+                    acceptor->cancel(ec);
+                });
+            }
+        }
+
+        bool isAcceptPaused() const { return _acceptPaused && _activeAccepts == 0; }
+
+        // 交接失败时恢复accept，或接管监听socket的一方在交接确认后开始accept，须在isAcceptPaused()为true之后调用
+        void resumeAccept() {
+            _acceptPaused = false;
+            _doAccept();
+        }
+
+        // 接管一个已连接的socket（热重启时从旧进程收到的），放到池中下一个io_service上，句柄的所有权随之转移
+        // 计入准入的连接数但不受速率和上限约束，名额由ticket带回；已断开的返回未打开的socket
+        asio::ip::tcp::socket adoptSocket(asio::ip::tcp::socket::native_handle_type handle, AdmissionTicket &ticket) {
+            asio::ip::tcp::socket socket(_pool != nullptr ? _pool->getNextService() : _queueTimer.get_io_service());
+            std::error_code ec;
+            socket.assign(asio::ip::tcp::v4(), handle, ec);
+            if (ec) {
+                LOG_ERROR("failed to adopt socket %d: %s", (int)handle, ec.message().c_str());
+                return socket;
+            }
+            asio::ip::tcp::endpoint remote = socket.remote_endpoint(ec);
+            if (ec) {
+                socket.close(ec);
+                return socket;
+            }
+            _admission->onInherited(remote.address());
+            ticket = _admission->makeTicket(remote.address());
+            return socket;
+        }
+
     private:
+        bool _isSharded() const { return _acceptors.size() > 1; }
+
+        // 第index个accept由哪个监听socket发起
+        asio::ip::tcp::acceptor &_getAcceptor(size_t index) { return *_acceptors[index % _acceptors.size()]; }
+
+        // 一个监听socket上的多发accept，在途期间和被服务器持有期间各占一份引用
+        // 服务器析构时还在途的，由最后一个完成项或io_service析构时的abandon释放
+        struct _UringAccept : UringOp {
+            std::atomic<BasicServer<_ServerProxy, _MaxAccept> *> server;  // 服务器析构后为nullptr
+            size_t index;  // 监听socket的下标
+            UringService *uring;
+            std::atomic<int> refs;
+
+            _UringAccept(BasicServer<_ServerProxy, _MaxAccept> *s, size_t i, UringService *u) : server(s), index(i), uring(u), refs(1) { }
+
+            virtual void complete(int result, bool more, const char *) override {
+                BasicServer<_ServerProxy, _MaxAccept> *s = server;
+                if (s != nullptr) {
+                    s->_uringAcceptCallback(index, result, more);
+                }
+#if defined(__linux__)
+                else if (result >= 0) {
+                    ::close(result);
+                }
+#endif
+                if (!more) {
+                    unref();
+                }
+            }
+
+            virtual void abandon() override {
+                unref();
+            }
+
+            void unref() {
+                if (--refs == 0) {
+                    delete this;
+                }
+            }
+        };
+
+        // 所属的io_service启用了io_uring的监听socket各建一个多发accept，其余的为nullptr
+        void _initUringAccepts() {
+            for (size_t i = 0; i < _acceptors.size(); ++i) {
+                UringService *uring = UringService::find(_acceptors[i]->get_io_service());
+                _uringAccepts.push_back(uring != nullptr ? new _UringAccept(this, i, uring) : nullptr);
+            }
+        }
+
+        void _armUringAccept(size_t index) {
+            _UringAccept *op = _uringAccepts[index];
+            ++op->refs;
+            op->uring->accept(op, (int)_acceptors[index]->native_handle());
+        }
+
         void _doAccept() {
+            // 多发accept的每个监听socket只发起一次
+            for (size_t i = 0; i < _uringAccepts.size(); ++i) {
+                if (_uringAccepts[i] != nullptr) {
+                    ++_activeAccepts;
+                    _armUringAccept(i);
+                }
+            }
             // 发起accept操作
             for (size_t i = 0; i < _MaxAccept; ++i) {
-                _acceptor.async_accept(*_sockets[i], std::bind(&BasicServer<_ServerProxy, _MaxAccept>::_acceptCallback, this, i, std::placeholders::_1));
+                if (_uringAccepts[i % _acceptors.size()] != nullptr) {
+                    continue;
+                }
+                ++_activeAccepts;
+                _getAcceptor(i).async_accept(*_sockets[i], std::bind(&BasicServer<_ServerProxy, _MaxAccept>::_acceptCallback, this, i, std::placeholders::_1));
             }
         }
 
         void _acceptCallback(size_t index, std::error_code ec) {
             if (!ec) {
                 // accept成功
-                _ServerProxy::acceptCallback(std::move(*_sockets[index]));
+                if (_pool != nullptr && !_isSharded() && !_pool->isActive(_sockets[index]->get_io_service())) {
+                    // 预先建好socket的io_service在此期间因缩容退役了，换到运行中的io_service上
+                    std::error_code moveError;
+                    moveSocket(*_sockets[index], _pool->getNextService(), moveError);
+                }
+                _admit(std::move(*_sockets[index]));
+                if (_pool != nullptr && !_isSharded()) {
+                    // 下一个连接分配到下一个io_service上
+                    _sockets[index] = std::make_shared<asio::ip::tcp::socket>(_pool->getNextService());
+                }
+            }
+            if (_acceptPaused) {
+                --_activeAccepts;
+                return;
             }
             // 发起下一次accept操作
-            _acceptor.async_accept(*_sockets[index], std::bind(&BasicServer<_ServerProxy, _MaxAccept>::_acceptCallback, this, index, std::placeholders::_1));
+            _getAcceptor(index).async_accept(*_sockets[index], std::bind(&BasicServer<_ServerProxy, _MaxAccept>::_acceptCallback, this, index, std::placeholders::_1));
+        }
+
+        // 多发accept的一个完成项，result为新连接的句柄，在监听socket所属io_service的线程上调用
+        // 新连接的socket与async_accept时一样放在池中下一个io_service上，SO_REUSEPORT时放在监听socket所属的io_service上
+        void _uringAcceptCallback(size_t index, int result, bool more) {
+            if (result >= 0) {
+                asio::ip::tcp::socket socket(_pool != nullptr && !_isSharded() ? _pool->getNextService() : _acceptors[index]->get_io_service());
+                std::error_code ec;
+                socket.assign(asio::ip::tcp::v4(), result, ec);
+                if (ec) {
+                    LOG_ERROR("failed to assign accepted socket %d: %s", result, ec.message().c_str());
+#if defined(__linux__)
+                    ::close(result);
+#endif
+                }
+                else {
+                    _admit(std::move(socket));
+                }
+            }
+            if (more) {
+                return;
+            }
+            if (_acceptPaused) {
+                --_activeAccepts;
+                return;
+            }
+            // 出错或被内核结束（如句柄用完），重新发起
+            _armUringAccept(index);
+        }
+
+        void _admit(asio::ip::tcp::socket &&socket) {
+            std::error_code ec;
+            asio::ip::tcp::endpoint remote = socket.remote_endpoint(ec);
+            if (ec) {
+                // 已经断开
+                return;
+            }
+
+            asio::ip::tcp::socket s(std::move(socket));
+            switch (_admission->onAccept(remote.address())) {
+            case AdmissionControl::Decision::Admit:
+                _ServerProxy::acceptCallback(std::move(s), _admission->makeTicket(remote.address()));
+                break;
+            case AdmissionControl::Decision::Queue: {
+                _Queued queued(std::move(s));
+                queued.address = remote.address();
+                queued.enqueueTime = std::chrono::steady_clock::now();
+                std::lock_guard<jw::QuickMutex> g(_queueMutex);
+                (void)g;
+                _queue.push_back(std::move(queued));
+                if (!_queueTimerArmed) {
+                    _queueTimerArmed = true;
+                    _armQueueTimer();
+                }
+                break;
+            }
+            default:
+                LOG_DEBUG("reject connection from %s", remote.address().to_string().c_str());
+                s.close(ec);
+                break;
+            }
+        }
+
+        void _armQueueTimer() {
+            // 有连接排队时每10ms检查一次名额
+            _queueTimer.expires_from_now(std::chrono::milliseconds(10));
+            _queueTimer.async_wait(std::bind(&BasicServer<_ServerProxy, _MaxAccept>::_drainQueue, this, std::placeholders::_1));
+        }
+
+        // 按名额把排队的连接交给上层，丢弃排队超时的和客户端已断开的
+        void _drainQueue(std::error_code ec) {
+            if (ec) {
+                return;
+            }
+
+            std::vector<_Queued> ready;
+            {
+                std::lock_guard<jw::QuickMutex> g(_queueMutex);
+                (void)g;
+                if (_acceptPaused) {
+                    // 交接期间连接留在队列中，交接成功时随进程退出断开
+                    _armQueueTimer();
+                    return;
+                }
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() - _admission->getMaxQueueWait();
+                while (!_queue.empty()) {
+                    _Queued &front = _queue.front();
+                    if (front.enqueueTime < deadline) {
+                        _admission->dropQueued(front.address, true);
+                        _queue.pop_front();
+                        continue;
+                    }
+                    if (_isPeerGone(front.socket)) {
+                        // 客户端等不及已经断开，不占名额
+                        _admission->dropQueued(front.address, false);
+                        _queue.pop_front();
+                        continue;
+                    }
+                    if (!_admission->tryAdmitQueued()) {
+                        break;
+                    }
+                    ready.push_back(std::move(front));
+                    _queue.pop_front();
+                }
+                _queueTimerArmed = !_queue.empty();
+                if (_queueTimerArmed) {
+                    _armQueueTimer();
+                }
+            }
+
+            for (typename std::vector<_Queued>::iterator it = ready.begin(); it != ready.end(); ++it) {
+                _ServerProxy::acceptCallback(std::move(it->socket), _admission->makeTicket(it->address));
+            }
+        }
+
+        // 非阻塞地窥探一个字节：对方已关闭（读到EOF）或连接出错时返回true，没有数据或有数据未读时返回false，不取走数据
+        static bool _isPeerGone(asio::ip::tcp::socket &socket) {
+            std::error_code ec;
+            bool nonBlocking = socket.non_blocking();
+            socket.non_blocking(true, ec);
+            char c;
+            socket.receive(asio::buffer(&c, 1), asio::socket_base::message_peek, ec);
+            std::error_code ignored;
+            socket.non_blocking(nonBlocking, ignored);
+            return ec && ec != asio::error::would_block && ec != asio::error::try_again;
         }
 
-        asio::ip::tcp::acceptor _acceptor;
+        // 排队的连接
+        struct _Queued {
+            asio::ip::tcp::socket socket;
+            asio::ip::address address;
+            std::chrono::steady_clock::time_point enqueueTime;
+
+            explicit _Queued(asio::ip::tcp::socket &&s) : socket(std::move(s)) { }
+            _Queued(_Queued &&other) : socket(std::move(other.socket)), address(other.address), enqueueTime(other.enqueueTime) { }
+            _Queued &operator=(_Queued &&other) {
+                socket = std::move(other.socket);
+                address = other.address;
+                enqueueTime = other.enqueueTime;
+                return *this;
+            }
+        };
+
+        std::vector<std::unique_ptr<asio::ip::tcp::acceptor> > _acceptors;
         std::shared_ptr<asio::ip::tcp::socket> _sockets[_MaxAccept];
+        IOServicePool *_pool = nullptr;
+        std::atomic<bool> _acceptPaused{ false };
+        std::atomic<size_t> _activeAccepts{ 0 };  // 挂起的async_accept和多发accept个数
+        std::vector<_UringAccept *> _uringAccepts;  // 以监听socket的下标为下标
+
+        std::shared_ptr<AdmissionControl> _admission;
+        std::deque<_Queued> _queue;
+        jw::QuickMutex _queueMutex;
+        bool _queueTimerArmed = false;
+        asio::steady_timer _queueTimer;
     };
 }
 
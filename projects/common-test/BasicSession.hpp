@@ -3,13 +3,25 @@
 
 #include "asio_header.hpp"
 #include "DebugConfig.h"
+#include "MPSCQueue.hpp"
 #include "QuickMutex.h"
+#include "HandlerAllocator.hpp"
+#include "BufferPool.hpp"
+#include "IntrusivePtr.hpp"
+#include "PacketSplitter.hpp"
+#include "IOServicePool.hpp"
+#include "UringService.hpp"
 #include <stddef.h>
+#include <stdint.h>
 #include <memory>
 #include <functional>
 #include <type_traits>
 #include <utility>
-#include <deque>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
 
 namespace jw {
     struct Nothing {};
@@ -19,23 +31,422 @@ namespace jw {
         Recv
     };
 
-    // _BufSize为write缓冲区的大小
-    template <class _Extra, size_t _BufSize>
-    class BasicSession : public _Extra, public std::enable_shared_from_this<BasicSession<_Extra, _BufSize> > {
+    // 不可变的共享发送缓冲区，广播时所有接收者的发送队列引用同一份数据
+    typedef std::shared_ptr<const std::vector<char> > SharedBuffer;
+
+    static inline SharedBuffer makeSharedBuffer(std::vector<char> &&buf) {
+        return std::make_shared<std::vector<char> >(std::move(buf));
+    }
+
+    // 发送优先级，每个优先级在会话中有一条发送通道
+    // Game：游戏状态、操作结果、请求的回复，总是先于Bulk发送，不丢弃
+    // Bulk：可以丢弃的推送，如发给其他人的聊天、进入房间时广播的完整用户列表（丢掉的由之后的一份补上），通道内的字节数有上限，超过上限或发送队列拥塞时丢弃
+    enum class SendPriority {
+        Game = 0,
+        Bulk = 1
+    };
+
+    // 发送队列的水位限制（字节）
+    // 超过高水位后丢弃Bulk的包，直到回落到低水位以下；超过硬上限则断开连接
+    // Bulk通道中未发送完成的字节数超过bulkLimit时也丢弃Bulk的包
+    // 所以读得慢的客户端先丢掉聊天这类Bulk推送，只有Game通道的数据堆到硬上限才会被断开
+    struct SendLimits {
+        size_t lowWaterMark;
+        size_t highWaterMark;
+        size_t hardLimit;
+        size_t bulkLimit;
+
+        SendLimits() : lowWaterMark(64U * 1024U), highWaterMark(256U * 1024U), hardLimit(4U * 1024U * 1024U), bulkLimit(64U * 1024U) { }
+    };
+
+    // 一条发送通道的统计，延迟为入队到发送完成的时间
+    struct SendLaneStats {
+        std::atomic<uint64_t> sentPackets;
+        std::atomic<uint64_t> droppedPackets;
+        std::atomic<uint64_t> totalLatencyUs;
+        std::atomic<uint64_t> maxLatencyUs;
+
+        void recordLatency(uint64_t us) {
+            ++sentPackets;
+            totalLatencyUs += us;
+            uint64_t maxUs = maxLatencyUs;
+            while (us > maxUs && !maxLatencyUs.compare_exchange_weak(maxUs, us)) {
+            }
+        }
+
+        double averageLatencyUs() const {
+            uint64_t packets = sentPackets;
+            return packets != 0 ? (double)totalLatencyUs / packets : 0.0;
+        }
+    };
+
+    // 所有连接的发送统计
+    struct SendStats {
+        std::atomic<uint64_t> queuedPackets;  // 当前在发送队列中（含正在发送）的包数
+        std::atomic<uint64_t> queuedBytes;  // 当前在发送队列中（含正在发送）的字节数
+        std::atomic<uint64_t> droppedPackets;  // 拥塞时丢弃的包数
+        std::atomic<uint64_t> droppedBytes;  // 拥塞时丢弃的字节数
+        std::atomic<uint64_t> evictedSessions;  // 因超过硬上限被断开的连接数
+        std::atomic<uint64_t> supersededPackets;  // 未发送就被同key的新包替换掉的包数
+        std::atomic<uint64_t> supersededBytes;  // 被替换掉的字节数
+        SendLaneStats lanes[2];  // 以SendPriority为下标
+
+        const SendLaneStats &getLane(SendPriority priority) const { return lanes[(size_t)priority]; }
+    };
+
+    // BasicSession串联异步操作的方式
+    // CallbackHandlers：每次发起操作都构造一个持有引用的lambda
+    // CoroutineHandlers：读、写各有一个常驻在会话中的协程（asio::coroutine），传给asio的handler只是指向它的指针，
+    // 协程运行期间持有一份引用，每次操作完成时不再复制引用
+    struct CallbackHandlers {};
+    struct CoroutineHandlers {};
+
+    // 经网关转发的会话的出口（见UpstreamLink.hpp），这样的会话不持有socket，发出的数据交给它
+    class RelayChannel {
+    public:
+        virtual ~RelayChannel() { }
+
+        // 发给会话id的一批数据，须在返回前复制，不能阻塞
+        virtual void relaySend(uint32_t id, const std::vector<asio::const_buffer> &buffers) = 0;
+
+        // 本端断开了会话id
+        virtual void relayClose(uint32_t id) = 0;
+    };
+
+    // _BufSize为每次read的缓冲区大小，缓冲区只在有数据可读时从共享的池中借用
+    // 读、写两个方向的handler各使用一块会话内的HandlerMemory，稳态下收发不为handler分配堆内存
+    // _Extra派生自PacketSplitter时，socket直接读入PacketSplitter的接收缓冲区，Recv事件回调的是完整的包体
+    // 否则Recv事件回调的是原始数据
+    // socket所属的io_service启用了io_uring（见UringService）时，start之后改用它收发：多发recv收进同一io_service上共用的提供缓冲区，
+    // 再复制进PacketSplitter的接收缓冲区，等待数据期间不占用会话的缓冲区；写用sendmsg；其余行为与走asio时相同
+    // 会话使用侵入式引用计数，以SessionPtr（IntrusivePtr）持有
+    template <class _Extra, size_t _BufSize, class _Handlers = CoroutineHandlers>
+    class BasicSession : public _Extra, public RefCounted<BasicSession<_Extra, _BufSize, _Handlers> > {
     public:
-        BasicSession<_Extra, _BufSize>(const BasicSession<_Extra, _BufSize> &) = delete;
-        BasicSession<_Extra, _BufSize> &operator=(const BasicSession<_Extra, _BufSize> &) = delete;
+        BasicSession<_Extra, _BufSize, _Handlers>(const BasicSession<_Extra, _BufSize, _Handlers> &) = delete;
+        BasicSession<_Extra, _BufSize, _Handlers> &operator=(const BasicSession<_Extra, _BufSize, _Handlers> &) = delete;
 
-        typedef std::shared_ptr<BasicSession<_Extra, _BufSize> > SessionPtr;
+        typedef IntrusivePtr<BasicSession<_Extra, _BufSize, _Handlers> > SessionPtr;
+        typedef ObjectRecycler<BasicSession<_Extra, _BufSize, _Handlers> > Recycler;
         typedef std::function<void (const SessionPtr &, SessionEvent, const char *, size_t)> SessionCallback;
 
         template <class _Callable>
-        BasicSession<_Extra, _BufSize>(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback)
-            : _socket(std::move(socket)) {
-            try {
-                static_assert(std::is_convertible<_Callable, SessionCallback>::value, "");
-                _sessionCallback = sessionCallback;
+        BasicSession<_Extra, _BufSize, _Handlers>(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback)
+            : _socket(std::move(socket)), _readLoop(this), _writeLoop(this), _uringRecv(this), _uringSend(this) {
+            static_assert(std::is_convertible<_Callable, SessionCallback>::value, "");
+            _sessionCallback = sessionCallback;
+            _service = &_socket.get_io_service();
+            _saveEndpoints();
+        }
+
+        ~BasicSession<_Extra, _BufSize, _Handlers>() {
+            _giveBackRecvBuffer(_IsSplitter());
+            // 不经过SessionPool时没有调用recycle()，未发送完成的包在这里移出全局统计
+            _sendStats.queuedPackets -= _queuedPackets.exchange(0);
+            _sendStats.queuedBytes -= _queuedBytes.exchange(0);
+            LOG_DEBUG("BasicSession<_Extra, _BufSize, _Handlers>::~BasicSession<_Extra, _BufSize, _Handlers>");
+        }
+
+        // 由SessionPool调用，把回收的对象绑定到新连接上，已分配的缓冲区保留复用
+        // 调用前须已调用过recycle()
+        template <class _Callable>
+        void reuse(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback) {
+            static_assert(std::is_convertible<_Callable, SessionCallback>::value, "");
+            _socket = std::move(socket);
+            _service = &_socket.get_io_service();
+            _sessionCallback = sessionCallback;
+            static_cast<_Extra &>(*this) = _Extra();  // 重置_Extra中的用户数据
+            _sendLimits = SendLimits();
+            _droppedPackets = 0;
+            _congested = false;
+            _evicted = false;
+            _disconnected = false;
+            _readPaused = false;
+            _readParked = false;
+            _sendFrozen = false;
+            _relayId = 0;
+            _relayEnded = false;
+            _migrating = false;
+            _writing = false;
+            _readLoop = _ReadLoop(this);
+            _writeLoop = _WriteLoop(this);
+            _uring = nullptr;
+            _recvInvalid = false;
+            _saveEndpoints();
+        }
+
+        // 最后一个引用释放时，设置了回收者的交给它（回到SessionPool），否则直接delete
+        void onLastRelease() {
+            std::shared_ptr<Recycler> recycler;
+            recycler.swap(_recycler);
+            if (recycler) {
+                recycler->giveBack(this);
+            }
+            else {
+                delete this;
+            }
+        }
+
+        void setRecycler(const std::shared_ptr<Recycler> &recycler) { _recycler = recycler; }
+
+        // 由SessionPool在最后一个引用释放时调用，关闭连接并丢弃未发送的数据
+        // 此时已没有挂起的异步操作（它们都持有引用）
+        void recycle() {
+            std::error_code ec;
+            _socket.close(ec);
+            _giveBackRecvBuffer(_IsSplitter());
+
+            for (size_t i = 0; i < _LaneCount; ++i) {
+                while (_writeQueues[i].front() != nullptr) {
+                    _writeQueues[i].pop();
+                }
+            }
+            _queuedCount = 0;
+            _bulkQueuedBytes = 0;
+            _latestSlots.clear();
+            _writingPackets.clear();
+            _writingBuffers.clear();
+            _writingBytes = 0;
+            _relay.reset();
+
+            // 未发送完成的包不再计入全局统计
+            size_t packets = _queuedPackets.exchange(0);
+            size_t bytes = _queuedBytes.exchange(0);
+            _sendStats.queuedPackets -= packets;
+            _sendStats.queuedBytes -= bytes;
+
+            _sessionCallback = nullptr;
+        }
+
+        inline void start() {
+            _touchRecvTime();
+            _uring = UringService::find(getIOService());
+            // 走asio时先等待可读再用非阻塞的read_some读取，socket须为非阻塞模式
+            // 走io_uring时保持阻塞模式，没有数据或发送缓冲区满时由内核等待，而不是以EAGAIN结束操作
+            std::error_code ec;
+            _socket.non_blocking(_uring == nullptr, ec);
+            _startRead(_Handlers());
+        }
+
+        // 主动断开连接，之后投递的包都被忽略
+        // 关闭socket后，挂起的read会失败，由_sessionCallback通知上层移除这个连接
+        // 已经断开过时返回false
+        bool close() {
+            if (_evicted.exchange(true)) {
+                return false;
+            }
+            _closeSocket();
+            return true;
+        }
+
+        // 最后一次收到数据的时刻（未收到过数据时为start的时刻），可在任意线程读取
+        std::chrono::steady_clock::time_point getLastRecvTime() const {
+            return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(_lastRecvTime.load(std::memory_order_relaxed)));
+        }
+
+        // 读失败、被断开或被主动关闭后为false
+        bool isConnected() const { return !_disconnected && !_evicted; }
+
+        // 以下用于热重启时把连接交给另一个进程，交接期间socket不能shutdown，因此不能调用close()
+
+        // 停止读：在socket所属的线程上取消等待，读循环结束时不回调断开，未读的数据留在内核中，未收完的包留在接收缓冲区中
+        // 读循环结束后isReadParked()为true；多线程共用io_service时取消可能早于下一次等待，可重复调用直到停下
+        void pauseRead() {
+            _readPaused = true;
+            _dispatchToOwner([this]() {
+                _cancelRead();
+            });
+        }
+
+        // 交接失败时恢复读
+        void resumeRead() {
+            _readPaused = false;
+            if (_readParked.exchange(false)) {
+                _startRead(_Handlers());
+            }
+        }
+
+        bool isReadParked() const { return _readParked; }
+
+        // 冻结发送：之后投递的包被丢弃（不计入统计，也不断开），已入队的照常发出
+        void freezeSend() { _sendFrozen = true; }
+
+        void resumeSend() {
+            _sendFrozen = false;
+            if (_queuedCount > 0) {
+                _kickWrite();
+            }
+        }
+
+        // 发送队列已空且没有正在进行的write，冻结发送之后为true即表示已全部发出
+        bool isSendIdle() const { return !_writing && _queuedCount == 0; }
+
+        asio::ip::tcp::socket::native_handle_type getNativeHandle() { return _socket.native_handle(); }
+
+        // 接收缓冲区中未收完的包，读循环停下后调用
+        std::vector<char> getPendingRecvData() const {
+            return _getPendingRecvData(_IsSplitter());
+        }
+
+        // 放入从另一个进程接过来的未收完的包，须在start()之前调用
+        void preloadRecvData(const char *data, size_t length) {
+            _preloadRecvData(data, length, _IsSplitter());
+        }
+
+        // 以下用于io线程池缩容（见IOServicePool::startScaling）：把连接迁到另一个io_service上，会话对象和连接都不变
+        // 仅Linux：在原io_service的线程上停读、取得发送标志，复制socket句柄在target上注册，再关闭原来的句柄
+        // 迁移期间收到的数据留在内核中，投递的包留在发送队列中，迁移完成后在target上继续收发
+
+        // 开始迁移时返回true，完成或放弃（连接断开、1秒内没能停下）后回调done(是否已迁移)，done在连接最终所属的io_service上调用
+        // 已在迁移中、已断开、经网关转发、已在target上或不支持时返回false，不回调；迁移期间不能调用pauseRead等热重启交接的函数
+        bool migrate(asio::io_service &target, const std::function<void (bool)> &done) {
+#if defined(__linux__)
+            if (_relay || !isConnected() || &target == &getIOService() || _migrating.exchange(true)) {
+                return false;
+            }
+            _readPaused = true;
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            asio::io_service *to = &target;
+            _dispatchToOwner([this, to, done, deadline]() {
+                _cancelRead();
+                _migrateWhenSettled(to, done, deadline, false);
+            });
+            return true;
+#else
+            (void)target;
+            (void)done;
+            return false;
+#endif
+        }
+
+        bool isMigrating() const { return _migrating; }
+
+        // 以下用于经网关转发的会话：socket不打开，只用来取io_service，收发都经过网关的上游连接（见UpstreamLink.hpp）
+
+        // 代替start()，remoteIP、remotePort为客户端连到网关的地址
+        void startRelay(const std::shared_ptr<RelayChannel> &relay, uint32_t id, const std::string &remoteIP, unsigned short remotePort) {
+            _relay = relay;
+            _relayId = id;
+            _remoteIP = remoteIP;
+            _remotePort = remotePort;
+            _touchRecvTime();
+        }
 
+        bool isRelayed() const { return _relay != nullptr; }
+        uint32_t getRelayId() const { return _relayId; }
+
+        // 网关转来的一个包体，data[length]须为'\0'，在上游连接的读线程上调用
+        void relayRecv(const char *data, size_t length) {
+            if (_relayEnded) {
+                return;
+            }
+            _touchRecvTime();
+            _sessionCallback(SessionPtr(this), SessionEvent::Recv, data, length);
+        }
+
+        // 网关一方断开了会话，或上游连接断开，之后投递的包都被忽略
+        void relayClosed() {
+            _evicted = true;
+            _endRelay();
+        }
+
+        // socket所属的io_service，迁移（见migrate）后即为新的io_service，可在任意线程调用
+        asio::io_service &getIOService() { return *_service; }
+
+        void setSendLimits(const SendLimits &limits) { _sendLimits = limits; }
+        const SendLimits &getSendLimits() const { return _sendLimits; }
+
+        size_t getQueuedPackets() const { return _queuedPackets; }
+        size_t getQueuedBytes() const { return _queuedBytes; }
+        uint64_t getDroppedPackets() const { return _droppedPackets; }
+        static const SendStats &getSendStats() { return _sendStats; }
+        static BufferPoolStats getRecvBufferStats() { return _recvBufferPool.getStats(); }
+
+        const std::string &getRemoteIP() const { return _remoteIP; }
+        unsigned short getRemotePort() const { return _remotePort; }
+        const std::string &getLocalIP() const { return _localIP; }
+        unsigned short getLocalPort() const { return _localPort; }
+
+        // priority为Bulk的包排在Game之后发送，拥塞时会被丢弃，状态变化的通知和请求的回复（包括发言者收到的自己的聊天）不能用Bulk
+        void deliver(const SharedBuffer &buf, SendPriority priority = SendPriority::Game) {
+            if (_push(buf, priority, 0)) {
+                _kickWrite();
+            }
+        }
+
+        // 只有最新一份有意义的包（如全量状态快照），以key区分，key不能为0
+        // 同key的旧包还在队列中未开始发送时，直接替换它的内容而不追加，慢速连接只会收到最新的一份
+        // 替换后的包占用旧包在队列中的位置，因此会先于旧包之后入队的其他包发出
+        void deliverLatest(const SharedBuffer &buf, uint64_t key, SendPriority priority = SendPriority::Game) {
+            bool pushed = false;
+            SharedBuffer superseded;  // 在锁外释放
+            {
+                std::lock_guard<jw::QuickMutex> g(_latestMutex);
+                (void)g;
+                typename std::vector<_LatestSlot>::iterator it = std::find_if(_latestSlots.begin(), _latestSlots.end(), [key](const _LatestSlot &slot) {
+                    return slot.key == key;
+                });
+                if (it == _latestSlots.end()) {
+                    pushed = _push(buf, priority, key);
+                }
+                else if (!_evicted && !_sendFrozen) {
+                    // 冻结后队列要原样交给新进程，不再替换
+                    superseded.swap(it->buf);
+                    it->buf = buf;
+                    _replaceQueuedBytes(superseded->size(), buf->size(), it->priority);
+                }
+            }
+            if (pushed) {
+                _kickWrite();
+            }
+        }
+
+        void deliverLatest(std::vector<char> &&buf, uint64_t key, SendPriority priority = SendPriority::Game) {
+            deliverLatest(makeSharedBuffer(std::move(buf)), key, priority);
+        }
+
+        void deliver(std::vector<char> &&buf, SendPriority priority = SendPriority::Game) {
+            deliver(makeSharedBuffer(std::move(buf)), priority);
+        }
+
+        void deliver(const void *data, size_t length, SendPriority priority = SendPriority::Game) {
+            deliver(std::vector<char>((char *)data, (char *)data + length), priority);
+        }
+
+        void deliver(const std::vector<char> &buf, SendPriority priority = SendPriority::Game) {
+            deliver(&buf.at(0), buf.size(), priority);
+        }
+
+        void deliver(const std::string &str, SendPriority priority = SendPriority::Game) {
+            deliver(str.c_str(), str.length(), priority);
+        }
+
+    private:
+        typedef typename std::is_base_of<PacketSplitter, _Extra>::type _IsSplitter;
+
+        // 发送队列中的包
+        struct _OutPacket {
+            SharedBuffer buf;
+            SendPriority priority;
+            uint64_t key;  // deliverLatest的key，不为0且buf为空时是占位，内容在_latestSlots中
+            std::chrono::steady_clock::time_point enqueueTime;
+
+            _OutPacket() : priority(SendPriority::Game), key(0) { }
+        };
+
+        // deliverLatest中每个key最新的未发送内容
+        struct _LatestSlot {
+            uint64_t key;
+            SharedBuffer buf;
+            SendPriority priority;
+        };
+
+        void _saveEndpoints() {
+            if (!_socket.is_open()) {
+                // 经网关转发的会话，地址由startRelay设置
+                return;
+            }
+            try {
                 // 保存远程和本地的IP、端口
                 asio::ip::tcp::endpoint remote = _socket.remote_endpoint();
                 asio::ip::tcp::endpoint local = _socket.local_endpoint();
@@ -50,93 +461,796 @@ namespace jw {
             }
         }
 
-        ~BasicSession<_Extra, _BufSize>() {
-            LOG_DEBUG("BasicSession<_Extra, _BufSize>::~BasicSession<_Extra, _BufSize>");
+        // 检查水位并入队，入队成功返回true，之后须调用_kickWrite
+        // key不为0时由deliverLatest在持有_latestMutex时调用，队列中只放一个占位，内容放在_latestSlots里
+        bool _push(const SharedBuffer &buf, SendPriority priority, uint64_t key) {
+            if (_evicted || _sendFrozen) {
+                return false;
+            }
+
+            size_t size = buf->size();
+            size_t queuedBytes = _queuedBytes;
+            if (queuedBytes + size > _sendLimits.hardLimit) {
+                _evict();
+                return false;
+            }
+            if (queuedBytes >= _sendLimits.highWaterMark) {
+                _congested = true;
+            }
+            if (priority == SendPriority::Bulk) {
+                if (_congested || _bulkQueuedBytes + size > _sendLimits.bulkLimit) {
+                    ++_droppedPackets;
+                    ++_sendStats.droppedPackets;
+                    _sendStats.droppedBytes += size;
+                    ++_sendStats.lanes[(size_t)priority].droppedPackets;
+                    return false;
+                }
+                _bulkQueuedBytes += size;
+            }
+
+            _queuedBytes += size;
+            ++_queuedPackets;
+            _sendStats.queuedBytes += size;
+            ++_sendStats.queuedPackets;
+
+            _OutPacket packet;
+            packet.priority = priority;
+            packet.key = key;
+            if (key != 0) {
+                _LatestSlot slot;
+                slot.key = key;
+                slot.buf = buf;
+                slot.priority = priority;
+                _latestSlots.push_back(std::move(slot));
+            }
+            else {
+                packet.buf = buf;
+            }
+            packet.enqueueTime = std::chrono::steady_clock::now();
+            _writeQueues[(size_t)priority].push(std::move(packet));
+            ++_queuedCount;
+            return true;
         }
 
-        inline void start() {
-            _doRead();
+        // 抢到发送标志的线程负责发起write，其余的只入队
+        // 通过dispatch交给socket所属的io_service：在其线程上时直接执行，否则投递到它的队列里
+        void _kickWrite() {
+            if (!_writing.exchange(true)) {
+                _startWrite(_Handlers());
+            }
         }
 
-        const std::string &getRemoteIP() const { return _remoteIP; }
-        unsigned short getRemotePort() const { return _remotePort; }
-        const std::string &getLocalIP() const { return _localIP; }
-        unsigned short getLocalPort() const { return _localPort; }
+        // 替换未发送的同key包后，按新旧大小之差修正统计
+        void _replaceQueuedBytes(size_t oldSize, size_t newSize, SendPriority priority) {
+            _queuedBytes += newSize;
+            _queuedBytes -= oldSize;
+            _sendStats.queuedBytes += newSize;
+            _sendStats.queuedBytes -= oldSize;
+            if (priority == SendPriority::Bulk) {
+                _bulkQueuedBytes += newSize;
+                _bulkQueuedBytes -= oldSize;
+            }
+            ++_sendStats.supersededPackets;
+            _sendStats.supersededBytes += oldSize;
+        }
 
-        void deliver(std::vector<char> &&buf) {
-            std::lock_guard<jw::QuickMutex> g(_mutex);
+        // 队列中占位包当前内容的大小
+        size_t _latestSize(uint64_t key) {
+            std::lock_guard<jw::QuickMutex> g(_latestMutex);
             (void)g;
-
-            bool empty = _writeQueue.empty();
-            _writeQueue.push_back(std::move(buf));
-            // push之前的发送队列为空，则须要发起write
-            if (empty) {
-                _doWrite();
-            }
+            typename std::vector<_LatestSlot>::const_iterator it = std::find_if(_latestSlots.begin(), _latestSlots.end(), [key](const _LatestSlot &slot) {
+                return slot.key == key;
+            });
+            return it->buf->size();
         }
 
-        void deliver(const void *data, size_t length) {
-            deliver(std::vector<char>((char *)data, (char *)data + length));
+        // 取出队列中占位包的最新内容，此后同key的包重新入队
+        void _takeLatest(_OutPacket &packet) {
+            std::lock_guard<jw::QuickMutex> g(_latestMutex);
+            (void)g;
+            typename std::vector<_LatestSlot>::iterator it = std::find_if(_latestSlots.begin(), _latestSlots.end(), [&packet](const _LatestSlot &slot) {
+                return slot.key == packet.key;
+            });
+            packet.buf = std::move(it->buf);
+            *it = std::move(_latestSlots.back());
+            _latestSlots.pop_back();
         }
 
-        void deliver(const std::vector<char> &buf) {
-            deliver(&buf.at(0), buf.size());
+        // 读入PacketSplitter的接收缓冲区，逐个回调完整的包体
+        void _startRead(CallbackHandlers) {
+            if (_uring != nullptr) {
+                _armUringRecv();
+                return;
+            }
+            _waitReadable();
         }
 
-        void deliver(const std::string &str) {
-            deliver(str.c_str(), str.length());
+        void _startWrite(CallbackHandlers) {
+            auto thiz = SessionPtr(this);
+            getIOService().dispatch(makeCustomAllocHandler(_writeMemory, [this, thiz]() {
+                _doWrite();
+            }));
         }
 
-    private:
-        void _doRead() {
-            auto thiz = shared_from_this();
-            _socket.async_read_some(asio::buffer(_readData, _BufSize), [this, thiz](std::error_code ec, size_t length) {
-                if (!ec) {
-                    _sessionCallback(thiz, SessionEvent::Recv, _readData, length);
-                    // 接收成功，须要发起read
-                    _doRead();
+        // 等待socket可读（Windows上是0字节的WSARecv），等待期间不占用接收缓冲区
+        void _waitReadable() {
+            auto thiz = SessionPtr(this);
+            _socket.async_read_some(asio::null_buffers(), makeCustomAllocHandler(_readMemory, [this, thiz](std::error_code ec, size_t) {
+                if (_readPaused) {
+                    _readParked = true;
+                }
+                else if (!ec && _readAvailable(thiz, _IsSplitter())) {
+                    _waitReadable();
                 }
                 else {
+                    _disconnected = true;
                     _sessionCallback(thiz, SessionEvent::Recv, nullptr, 0);
                 }
+            }));
+        }
+
+        // 每次可读时记录一次，供IdleReaper判断连接是否空闲
+        void _touchRecvTime() {
+            _lastRecvTime.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        }
+
+        // 从池中借缓冲区，读出已到达的数据，逐个回调完整的包体
+        // 没有未收完的包时把缓冲区还回池中
+        // 连接断开或收到非法的包时返回false
+        bool _readAvailable(const SessionPtr &thiz, std::true_type) {
+            _touchRecvTime();
+            std::error_code ec;
+            for (;;) {
+                _borrowRecvBuffer();
+                std::pair<char *, size_t> buf = this->prepareRecvBuffer(_BufSize);
+                size_t length = _socket.read_some(asio::buffer(buf.first, buf.second), ec);
+                if (ec) {
+                    break;
+                }
+                this->commitRecvBuffer(length);
+                bool valid = this->splitRecvPackets([this, &thiz](const char *data, size_t size) {
+                    _sessionCallback(thiz, SessionEvent::Recv, data, size);
+                });
+                if (!valid) {
+                    return false;
+                }
+                if (length < buf.second) {
+                    // 已读空
+                    break;
+                }
+            }
+
+            if (!this->hasPendingRecvData()) {
+                _giveBackRecvBuffer(std::true_type());
+            }
+            return !ec || ec == asio::error::would_block;
+        }
+
+        bool _readAvailable(const SessionPtr &thiz, std::false_type) {
+            _touchRecvTime();
+            std::vector<char> recvBuf;
+            _recvBufferPool.borrow(recvBuf);
+            recvBuf.resize(_BufSize);
+
+            std::error_code ec;
+            for (;;) {
+                size_t length = _socket.read_some(asio::buffer(recvBuf), ec);
+                if (ec) {
+                    break;
+                }
+                _sessionCallback(thiz, SessionEvent::Recv, &recvBuf[0], length);
+                if (length < recvBuf.size()) {
+                    // 已读空
+                    break;
+                }
+            }
+
+            _recvBufferPool.giveBack(recvBuf);
+            return !ec || ec == asio::error::would_block;
+        }
+
+        void _borrowRecvBuffer() {
+            if (!_recvBufBorrowed) {
+                std::vector<char> recvBuf;
+                _recvBufferPool.borrow(recvBuf);
+                this->swapRecvBuffer(recvBuf);
+                _recvBufBorrowed = true;
+            }
+        }
+
+        void _giveBackRecvBuffer(std::true_type) {
+            if (_recvBufBorrowed) {
+                std::vector<char> recvBuf;
+                this->swapRecvBuffer(recvBuf);
+                _recvBufferPool.giveBack(recvBuf);
+                _recvBufBorrowed = false;
+            }
+        }
+
+        void _giveBackRecvBuffer(std::false_type) {
+        }
+
+        std::vector<char> _getPendingRecvData(std::true_type) const {
+            std::pair<const char *, size_t> pending = this->PacketSplitter::getPendingRecvData();
+            return std::vector<char>(pending.first, pending.first + pending.second);
+        }
+
+        std::vector<char> _getPendingRecvData(std::false_type) const {
+            return std::vector<char>();
+        }
+
+        void _preloadRecvData(const char *data, size_t length, std::true_type) {
+            if (length == 0) {
+                return;
+            }
+            _borrowRecvBuffer();
+            std::pair<char *, size_t> buf = this->prepareRecvBuffer(length);
+            std::copy(data, data + length, buf.first);
+            this->commitRecvBuffer(length);
+        }
+
+        void _preloadRecvData(const char *, size_t, std::false_type) {
+        }
+
+        // 以下是走io_uring时的读写，都在socket所属io_service的线程上调用
+
+        // io_uring上的多发recv，在途期间持有会话
+        struct _UringRecv : UringOp {
+            BasicSession<_Extra, _BufSize, _Handlers> *session;
+            SessionPtr self;
+
+            explicit _UringRecv(BasicSession<_Extra, _BufSize, _Handlers> *s) : session(s) { }
+
+            virtual void complete(int result, bool more, const char *data) override {
+                session->_onUringRecv(result, more, data);
+            }
+
+            virtual void abandon() override {
+                SessionPtr released;
+                released.swap(self);
+            }
+        };
+
+        // io_uring上的一次批量发送，在途期间持有会话
+        struct _UringSend : UringSendOp {
+            BasicSession<_Extra, _BufSize, _Handlers> *session;
+            SessionPtr self;
+
+            explicit _UringSend(BasicSession<_Extra, _BufSize, _Handlers> *s) : session(s) { }
+
+            virtual void complete(int result, bool, const char *) override {
+                session->_onUringSend(result);
+            }
+
+            virtual void abandon() override {
+                SessionPtr released;
+                released.swap(self);
+            }
+        };
+
+        void _armUringRecv() {
+            _uringRecv.self = SessionPtr(this);
+            _uring->recv(&_uringRecv, (int)_socket.native_handle());
+        }
+
+        // 提供缓冲区中的数据接到未收完的包后面再拆包，没有剩下未收完的包时把接收缓冲区还回池中
+        // 收到非法的包时返回false
+        bool _deliverUringRecv(const SessionPtr &thiz, const char *data, size_t length, std::true_type) {
+            _preloadRecvData(data, length, std::true_type());
+            bool valid = this->splitRecvPackets([this, &thiz](const char *packet, size_t size) {
+                _sessionCallback(thiz, SessionEvent::Recv, packet, size);
             });
+            if (valid && !this->hasPendingRecvData()) {
+                _giveBackRecvBuffer(std::true_type());
+            }
+            return valid;
         }
 
-        inline void _doWrite() {
-            asio::async_write(_socket, asio::buffer(&_writeQueue.front()[0], _writeQueue.front().size()),
-                std::bind(&BasicSession<_Extra, _BufSize>::_writeCallback, this, std::placeholders::_1, std::placeholders::_2));
+        bool _deliverUringRecv(const SessionPtr &thiz, const char *data, size_t length, std::false_type) {
+            _sessionCallback(thiz, SessionEvent::Recv, data, length);
+            return true;
         }
 
-        void _writeCallback(std::error_code ec, size_t length) {
-            std::lock_guard<jw::QuickMutex> g(_mutex);
-            (void)g;
+        // 多发recv在提供缓冲区用完（-ENOBUFS）或被取消后恢复读时（-ECANCELED）结束，重新发起
+        // 对端关闭、出错或收到非法的包时结束读，回调断开
+        void _onUringRecv(int result, bool more, const char *data) {
+            if (data != nullptr && !_recvInvalid) {
+                _touchRecvTime();
+                if (!_deliverUringRecv(_uringRecv.self, data, (size_t)result, _IsSplitter())) {
+                    _recvInvalid = true;
+                    if (more) {
+                        _uring->cancel(&_uringRecv);
+                    }
+                }
+            }
+            if (more) {
+                return;
+            }
+
+            SessionPtr thiz;
+            thiz.swap(_uringRecv.self);
+            if (_recvInvalid) {
+                _disconnected = true;
+                _sessionCallback(thiz, SessionEvent::Recv, nullptr, 0);
+            }
+            else if (_readPaused) {
+                // 交接前停下，连接仍然有效
+                _readParked = true;
+            }
+            else if (result > 0 || result == -ENOBUFS || result == -ECANCELED) {
+                _armUringRecv();
+            }
+            else {
+                _disconnected = true;
+                _sessionCallback(thiz, SessionEvent::Recv, nullptr, 0);
+            }
+        }
+
+        // 只发出一部分时接着发剩下的，全部发出或失败时交给写循环
+        void _onUringSend(int result) {
+            SessionPtr thiz;
+            thiz.swap(_uringSend.self);
+            if (result > 0 && _uringSend.advance((size_t)result)) {
+                _uringSend.self.swap(thiz);
+                _uring->send(&_uringSend, (int)_socket.native_handle());
+                return;
+            }
+            std::error_code ec;
+            if (result < 0) {
+                ec = std::error_code(-result, asio::error::get_system_category());
+            }
+            else if (result == 0) {
+                ec = asio::error::eof;
+            }
+            _uringWriteDone(ec, _Handlers());
+        }
+
+        void _uringWriteDone(std::error_code ec, CallbackHandlers) {
+            _writeCallback(ec, _writingBytes);
+        }
 
+        void _uringWriteDone(std::error_code ec, CoroutineHandlers) {
+            _writeLoop(ec, _writingBytes);
+        }
+
+        // 在socket所属io_service的线程上取消挂起的读
+        void _cancelRead() {
+            if (_uring != nullptr) {
+                _uring->cancel(&_uringRecv);
+            }
+            else {
+                std::error_code ec;
+                _socket.cancel(ec);
+            }
+        }
+
+        // 将发送队列中的包合并到一次scatter-gather写里，受包数和字节数上限约束
+        // 先取Game通道，取空后再取Bulk通道，Bulk的包在一批中最多_MaxBulkWriteBytes字节，
+        // 以免慢速连接上一大批Bulk数据挡住之后到来的Game包
+        // 至少取一个包，即使它超过了字节数上限
+        // 占位包确定放进这一批之后才取出内容，放不下时留在队列中，之后同key的包仍然替换它
+        // 只有持有_writing标志的一方会调用到这里，因此它是发送队列唯一的消费者
+        // 没有可取的包时返回false
+        bool _takeWriteBatch() {
+            _writingPackets.clear();
+            _writingBuffers.clear();
+            size_t bytes = 0;
+            bool full = false;
+            for (size_t i = 0; i < _LaneCount && !full; ++i) {
+                size_t maxBytes = i == (size_t)SendPriority::Bulk ? std::min(bytes + _MaxBulkWriteBytes, _MaxWriteBytes) : _MaxWriteBytes;
+                _OutPacket *front;
+                while ((front = _writeQueues[i].front()) != nullptr) {
+                    bool placeholder = front->key != 0 && !front->buf;
+                    size_t size = placeholder ? _latestSize(front->key) : front->buf->size();
+                    if (_writingPackets.size() >= _MaxWriteBuffers || (!_writingPackets.empty() && bytes + size > maxBytes)) {
+                        full = true;
+                        break;
+                    }
+                    if (placeholder) {
+                        // 检查大小之后可能又被替换了，以取出的为准
+                        _takeLatest(*front);
+                        size = front->buf->size();
+                    }
+                    _writingPackets.push_back(std::move(*front));
+                    _writeQueues[i].pop();
+                    bytes += size;
+                }
+            }
+
+            if (_writingPackets.empty()) {
+                return false;
+            }
+
+            _queuedCount -= _writingPackets.size();
+            _writingBytes = bytes;
+            for (typename std::vector<_OutPacket>::const_iterator it = _writingPackets.begin(); it != _writingPackets.end(); ++it) {
+                _writingBuffers.push_back(asio::buffer(*it->buf));
+            }
+            return true;
+        }
+
+        // 发出_writingBuffers，完成时调用handler(ec, length)
+        // 经网关转发的会话交给上游连接合并发送，不会阻塞，随即完成
+        // 走io_uring时不用handler，完成后由_uringWriteDone回到写循环
+        template <class _Handler>
+        void _asyncWriteBatch(_Handler &&handler) {
+            if (_relay) {
+                _relay->relaySend(_relayId, _writingBuffers);
+                getIOService().post(makeCustomAllocHandler(_writeMemory, std::bind(std::forward<_Handler>(handler), std::error_code(), _writingBytes)));
+            }
+            else if (_uring != nullptr) {
+                _uringSend.setBuffers(_writingBuffers.data(), _writingBuffers.size());
+                _uringSend.self = SessionPtr(this);
+                _uring->send(&_uringSend, (int)_socket.native_handle());
+            }
+            else {
+                asio::async_write(_socket, _writingRange(), makeCustomAllocHandler(_writeMemory, std::forward<_Handler>(handler)));
+            }
+        }
+
+        // 以不持有数据的区间传给async_write，避免它复制_writingBuffers
+        ConstBufferRange _writingRange() const {
+            return ConstBufferRange(_writingBuffers.data(), _writingBuffers.data() + _writingBuffers.size());
+        }
+
+        // 一批包发送完成，更新统计
+        void _finishWriteBatch() {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            size_t bulkBytes = 0;
+            for (typename std::vector<_OutPacket>::const_iterator it = _writingPackets.begin(); it != _writingPackets.end(); ++it) {
+                uint64_t latency = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - it->enqueueTime).count();
+                _sendStats.lanes[(size_t)it->priority].recordLatency(latency);
+                if (it->priority == SendPriority::Bulk) {
+                    bulkBytes += it->buf->size();
+                }
+            }
+            _bulkQueuedBytes -= bulkBytes;
+
+            size_t packets = _writingPackets.size();
+            _queuedPackets -= packets;
+            _sendStats.queuedPackets -= packets;
+            _queuedBytes -= _writingBytes;
+            _sendStats.queuedBytes -= _writingBytes;
+            if (_queuedBytes <= _sendLimits.lowWaterMark) {
+                _congested = false;
+            }
+        }
+
+        void _doWrite() {
+            if (!_takeWriteBatch()) {
+                if (_queuedCount > 0) {
+                    // 有生产者入队了但还没链接上，稍后再试
+                    _postWrite();
+                    return;
+                }
+
+                _writing = false;
+                // 清除标志后再检查一次，生产者可能在清除之前入队而没能抢到标志
+                if (_queuedCount > 0 && !_writing.exchange(true)) {
+                    _postWrite();
+                }
+                return;
+            }
+
+            // handler持有引用，保证发送完成前对象不被释放或被SessionPool复用
+            auto thiz = SessionPtr(this);
+            _asyncWriteBatch([this, thiz](std::error_code ec, size_t length) {
+                _writeCallback(ec, length);
+            });
+        }
+
+        void _postWrite() {
+            auto thiz = SessionPtr(this);
+            getIOService().post(makeCustomAllocHandler(_writeMemory, [this, thiz]() {
+                _doWrite();
+            }));
+        }
+
+        void _writeCallback(std::error_code ec, size_t) {
             if (!ec) {
-                _writeQueue.pop_front();
-                // 发送队列不为空，则须要发起下一次write
-                if (!_writeQueue.empty()) {
-                    _doWrite();
+                _finishWriteBatch();
+                // 继续发送，队列已空时_doWrite会释放发送标志
+                _doWrite();
+            }
+            else {
+                // 发送失败，不释放发送标志，之后入队的包不再发送
+                _sessionCallback(SessionPtr(this), SessionEvent::Send, nullptr, 0);
+            }
+        }
+
+        // 传给asio的handler，只持有指向常驻协程的指针
+        template <class _Loop>
+        struct _LoopRef {
+            _Loop *loop;
+
+            explicit _LoopRef(_Loop *l) : loop(l) { }
+
+            void operator()(std::error_code ec = std::error_code(), size_t length = 0) {
+                (*loop)(ec, length);
+            }
+        };
+
+        // 读循环：等待可读，读出并回调，直到连接断开
+        // 协程状态保存完之后才发起下一次操作，因为操作可能在其他线程上完成并重入协程
+        struct _ReadLoop : asio::coroutine {
+            BasicSession<_Extra, _BufSize, _Handlers> *session;
+            SessionPtr self;  // 循环运行期间持有会话，循环结束时释放
+
+            explicit _ReadLoop(BasicSession<_Extra, _BufSize, _Handlers> *s) : session(s) { }
+
+            void operator()(std::error_code ec = std::error_code(), size_t = 0) {
+                BasicSession<_Extra, _BufSize, _Handlers> *s = session;
+                bool wait = false;
+                SessionPtr released;  // 在返回时释放，此后不再访问会话
+                ASIO_CORO_REENTER(this) {
+                    for (;;) {
+                        ASIO_CORO_YIELD wait = true;
+                        if (s->_readPaused || ec || !s->_readAvailable(self, _IsSplitter())) {
+                            break;
+                        }
+                    }
+                    if (s->_readPaused) {
+                        // 交接前停下，连接仍然有效
+                        s->_readParked = true;
+                    }
+                    else {
+                        s->_disconnected = true;
+                        s->_sessionCallback(self, SessionEvent::Recv, nullptr, 0);
+                    }
+                    released.swap(self);
+                }
+
+                if (wait) {
+                    s->_socket.async_read_some(asio::null_buffers(), makeCustomAllocHandler(s->_readMemory, _LoopRef<_ReadLoop>(this)));
                 }
             }
+        };
+
+        // 写循环：取一批包发送，直到发送队列为空时挂起，由抢到发送标志的deliver唤醒
+        // 挂起期间不持有会话
+        struct _WriteLoop : asio::coroutine {
+            BasicSession<_Extra, _BufSize, _Handlers> *session;
+            SessionPtr self;  // 持有发送标志期间持有会话
+
+            explicit _WriteLoop(BasicSession<_Extra, _BufSize, _Handlers> *s) : session(s) { }
+
+            void operator()(std::error_code ec = std::error_code(), size_t = 0) {
+                BasicSession<_Extra, _BufSize, _Handlers> *s = session;
+                enum class _Next { None, Write, Retry, Idle } next = _Next::None;
+                SessionPtr released;  // 在返回时释放，此后不再访问会话
+                ASIO_CORO_REENTER(this) {
+                    for (;;) {
+                        if (s->_takeWriteBatch()) {
+                            ASIO_CORO_YIELD next = _Next::Write;
+                            if (ec) {
+                                // 发送失败，不释放发送标志，之后入队的包不再发送
+                                s->_sessionCallback(self, SessionEvent::Send, nullptr, 0);
+                                break;
+                            }
+                            s->_finishWriteBatch();
+                        }
+                        else if (s->_queuedCount > 0) {
+                            // 有生产者入队了但还没链接上，稍后再试
+                            ASIO_CORO_YIELD next = _Next::Retry;
+                        }
+                        else {
+                            ASIO_CORO_YIELD next = _Next::Idle;
+                        }
+                    }
+                    released.swap(self);
+                }
+
+                switch (next) {
+                case _Next::Write:
+                    s->_asyncWriteBatch(_LoopRef<_WriteLoop>(this));
+                    break;
+                case _Next::Retry:
+                    s->getIOService().post(makeCustomAllocHandler(s->_writeMemory, _LoopRef<_WriteLoop>(this)));
+                    break;
+                case _Next::Idle:
+                    // 先让出引用再清除标志，清除之后其他线程可能抢到标志并重入协程
+                    released.swap(self);
+                    s->_writing = false;
+                    // 清除标志后再检查一次，生产者可能在清除之前入队而没能抢到标志
+                    if (s->_queuedCount > 0 && !s->_writing.exchange(true)) {
+                        self = std::move(released);
+                        s->getIOService().post(makeCustomAllocHandler(s->_writeMemory, _LoopRef<_WriteLoop>(this)));
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+        };
+
+        void _startRead(CoroutineHandlers) {
+            if (_uring != nullptr) {
+                _armUringRecv();
+                return;
+            }
+            _readLoop = _ReadLoop(this);
+            _readLoop.self = SessionPtr(this);
+            _readLoop();
+        }
+
+        // 只在抢到发送标志后调用
+        void _startWrite(CoroutineHandlers) {
+            _writeLoop.self = SessionPtr(this);
+            getIOService().dispatch(makeCustomAllocHandler(_writeMemory, _LoopRef<_WriteLoop>(&_writeLoop)));
+        }
+
+        // 在socket所属io_service的线程上执行func，投递之后连接被迁走的，转投到新的io_service上
+        template <class _Func>
+        void _dispatchToOwner(const _Func &func) {
+            auto thiz = SessionPtr(this);
+            asio::io_service *service = _service;
+            service->dispatch([this, thiz, service, func]() {
+                if (service != _service) {
+                    _dispatchToOwner(func);
+                    return;
+                }
+                func();
+            });
+        }
+
+        // 在原io_service的线程上，等读循环停下、取得发送标志后换socket；取得的发送标志一直持有到迁移结束，其间入队的包不发出
+        void _migrateWhenSettled(asio::io_service *target, const std::function<void (bool)> &done, std::chrono::steady_clock::time_point deadline, bool holdingWrite) {
+            holdingWrite = holdingWrite || !_writing.exchange(true);
+            if (isConnected() && (!_readParked || !holdingWrite) && std::chrono::steady_clock::now() < deadline) {
+                // 读循环还没结束，或write还在进行
+                auto thiz = SessionPtr(this);
+                getIOService().post([this, thiz, target, done, deadline, holdingWrite]() {
+                    _migrateWhenSettled(target, done, deadline, holdingWrite);
+                });
+                return;
+            }
+
+            bool moved = isConnected() && _readParked && holdingWrite && _moveSocket(*target);
+            auto thiz = SessionPtr(this);
+            std::function<void ()> resume = [this, thiz, holdingWrite, done, moved]() {
+                _readPaused = false;
+                if (_readParked.exchange(false)) {
+                    _startRead(_Handlers());
+                }
+                if (holdingWrite) {
+                    _writing = false;
+                    if (_queuedCount > 0) {
+                        _kickWrite();
+                    }
+                }
+                _migrating = false;
+                done(moved);
+            };
+            if (moved) {
+                target->post(resume);
+            }
             else {
-                // 发送失败
-                _sessionCallback(shared_from_this(), SessionEvent::Send, nullptr, 0);
+                resume();
+            }
+        }
+
+        bool _moveSocket(asio::io_service &target) {
+            std::error_code ec;
+            if (!moveSocket(_socket, target, ec)) {
+                LOG_WARN("failed to migrate session %s:%hu: %s", _remoteIP.c_str(), _remotePort, ec.message().c_str());
+                return false;
+            }
+            _service = &target;
+            if (_uring != nullptr) {
+                // 目标io_service没有启用io_uring时改走asio，socket须为非阻塞模式
+                _uring = UringService::find(target);
+                _socket.non_blocking(_uring == nullptr, ec);
             }
+            return true;
+        }
+
+        // 发送队列超过硬上限，断开连接
+        // 关闭socket后，挂起的read会失败，由_sessionCallback通知上层移除这个连接
+        void _evict() {
+            if (_evicted.exchange(true)) {
+                return;
+            }
+            ++_sendStats.evictedSessions;
+            LOG_WARN("evict slow session %s:%hu, queued %lu bytes", _remoteIP.c_str(), _remotePort, (unsigned long)_queuedBytes);
+            _closeSocket();
+        }
+
+        void _closeSocket() {
+            if (_relay) {
+                _relay->relayClose(_relayId);
+                _endRelay();
+                return;
+            }
+            _dispatchToOwner([this]() {
+                std::error_code ec;
+                _socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+                if (_uring == nullptr) {
+                    _socket.close(ec);
+                }
+                // 走io_uring时只shutdown，在途的操作随之结束；句柄留到recycle或析构时关闭，
+                // 以免还排在提交队列里的操作落到复用了这个句柄的新连接上
+            });
+        }
+
+        // 经网关转发的会话结束，回调一次断开
+        void _endRelay() {
+            if (_relayEnded.exchange(true)) {
+                return;
+            }
+            auto thiz = SessionPtr(this);
+            getIOService().post([this, thiz]() {
+                _disconnected = true;
+                _sessionCallback(thiz, SessionEvent::Recv, nullptr, 0);
+            });
         }
 
         asio::ip::tcp::socket _socket;
+        std::atomic<asio::io_service *> _service{ nullptr };  // _socket所属的io_service，只在迁移时在原io_service的线程上改变
         std::string _remoteIP;
         unsigned short _remotePort = 0;
         std::string _localIP;
         unsigned short _localPort = 0;
-        char _readData[_BufSize];
+        bool _recvBufBorrowed = false;  // PacketSplitter的接收缓冲区是否借自_recvBufferPool
+        static BufferPool _recvBufferPool;
+
+        // 单次async_write最多合并的包数和字节数
+        static const size_t _MaxWriteBuffers = 64U;
+        static const size_t _MaxWriteBytes = 64U * 1024U;
+        static const size_t _MaxBulkWriteBytes = 8U * 1024U;
+
+        static const size_t _LaneCount = 2U;
+        jw::MPSCQueue<_OutPacket> _writeQueues[_LaneCount];  // 以SendPriority为下标，每个优先级一条通道
+        std::atomic<size_t> _queuedCount{ 0 };  // 各通道已入队且未取出的包数之和
+        std::atomic<size_t> _bulkQueuedBytes{ 0 };  // Bulk通道中未发送完成的字节数
+        std::atomic<bool> _writing{ false };  // 是否有write在进行中
+        std::vector<_LatestSlot> _latestSlots;  // 在队列中有占位、尚未取出的可替换包，通常只有几个
+        jw::QuickMutex _latestMutex;
+        std::vector<_OutPacket> _writingPackets;  // 正在发送的包
+        std::vector<asio::const_buffer> _writingBuffers;  // 对应_writingPackets的缓冲区
+        size_t _writingBytes = 0;  // 正在发送的字节数
+
+        _ReadLoop _readLoop;  // CoroutineHandlers时使用
+        _WriteLoop _writeLoop;
 
-        std::deque<std::vector<char> > _writeQueue;
-        jw::QuickMutex _mutex;
+        _UringRecv _uringRecv;  // 以下走io_uring时使用
+        _UringSend _uringSend;
+        UringService *_uring = nullptr;  // start时socket所属的io_service启用了io_uring时不为空，只在它的线程上改变
+        bool _recvInvalid = false;  // 收到了非法的包，等多发recv结束后回调断开
+
+        // handler内存块，大小须容纳asio的读、写操作对象（含包装的handler）
+        // 写方向的post/dispatch和async_write都只由持有_writing标志的一方发起，同一时刻最多一个
+        static const size_t _HandlerMemorySize = 512U;
+        HandlerMemory<_HandlerMemorySize> _readMemory;
+        HandlerMemory<_HandlerMemorySize> _writeMemory;
+
+        SendLimits _sendLimits;
+        std::atomic<size_t> _queuedPackets{ 0 };  // 未发送完成的包数
+        std::atomic<size_t> _queuedBytes{ 0 };  // 未发送完成的字节数
+        std::atomic<uint64_t> _droppedPackets{ 0 };
+        std::atomic<bool> _congested{ false };
+        std::atomic<bool> _evicted{ false };
+        std::atomic<bool> _disconnected{ false };  // 读循环已结束
+        std::atomic<bool> _readPaused{ false };  // 以下三个用于热重启交接
+        std::atomic<bool> _readParked{ false };  // 读循环因_readPaused而结束
+        std::atomic<bool> _sendFrozen{ false };
+        std::atomic<bool> _migrating{ false };
+        std::atomic<int64_t> _lastRecvTime{ 0 };  // steady_clock的计数
+        std::shared_ptr<RelayChannel> _relay;  // 经网关转发时不为空
+        uint32_t _relayId = 0;
+        std::atomic<bool> _relayEnded{ false };
+        static SendStats _sendStats;
 
         SessionCallback _sessionCallback;
+        std::shared_ptr<Recycler> _recycler;
     };
 
+    template <class _Extra, size_t _BufSize, class _Handlers>
+    SendStats BasicSession<_Extra, _BufSize, _Handlers>::_sendStats;
+
+    // 同一种会话共享的接收缓冲区池，最多保留4096个空闲缓冲区，扩容超过64KB的不回收
+    template <class _Extra, size_t _BufSize, class _Handlers>
+    BufferPool BasicSession<_Extra, _BufSize, _Handlers>::_recvBufferPool(4096U, 64U * 1024U);
+
     typedef BasicSession<Nothing, 1024U> Session;
 }
 
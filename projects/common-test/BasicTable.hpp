@@ -2,6 +2,7 @@
 #define _GAME_TABLE_HPP_
 
 #include "QuickMutex.h"
+#include "IntrusivePtr.hpp"
 #include <stddef.h>
 #include <vector>
 #include <memory>
@@ -20,13 +21,14 @@ namespace gs {
     template <class _GameUser, class _GameLogic>
     struct BasicTable {
         typedef _GameUser UserType;
+        typedef jw::IntrusivePtr<_GameUser> UserPtr;
         typedef _GameLogic LogicType;
         static const size_t ParticipantCount = _GameLogic::ParticipantCount;
 
         BasicTable<_GameUser, _GameLogic>() {
         }
 
-        bool sitDown(const std::shared_ptr<_GameUser> &user, unsigned seat) {
+        bool sitDown(const UserPtr &user, unsigned seat) {
             std::lock_guard<jw::QuickMutex> g(_mutex);
             (void)g;
             if (_participants[seat] != nullptr) {
@@ -38,7 +40,7 @@ namespace gs {
             return true;
         }
 
-        bool standUp(const std::shared_ptr<_GameUser> &user, unsigned seat) {
+        bool standUp(const UserPtr &user, unsigned seat) {
             std::lock_guard<jw::QuickMutex> g(_mutex);
             (void)g;
             if (_participants[seat] == nullptr) {
@@ -50,16 +52,16 @@ namespace gs {
         }
 
         // 语法：返回数组的引用
-        std::shared_ptr<_GameUser> (&getParticipants())[_GameLogic::ParticipantCount] {
+        UserPtr (&getParticipants())[_GameLogic::ParticipantCount] {
             return _participants;
         }
 
-        const std::shared_ptr<_GameUser> (&getParticipants() const)[_GameLogic::ParticipantCount] {
+        const UserPtr (&getParticipants() const)[_GameLogic::ParticipantCount] {
             return _participants;
         }
     protected:
-        std::shared_ptr<_GameUser> _participants[_GameLogic::ParticipantCount];  // 参与玩家
-        std::vector<std::shared_ptr<_GameUser> > _watchers;  // 旁观玩家
+        UserPtr _participants[_GameLogic::ParticipantCount];  // 参与玩家
+        std::vector<UserPtr > _watchers;  // 旁观玩家
 
         jw::QuickMutex _mutex;
 
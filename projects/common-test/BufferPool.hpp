@@ -0,0 +1,83 @@
+﻿#ifndef _BUFFER_POOL_HPP_
+#define _BUFFER_POOL_HPP_
+
+#include "QuickMutex.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <utility>
+
+namespace jw {
+
+    // 缓冲区池的统计
+    struct BufferPoolStats {
+        uint64_t borrowed;  // 当前借出的缓冲区数
+        uint64_t allocated;  // 池中没有空闲缓冲区而新建的次数
+        size_t idle;  // 当前空闲的缓冲区数
+    };
+
+    // 多个连接共享的接收缓冲区池，连接只在有数据可读时才借用缓冲区，处理完后归还
+    // 容量超过maxBufferSize的缓冲区（为大包扩容过的）归还时直接释放
+    class BufferPool {
+    public:
+        BufferPool(const BufferPool &) = delete;
+        BufferPool &operator=(const BufferPool &) = delete;
+
+        BufferPool(size_t maxIdle, size_t maxBufferSize) : _maxIdle(maxIdle), _maxBufferSize(maxBufferSize) {
+        }
+
+        // 借出一个缓冲区与buf交换，buf原先的内容被丢弃
+        void borrow(std::vector<char> &buf) {
+            ++_borrowed;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (!_idleList.empty()) {
+                    buf.swap(_idleList.back());
+                    _idleList.pop_back();
+                    return;
+                }
+            }
+            ++_allocated;
+            std::vector<char>().swap(buf);
+        }
+
+        // 归还buf中的缓冲区，之后buf为空
+        void giveBack(std::vector<char> &buf) {
+            --_borrowed;
+            std::vector<char> tmp;
+            tmp.swap(buf);
+            if (tmp.capacity() > _maxBufferSize) {
+                return;
+            }
+
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            if (_idleList.size() < _maxIdle) {
+                _idleList.push_back(std::move(tmp));
+            }
+        }
+
+        BufferPoolStats getStats() {
+            BufferPoolStats stats;
+            stats.borrowed = _borrowed;
+            stats.allocated = _allocated;
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            stats.idle = _idleList.size();
+            return stats;
+        }
+
+    private:
+        std::vector<std::vector<char> > _idleList;
+        size_t _maxIdle;
+        size_t _maxBufferSize;
+        jw::QuickMutex _mutex;
+        std::atomic<uint64_t> _borrowed{ 0 };
+        std::atomic<uint64_t> _allocated{ 0 };
+    };
+}
+
+#endif
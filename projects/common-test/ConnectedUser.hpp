@@ -2,11 +2,13 @@
 #define _CONNECTED_USER_HPP_
 
 #include "PacketSplitter.hpp"
+#include "AdmissionControl.hpp"
 
 namespace gs {
     struct ConnectedUser : jw::JsonPacketSplitter {
         int64_t id = 0;
         std::string name;
+        jw::AdmissionTicket admission;  // 连接断开时归还
     };
 }
 
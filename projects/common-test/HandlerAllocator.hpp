@@ -0,0 +1,111 @@
+﻿#ifndef _HANDLER_ALLOCATOR_HPP_
+#define _HANDLER_ALLOCATOR_HPP_
+
+#include "asio_header.hpp"
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+#include <atomic>
+
+namespace jw {
+
+    // 一块固定大小的handler内存，同一时刻只服务一个异步操作
+    // 同一方向（读或写）的异步操作是串行的，每个方向用一块即可让稳态下的handler不再分配堆内存
+    // 申请的大小超过_Size或这块内存正被占用时，退回到operator new
+    template <size_t _Size>
+    class HandlerMemory {
+    public:
+        HandlerMemory<_Size>(const HandlerMemory<_Size> &) = delete;
+        HandlerMemory<_Size> &operator=(const HandlerMemory<_Size> &) = delete;
+
+        HandlerMemory<_Size>() { }
+
+        void *allocate(size_t size) {
+            if (!_inUse && size <= sizeof(_storage)) {
+                _inUse = true;
+                return &_storage;
+            }
+            ++_fallbackCount;
+            return ::operator new(size);
+        }
+
+        void deallocate(void *pointer) {
+            if (pointer == &_storage) {
+                _inUse = false;
+            }
+            else {
+                ::operator delete(pointer);
+            }
+        }
+
+        // 退回到operator new的次数，所有HandlerMemory<_Size>共享
+        static uint64_t getFallbackCount() { return _fallbackCount; }
+
+    private:
+        typename std::aligned_storage<_Size>::type _storage;
+        bool _inUse = false;
+        static std::atomic<uint64_t> _fallbackCount;
+    };
+
+    template <size_t _Size>
+    std::atomic<uint64_t> HandlerMemory<_Size>::_fallbackCount;
+
+    // 包装handler，通过asio_handler_allocate/asio_handler_deallocate钩子让asio从HandlerMemory申请内存
+    // asio_handler_invoke和asio_handler_is_continuation转给被包装的handler，包装strand的handler时仍在strand上执行，连续的读写仍按continuation投递
+    template <class _Memory, class _Handler>
+    class CustomAllocHandler {
+    public:
+        CustomAllocHandler<_Memory, _Handler>(_Memory &memory, _Handler &&handler)
+            : _memory(memory), _handler(std::move(handler)) {
+        }
+
+        template <class ..._Args>
+        void operator()(_Args &&...args) {
+            _handler(std::forward<_Args>(args)...);
+        }
+
+        friend void *asio_handler_allocate(size_t size, CustomAllocHandler<_Memory, _Handler> *thiz) {
+            return thiz->_memory.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void *pointer, size_t, CustomAllocHandler<_Memory, _Handler> *thiz) {
+            thiz->_memory.deallocate(pointer);
+        }
+
+        template <class _Function>
+        friend void asio_handler_invoke(_Function &&function, CustomAllocHandler<_Memory, _Handler> *thiz) {
+            asio_handler_invoke_helpers::invoke(function, thiz->_handler);
+        }
+
+        friend bool asio_handler_is_continuation(CustomAllocHandler<_Memory, _Handler> *thiz) {
+            return asio_handler_cont_helpers::is_continuation(thiz->_handler);
+        }
+
+    private:
+        _Memory &_memory;
+        _Handler _handler;
+    };
+
+    template <class _Memory, class _Handler>
+    inline CustomAllocHandler<_Memory, typename std::decay<_Handler>::type> makeCustomAllocHandler(_Memory &memory, _Handler &&handler) {
+        return CustomAllocHandler<_Memory, typename std::decay<_Handler>::type>(memory, typename std::decay<_Handler>::type(std::forward<_Handler>(handler)));
+    }
+
+    // 不持有数据的const_buffer序列，作为async_write的参数时复制它不会分配内存
+    class ConstBufferRange {
+    public:
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer *const_iterator;
+
+        ConstBufferRange(const asio::const_buffer *first, const asio::const_buffer *last) : _first(first), _last(last) { }
+
+        const_iterator begin() const { return _first; }
+        const_iterator end() const { return _last; }
+
+    private:
+        const asio::const_buffer *_first;
+        const asio::const_buffer *_last;
+    };
+}
+
+#endif
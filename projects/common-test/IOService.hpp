@@ -3,53 +3,87 @@
 
 #include "asio_header.hpp"
 #include "DebugConfig.h"
-#include <vector>
+#include "IOServicePool.hpp"
 #include <thread>
+#include <vector>
+#include <algorithm>
 
 namespace jw {
 
-    // _Server的构造函数必须为_Server(asio::io_service &service, unsigned port);
+    enum class IOServiceMode {
+        SharedService = 0,  // 所有工作线程共用一个io_service
+        ServicePerCore,  // 每个核一个io_service，每个io_service只由一个线程运行，连接轮询分配
+        ServicePerCoreReusePort  // 同ServicePerCore，但每个io_service有自己的SO_REUSEPORT监听socket（仅Linux，否则同ServicePerCore）
+    };
+
+    // _Server的构造函数必须为_Server(jw::IOServicePool &pool, unsigned short port, bool reusePort, const std::vector<native_handle_type> &listenHandles);
+    // listenHandles为接管的监听socket（热重启），为空时由_Server自己监听
+    // topology指定io线程的数量和绑定的CPU，未指定的数量按mode取默认值；定时器线程由TimerEngine::setAffinity放置
+    // topology.maxServiceCount大于io_service的个数时，多出的先不运行，由enableAutoScaling按负载启用
+    // topology.ioUring为true时，在构造_Server之前给所有io_service启用io_uring
     template <class _Server>
     class IOService {
     private:
-        // 构造顺序：先构造_service，再用它构造_server和_work
-        asio::io_service _service;
+        // 构造顺序：先构造_pool，再用它构造_server
+        IOServicePool _pool;
         _Server _server;
-        asio::io_service::work _work;
-        std::vector<std::thread *> _workerThreads;
+        IOServiceMode _mode;
+
+        static size_t _HardwareConcurrency() {
+            size_t hc = std::thread::hardware_concurrency();
+            return hc > 0 ? hc : 1;
+        }
+
+        static size_t _ServiceCount(IOServiceMode mode, const ThreadTopology &topology) {
+            if (mode == IOServiceMode::SharedService) {
+                return 1;
+            }
+            return topology.serviceCount != 0 ? topology.serviceCount : _HardwareConcurrency();
+        }
+
+        // 含未运行的；SO_REUSEPORT时每个io_service都有监听socket，都要运行
+        static size_t _MaxServiceCount(IOServiceMode mode, const ThreadTopology &topology) {
+            return std::max(_ServiceCount(mode, topology), mode == IOServiceMode::ServicePerCore ? topology.maxServiceCount : 0);
+        }
+
+        static size_t _ThreadsPerService(IOServiceMode mode, const ThreadTopology &topology) {
+            if (topology.threadsPerService != 0) {
+                return topology.threadsPerService;
+            }
+            return mode != IOServiceMode::SharedService ? 1 : _HardwareConcurrency() * 2 + 2;
+        }
 
     public:
         IOService<_Server>(const IOService<_Server> &) = delete;
         IOService<_Server> &operator=(const IOService<_Server> &) = delete;
 
-        IOService<_Server>(unsigned short port) try : _server(_service, port), _work(_service) {
-            int hc = std::thread::hardware_concurrency();
-            hc *= 2;
-            hc += 2;
-            while (hc-- > 0) {
-                _workerThreads.push_back(new (std::nothrow) std::thread([this]() {
-                    _service.run();
-                }));
-            }
+        IOService<_Server>(unsigned short port, IOServiceMode mode = IOServiceMode::SharedService, const ThreadTopology &topology = ThreadTopology(),
+            const std::vector<asio::ip::tcp::acceptor::native_handle_type> &listenHandles = std::vector<asio::ip::tcp::acceptor::native_handle_type>()) try
+            : _pool(_MaxServiceCount(mode, topology), _ThreadsPerService(mode, topology), topology.ioCpus, _ServiceCount(mode, topology), 0, topology.ioUring)
+            , _server(_pool, port, mode == IOServiceMode::ServicePerCoreReusePort, listenHandles), _mode(mode) {
+            _pool.start();
         }
         catch (std::exception &e) {
             LOG_ERROR("%s", e.what());
         }
 
         ~IOService<_Server>() {
-            _service.stop();
-
-            while (_workerThreads.empty()) {
-                std::thread *t = _workerThreads.back();
-                if (t != nullptr) {
-                    if (t->joinable()) {
-                        t->join();
-                    }
-                    delete t;
-                }
-                _workerThreads.pop_back();
+            // 先停掉工作线程，再析构_server
+            _pool.stop();
+        }
+
+        // 按负载伸缩io线程池（见IOServicePool::startScaling），_Server须有ScalingHooks getScalingHooks(IOServicePool &)
+        // ServicePerCoreReusePort时每个io_service有自己的监听socket，不能退役，不支持伸缩
+        bool enableAutoScaling(const ScalingPolicy &policy) {
+            if (_mode == IOServiceMode::ServicePerCoreReusePort) {
+                LOG_WARN("io pool scaling is not supported with SO_REUSEPORT acceptors");
+                return false;
             }
+            return _pool.startScaling(policy, _server.getScalingHooks(_pool));
         }
+
+        _Server &getServer() { return _server; }
+        IOServicePool &getPool() { return _pool; }
     };
 }
 
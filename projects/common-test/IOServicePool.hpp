@@ -0,0 +1,627 @@
+﻿#ifndef _IO_SERVICE_POOL_HPP_
+#define _IO_SERVICE_POOL_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "ThreadTopology.hpp"
+#include "UringService.hpp"
+#include "QuickMutex.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__linux__)
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <errno.h>
+#endif
+
+namespace jw {
+
+    // 把已连接的socket换成target上的一个副本（复制句柄后在target上注册，再关闭原来的句柄），用于把连接迁出退役的io_service
+    // 原来的句柄关闭时从原io_service的epoll中删除（accept或assign得到的socket都是如此），副本不受影响
+    // 须在socket没有挂起的异步操作、且没有其他线程访问它时调用；仅Linux，其他平台返回false
+    inline bool moveSocket(asio::ip::tcp::socket &socket, asio::io_service &target, std::error_code &ec) {
+#if defined(__linux__)
+        asio::ip::tcp::endpoint local = socket.local_endpoint(ec);
+        if (ec) {
+            return false;
+        }
+        int handle = ::fcntl(socket.native_handle(), F_DUPFD_CLOEXEC, 0);
+        if (handle < 0) {
+            ec = std::error_code(errno, asio::error::get_system_category());
+            return false;
+        }
+        asio::ip::tcp::socket moved(target);
+        moved.assign(local.protocol(), handle, ec);
+        if (ec) {
+            ::close(handle);
+            return false;
+        }
+        bool nonBlocking = socket.non_blocking();
+        moved.non_blocking(nonBlocking, ec);
+        socket.close(ec);
+        socket = std::move(moved);
+        ec = std::error_code();
+        return true;
+#else
+        (void)socket;
+        (void)target;
+        ec = asio::error::operation_not_supported;
+        return false;
+#endif
+    }
+
+    // io线程池的伸缩策略（见IOServicePool::startScaling）
+    // 伸缩的单位：池中只有一个io_service时是线程，否则是io_service（连同它的线程）
+    // 利用率是io线程占用的CPU时间与经过时间之比（各单位的平均值），排队延迟是post一个handler到它开始执行的时间（各单位的最大值）
+    // 利用率或延迟高于上限连续scaleUpSamples次时扩容；都低于下限连续scaleDownSamples次、且少一个单位后利用率不超过上限时缩容
+    // 两次伸缩至少间隔cooldown；不能取得线程CPU时间的平台只按延迟伸缩
+    struct ScalingPolicy {
+        size_t minWorkers;
+        size_t maxWorkers;  // 不超过池的容量，0表示池的容量：多个io_service时为io_service的总数，否则为构造时的maxThreads
+        std::chrono::milliseconds interval;  // 采样间隔
+        double scaleUpUtilization;
+        std::chrono::milliseconds scaleUpLag;
+        double scaleDownUtilization;
+        std::chrono::milliseconds scaleDownLag;
+        size_t scaleUpSamples;
+        size_t scaleDownSamples;
+        std::chrono::milliseconds cooldown;
+        std::chrono::milliseconds migrateTimeout;  // 退役的io_service上的连接须在这段时间内迁走，否则放弃这次缩容
+
+        ScalingPolicy() : minWorkers(1), maxWorkers(0), interval(1000), scaleUpUtilization(0.75), scaleUpLag(20), scaleDownUtilization(0.25), scaleDownLag(2),
+            scaleUpSamples(3), scaleDownSamples(30), cooldown(10000), migrateTimeout(10000) { }
+    };
+
+    // 按io_service伸缩时通知上层，都在伸缩线程上调用，不需要的可以为空
+    // 没有migrate时不缩容，因为不知道退役的io_service上是否还有连接
+    struct ScalingHooks {
+        std::function<void (asio::io_service &)> activated;  // 停用的io_service重新开始运行之前
+        std::function<size_t (asio::io_service &)> migrate;  // 把连接迁出退役中的io_service，返回仍在上面的连接数，反复调用直到为0
+        std::function<void (asio::io_service &)> retired;  // io_service停止之后
+    };
+
+    struct ScalingStats {
+        size_t workers;  // 当前的单位数
+        size_t threads;  // 当前的io线程数
+        double utilization;  // 最近一次采样的利用率，不支持时为-1
+        std::chrono::microseconds lag;  // 最近一次采样的排队延迟
+        uint64_t scaleUps;
+        uint64_t scaleDowns;
+        uint64_t abortedScaleDowns;  // 连接没能按时迁走而放弃的缩容
+    };
+
+    // 一组io_service，每个io_service由threadsPerService个线程运行
+    // serviceCount为1时即所有线程共用一个io_service
+    // threadsPerService为1时每个io_service只在一个线程上运行，挂在它上面的socket的所有回调都在这个线程上执行
+    // threadCpus不为空时，第i个工作线程（按io_service依次编号）启动时绑定到threadCpus[i % threadCpus.size()]
+    // activeCount不为0时只运行前activeCount个io_service，其余的留给伸缩（见startScaling）
+    // maxThreads只用于serviceCount为1时：伸缩时线程数的上限，为0时同threadsPerService
+    // io_service按每个io_service最多的线程数构造：asio的并发提示为1时认为只有一个线程在运行它，不再唤醒其他线程，扩容出的线程取不到handler
+    // uring为true时在所有io_service上启用io_uring（见enableUring）
+    class IOServicePool {
+    public:
+        IOServicePool(const IOServicePool &) = delete;
+        IOServicePool &operator=(const IOServicePool &) = delete;
+
+        IOServicePool(size_t serviceCount, size_t threadsPerService, const std::vector<CpuSet> &threadCpus = std::vector<CpuSet>(), size_t activeCount = 0,
+            size_t maxThreads = 0, bool uring = false)
+            : _threadsPerService(threadsPerService), _maxThreads(0), _threadCpus(threadCpus) {
+            if (serviceCount == 0) {
+                serviceCount = 1;
+            }
+            if (_threadsPerService == 0) {
+                _threadsPerService = 1;
+            }
+            if (activeCount == 0 || activeCount > serviceCount) {
+                activeCount = serviceCount;
+            }
+            _maxThreads = serviceCount == 1 ? std::max(maxThreads, _threadsPerService) : _threadsPerService;
+            for (size_t i = 0; i < serviceCount; ++i) {
+                _loops.push_back(std::unique_ptr<_Loop>(new _Loop(_maxThreads)));
+                _loops.back()->state = i < activeCount ? _State::Active : _State::Parked;
+            }
+            if (uring) {
+                enableUring();
+            }
+        }
+
+        ~IOServicePool() {
+            stop();
+        }
+
+        // 启动工作线程
+        void start() {
+            std::lock_guard<std::mutex> g(_mutex);
+            (void)g;
+            size_t active = 0;
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                if (_loops[i]->state == _State::Active) {
+                    _startWorkers(i, _threadsPerService);
+                    ++active;
+                }
+            }
+            LOG_INFO("IOServicePool started: %lu of %lu service(s) x %lu thread(s)%s", (unsigned long)active, (unsigned long)_loops.size(),
+                (unsigned long)_threadsPerService, _threadCpus.empty() ? "" : ", pinned");
+        }
+
+        // 停止伸缩和所有io_service，等待工作线程退出
+        void stop() {
+            _stopScaling();
+            std::lock_guard<std::mutex> g(_mutex);
+            (void)g;
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _loops[i]->work.reset();
+            }
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _loops[i]->service->stop();
+            }
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _joinWorkers(*_loops[i]);
+            }
+        }
+
+        // 在所有io_service（含未运行的）上启用io_uring（见UringService）：之后在上面开始的连接用io_uring收发，BasicServer用它accept
+        // 内核不支持或被禁用时返回false，连接照常走asio；须在构造BasicServer和开始连接之前调用
+        // 一个io_service的完成项同一时刻只由一个线程处理，一个io_service多个线程（SharedService）时处理不会随线程数扩展
+        bool enableUring() {
+            for (size_t i = 0; i < _loops.size(); ++i) {
+                if (!UringService::enable(*_loops[i]->service)) {
+                    LOG_WARN("io_uring is not available, connections use asio");
+                    return false;
+                }
+            }
+            LOG_INFO("io_uring enabled on %lu service(s)", (unsigned long)_loops.size());
+            return true;
+        }
+
+        // io_service的总数，含未运行的
+        size_t size() const { return _loops.size(); }
+
+        asio::io_service &getService(size_t index) { return *_loops.at(index)->service; }
+
+        // 轮询取下一个运行中的io_service，用于分配新连接，跳过未运行和退役中的
+        asio::io_service &getNextService() {
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _Loop &loop = *_loops[_next++ % cnt];
+                if (loop.state == _State::Active) {
+                    return *loop.service;
+                }
+            }
+            return *_loops[0]->service;
+        }
+
+        // service是否在运行且不在退役中，新连接只应放在这样的io_service上
+        bool isActive(asio::io_service &service) const {
+            const _Loop *loop = _find(service);
+            return loop != nullptr && loop->state == _State::Active;
+        }
+
+        // 缩容时不退役service，用于其上有不能迁移的连接（如网关的上游连接）时；第0个io_service总是不退役
+        void pinService(asio::io_service &service) {
+            _Loop *loop = _find(service);
+            if (loop != nullptr && !loop->pinned.exchange(true)) {
+                LOG_INFO("IOServicePool: service %lu pinned", (unsigned long)(_index(*loop)));
+            }
+        }
+
+        // 按负载在policy的上下限之间伸缩，每次伸缩都写日志，计数见getScalingStats
+        // 只有一个io_service时增减运行它的线程；否则启用或退役io_service，退役的io_service上的连接由hooks.migrate迁走
+        // 须在start()之后调用，已在伸缩时返回false
+        bool startScaling(const ScalingPolicy &policy, const ScalingHooks &hooks = ScalingHooks()) {
+            std::lock_guard<std::mutex> g(_mutex);
+            (void)g;
+            if (_scaler.joinable()) {
+                return false;
+            }
+            size_t capacity = _isShared() ? _maxThreads : _loops.size();
+            _policy = policy;
+            _policy.maxWorkers = policy.maxWorkers != 0 && policy.maxWorkers < capacity ? policy.maxWorkers : capacity;
+            _policy.minWorkers = std::min(std::max(policy.minWorkers, (size_t)1), _policy.maxWorkers);
+            _hooks = hooks;
+            if (!_isShared() && !_hooks.migrate) {
+                LOG_WARN("IOServicePool: no migrate hook, services will not be retired");
+            }
+            _lastSample = std::chrono::steady_clock::now();
+            _scalingStopped = false;
+            _scaler = std::thread(std::bind(&IOServicePool::_runScaler, this));
+            LOG_INFO("IOServicePool scaling between %lu and %lu %s, now %lu", (unsigned long)_policy.minWorkers, (unsigned long)_policy.maxWorkers,
+                _unitName(), (unsigned long)_countWorkers());
+            return true;
+        }
+
+        ScalingStats getScalingStats() {
+            std::lock_guard<jw::QuickMutex> g(_statsMutex);
+            (void)g;
+            return _stats;
+        }
+
+    private:
+        enum class _State {
+            Parked = 0,  // 没有线程在运行它
+            Active,
+            Retiring  // 正在迁走连接，不再分配新连接
+        };
+
+        struct _Worker {
+            std::thread thread;
+            std::atomic<bool> exited{ false };
+            int64_t cpuTime = 0;  // 上次采样时的CPU时间，只在伸缩线程上访问
+        };
+
+        struct _Loop {
+            std::unique_ptr<asio::io_service> service;
+            std::unique_ptr<asio::io_service::work> work;
+            std::vector<std::unique_ptr<_Worker> > workers;  // 持有_mutex访问
+            std::atomic<_State> state{ _State::Parked };
+            std::atomic<bool> pinned{ false };
+            std::atomic<size_t> retireThreads{ 0 };  // 待退出的线程数，只用于一个io_service时的缩容
+
+            // 排队延迟的探测，probeSent、probeTime、probeSkip只在伸缩线程上访问
+            std::atomic<uint64_t> probeDone{ 0 };
+            std::atomic<int64_t> probeLagUs{ 0 };
+            uint64_t probeSent = 0;
+            std::chrono::steady_clock::time_point probeTime;
+            bool probeSkip = false;  // 刚启用时，停用前投递的探测才执行，这次的结果不算
+
+            explicit _Loop(size_t concurrencyHint)
+                : service(new asio::io_service(concurrencyHint)), work(new asio::io_service::work(*service)) { }
+        };
+
+        bool _isShared() const { return _loops.size() == 1; }
+        const char *_unitName() const { return _isShared() ? "thread(s)" : "service(s)"; }
+
+        _Loop *_find(asio::io_service &service) const {
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                if (_loops[i]->service.get() == &service) {
+                    return _loops[i].get();
+                }
+            }
+            return nullptr;
+        }
+
+        size_t _index(const _Loop &loop) const {
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                if (_loops[i].get() == &loop) {
+                    return i;
+                }
+            }
+            return _loops.size();
+        }
+
+        // 调用时须持有_mutex
+        void _startWorkers(size_t index, size_t count) {
+            _Loop *loop = _loops[index].get();
+            for (size_t k = 0; k < count; ++k) {
+                size_t ordinal = index * _threadsPerService + loop->workers.size();
+                CpuSet cpus = _threadCpus.empty() ? CpuSet() : _threadCpus[ordinal % _threadCpus.size()];
+                std::unique_ptr<_Worker> worker(new _Worker());
+                _Worker *w = worker.get();
+                w->thread = std::thread([loop, w, cpus]() {
+                    _Run(loop, w, cpus);
+                });
+                loop->workers.push_back(std::move(worker));
+            }
+        }
+
+        // 调用时须持有_mutex
+        static void _joinWorkers(_Loop &loop) {
+            for (size_t i = 0; i < loop.workers.size(); ++i) {
+                if (loop.workers[i]->thread.joinable()) {
+                    loop.workers[i]->thread.join();
+                }
+            }
+            loop.workers.clear();
+        }
+
+        static void _Run(_Loop *loop, _Worker *worker, const CpuSet &cpus) {
+            if (!setCurrentThreadAffinity(cpus)) {
+                LOG_WARN("failed to bind io thread to cpu %s", formatCpuList(cpus).c_str());
+            }
+            std::error_code ec;
+            while (loop->service->run_one(ec) != 0) {
+                // 缩容时任意一个线程领到名额即退出
+                size_t retire = loop->retireThreads.load(std::memory_order_relaxed);
+                while (retire > 0 && !loop->retireThreads.compare_exchange_weak(retire, retire - 1)) {
+                }
+                if (retire > 0) {
+                    break;
+                }
+            }
+            worker->exited = true;
+        }
+
+        // 调用时须持有_mutex
+        size_t _countWorkers() const {
+            if (_isShared()) {
+                return _loops[0]->workers.size() - _loops[0]->retireThreads;
+            }
+            size_t active = 0;
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                if (_loops[i]->state == _State::Active) {
+                    ++active;
+                }
+            }
+            return active;
+        }
+
+        void _stopScaling() {
+            {
+                std::lock_guard<std::mutex> g(_scalerMutex);
+                (void)g;
+                _scalingStopped = true;
+            }
+            _scalerCv.notify_all();
+            if (_scaler.joinable()) {
+                _scaler.join();
+            }
+        }
+
+        void _runScaler() {
+            typedef std::chrono::steady_clock Clock;
+            Clock::time_point lastScale = Clock::now() - _policy.cooldown;
+            size_t hotSamples = 0, coldSamples = 0;
+            std::unique_lock<std::mutex> lock(_scalerMutex);
+            for (;;) {
+                _scalerCv.wait_for(lock, _policy.interval, [this]() { return _scalingStopped.load(); });
+                if (_scalingStopped) {
+                    break;
+                }
+                lock.unlock();
+
+                double utilization = -1.0;
+                int64_t lagUs = 0;
+                size_t workers = _sample(utilization, lagUs);
+                bool hot = utilization > _policy.scaleUpUtilization
+                    || lagUs > std::chrono::duration_cast<std::chrono::microseconds>(_policy.scaleUpLag).count();
+                bool cold = utilization < _policy.scaleDownUtilization
+                    && lagUs < std::chrono::duration_cast<std::chrono::microseconds>(_policy.scaleDownLag).count();
+                // 少一个单位后负载由其余的分担，利用率不能因此超过扩容的阈值，否则刚缩容又要扩容
+                bool fits = workers > 1 && utilization * workers / (workers - 1) <= _policy.scaleUpUtilization;
+                hotSamples = hot ? hotSamples + 1 : 0;
+                coldSamples = cold ? coldSamples + 1 : 0;
+
+                Clock::time_point now = Clock::now();
+                bool scaled = false;
+                if (workers < _policy.minWorkers) {
+                    scaled = _scaleUp("below minimum", workers, utilization, lagUs);
+                }
+                else if (workers > _policy.maxWorkers) {
+                    scaled = _scaleDown("above maximum", workers, utilization, lagUs);
+                }
+                else if (now - lastScale < _policy.cooldown) {
+                }
+                else if (hotSamples >= _policy.scaleUpSamples && workers < _policy.maxWorkers) {
+                    scaled = _scaleUp(lagUs > std::chrono::duration_cast<std::chrono::microseconds>(_policy.scaleUpLag).count() ? "lag" : "utilization",
+                        workers, utilization, lagUs);
+                }
+                else if (coldSamples >= _policy.scaleDownSamples && workers > _policy.minWorkers && fits) {
+                    scaled = _scaleDown("idle", workers, utilization, lagUs);
+                }
+                if (scaled) {
+                    lastScale = Clock::now();
+                    hotSamples = coldSamples = 0;
+                }
+                lock.lock();
+            }
+        }
+
+        // 回收已退出的线程，计算这段时间的利用率和排队延迟，再投递下一次的探测，返回当前的单位数
+        size_t _sample(double &utilization, int64_t &lagUs) {
+            typedef std::chrono::steady_clock Clock;
+            std::lock_guard<std::mutex> g(_mutex);
+            (void)g;
+            Clock::time_point now = Clock::now();
+            int64_t elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(now - _lastSample).count();
+            _lastSample = now;
+
+            int64_t busyUs = 0;
+            size_t threads = 0;
+            bool supported = true;
+            lagUs = 0;
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _Loop &loop = *_loops[i];
+                for (size_t k = 0; k < loop.workers.size(); ) {
+                    if (loop.workers[k]->exited) {
+                        loop.workers[k]->thread.join();
+                        loop.workers.erase(loop.workers.begin() + k);
+                        continue;
+                    }
+                    _Worker &worker = *loop.workers[k++];
+                    int64_t cpuTime = getThreadCpuTime(worker.thread.native_handle());
+                    if (cpuTime < 0) {
+                        // 刚退出的线程取不到
+                        supported = supported && worker.exited;
+                        continue;
+                    }
+                    if (loop.state != _State::Parked) {
+                        busyUs += cpuTime - worker.cpuTime;
+                        ++threads;
+                    }
+                    worker.cpuTime = cpuTime;
+                }
+                if (loop.state != _State::Active) {
+                    continue;
+                }
+
+                if (loop.probeSent != 0 && !loop.probeSkip) {
+                    int64_t lag = loop.probeDone == loop.probeSent ? loop.probeLagUs.load()
+                        : std::chrono::duration_cast<std::chrono::microseconds>(now - loop.probeTime).count();
+                    lagUs = std::max(lagUs, lag);
+                }
+                loop.probeSkip = false;
+                uint64_t seq = ++loop.probeSent;
+                loop.probeTime = now;
+                _Loop *l = &loop;
+                loop.service->post([l, seq, now]() {
+                    l->probeLagUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - now).count();
+                    l->probeDone = seq;
+                });
+            }
+            utilization = supported && threads > 0 && elapsedUs > 0 ? (double)busyUs / ((double)elapsedUs * threads) : -1.0;
+
+            size_t workers = _countWorkers();
+            std::lock_guard<jw::QuickMutex> gs(_statsMutex);
+            (void)gs;
+            _stats.workers = workers;
+            _stats.threads = 0;
+            for (size_t i = 0, cnt = _loops.size(); i < cnt; ++i) {
+                _stats.threads += _loops[i]->workers.size();
+            }
+            _stats.utilization = utilization;
+            _stats.lag = std::chrono::microseconds(lagUs);
+            return workers;
+        }
+
+        bool _scaleUp(const char *reason, size_t workers, double utilization, int64_t lagUs) {
+            {
+                std::lock_guard<std::mutex> g(_mutex);
+                (void)g;
+                if (_isShared()) {
+                    _startWorkers(0, 1);
+                }
+                else {
+                    _Loop *loop = nullptr;
+                    for (size_t i = 0, cnt = _loops.size(); i < cnt && loop == nullptr; ++i) {
+                        if (_loops[i]->state == _State::Parked) {
+                            loop = _loops[i].get();
+                        }
+                    }
+                    if (loop == nullptr) {
+                        return false;
+                    }
+                    if (_hooks.activated) {
+                        _hooks.activated(*loop->service);
+                    }
+                    loop->service->reset();
+                    loop->probeSkip = true;
+                    _startWorkers(_index(*loop), _threadsPerService);
+                    loop->state = _State::Active;
+                }
+            }
+            _logScaling("up", reason, workers, workers + 1, utilization, lagUs);
+            std::lock_guard<jw::QuickMutex> g(_statsMutex);
+            (void)g;
+            ++_stats.scaleUps;
+            return true;
+        }
+
+        bool _scaleDown(const char *reason, size_t workers, double utilization, int64_t lagUs) {
+            if (_isShared()) {
+                // 让任意一个线程在执行完手上的handler后退出，下次采样时回收
+                ++_loops[0]->retireThreads;
+                _loops[0]->service->post([]() { });
+            }
+            else if (!_retire()) {
+                return false;
+            }
+            _logScaling("down", reason, workers, workers - 1, utilization, lagUs);
+            std::lock_guard<jw::QuickMutex> g(_statsMutex);
+            (void)g;
+            ++_stats.scaleDowns;
+            return true;
+        }
+
+        // 退役编号最大的运行中的io_service：不再给它分配新连接，等hooks.migrate把连接都迁走后停止它的线程
+        // 连续两次（间隔20ms）迁移后都没有连接才停止，覆盖迁移开始时正要建立在它上面的连接
+        bool _retire() {
+            typedef std::chrono::steady_clock Clock;
+            if (!_hooks.migrate) {
+                return false;
+            }
+            _Loop *loop = nullptr;
+            for (size_t i = _loops.size() - 1; i > 0 && loop == nullptr; --i) {
+                if (_loops[i]->state == _State::Active && !_loops[i]->pinned) {
+                    loop = _loops[i].get();
+                }
+            }
+            if (loop == nullptr) {
+                return false;
+            }
+
+            loop->state = _State::Retiring;
+            Clock::time_point start = Clock::now();
+            Clock::time_point deadline = start + _policy.migrateTimeout;
+            size_t remaining = 0, emptySweeps = 0;
+            while (!_scalingStopped && emptySweeps < 2) {
+                remaining = _hooks.migrate(*loop->service);
+                emptySweeps = remaining == 0 ? emptySweeps + 1 : 0;
+                if (emptySweeps < 2) {
+                    if (Clock::now() >= deadline) {
+                        break;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+            }
+            if (emptySweeps < 2) {
+                loop->state = _State::Active;
+                LOG_WARN("IOServicePool: gave up retiring service %lu, %lu session(s) left after %lld ms", (unsigned long)_index(*loop), (unsigned long)remaining,
+                    (long long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+                std::lock_guard<jw::QuickMutex> g(_statsMutex);
+                (void)g;
+                ++_stats.abortedScaleDowns;
+                return false;
+            }
+
+            // 先执行完迁移之前投递到它上面的handler（如另一个线程发起的close）再停止
+            std::shared_ptr<std::atomic<bool> > drained = std::make_shared<std::atomic<bool> >(false);
+            loop->service->post([drained]() {
+                *drained = true;
+            });
+            while (!*drained && !_scalingStopped) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            loop->service->stop();
+            {
+                std::lock_guard<std::mutex> g(_mutex);
+                (void)g;
+                _joinWorkers(*loop);
+                loop->state = _State::Parked;
+            }
+            if (_hooks.retired) {
+                _hooks.retired(*loop->service);
+            }
+            LOG_INFO("IOServicePool: service %lu retired in %lld ms", (unsigned long)_index(*loop),
+                (long long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count());
+            return true;
+        }
+
+        void _logScaling(const char *direction, const char *reason, size_t from, size_t to, double utilization, int64_t lagUs) {
+            char util[16] = "n/a";
+            if (utilization >= 0.0) {
+                snprintf(util, sizeof(util), "%.0f%%", utilization * 100.0);
+            }
+            LOG_INFO("IOServicePool scale %s (%s): %lu -> %lu %s, utilization %s, lag %lld us", direction, reason, (unsigned long)from, (unsigned long)to,
+                _unitName(), util, (long long)lagUs);
+        }
+
+        std::vector<std::unique_ptr<_Loop> > _loops;  // 构造后不再增减，伸缩只改变状态和线程
+        size_t _threadsPerService;
+        size_t _maxThreads;  // 每个io_service最多的线程数，也是io_service的并发提示
+        std::vector<CpuSet> _threadCpus;
+        std::atomic<size_t> _next{ 0 };
+        std::mutex _mutex;  // 保护各_Loop的workers
+
+        ScalingPolicy _policy;
+        ScalingHooks _hooks;
+        std::thread _scaler;
+        std::mutex _scalerMutex;
+        std::condition_variable _scalerCv;
+        std::atomic<bool> _scalingStopped{ false };
+        std::chrono::steady_clock::time_point _lastSample;
+        ScalingStats _stats = ScalingStats();
+        jw::QuickMutex _statsMutex;
+    };
+}
+
+#endif
@@ -0,0 +1,138 @@
+﻿#ifndef _IDLE_REAPER_HPP_
+#define _IDLE_REAPER_HPP_
+
+#include "DebugConfig.h"
+#include "QuickMutex.h"
+#include "IntrusivePtr.hpp"
+#include "TimingWheel.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <atomic>
+
+namespace jw {
+
+    // 空闲连接回收的统计
+    struct IdleReaperStats {
+        size_t watched;  // 当前监视的连接数
+        uint64_t pinged;  // 发出的ping数
+        uint64_t reaped;  // 因空闲被断开的连接数
+    };
+
+    // 断开长时间没有收到数据的连接（对端已消失的半开连接等）
+    // 连接放在时间轮中，到期时才检查最后一次收到数据的时刻：期间有数据的按新的时刻放回，否则先ping（如果设置了）再断开
+    // 收数据时不碰时间轮，每个连接每个空闲周期只被检查一次
+    // _Session须提供：
+    //   std::chrono::steady_clock::time_point getLastRecvTime() const
+    //   bool isConnected() const，已断开的连接直接移出
+    //   bool close()
+    //   getRemoteIP()、getRemotePort()，用于日志
+    // 时间轮持有连接的引用，已断开的连接最晚在下一次到期时释放
+    template <class _Session>
+    class IdleReaper {
+    public:
+        IdleReaper<_Session>(const IdleReaper<_Session> &) = delete;
+        IdleReaper<_Session> &operator=(const IdleReaper<_Session> &) = delete;
+
+        typedef IntrusivePtr<_Session> SessionPtr;
+        typedef std::function<void (const SessionPtr &)> PingCallback;
+        typedef std::chrono::steady_clock Clock;
+
+        // idleTimeout内没有收到数据的连接被断开
+        // ping不为空时，先调用它给连接发送应用层的ping，再过pingTimeout仍没有收到数据才断开
+        // tick为检查的精度，须按这个间隔调用tick()
+        IdleReaper<_Session>(std::chrono::milliseconds tick, std::chrono::milliseconds idleTimeout,
+            std::chrono::milliseconds pingTimeout = std::chrono::milliseconds(0), const PingCallback &ping = nullptr)
+            : _start(Clock::now()), _tick(tick), _idleTimeout(idleTimeout), _pingTimeout(pingTimeout), _ping(ping) {
+        }
+
+        // 开始监视，在连接start之后调用
+        void watch(const SessionPtr &session) {
+            _Entry entry;
+            entry.session = session;
+            entry.pinged = false;
+            uint64_t expires = _toTick(session->getLastRecvTime() + _idleTimeout);
+
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _wheel.add(expires, std::move(entry));
+        }
+
+        // 处理到期的连接，now之前已到期的都会被处理
+        void tick(Clock::time_point now = Clock::now()) {
+            uint64_t current = now > _start ? (uint64_t)((now - _start) / _tick) : 0;
+
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _wheel.advance(current, [this, now](_Entry &entry) {
+                _check(entry, now);
+            });
+        }
+
+        IdleReaperStats getStats() {
+            IdleReaperStats stats;
+            stats.pinged = _pinged;
+            stats.reaped = _reaped;
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            stats.watched = _wheel.size();
+            return stats;
+        }
+
+    private:
+        struct _Entry {
+            SessionPtr session;
+            bool pinged;  // 本次空闲已经ping过
+        };
+
+        // 向上取整，保证到期时已经过了deadline
+        uint64_t _toTick(Clock::time_point deadline) const {
+            if (deadline <= _start) {
+                return 0;
+            }
+            Clock::duration elapsed = deadline - _start;
+            return (uint64_t)((elapsed + _tick - Clock::duration(1)) / _tick);
+        }
+
+        void _check(_Entry &entry, Clock::time_point now) {
+            if (!entry.session->isConnected()) {
+                return;
+            }
+
+            Clock::time_point deadline = entry.session->getLastRecvTime() + _idleTimeout;
+            if (deadline > now) {
+                // 期间收到过数据
+                entry.pinged = false;
+                _wheel.add(_toTick(deadline), std::move(entry));
+                return;
+            }
+
+            if (_ping && !entry.pinged) {
+                ++_pinged;
+                _ping(entry.session);
+                entry.pinged = true;
+                _wheel.add(_toTick(now + _pingTimeout), std::move(entry));
+                return;
+            }
+
+            ++_reaped;
+            LOG_INFO("reap idle session %s:%hu", entry.session->getRemoteIP().c_str(), entry.session->getRemotePort());
+            entry.session->close();
+        }
+
+        Clock::time_point _start;
+        Clock::duration _tick;
+        Clock::duration _idleTimeout;
+        Clock::duration _pingTimeout;
+        PingCallback _ping;
+
+        TimingWheel<_Entry> _wheel;
+        jw::QuickMutex _mutex;
+        std::atomic<uint64_t> _pinged{ 0 };
+        std::atomic<uint64_t> _reaped{ 0 };
+    };
+}
+
+#endif
@@ -0,0 +1,138 @@
+﻿#ifndef _INTRUSIVE_PTR_HPP_
+#define _INTRUSIVE_PTR_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+
+namespace jw {
+
+    // 侵入式引用计数基类，计数就在对象里，不需要单独分配控制块
+    // 计数归零时调用_Derived::onLastRelease()，默认delete对象，派生类可以隐藏它改为回收到对象池
+    // 只有复制IntrusivePtr（存入容器、交给异步操作）才修改计数；
+    // 在已持有引用的线程上借用对象时，传const IntrusivePtr &或引用即可，不碰计数
+    template <class _Derived>
+    class RefCounted {
+    public:
+        RefCounted<_Derived>(const RefCounted<_Derived> &) = delete;
+        RefCounted<_Derived> &operator=(const RefCounted<_Derived> &) = delete;
+
+        void addRef() {
+            _refCount.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void release() {
+            if (_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                static_cast<_Derived *>(this)->onLastRelease();
+            }
+        }
+
+        size_t getRefCount() const { return _refCount.load(std::memory_order_relaxed); }
+
+        void onLastRelease() {
+            delete static_cast<_Derived *>(this);
+        }
+
+    protected:
+        RefCounted<_Derived>() : _refCount(0) { }
+        ~RefCounted<_Derived>() { }
+
+    private:
+        std::atomic<size_t> _refCount;
+    };
+
+    // 持有一份RefCounted引用的智能指针
+    template <class _T>
+    class IntrusivePtr {
+    public:
+        IntrusivePtr<_T>() : _ptr(nullptr) { }
+        IntrusivePtr<_T>(std::nullptr_t) : _ptr(nullptr) { }
+
+        explicit IntrusivePtr<_T>(_T *ptr) : _ptr(ptr) {
+            if (_ptr != nullptr) {
+                _ptr->addRef();
+            }
+        }
+
+        IntrusivePtr<_T>(const IntrusivePtr<_T> &other) : _ptr(other._ptr) {
+            if (_ptr != nullptr) {
+                _ptr->addRef();
+            }
+        }
+
+        IntrusivePtr<_T>(IntrusivePtr<_T> &&other) : _ptr(other._ptr) {
+            other._ptr = nullptr;
+        }
+
+        ~IntrusivePtr<_T>() {
+            if (_ptr != nullptr) {
+                _ptr->release();
+            }
+        }
+
+        IntrusivePtr<_T> &operator=(const IntrusivePtr<_T> &other) {
+            IntrusivePtr<_T>(other).swap(*this);
+            return *this;
+        }
+
+        IntrusivePtr<_T> &operator=(IntrusivePtr<_T> &&other) {
+            IntrusivePtr<_T>(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        IntrusivePtr<_T> &operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        void reset() {
+            IntrusivePtr<_T>().swap(*this);
+        }
+
+        void swap(IntrusivePtr<_T> &other) {
+            std::swap(_ptr, other._ptr);
+        }
+
+        _T *get() const { return _ptr; }
+        _T &operator*() const { return *_ptr; }
+        _T *operator->() const { return _ptr; }
+        explicit operator bool() const { return _ptr != nullptr; }
+
+    private:
+        _T *_ptr;
+    };
+
+    template <class _T>
+    inline bool operator==(const IntrusivePtr<_T> &a, const IntrusivePtr<_T> &b) { return a.get() == b.get(); }
+
+    template <class _T>
+    inline bool operator!=(const IntrusivePtr<_T> &a, const IntrusivePtr<_T> &b) { return a.get() != b.get(); }
+
+    template <class _T>
+    inline bool operator==(const IntrusivePtr<_T> &a, std::nullptr_t) { return a.get() == nullptr; }
+
+    template <class _T>
+    inline bool operator!=(const IntrusivePtr<_T> &a, std::nullptr_t) { return a.get() != nullptr; }
+
+    template <class _T>
+    inline bool operator<(const IntrusivePtr<_T> &a, const IntrusivePtr<_T> &b) { return a.get() < b.get(); }
+
+    // 以对象地址作哈希，去掉因对齐而恒为0的低位
+    struct IntrusivePtrHash {
+        template <class _T>
+        size_t operator()(const IntrusivePtr<_T> &p) const {
+            return (size_t)((uintptr_t)p.get() >> 4);
+        }
+    };
+
+    // 计数归零时接收对象的回收者，用于对象池
+    template <class _T>
+    class ObjectRecycler {
+    public:
+        virtual ~ObjectRecycler<_T>() { }
+        virtual void giveBack(_T *p) = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,221 @@
+﻿#ifndef _LOOP_LAG_MONITOR_HPP_
+#define _LOOP_LAG_MONITOR_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "QuickMutex.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace jw {
+
+    // 根据事件循环延迟得出的负载等级
+    enum class LoadLevel {
+        Normal = 0,
+        Shedding,  // 丢弃可选的工作，如聊天和大厅广播
+        Overloaded  // 另外拒绝新的进入请求
+    };
+
+    // 按事件循环延迟卸载负载的阈值，阈值为0表示不启用这一级
+    struct LoadShedPolicy {
+        std::chrono::milliseconds probeInterval;  // 探测的间隔
+        std::chrono::milliseconds shedLag;  // 延迟超过这个值进入Shedding
+        std::chrono::milliseconds overloadLag;  // 延迟超过这个值进入Overloaded
+
+        LoadShedPolicy() : probeInterval(100), shedLag(50), overloadLag(200) { }
+    };
+
+    // 事件循环延迟的统计
+    struct LoopLagStats {
+        std::chrono::microseconds lag;  // 各事件循环当前延迟的最大值
+        std::chrono::microseconds peakLag;  // 启动以来单次探测到的最大延迟
+        LoadLevel level;
+        uint64_t probes;  // 探测的次数
+        uint64_t levelChanges;  // 负载等级变化的次数
+        std::vector<std::chrono::microseconds> loopLags;  // 各事件循环当前的延迟，按attach的顺序
+    };
+
+    // 监测事件循环的调度延迟：在每个io_service上挂一个周期定时器，记录它到期后过了多久回调才执行
+    // 到期的定时器和post的handler一样排在已就绪的handler之后，所以这个延迟就是新到的包要等多久才会被处理
+    // 延迟快升慢降：变慢时立即反映，恢复时每次探测只回落剩余的1/4
+    // 负载等级取各事件循环中最高的，level()只读一个原子变量，可以在每个包上调用
+    // 定时器的回调持有this，须在io_service停止之后析构
+    class LoopLagMonitor {
+    public:
+        LoopLagMonitor(const LoopLagMonitor &) = delete;
+        LoopLagMonitor &operator=(const LoopLagMonitor &) = delete;
+
+        typedef std::chrono::steady_clock Clock;
+
+        explicit LoopLagMonitor(const LoadShedPolicy &policy = LoadShedPolicy()) : _policy(policy) {
+        }
+
+        // 开始监测一个io_service，每个io_service只调用一次
+        void attach(asio::io_service &service) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _probes.push_back(std::unique_ptr<_Probe>(new _Probe(service)));
+            _arm(_probes.back().get());
+        }
+
+        // io线程池缩容停掉了service（见IOServicePool::startScaling），它的延迟不再计入
+        void suspend(asio::io_service &service) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _Probe *probe = _find(service);
+            if (probe != nullptr) {
+                probe->lagUs.store(0, std::memory_order_relaxed);
+                _updateLevel();
+            }
+        }
+
+        // service重新开始运行之前调用，停止期间到期的那次探测不计
+        void resume(asio::io_service &service) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _Probe *probe = _find(service);
+            if (probe != nullptr) {
+                probe->resync = true;
+            }
+        }
+
+        void setPolicy(const LoadShedPolicy &policy) {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _policy = policy;
+        }
+
+        LoadShedPolicy getPolicy() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _policy;
+        }
+
+        LoadLevel level() const {
+            return _level.load(std::memory_order_relaxed);
+        }
+
+        LoopLagStats getStats() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            LoopLagStats stats;
+            stats.lag = std::chrono::microseconds(_maxLagUs());
+            stats.peakLag = std::chrono::microseconds(_peakUs);
+            stats.level = level();
+            stats.probes = _probeCount;
+            stats.levelChanges = _levelChanges;
+            for (std::vector<std::unique_ptr<_Probe> >::const_iterator it = _probes.begin(); it != _probes.end(); ++it) {
+                stats.loopLags.push_back(std::chrono::microseconds((*it)->lagUs.load(std::memory_order_relaxed)));
+            }
+            return stats;
+        }
+
+    private:
+        struct _Probe {
+            asio::steady_timer timer;
+            Clock::time_point expected;  // 只在该io_service的回调中访问
+            std::atomic<int64_t> lagUs{ 0 };  // 平滑后的延迟
+            std::atomic<bool> resync{ false };  // 见resume
+
+            explicit _Probe(asio::io_service &service) : timer(service) { }
+        };
+
+        // 调用时须持有_mutex
+        void _arm(_Probe *probe) {
+            probe->expected = Clock::now() + _policy.probeInterval;
+            probe->timer.expires_at(probe->expected);
+            probe->timer.async_wait([this, probe](const std::error_code &ec) {
+                if (!ec) {
+                    _onProbe(probe);
+                }
+            });
+        }
+
+        // 调用时须持有_mutex
+        _Probe *_find(asio::io_service &service) const {
+            for (std::vector<std::unique_ptr<_Probe> >::const_iterator it = _probes.begin(); it != _probes.end(); ++it) {
+                if (&(*it)->timer.get_io_service() == &service) {
+                    return it->get();
+                }
+            }
+            return nullptr;
+        }
+
+        void _onProbe(_Probe *probe) {
+            if (probe->resync.exchange(false)) {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                _arm(probe);
+                return;
+            }
+            Clock::time_point now = Clock::now();
+            int64_t sample = now > probe->expected ? std::chrono::duration_cast<std::chrono::microseconds>(now - probe->expected).count() : 0;
+            int64_t lag = probe->lagUs.load(std::memory_order_relaxed);
+            lag = sample >= lag ? sample : lag - (lag - sample) / 4;
+            probe->lagUs.store(lag, std::memory_order_relaxed);
+
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            ++_probeCount;
+            if (sample > _peakUs) {
+                _peakUs = sample;
+            }
+            _updateLevel();
+            _arm(probe);
+        }
+
+        // 调用时须持有_mutex
+        int64_t _maxLagUs() const {
+            int64_t lag = 0;
+            for (std::vector<std::unique_ptr<_Probe> >::const_iterator it = _probes.begin(); it != _probes.end(); ++it) {
+                int64_t l = (*it)->lagUs.load(std::memory_order_relaxed);
+                if (l > lag) {
+                    lag = l;
+                }
+            }
+            return lag;
+        }
+
+        // 超过阈值即升级，降级要等延迟回落到阈值的一半以下，否则卸载后延迟一降就恢复，又立即升级
+        // 调用时须持有_mutex
+        void _updateLevel() {
+            std::chrono::microseconds lag(_maxLagUs());
+            LoadLevel oldLevel = _level.load(std::memory_order_relaxed);
+            LoadLevel newLevel = LoadLevel::Normal;
+            if (_exceeds(lag, _policy.overloadLag, oldLevel >= LoadLevel::Overloaded)) {
+                newLevel = LoadLevel::Overloaded;
+            }
+            else if (_exceeds(lag, _policy.shedLag, oldLevel >= LoadLevel::Shedding)) {
+                newLevel = LoadLevel::Shedding;
+            }
+
+            if (newLevel != oldLevel) {
+                ++_levelChanges;
+                _level.store(newLevel, std::memory_order_relaxed);
+                LOG_WARN("event loop lag %lld us, load level %d -> %d", (long long)lag.count(), (int)oldLevel, (int)newLevel);
+            }
+        }
+
+        static bool _exceeds(std::chrono::microseconds lag, std::chrono::milliseconds threshold, bool active) {
+            if (threshold.count() == 0) {
+                return false;
+            }
+            return active ? lag > threshold / 2 : lag > threshold;
+        }
+
+        LoadShedPolicy _policy;
+        std::vector<std::unique_ptr<_Probe> > _probes;
+        std::atomic<LoadLevel> _level{ LoadLevel::Normal };
+        int64_t _peakUs = 0;
+        uint64_t _probeCount = 0;
+        uint64_t _levelChanges = 0;
+        jw::QuickMutex _mutex;
+    };
+}
+
+#endif
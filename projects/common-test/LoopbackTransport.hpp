@@ -0,0 +1,906 @@
+﻿#ifndef _LOOPBACK_TRANSPORT_HPP_
+#define _LOOPBACK_TRANSPORT_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "QuickMutex.h"
+#include "PacketSplitter.hpp"
+#include "UpstreamLink.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <limits>
+#include <new>
+
+#if defined(__linux__)
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <sys/statvfs.h>
+#   include <sys/syscall.h>
+#   include <linux/futex.h>
+#   include <time.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <signal.h>
+#   include <errno.h>
+#endif
+
+namespace jw {
+
+    // 单生产者单消费者环形缓冲区的读写位置，各占一个缓存行，可放在共享内存中
+    struct SpscRingHeader {
+        std::atomic<uint64_t> head;  // 已写入的总字节数，只由生产者修改
+        char _padHead[64 - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint64_t> tail;  // 已读出的总字节数，只由消费者修改
+        char _padTail[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    // 单生产者单消费者的无锁字节环，只是头和数据区的视图，内存由LoopbackRegion持有
+    // 容量须为2的幂；写入要么全部成功要么不写，读出按字节流
+    class SpscRing {
+    public:
+        SpscRing() : _header(nullptr), _data(nullptr), _mask(0) { }
+        SpscRing(SpscRingHeader *header, char *data, size_t capacity) : _header(header), _data(data), _mask(capacity - 1) { }
+
+        size_t getCapacity() const { return _mask + 1; }
+
+        // 清空，只在两端都没有使用时调用
+        void reset() {
+            _header->head.store(0, std::memory_order_relaxed);
+            _header->tail.store(0, std::memory_order_relaxed);
+        }
+
+        // 生产者：依次写入所有缓冲区，空间不够时什么都不写，返回false
+        bool write(const asio::const_buffer *buffers, size_t count) {
+            size_t length = 0;
+            for (size_t i = 0; i < count; ++i) {
+                length += asio::buffer_size(buffers[i]);
+            }
+            uint64_t head = _header->head.load(std::memory_order_relaxed);
+            uint64_t tail = _header->tail.load(std::memory_order_acquire);
+            if (length > getCapacity() - (size_t)(head - tail)) {
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                size_t size = asio::buffer_size(buffers[i]);
+                _copyIn(head, asio::buffer_cast<const char *>(buffers[i]), size);
+                head += size;
+            }
+            _header->head.store(head, std::memory_order_release);
+            return true;
+        }
+
+        bool write(const char *data, size_t length) {
+            asio::const_buffer buffer(data, length);
+            return write(&buffer, 1);
+        }
+
+        // 消费者：可读的字节数
+        size_t readable() const {
+            return (size_t)(_header->head.load(std::memory_order_acquire) - _header->tail.load(std::memory_order_relaxed));
+        }
+
+        // 消费者：最多读出size字节，返回读出的字节数
+        size_t read(char *buf, size_t size) {
+            uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+            uint64_t head = _header->head.load(std::memory_order_acquire);
+            size_t length = std::min(size, (size_t)(head - tail));
+            size_t offset = (size_t)tail & _mask;
+            size_t first = std::min(length, getCapacity() - offset);
+            memcpy(buf, _data + offset, first);
+            memcpy(buf + first, _data, length - first);
+            _header->tail.store(tail + length, std::memory_order_release);
+            return length;
+        }
+
+    private:
+        void _copyIn(uint64_t pos, const char *data, size_t size) {
+            size_t offset = (size_t)pos & _mask;
+            size_t first = std::min(size, getCapacity() - offset);
+            memcpy(_data + offset, data, first);
+            memcpy(_data, data + first, size - first);
+        }
+
+        SpscRingHeader *_header;
+        char *_data;
+        size_t _mask;
+    };
+
+    // 回环传输的参数
+    struct LoopbackConfig {
+        uint32_t slots;  // 最多同时连接的客户端数，1到65536
+        uint32_t ringCapacity;  // 每个方向的环形缓冲区大小，4K到1G之间的2的幂，须大于一次发给客户端的最大数据量（如进入房间时的用户列表）
+        std::chrono::microseconds busyPoll;  // 最后一次有数据之后继续连续检查这么久，之后等客户端唤醒
+
+        LoopbackConfig() : slots(256), ringCapacity(1024U * 1024U), busyPoll(200) { }
+    };
+
+    // 槽的状态，客户端占用（Free -> Claimed -> Open），任一方断开后由另一方释放（-> Free）
+    enum class LoopbackSlotState : uint32_t {
+        Free = 0,
+        Claimed,  // 客户端正在初始化
+        Open,
+        ClientClosed,  // 客户端已断开，等服务端取完数据后释放
+        ServerClosed  // 服务端已断开，等客户端释放
+    };
+
+    struct LoopbackRegionHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slots;
+        uint32_t ringCapacity;
+        std::atomic<uint32_t> serving;  // 服务端仍在服务
+        std::atomic<uint32_t> doorbell;  // 门铃：跨进程的客户端每次写入或断开后加一，服务端空闲时在上面等（futex）
+        std::atomic<uint32_t> sleeping;  // 服务端正在等门铃，客户端这时才需要唤醒它
+        char _pad[36];
+    };
+
+    struct LoopbackSlotHeader {
+        std::atomic<uint32_t> state;  // LoopbackSlotState
+        std::atomic<int32_t> pid;  // 客户端的进程id，同一进程内的客户端为0，服务端据此发现客户端进程退出
+        std::atomic<uint64_t> startTime;  // 客户端进程的启动时间（见LoopbackRegion::processStartTime），pid被重用后不同
+        char _pad[48];
+        SpscRingHeader toServer;
+        SpscRingHeader toClient;
+    };
+
+    static_assert(sizeof(LoopbackRegionHeader) == 64 && sizeof(LoopbackSlotHeader) % 64 == 0, "loopback headers must be cache line aligned");
+
+    // 回环传输的内存区域：区域头，所有槽的槽头，然后是每个槽两个方向的环形缓冲区
+    // 同一进程内使用时在堆上分配；跨进程时是POSIX共享内存（仅Linux），由服务端创建，客户端打开
+    class LoopbackRegion {
+    public:
+        LoopbackRegion(const LoopbackRegion &) = delete;
+        LoopbackRegion &operator=(const LoopbackRegion &) = delete;
+
+        static const uint32_t Magic = 0x4A574C42;  // "JWLB"
+        static const uint32_t Version = 2;
+        static const uint32_t MaxSlots = 65536;  // 槽号占会话id的低16位
+        static const uint32_t MinRingCapacity = 4096;
+        static const uint32_t MaxRingCapacity = 1U << 30;
+
+        ~LoopbackRegion() {
+            if (_heap) {
+                return;
+            }
+#if defined(__linux__)
+            if (_owner) {
+                header().serving.store(0, std::memory_order_release);
+                shm_unlink(_name.c_str());
+            }
+            munmap(_base, _size);
+#endif
+        }
+
+        // 同一进程内使用的区域
+        static std::shared_ptr<LoopbackRegion> createPrivate(const LoopbackConfig &config) {
+            if (!_checkConfig(config)) {
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            std::shared_ptr<LoopbackRegion> region(new LoopbackRegion());
+            region->_size = (size_t)_regionSize(config.slots, config.ringCapacity);
+            region->_heap.reset(new char[region->_size + 64]);
+            region->_base = region->_heap.get() + (64 - (reinterpret_cast<uintptr_t>(region->_heap.get()) & 63));
+            region->_initialize(config);
+            return region;
+        }
+
+        // 创建名为name的共享内存（不含'/'），上次异常退出留下的同名共享内存先删除；参数不合法或空间不够时返回空
+        static std::shared_ptr<LoopbackRegion> createShared(const std::string &name, const LoopbackConfig &config) {
+#if defined(__linux__)
+            if (!_checkConfig(config)) {
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            std::string path = "/" + name;
+            shm_unlink(path.c_str());
+            int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0) {
+                LOG_ERROR("failed to create shared memory %s: %s", path.c_str(), strerror(errno));
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            size_t size = (size_t)_regionSize(config.slots, config.ringCapacity);
+            // tmpfs上ftruncate总能成功，空间不够要等写到没有页的地方才以SIGBUS出现
+            struct statvfs fs;
+            if (fstatvfs(fd, &fs) == 0 && (uint64_t)fs.f_bavail * fs.f_frsize < size) {
+                LOG_ERROR("shared memory %s needs %llu bytes but only %llu are available", path.c_str(),
+                    (unsigned long long)size, (unsigned long long)fs.f_bavail * fs.f_frsize);
+                ::close(fd);
+                shm_unlink(path.c_str());
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            void *p = ftruncate(fd, (off_t)size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                LOG_ERROR("failed to map shared memory %s: %s", path.c_str(), strerror(errno));
+                shm_unlink(path.c_str());
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            std::shared_ptr<LoopbackRegion> region(new LoopbackRegion());
+            region->_base = static_cast<char *>(p);
+            region->_size = size;
+            region->_owner = true;
+            region->_name = path;
+            region->_initialize(config);
+            return region;
+#else
+            (void)name;
+            (void)config;
+            LOG_WARN("shared memory loopback is not supported on this platform");
+            return std::shared_ptr<LoopbackRegion>();
+#endif
+        }
+
+        // 打开服务端创建的共享内存，失败或版本不符时返回空
+        static std::shared_ptr<LoopbackRegion> openShared(const std::string &name) {
+#if defined(__linux__)
+            std::string path = "/" + name;
+            int fd = shm_open(path.c_str(), O_RDWR | O_CLOEXEC, 0);
+            if (fd < 0) {
+                LOG_ERROR("failed to open shared memory %s: %s", path.c_str(), strerror(errno));
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            struct stat st;
+            void *p = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(LoopbackRegionHeader)
+                ? mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                LOG_ERROR("failed to map shared memory %s", path.c_str());
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            std::shared_ptr<LoopbackRegion> region(new LoopbackRegion());
+            region->_base = static_cast<char *>(p);
+            region->_size = (size_t)st.st_size;
+            const LoopbackRegionHeader &h = region->header();
+            if (h.magic != Magic || h.version != Version || !_checkLayout(h.slots, h.ringCapacity)
+                || _regionSize(h.slots, h.ringCapacity) != region->_size) {
+                LOG_ERROR("shared memory %s is not a loopback region of version %u", path.c_str(), Version);
+                return std::shared_ptr<LoopbackRegion>();
+            }
+            return region;
+#else
+            (void)name;
+            LOG_WARN("shared memory loopback is not supported on this platform");
+            return std::shared_ptr<LoopbackRegion>();
+#endif
+        }
+
+        // 是否是共享内存，此时客户端可能在另一个进程
+        bool isShared() const { return !_heap; }
+
+        LoopbackRegionHeader &header() { return *reinterpret_cast<LoopbackRegionHeader *>(_base); }
+        size_t getSlotCount() { return header().slots; }
+
+        LoopbackSlotHeader &slot(size_t index) {
+            return *reinterpret_cast<LoopbackSlotHeader *>(_base + sizeof(LoopbackRegionHeader) + index * sizeof(LoopbackSlotHeader));
+        }
+
+        SpscRing toServer(size_t index) { return SpscRing(&slot(index).toServer, _ringData(index, 0), header().ringCapacity); }
+        SpscRing toClient(size_t index) { return SpscRing(&slot(index).toClient, _ringData(index, 1), header().ringCapacity); }
+
+        // 客户端：写入或断开后敲门铃，服务端正在等门铃时唤醒它
+        void ringDoorbell() {
+            LoopbackRegionHeader &h = header();
+            h.doorbell.fetch_add(1, std::memory_order_seq_cst);
+            if (h.sleeping.load(std::memory_order_seq_cst) != 0) {
+#if defined(__linux__)
+                _futex(h.doorbell, FUTEX_WAKE, 1, nullptr);
+#endif
+            }
+        }
+
+        // 服务端：检查各个槽之前读一次门铃，检查完没有事可做时以这个值调用waitDoorbell
+        uint32_t readDoorbell() { return header().doorbell.load(std::memory_order_seq_cst); }
+
+        // 服务端：从读门铃到现在没有人敲过时睡眠，直到有人敲门铃或超时
+        void waitDoorbell(uint32_t seq, std::chrono::milliseconds timeout) {
+            LoopbackRegionHeader &h = header();
+            h.sleeping.store(1, std::memory_order_seq_cst);
+            if (h.doorbell.load(std::memory_order_seq_cst) == seq) {
+#if defined(__linux__)
+                struct timespec ts;
+                ts.tv_sec = (time_t)(timeout.count() / 1000);
+                ts.tv_nsec = (long)(timeout.count() % 1000) * 1000000L;
+                _futex(h.doorbell, FUTEX_WAIT, seq, &ts);
+#else
+                std::this_thread::sleep_for(timeout);
+#endif
+            }
+            h.sleeping.store(0, std::memory_order_relaxed);
+        }
+
+        // 进程的启动时间（系统启动后的时钟滴答数），进程不存在或已退出（僵尸）时为0
+        // 与pid一起识别一个进程：pid被重用后启动时间不同
+        static uint64_t processStartTime(int32_t pid) {
+#if defined(__linux__)
+            char path[32];
+            snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+            FILE *fp = fopen(path, "r");
+            if (fp == nullptr) {
+                return 0;
+            }
+            char buf[1024];
+            size_t length = fread(buf, 1, sizeof(buf) - 1, fp);
+            fclose(fp);
+            buf[length] = '\0';
+            // 第2个字段是括号中的进程名，可能含空格，从最后一个')'之后数：状态是第3个字段，启动时间是第22个
+            const char *p = strrchr(buf, ')');
+            if (p == nullptr || p[1] != ' ' || p[2] == 'Z' || p[2] == 'X') {
+                return 0;
+            }
+            p += 2;
+            for (int field = 3; field < 22; ++field) {
+                p = strchr(p, ' ');
+                if (p == nullptr) {
+                    return 0;
+                }
+                ++p;
+            }
+            return strtoull(p, nullptr, 10);
+#else
+            (void)pid;
+            return 0;
+#endif
+        }
+
+    private:
+        LoopbackRegion() : _base(nullptr), _size(0), _owner(false) { }
+
+        static uint64_t _regionSize(uint64_t slots, uint64_t ringCapacity) {
+            return sizeof(LoopbackRegionHeader) + slots * (sizeof(LoopbackSlotHeader) + 2 * ringCapacity);
+        }
+
+        // 槽数和环形缓冲区大小是否可用：槽号不超过16位，环形缓冲区按2的幂取模，整个区域能放进size_t
+        static bool _checkLayout(uint64_t slots, uint64_t ringCapacity) {
+            return slots >= 1 && slots <= MaxSlots && ringCapacity >= MinRingCapacity && ringCapacity <= MaxRingCapacity
+                && (ringCapacity & (ringCapacity - 1)) == 0 && _regionSize(slots, ringCapacity) <= std::numeric_limits<size_t>::max();
+        }
+
+        static bool _checkConfig(const LoopbackConfig &config) {
+            if (!_checkLayout(config.slots, config.ringCapacity)) {
+                LOG_ERROR("invalid loopback config: %u slot(s) (1-%u), ring capacity %u (a power of two in %u-%u)",
+                    config.slots, MaxSlots, config.ringCapacity, MinRingCapacity, MaxRingCapacity);
+                return false;
+            }
+            return true;
+        }
+
+#if defined(__linux__)
+        // 共享内存中的futex不能加FUTEX_PRIVATE_FLAG
+        static void _futex(std::atomic<uint32_t> &word, int op, uint32_t value, const struct timespec *timeout) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), op, value, timeout, nullptr, 0);
+        }
+#endif
+
+        char *_ringData(size_t index, size_t direction) {
+            size_t slots = header().slots;
+            size_t capacity = header().ringCapacity;
+            return _base + sizeof(LoopbackRegionHeader) + slots * sizeof(LoopbackSlotHeader) + (index * 2 + direction) * capacity;
+        }
+
+        // 新建的内存上构造各个头，magic最后写
+        void _initialize(const LoopbackConfig &config) {
+            LoopbackRegionHeader *h = new (_base) LoopbackRegionHeader();
+            h->version = Version;
+            h->slots = config.slots;
+            h->ringCapacity = config.ringCapacity;
+            h->doorbell.store(0, std::memory_order_relaxed);
+            h->sleeping.store(0, std::memory_order_relaxed);
+            for (size_t i = 0; i < config.slots; ++i) {
+                LoopbackSlotHeader *s = new (&slot(i)) LoopbackSlotHeader();
+                s->state.store((uint32_t)LoopbackSlotState::Free, std::memory_order_relaxed);
+                s->pid.store(0, std::memory_order_relaxed);
+                s->startTime.store(0, std::memory_order_relaxed);
+                toServer(i).reset();
+                toClient(i).reset();
+            }
+            h->serving.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            h->magic = Magic;
+        }
+
+        char *_base;  // 64字节对齐
+        size_t _size;
+        bool _owner;  // 创建共享内存的一方，析构时删除
+        std::string _name;
+        std::unique_ptr<char[]> _heap;  // 同一进程内使用时的内存
+    };
+
+    // 回环传输的客户端一端，供机器人和测试使用，收发与TCP连接相同格式的包（见PacketSplitter）
+    // deliver和receive各自只能在一个线程上调用（可以是不同的线程）
+    class LoopbackClient {
+    public:
+        LoopbackClient(const LoopbackClient &) = delete;
+        LoopbackClient &operator=(const LoopbackClient &) = delete;
+
+        // 连接另一个进程中服务端创建的共享内存（见LoopbackServer），打不开或没有空闲的槽时返回空
+        static std::unique_ptr<LoopbackClient> connectShared(const std::string &name) {
+            std::shared_ptr<LoopbackRegion> region = LoopbackRegion::openShared(name);
+            return region ? connect(region, std::function<void ()>()) : std::unique_ptr<LoopbackClient>();
+        }
+
+        // 占用region中一个空闲的槽，服务端不在服务或没有空闲的槽时返回空
+        // kick不为空时在每次写入后调用，用于唤醒同一进程内的服务端；为空时敲区域的门铃
+        static std::unique_ptr<LoopbackClient> connect(const std::shared_ptr<LoopbackRegion> &region, const std::function<void ()> &kick) {
+            if (region->header().serving.load(std::memory_order_acquire) == 0) {
+                return std::unique_ptr<LoopbackClient>();
+            }
+            for (size_t i = 0, cnt = region->getSlotCount(); i < cnt; ++i) {
+                LoopbackSlotHeader &h = region->slot(i);
+                uint32_t expected = (uint32_t)LoopbackSlotState::Free;
+                if (h.state.compare_exchange_strong(expected, (uint32_t)LoopbackSlotState::Claimed, std::memory_order_acquire)) {
+                    region->toServer(i).reset();
+                    region->toClient(i).reset();
+                    int32_t pid = region->isShared() ? _currentPid() : 0;
+                    h.pid.store(pid, std::memory_order_relaxed);
+                    h.startTime.store(pid != 0 ? LoopbackRegion::processStartTime(pid) : 0, std::memory_order_relaxed);
+                    h.state.store((uint32_t)LoopbackSlotState::Open, std::memory_order_release);
+                    std::unique_ptr<LoopbackClient> client(new LoopbackClient(region, i, kick));
+                    client->_wake();
+                    return client;
+                }
+            }
+            return std::unique_ptr<LoopbackClient>();
+        }
+
+        ~LoopbackClient() {
+            close();
+        }
+
+        size_t getSlot() const { return _index; }
+
+        // 发送一个或多个完整的包，缓冲区已满或已断开时返回false，须稍后重试
+        bool deliver(const char *data, size_t length) {
+            if (isClosed() || !_toServer.write(data, length)) {
+                return false;
+            }
+            _wake();
+            return true;
+        }
+
+        // 取出服务端发来的数据，对每个包调用func(const char *data, size_t length)，返回包数
+        // 服务端断开后仍能取完断开前发来的数据
+        template <class _Func>
+        size_t receive(_Func &&func) {
+            size_t size = _toClient.readable();
+            if (size > 0) {
+                std::pair<char *, size_t> buf = _splitter.prepareRecvBuffer(size);
+                _splitter.commitRecvBuffer(_toClient.read(buf.first, size));
+            }
+            size_t count = 0;
+            bool ok = _splitter.splitRecvPackets([&func, &count](const char *data, size_t length) {
+                ++count;
+                func(data, length);
+            });
+            if (!ok) {
+                close();
+            }
+            return count;
+        }
+
+        // 自己已断开，或服务端已断开或停止服务
+        bool isClosed() {
+            return _closed || _header.state.load(std::memory_order_acquire) != (uint32_t)LoopbackSlotState::Open
+                || _region->header().serving.load(std::memory_order_relaxed) == 0;
+        }
+
+        // 断开，服务端取完已发出的数据后回调Close；服务端已先断开时释放槽
+        void close() {
+            if (_closed) {
+                return;
+            }
+            _closed = true;
+            uint32_t expected = (uint32_t)LoopbackSlotState::Open;
+            if (!_header.state.compare_exchange_strong(expected, (uint32_t)LoopbackSlotState::ClientClosed, std::memory_order_acq_rel)
+                && expected == (uint32_t)LoopbackSlotState::ServerClosed) {
+                _header.state.store((uint32_t)LoopbackSlotState::Free, std::memory_order_release);
+            }
+            _wake();
+        }
+
+    private:
+        LoopbackClient(const std::shared_ptr<LoopbackRegion> &region, size_t index, const std::function<void ()> &kick)
+            : _region(region), _index(index), _header(region->slot(index))
+            , _toServer(region->toServer(index)), _toClient(region->toClient(index)), _kick(kick) { }
+
+        void _wake() {
+            if (_kick) {
+                _kick();
+            }
+            else {
+                _region->ringDoorbell();
+            }
+        }
+
+        static int32_t _currentPid() {
+#if defined(__linux__)
+            return (int32_t)getpid();
+#else
+            return 0;
+#endif
+        }
+
+        std::shared_ptr<LoopbackRegion> _region;
+        size_t _index;
+        LoopbackSlotHeader &_header;
+        SpscRing _toServer;
+        SpscRing _toClient;
+        std::function<void ()> _kick;
+        PacketSplitter _splitter;
+        bool _closed = false;
+    };
+
+    // 回环传输的统计
+    struct LoopbackStats {
+        uint64_t receivedPackets;  // 从客户端收到的包
+        uint64_t sentBatches;  // 写给客户端的次数（一次写可含多个包）
+        uint64_t overflows;  // 因客户端没有及时取走数据而断开的次数
+        size_t sessions;  // 当前绑定的会话数
+    };
+
+    // 回环传输的服务端一端：客户端经内存中的一对环形缓冲区收发，不经过网络协议栈，用于机器人和压测房间逻辑
+    // 与ReliableUdpServer一样是会话的转发通道（RelayChannel），回调的形式相同，游戏服用同一套代码处理
+    //   Open：客户端连上，内容为"loopback:槽号"；Data：一个包体（不含包头）；Close：客户端断开，内容为空
+    // 所有客户端在构造时给定的io_service上轮询：有数据时连续处理，没有数据时不再轮询，
+    // 同一进程内的客户端（connect）写入后直接唤醒；跨进程的客户端敲区域的门铃，由一个线程等门铃后唤醒，
+    // 这个线程至少每秒唤醒一次，检查跨进程的客户端所在进程是否已退出
+    // 会话id为(代数 << 16) | 槽号，槽被重新占用后旧会话的发送不会写到新客户端
+    template <class _Session>
+    class LoopbackServer : public RelaySessionMap<_Session>, public std::enable_shared_from_this<LoopbackServer<_Session> > {
+    public:
+        LoopbackServer<_Session>(const LoopbackServer<_Session> &) = delete;
+        LoopbackServer<_Session> &operator=(const LoopbackServer<_Session> &) = delete;
+
+        // 客户端的连接、数据和断开，在io_service的线程上调用，data[length]为'\0'
+        typedef std::function<void (LoopbackServer<_Session> &, uint32_t, LinkFrame, const char *, size_t)> PeerCallback;
+
+        LoopbackServer<_Session>(asio::io_service &service, const std::shared_ptr<LoopbackRegion> &region, const LoopbackConfig &config)
+            : _service(service), _region(region), _busyPoll(config.busyPoll) {
+            for (size_t i = 0, cnt = std::min<size_t>(region->getSlotCount(), (size_t)LoopbackRegion::MaxSlots); i < cnt; ++i) {
+                _slots.push_back(std::unique_ptr<_Slot>(new _Slot()));
+            }
+        }
+
+        ~LoopbackServer<_Session>() {
+            LOG_DEBUG("LoopbackServer<_Session>::~LoopbackServer<_Session>");
+            _stopWaiter();
+        }
+
+        void start(const PeerCallback &callback) {
+            _callback = callback;
+            _lastLivenessCheck = std::chrono::steady_clock::now();
+            _self = this->shared_from_this();
+            if (_region->isShared()) {
+                _waiter = std::thread(&LoopbackServer<_Session>::_waitLoop, this);
+            }
+            _kick();
+        }
+
+        // 停止服务，客户端随之看到断开；已绑定的会话不再回调，由调用者处理
+        void stop() {
+            this->unbindAll();
+            _region->header().serving.store(0, std::memory_order_release);
+            _stopWaiter();
+            std::shared_ptr<LoopbackServer<_Session> > thiz = this->shared_from_this();
+            _service.post([thiz]() {
+                thiz->_stopped = true;
+            });
+        }
+
+        // 同一进程内的客户端，写入后立即唤醒服务端；没有空闲的槽时返回空
+        std::unique_ptr<LoopbackClient> connect() {
+            std::weak_ptr<LoopbackServer<_Session> > weak = this->shared_from_this();
+            return LoopbackClient::connect(_region, [weak]() {
+                std::shared_ptr<LoopbackServer<_Session> > thiz = weak.lock();
+                if (thiz != nullptr) {
+                    thiz->_kick();
+                }
+            });
+        }
+
+        asio::io_service &getIOService() { return _service; }
+
+        LoopbackStats getStats() {
+            LoopbackStats stats;
+            stats.receivedPackets = _receivedPackets;
+            stats.sentBatches = _sentBatches;
+            stats.overflows = _overflows;
+            stats.sessions = this->getSessionCount();
+            return stats;
+        }
+
+        // RelayChannel，会话的一批写直接写入客户端的环形缓冲区
+        virtual void relaySend(uint32_t id, const std::vector<asio::const_buffer> &buffers) override {
+            size_t index = id & 0xFFFFU;
+            if (index >= _slots.size()) {
+                return;
+            }
+            _Slot &slot = *_slots[index];
+            {
+                std::lock_guard<jw::QuickMutex> g(slot.sendMutex);
+                (void)g;
+                if (slot.id != id) {
+                    return;
+                }
+                if (slot.toClient.write(buffers.data(), buffers.size())) {
+                    ++_sentBatches;
+                    return;
+                }
+            }
+            // 客户端没有及时取走，与TCP连接的发送队列超过上限一样断开
+            int expected = 0;
+            if (slot.closeReason.compare_exchange_strong(expected, _CloseOverflow)) {
+                ++_overflows;
+                LOG_WARN("loopback client %u is not draining its ring, disconnect", id);
+                _kick();
+            }
+        }
+
+        virtual void relayClose(uint32_t id) override {
+            if (this->unbind(id) == nullptr) {
+                return;
+            }
+            _Slot &slot = *_slots[id & 0xFFFFU];
+            int expected = 0;
+            slot.closeReason.compare_exchange_strong(expected, _CloseBySession);
+            _kick();
+        }
+
+    private:
+        enum {
+            _CloseBySession = 1,  // 会话已断开，不再回调Close
+            _CloseOverflow  // 客户端没有及时取走数据，回调Close
+        };
+
+        struct _Slot {
+            uint32_t id = 0;  // 当前会话，0为没有；只由轮询修改，修改时持有sendMutex
+            uint32_t generation = 0;  // 只由轮询访问
+            SpscRing toClient;  // 由sendMutex保护
+            std::atomic<int> closeReason{ 0 };
+            PacketSplitter splitter;  // 只由轮询访问
+            jw::QuickMutex sendMutex;
+        };
+
+        // 投递一次轮询，已投递过还没执行时不再投递；投递的任务不持有服务端，析构不会发生在_waiter线程上
+        void _kick() {
+            if (!_kicked.exchange(true)) {
+                std::weak_ptr<LoopbackServer<_Session> > weak = _self;
+                _service.post([weak]() {
+                    std::shared_ptr<LoopbackServer<_Session> > thiz = weak.lock();
+                    if (thiz != nullptr) {
+                        thiz->_pump();
+                    }
+                });
+            }
+        }
+
+        // 同时只有一个线程轮询，另一个线程上的轮询没抢到时让正在轮询的那个结束后再来一次
+        // 有数据后的busyPoll内再投递一次，让出io_service给其他任务；之后不再投递，共享内存上交给_waiter等门铃
+        void _pump() {
+            _kicked = false;
+            _pumpAgain = true;
+            if (_stopped || _pumping.exchange(true)) {
+                return;
+            }
+            _pumpAgain = false;
+            // 先读门铃再检查各个槽，检查开始之后客户端的写入一定会让门铃变化
+            uint32_t doorbell = _region->readDoorbell();
+            bool checkLiveness = false;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (_region->isShared() && now - _lastLivenessCheck >= std::chrono::seconds(1)) {
+                _lastLivenessCheck = now;
+                checkLiveness = true;
+            }
+            bool busy = false;
+            for (size_t i = 0; i < _slots.size(); ++i) {
+                busy = _pumpSlot(i, checkLiveness) || busy;
+            }
+            if (busy) {
+                _lastActive = now;
+            }
+            _pumping = false;
+            if (now - _lastActive < _busyPoll || _pumpAgain) {
+                _kick();
+                return;
+            }
+            if (_region->isShared()) {
+                {
+                    std::lock_guard<std::mutex> g(_waitMutex);
+                    (void)g;
+                    _waitSeq = doorbell;
+                    _waitRequested = true;
+                }
+                _waitCond.notify_one();
+            }
+        }
+
+        // _waiter线程：轮询空闲后等门铃，门铃响了或到了检查客户端进程的时间时投递一次轮询
+        void _waitLoop() {
+            std::unique_lock<std::mutex> lock(_waitMutex);
+            while (!_waiterStopped) {
+                if (!_waitRequested) {
+                    _waitCond.wait(lock);
+                    continue;
+                }
+                _waitRequested = false;
+                uint32_t seq = _waitSeq;
+                lock.unlock();
+                _region->waitDoorbell(seq, std::chrono::milliseconds(1000));
+                lock.lock();
+                if (!_waiterStopped) {
+                    _kick();
+                }
+            }
+        }
+
+        void _stopWaiter() {
+            {
+                std::lock_guard<std::mutex> g(_waitMutex);
+                (void)g;
+                _waiterStopped = true;
+            }
+            _waitCond.notify_one();
+            if (_waiter.joinable()) {
+                _region->ringDoorbell();
+                _waiter.join();
+            }
+        }
+
+        // 处理一个槽，返回是否有数据
+        bool _pumpSlot(size_t index, bool checkLiveness) {
+            _Slot &slot = *_slots[index];
+            LoopbackSlotHeader &header = _region->slot(index);
+            // 先读状态再取数据，客户端断开前写入的数据都能取到
+            uint32_t state = header.state.load(std::memory_order_acquire);
+            if (slot.id == 0) {
+                if (state == (uint32_t)LoopbackSlotState::ServerClosed && checkLiveness && !_isAlive(header)) {
+                    // 服务端断开后客户端进程退出了，没有人释放这个槽
+                    header.state.store((uint32_t)LoopbackSlotState::Free, std::memory_order_release);
+                }
+                if (state != (uint32_t)LoopbackSlotState::Open && state != (uint32_t)LoopbackSlotState::ClientClosed) {
+                    return false;
+                }
+                _openSlot(index);
+            }
+
+            bool busy = false;
+            SpscRing toServer = _region->toServer(index);
+            size_t size = std::min(toServer.readable(), _maxReadPerPump);
+            if (size > 0) {
+                busy = true;
+                std::pair<char *, size_t> buf = slot.splitter.prepareRecvBuffer(size);
+                slot.splitter.commitRecvBuffer(toServer.read(buf.first, size));
+                if (slot.closeReason != 0) {
+                    // 已断开，收到的数据丢弃
+                    std::vector<char> empty;
+                    slot.splitter.swapRecvBuffer(empty);
+                }
+                else {
+                    uint32_t id = slot.id;
+                    bool ok = slot.splitter.splitRecvPackets([this, id](const char *data, size_t length) {
+                        ++_receivedPackets;
+                        _callback(*this, id, LinkFrame::Data, data, length);
+                    });
+                    if (!ok) {
+                        int expected = 0;
+                        slot.closeReason.compare_exchange_strong(expected, _CloseOverflow);
+                    }
+                }
+            }
+
+            int reason = slot.closeReason;
+            if (state == (uint32_t)LoopbackSlotState::ClientClosed && (toServer.readable() == 0 || reason != 0)) {
+                _closeSlot(index, reason == 0);
+            }
+            else if (checkLiveness && !_isAlive(header)) {
+                LOG_INFO("loopback client process %d exited", (int)header.pid.load(std::memory_order_relaxed));
+                _closeSlot(index, reason == 0 || reason == _CloseOverflow);
+            }
+            else if (reason != 0) {
+                _closeSlot(index, reason == _CloseOverflow);
+            }
+            return busy;
+        }
+
+        void _openSlot(size_t index) {
+            _Slot &slot = *_slots[index];
+            slot.generation = (slot.generation + 1) & 0xFFFFU;
+            if (slot.generation == 0) {
+                slot.generation = 1;
+            }
+            uint32_t id = (slot.generation << 16) | (uint32_t)index;
+            {
+                std::lock_guard<jw::QuickMutex> g(slot.sendMutex);
+                (void)g;
+                slot.id = id;
+                slot.toClient = _region->toClient(index);
+            }
+            slot.closeReason = 0;
+            char address[32];
+            snprintf(address, sizeof(address), "loopback:%u", (unsigned)index);
+            _callback(*this, id, LinkFrame::Open, address, strlen(address));
+        }
+
+        // 结束槽上的会话并交给客户端释放（客户端已断开时直接释放）；notify为true时回调Close
+        void _closeSlot(size_t index, bool notify) {
+            _Slot &slot = *_slots[index];
+            uint32_t id;
+            {
+                std::lock_guard<jw::QuickMutex> g(slot.sendMutex);
+                (void)g;
+                id = slot.id;
+                slot.id = 0;
+            }
+            slot.closeReason = 0;
+            std::vector<char> empty;
+            slot.splitter.swapRecvBuffer(empty);
+
+            LoopbackSlotHeader &header = _region->slot(index);
+            uint32_t expected = (uint32_t)LoopbackSlotState::Open;
+            if (!header.state.compare_exchange_strong(expected, (uint32_t)LoopbackSlotState::ServerClosed, std::memory_order_acq_rel)
+                || !_isAlive(header)) {
+                header.state.store((uint32_t)LoopbackSlotState::Free, std::memory_order_release);
+            }
+            if (notify) {
+                _callback(*this, id, LinkFrame::Close, "", 0);
+            }
+        }
+
+        // 客户端进程是否还在：pid和启动时间都相同；读不到启动时间时（如没有/proc）只看pid
+        static bool _isAlive(const LoopbackSlotHeader &header) {
+#if defined(__linux__)
+            int32_t pid = header.pid.load(std::memory_order_relaxed);
+            if (pid == 0) {
+                return true;
+            }
+            uint64_t startTime = header.startTime.load(std::memory_order_relaxed);
+            if (startTime != 0) {
+                return LoopbackRegion::processStartTime(pid) == startTime;
+            }
+            return kill((pid_t)pid, 0) == 0 || errno == EPERM;
+#else
+            (void)header;
+            return true;
+#endif
+        }
+
+        static const size_t _maxReadPerPump = 256U * 1024U;  // 每个槽每轮最多取这么多，避免一个客户端占住轮询
+
+        asio::io_service &_service;
+        std::shared_ptr<LoopbackRegion> _region;
+        std::chrono::microseconds _busyPoll;
+        PeerCallback _callback;
+        std::weak_ptr<LoopbackServer<_Session> > _self;
+        std::vector<std::unique_ptr<_Slot> > _slots;
+        std::chrono::steady_clock::time_point _lastLivenessCheck;
+        std::chrono::steady_clock::time_point _lastActive;  // 只由轮询访问
+        std::atomic<bool> _kicked{ false };
+        std::atomic<bool> _pumping{ false };
+        std::atomic<bool> _pumpAgain{ false };
+        bool _stopped = false;  // 只在io_service上访问
+        std::thread _waiter;  // 只用于共享内存
+        std::mutex _waitMutex;
+        std::condition_variable _waitCond;
+        uint32_t _waitSeq = 0;  // 以下由_waitMutex保护
+        bool _waitRequested = false;
+        bool _waiterStopped = false;
+        std::atomic<uint64_t> _receivedPackets{ 0 };
+        std::atomic<uint64_t> _sentBatches{ 0 };
+        std::atomic<uint64_t> _overflows{ 0 };
+    };
+
+    template <class _Session> const size_t LoopbackServer<_Session>::_maxReadPerPump;
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+﻿#ifndef _MPSC_QUEUE_HPP_
+#define _MPSC_QUEUE_HPP_
+
+#include <atomic>
+#include <utility>
+
+namespace jw {
+
+    // 无锁多生产者单消费者队列（Vyukov算法）
+    // push可在任意线程调用，永不阻塞；front/pop/empty只能由当前唯一的消费者调用
+    // 注意：生产者交换_head后、链接next前的短暂窗口内，已入队的元素对消费者不可见
+    // 出队的节点放回一组空闲槽位供push复用，稳定收发时不再分配；找不到空槽位才释放，找不到节点才分配
+    // 槽位只有两种转换：消费者把空槽位填上（唯一的填充者，直接store），生产者用exchange整个取走，不存在ABA问题
+    template <class _T>
+    class MPSCQueue {
+    public:
+        MPSCQueue<_T>(const MPSCQueue<_T> &) = delete;
+        MPSCQueue<_T> &operator=(const MPSCQueue<_T> &) = delete;
+
+        MPSCQueue<_T>() : _takeHint(0), _putHint(0) {
+            for (size_t i = 0; i < _PoolSize; ++i) {
+                _pool[i].store(nullptr, std::memory_order_relaxed);
+            }
+            _Node *stub = new _Node();
+            _head.store(stub);
+            _tail = stub;
+        }
+
+        ~MPSCQueue<_T>() {
+            while (front() != nullptr) {
+                pop();
+            }
+            delete _tail;
+            for (size_t i = 0; i < _PoolSize; ++i) {
+                delete _pool[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        void push(const _T &value) {
+            _Node *node = _allocNode();
+            node->value = value;
+            _link(node);
+        }
+
+        void push(_T &&value) {
+            _Node *node = _allocNode();
+            node->value = std::move(value);
+            _link(node);
+        }
+
+        // 队首元素，不可见时返回nullptr
+        _T *front() {
+            _Node *next = _tail->next.load(std::memory_order_acquire);
+            return next != nullptr ? &next->value : nullptr;
+        }
+
+        // 弹出队首元素，调用前须确认front()不为nullptr
+        void pop() {
+            _Node *tail = _tail;
+            _Node *next = tail->next.load(std::memory_order_acquire);
+            next->value = _T();  // next成为新的哨兵节点，释放其中的值
+            _tail = next;
+            _freeNode(tail);
+        }
+
+        bool empty() const {
+            return _tail == _head.load(std::memory_order_acquire);
+        }
+
+    private:
+        struct _Node {
+            std::atomic<_Node *> next{ nullptr };
+            _T value;
+        };
+
+        static const size_t _PoolSize = 32;  // 每个队列最多缓存的空闲节点数
+        static const size_t _PoolProbes = 4;  // 每次取放最多看几个槽位，队列积压时池总是空的，不必找遍
+
+        void _link(_Node *node) {
+            _Node *prev = _head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        // 生产者调用：从_takeHint开始找一个有节点的槽位取走，找不到才分配
+        _Node *_allocNode() {
+            size_t hint = _takeHint.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < _PoolProbes; ++i) {
+                size_t idx = (hint + i) % _PoolSize;
+                if (_pool[idx].load(std::memory_order_relaxed) != nullptr) {
+                    _Node *node = _pool[idx].exchange(nullptr, std::memory_order_acquire);
+                    if (node != nullptr) {
+                        _takeHint.store(idx + 1, std::memory_order_relaxed);
+                        node->next.store(nullptr, std::memory_order_relaxed);
+                        return node;
+                    }
+                }
+            }
+            return new _Node();
+        }
+
+        // 消费者调用：节点的值已清空，放进一个空槽位，找不到才释放
+        void _freeNode(_Node *node) {
+            for (size_t i = 0; i < _PoolProbes; ++i) {
+                size_t idx = (_putHint + i) % _PoolSize;
+                if (_pool[idx].load(std::memory_order_relaxed) == nullptr) {
+                    _pool[idx].store(node, std::memory_order_release);
+                    _putHint = idx + 1;
+                    return;
+                }
+            }
+            delete node;
+        }
+
+        std::atomic<_Node *> _head;  // 生产者从这里入队
+        _Node *_tail;  // 哨兵节点，消费者从这里出队
+
+        std::atomic<_Node *> _pool[_PoolSize];  // 空闲节点
+        std::atomic<size_t> _takeHint;  // 生产者下次从哪个槽位开始找
+        size_t _putHint;  // 消费者下次从哪个槽位开始找
+    };
+}
+
+#endif
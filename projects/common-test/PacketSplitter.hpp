@@ -6,54 +6,112 @@
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
+#include <utility>
 #include <stdint.h>
 
 #define PUSH_SERVICE_TAG (uint32_t)-1
 
+// 服务端对空闲连接推送ping，客户端原样回一个同cmd的包，服务端据此刷新连接的空闲计时
+#define CMD_PING 1000
+
 namespace jw {
+    // 包格式：4字节小端包体长度 + 包体
+    // 接收缓冲区由PacketSplitter持有，socket直接读到这里，解出的包体以指针形式回调，不再复制
     class PacketSplitter {
     private:
-        std::vector<char> _cacheBuf;
+        std::vector<char> _recvBuf;
+        size_t _recvBegin = 0;  // 未处理数据的起始位置
+        size_t _recvEnd = 0;  // 已接收数据的结束位置
 
-    public:
-        // 解出的包从buf中传回
-        void decodeRecvPacket(std::vector<char> &buf, const char *data, size_t length) {
-            std::copy(data, data + length, std::back_inserter(_cacheBuf));  // 将data复制到cache尾部
-            size_t bufSize = _cacheBuf.size();
-            if (bufSize < 4) {  // 包头
-                LOG_DEBUG("not enough for packet header");
-                buf.clear();
-                return;
+        size_t _pendingPacketSize() const {
+            if (_recvEnd - _recvBegin < 4) {
+                return 0;
             }
+            const unsigned char *p = (const unsigned char *)&_recvBuf[_recvBegin];
+            return ((size_t)p[3] << 24) | ((size_t)p[2] << 16) | ((size_t)p[1] << 8) | (size_t)p[0];
+        }
 
-            // 计算包体长度
-            unsigned recvLen = (unsigned char)_cacheBuf[3];
-            recvLen <<= 8;
-            recvLen |= (unsigned char)_cacheBuf[2];
-            recvLen <<= 8;
-            recvLen |= (unsigned char)_cacheBuf[1];
-            recvLen <<= 8;
-            recvLen |= (unsigned char)_cacheBuf[0];
-            if (bufSize - 4 < recvLen) {
-                LOG_DEBUG("not enough for packet body, expect : %lu", (unsigned long)recvLen);
-                buf.clear();
-                return;
+    public:
+        static const size_t MaxPacketSize = 1024U * 1024U;  // 包体长度上限
+
+        // 准备至少minSize字节的空闲空间供socket读入，返回空闲区域的起始地址和大小
+        // 若已收到包头，空闲空间至少能容纳整个包
+        // 始终在末尾多保留一个字节，供splitRecvPackets在包体后临时写入'\0'
+        std::pair<char *, size_t> prepareRecvBuffer(size_t minSize) {
+            size_t pending = _pendingPacketSize();
+            if (pending != 0 && pending <= MaxPacketSize) {
+                minSize = std::max(minSize, pending + 4 - (_recvEnd - _recvBegin));
             }
 
-            _cacheBuf.erase(_cacheBuf.begin(), _cacheBuf.begin() + 4);
-            buf = std::move(_cacheBuf);  // 移动到buf里面
-            if (bufSize - 4 > recvLen) {
-                // 将多余的保存在cache里面，并从buf中移走多余的
-                std::copy(buf.begin() + 4 + recvLen, buf.end(), std::back_inserter(_cacheBuf));
-                buf.erase(buf.begin() + 4 + recvLen, buf.end());
-                LOG_DEBUG("to long for packet body, remain : %lu", (unsigned long)bufSize - 4 - recvLen);
+            if (_recvBuf.size() - _recvEnd < minSize + 1) {
+                if (_recvBegin > 0) {
+                    // 把未处理的数据挪到头部
+                    std::copy(_recvBuf.begin() + _recvBegin, _recvBuf.begin() + _recvEnd, _recvBuf.begin());
+                    _recvEnd -= _recvBegin;
+                    _recvBegin = 0;
+                }
+                if (_recvBuf.size() - _recvEnd < minSize + 1) {
+                    _recvBuf.resize(_recvEnd + minSize + 1);
+                }
             }
+            return std::make_pair(&_recvBuf[_recvEnd], _recvBuf.size() - _recvEnd - 1);
         }
 
-        std::vector<char> decodeRecvPacket(const char *data, size_t length) {
-            std::vector<char> buf;
-            decodeRecvPacket(buf, data, length);
-            return std::move(buf);
+        // socket读入了length字节
+        void commitRecvBuffer(size_t length) {
+            _recvEnd += length;
+        }
+
+        // 与buf交换接收缓冲区并丢弃未处理的数据，用于从缓冲区池借用和归还
+        void swapRecvBuffer(std::vector<char> &buf) {
+            _recvBuf.swap(buf);
+            _recvBegin = _recvEnd = 0;
+        }
+
+        // 是否有未收完的包
+        bool hasPendingRecvData() const {
+            return _recvBegin != _recvEnd;
+        }
+
+        // 未收完的包的数据，在下次读入之前有效
+        std::pair<const char *, size_t> getPendingRecvData() const {
+            return std::make_pair(_recvBuf.empty() ? nullptr : &_recvBuf[_recvBegin], _recvEnd - _recvBegin);
+        }
+
+        // 依次解出所有完整的包，调用func(const char *data, size_t length)
+        // data指向接收缓冲区中的包体（不含包头），在func返回前有效，且data[length]为'\0'
+        // 包体长度超过MaxPacketSize时返回false
+        template <class _Func>
+        bool splitRecvPackets(_Func &&func) {
+            while (_recvEnd - _recvBegin >= 4) {
+                size_t length = _pendingPacketSize();
+                if (length > MaxPacketSize) {
+                    LOG_ERROR("packet too large: %lu", (unsigned long)length);
+                    return false;
+                }
+                if (_recvEnd - _recvBegin - 4 < length) {
+                    LOG_DEBUG("not enough for packet body, expect : %lu", (unsigned long)length);
+                    break;
+                }
+
+                char *data = &_recvBuf[_recvBegin + 4];
+                char saved = data[length];  // 下一个包的首字节，或者保留的空闲字节
+                data[length] = '\0';
+                _recvBegin += 4 + length;
+                try {
+                    func(data, length);
+                }
+                catch (...) {
+                    data[length] = saved;
+                    throw;
+                }
+                data[length] = saved;
+            }
+
+            if (_recvBegin == _recvEnd) {
+                _recvBegin = _recvEnd = 0;
+            }
+            return true;
         }
 
         static void encodeSendPacket(std::vector<char> &buf, const std::string &str) {
@@ -75,37 +133,44 @@ namespace jw {
     };
 
     struct JsonPacketSplitter : PacketSplitter {
-        void decodeRecvPacket(jw::cppJSON &json, unsigned &cmd, unsigned &tag, const char *data, size_t length) {
-            std::vector<char> buf;
-            PacketSplitter::decodeRecvPacket(buf, data, length);
+        // 只取出包体中的cmd，不解析JSON，用于分发前的限流等检查
+        // 包体不足8字节时返回0，与decodeRecvPacket一致
+        static unsigned peekCommand(const char *data, size_t length) {
+            if (length <= 8) {
+                return 0;
+            }
+            return (unsigned)(unsigned char)data[0] | ((unsigned)(unsigned char)data[1] << 8)
+                | ((unsigned)(unsigned char)data[2] << 16) | ((unsigned)(unsigned char)data[3] << 24);
+        }
 
-            size_t size = buf.size();
-            if (size >= 8) {
-                cmd = (unsigned char)buf[3];
+        // data为splitRecvPackets解出的一个包体，须以'\0'结尾
+        static void decodeRecvPacket(jw::cppJSON &json, unsigned &cmd, unsigned &tag, const char *data, size_t length) {
+            if (length >= 8) {
+                cmd = (unsigned char)data[3];
                 cmd <<= 8;
-                cmd |= (unsigned char)buf[2];
+                cmd |= (unsigned char)data[2];
                 cmd <<= 8;
-                cmd |= (unsigned char)buf[1];
+                cmd |= (unsigned char)data[1];
                 cmd <<= 8;
-                cmd |= (unsigned char)buf[0];
+                cmd |= (unsigned char)data[0];
 
-                tag = (unsigned char)buf[7];
+                tag = (unsigned char)data[7];
                 tag <<= 8;
-                tag |= (unsigned char)buf[6];
+                tag |= (unsigned char)data[6];
                 tag <<= 8;
-                tag |= (unsigned char)buf[5];
+                tag |= (unsigned char)data[5];
                 tag <<= 8;
-                tag |= (unsigned char)buf[4];
+                tag |= (unsigned char)data[4];
             }
 
-            if (size <= 8) {
+            if (length <= 8) {
                 cmd = 0;
                 tag = (unsigned)-1;
                 json.clear();
             }
             else {
-                LOG_DEBUG("[recv] package size = %lu cmd = %u tag = %u | %.*s", (unsigned long)size, cmd, tag, (int)size - 8, &buf[8]);
-                json.Parse(&buf[8]);
+                LOG_DEBUG("[recv] package size = %lu cmd = %u tag = %u | %.*s", (unsigned long)length, cmd, tag, (int)length - 8, &data[8]);
+                json.Parse(&data[8]);
             }
         }
 
@@ -0,0 +1,103 @@
+﻿#ifndef _RATE_LIMITER_HPP_
+#define _RATE_LIMITER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+namespace jw {
+
+    // 令牌桶的参数：每秒补充rate个令牌，最多积攒burst个，rate为0表示不限制
+    // 构造时换算成纳秒，检查时不做除法
+    struct RateLimit {
+        int64_t intervalNs;  // 补充一个令牌的间隔
+        int64_t toleranceNs;  // 积攒burst个令牌所需的时间
+
+        RateLimit() : intervalNs(0), toleranceNs(0) { }
+
+        RateLimit(uint32_t rate, uint32_t burst)
+            : intervalNs(rate != 0 ? 1000000000LL / rate : 0), toleranceNs(rate != 0 ? 1000000000LL / rate * (burst != 0 ? burst : 1) : 0) {
+        }
+
+        bool isUnlimited() const { return intervalNs == 0; }
+    };
+
+    // 令牌桶，以GCRA（虚拟调度）实现：只记录令牌用完的理论时刻，检查只有几次整数比较和加法
+    // 不加锁，每个桶只能在一个线程上使用（会话的回调不会并发）
+    class TokenBucket {
+    public:
+        TokenBucket() : _tat(0) { }
+
+        // now为单调时钟的纳秒数，有令牌时取走一个并返回true
+        bool consume(const RateLimit &limit, int64_t now) {
+            if (limit.isUnlimited()) {
+                return true;
+            }
+            int64_t tat = _tat > now ? _tat : now;
+            if (tat + limit.intervalNs - now > limit.toleranceNs) {
+                return false;
+            }
+            _tat = tat + limit.intervalNs;
+            return true;
+        }
+
+        void reset() { _tat = 0; }
+
+    private:
+        int64_t _tat;
+    };
+
+    // 取单调时钟的纳秒数，每个包取一次，供多个桶共用
+    static inline int64_t rateLimiterNow() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // 各类命令的限流参数
+    // abuse为被限流命令的容忍速率：被拒绝的命令也消耗一个令牌，耗尽说明客户端在持续刷包，应断开；不限制时从不断开
+    template <size_t _ClassCount>
+    struct RateLimitPolicy {
+        RateLimit limits[_ClassCount];
+        RateLimit abuse;
+    };
+
+    // 限流统计，由同一个服务器的所有会话共享
+    template <size_t _ClassCount>
+    struct RateLimitStats {
+        std::atomic<uint64_t> throttled[_ClassCount];  // 各类被拒绝的命令数
+        std::atomic<uint64_t> disconnected;  // 因持续刷包被断开的连接数
+
+        RateLimitStats<_ClassCount>() : disconnected(0) {
+            for (size_t i = 0; i < _ClassCount; ++i) {
+                throttled[i] = 0;
+            }
+        }
+    };
+
+    enum class RateLimitResult {
+        Allowed = 0,
+        Throttled,  // 丢弃这个命令
+        Abusive  // 丢弃并断开连接
+    };
+
+    // 每个会话、每类命令一个令牌桶，放在会话的用户数据中
+    template <size_t _ClassCount>
+    class CommandRateLimiter {
+    public:
+        RateLimitResult check(const RateLimitPolicy<_ClassCount> &policy, size_t commandClass, int64_t now) {
+            if (_buckets[commandClass].consume(policy.limits[commandClass], now)) {
+                return RateLimitResult::Allowed;
+            }
+            if (_abuse.consume(policy.abuse, now)) {
+                return RateLimitResult::Throttled;
+            }
+            return RateLimitResult::Abusive;
+        }
+
+    private:
+        TokenBucket _buckets[_ClassCount];
+        TokenBucket _abuse;
+    };
+}
+
+#endif
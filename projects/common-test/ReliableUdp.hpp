@@ -0,0 +1,1218 @@
+﻿#ifndef _RELIABLE_UDP_HPP_
+#define _RELIABLE_UDP_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "QuickMutex.h"
+#include "PacketSplitter.hpp"
+#include "UpstreamLink.hpp"
+#include "AdmissionControl.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+namespace jw {
+
+    // 可靠UDP使用的毫秒时钟，32位回绕，比较时用差值
+    inline uint32_t reliableNow() {
+        return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // 可靠UDP的参数，默认值为低延迟调整（相当于KCP的快速模式）
+    struct ReliableConfig {
+        uint32_t mtu;  // 数据报大小上限
+        uint32_t interval;  // 定时flush的间隔（毫秒），收到数据和有数据要发时另外立即flush
+        uint32_t minRto;  // 最小重传超时（毫秒）
+        uint32_t fastResend;  // 分片被后面的分片的确认越过这么多次时立即重传，0为不快速重传
+        bool rtoBackoff;  // 超时重传后RTO加倍，否则增加一半
+        uint32_t ackDelay;  // 确认最多推迟这么久（毫秒），攒够2个时立即发出；0为不推迟
+        bool congestionControl;  // 使用拥塞窗口（慢启动，丢包时减小），否则只受收发窗口限制
+        uint32_t sendWindow;  // 发送窗口（分片数）
+        uint32_t recvWindow;  // 接收窗口（分片数）
+        uint32_t deadLink;  // 同一分片发送这么多次仍未确认时认为对方已断开
+        size_t maxPending;  // 还没被确认的数据（字节）上限，服务端超过时断开连接，与TCP连接的发送队列超过硬上限一样；0为不限
+
+        ReliableConfig()
+            : mtu(1200), interval(10), minRto(30), fastResend(2), rtoBackoff(false), ackDelay(0), congestionControl(false)
+            , sendWindow(256), recvWindow(256), deadLink(20), maxPending(4U * 1024U * 1024U) {
+        }
+
+        // 按TCP的行为设置，用于在同样的丢包下对比：最小RTO为200ms且加倍退避、3个重复确认才快速重传、延迟确认、拥塞控制
+        static ReliableConfig tcpLike() {
+            ReliableConfig config;
+            config.minRto = 200;
+            config.fastResend = 3;
+            config.rtoBackoff = true;
+            config.ackDelay = 40;
+            config.congestionControl = true;
+            config.deadLink = 15;
+            return config;
+        }
+    };
+
+    // 一个可靠通道的统计
+    struct ReliableStats {
+        uint64_t sentSegments;  // 发出的数据分片，含重传
+        uint64_t timeoutRetransmits;  // 超时重传的分片
+        uint64_t fastRetransmits;  // 快速重传的分片
+        uint64_t receivedSegments;  // 收到的数据分片，含重复的
+        uint64_t duplicateSegments;  // 收到的重复分片
+        uint32_t srtt;  // 平滑的往返时间（毫秒）
+        uint32_t rto;  // 当前的重传超时（毫秒）
+
+        ReliableStats() : sentSegments(0), timeoutRetransmits(0), fastRetransmits(0), receivedSegments(0), duplicateSegments(0), srtt(0), rto(0) { }
+
+        void accumulate(const ReliableStats &other) {
+            sentSegments += other.sentSegments;
+            timeoutRetransmits += other.timeoutRetransmits;
+            fastRetransmits += other.fastRetransmits;
+            receivedSegments += other.receivedSegments;
+            duplicateSegments += other.duplicateSegments;
+        }
+    };
+
+    // 可靠、有序的字节流（KCP风格的ARQ），本身不做I/O：收到的数据报交给input，要发出的数据报交给OutputFunction
+    // 每个分片单独确认（选择确认），分片被后面的分片的确认越过fastResend次时立即重传，不等超时；RTO按RTT估计，有下限
+    // 流模式：send的数据追加到还没发出的最后一个分片里，flush之前多次send的小包合并成一个分片
+    // 数据报由若干个分片组成，每个分片24字节头（小端）：conv u32、cmd u8、frg u8（总为0）、wnd u16、ts u32、sn u32、una u32、len u32，之后是len字节数据
+    //   Push为数据分片；Ack确认一个分片，ts为被确认的分片发出的时刻；Close为一方断开了连接，不需要确认
+    // 不是线程安全的
+    class ReliableChannel {
+    public:
+        ReliableChannel(const ReliableChannel &) = delete;
+        ReliableChannel &operator=(const ReliableChannel &) = delete;
+
+        enum Command : uint8_t {
+            Push = 81,
+            Ack = 82,
+            Close = 85
+        };
+
+        static const size_t HeaderSize = 24;
+
+        typedef std::function<void (const char *, size_t)> OutputFunction;
+
+        ReliableChannel(uint32_t conv, const ReliableConfig &config, const OutputFunction &output)
+            : _conv(conv), _config(config), _output(output), _rxRto(std::max<uint32_t>(config.minRto, 200)) {
+            _cwnd = std::min<uint32_t>(10, config.sendWindow);
+            _ssthresh = config.sendWindow;
+            _rmtWnd = config.recvWindow;
+            _buffer.reserve(config.mtu);
+        }
+
+        uint32_t getConv() const { return _conv; }
+
+        // 取数据报的conv，数据报比一个分片头短时返回false
+        static bool peekConv(const char *data, size_t length, uint32_t &conv) {
+            if (length < HeaderSize) {
+                return false;
+            }
+            conv = _getUint32(data);
+            return true;
+        }
+
+        // 数据报是否来自对方新建的连接：以初始窗口内的数据分片开头，且对方还没收到过任何分片
+        // 第一个数据报可能丢失或晚到，不能只认sn为0的分片
+        static bool isHandshake(const char *data, size_t length, uint32_t recvWindow) {
+            return length >= HeaderSize && (uint8_t)data[4] == Push && _getUint32(data + 12) < recvWindow && _getUint32(data + 16) == 0;
+        }
+
+        // 组一个Close分片，用于回复不认识的conv
+        static std::vector<char> encodeClose(uint32_t conv) {
+            std::vector<char> buf(HeaderSize, '\0');
+            _putUint32(&buf[0], conv);
+            buf[4] = (char)Close;
+            return buf;
+        }
+
+        // 追加要发送的数据，在下一次flush时按窗口发出
+        void send(const char *data, size_t length) {
+            size_t mss = _config.mtu - HeaderSize;
+            _sndBytes += length;
+            if (!_sndQueue.empty() && _sndQueue.back().data.size() < mss) {
+                std::vector<char> &tail = _sndQueue.back().data;
+                size_t n = std::min(length, mss - tail.size());
+                tail.insert(tail.end(), data, data + n);
+                data += n;
+                length -= n;
+            }
+            while (length > 0) {
+                size_t n = std::min(length, mss);
+                _sndQueue.push_back(_Segment());
+                _sndQueue.back().data.assign(data, data + n);
+                data += n;
+                length -= n;
+            }
+        }
+
+        // 收到一个数据报，格式错误或conv不符时返回false（之前的分片已处理）
+        // acceptClose为false时忽略其中的Close分片（如来自还没确认的地址）
+        bool input(const char *data, size_t length, uint32_t now, bool acceptClose = true) {
+            uint32_t prevUna = _sndUna;
+            bool gotAck = false;
+            uint32_t maxAck = 0;
+            bool valid = true;
+            while (length >= HeaderSize) {
+                uint8_t cmd = (uint8_t)data[4];
+                uint16_t wnd = (uint16_t)((uint8_t)data[6] | ((uint8_t)data[7] << 8));
+                uint32_t ts = _getUint32(data + 8);
+                uint32_t sn = _getUint32(data + 12);
+                uint32_t una = _getUint32(data + 16);
+                uint32_t len = _getUint32(data + 20);
+                if (_getUint32(data) != _conv || len > length - HeaderSize || (cmd != Push && cmd != Ack && cmd != Close)) {
+                    valid = false;
+                    break;
+                }
+                data += HeaderSize;
+                length -= HeaderSize;
+
+                if (cmd == Close) {
+                    _peerClosed = _peerClosed || acceptClose;
+                }
+                else {
+                    _rmtWnd = wnd;
+                    _parseUna(una);
+                    if (cmd == Ack) {
+                        if (_diff(now, ts) >= 0) {
+                            _updateRtt((uint32_t)_diff(now, ts));
+                        }
+                        _parseAck(sn);
+                        if (!gotAck || _diff(sn, maxAck) > 0) {
+                            gotAck = true;
+                            maxAck = sn;
+                        }
+                    }
+                    else if (_diff(sn, _rcvNxt + _config.recvWindow) < 0) {
+                        ++_stats.receivedSegments;
+                        if (_acks.empty()) {
+                            _ackSince = now;
+                        }
+                        _acks.push_back(std::make_pair(sn, ts));
+                        if (_diff(sn, _rcvNxt) >= 0 && _rcvBuf.find(sn) == _rcvBuf.end()) {
+                            _rcvBuf[sn].assign(data, data + len);
+                            _moveReady();
+                        }
+                        else {
+                            ++_stats.duplicateSegments;
+                        }
+                    }
+                }
+                data += len;
+                length -= len;
+            }
+
+            if (gotAck) {
+                _parseFastack(maxAck);
+            }
+            if (_config.congestionControl && _diff(_sndUna, prevUna) > 0) {
+                if (_cwnd < _ssthresh) {
+                    ++_cwnd;
+                }
+                else if (++_cwndCount >= _cwnd) {
+                    _cwndCount = 0;
+                    ++_cwnd;
+                }
+                _cwnd = std::min(_cwnd, _config.sendWindow);
+            }
+            return valid && length == 0;
+        }
+
+        // 已按序收到、可以取出的字节数
+        size_t getRecvSize() const { return _rcvSize; }
+
+        // 取出最多size字节按序收到的数据，返回取出的字节数
+        size_t recv(char *buf, size_t size) {
+            size_t copied = 0;
+            while (copied < size && !_rcvQueue.empty()) {
+                std::vector<char> &front = _rcvQueue.front();
+                size_t n = std::min(size - copied, front.size() - _rcvOffset);
+                std::copy(front.begin() + _rcvOffset, front.begin() + _rcvOffset + n, buf + copied);
+                copied += n;
+                _rcvOffset += n;
+                if (_rcvOffset == front.size()) {
+                    _rcvQueue.pop_front();
+                    _rcvOffset = 0;
+                }
+            }
+            _rcvSize -= copied;
+            _moveReady();
+            return copied;
+        }
+
+        // 丢弃所有按序收到的数据
+        void discardRecv() {
+            do {
+                _rcvQueue.clear();
+                _rcvOffset = 0;
+                _rcvSize = 0;
+                _moveReady();
+            } while (!_rcvQueue.empty());
+        }
+
+        // 发出待发的确认、窗口内的新分片和该重传的分片
+        void flush(uint32_t now) {
+            if (!_acks.empty() && (_config.ackDelay == 0 || _acks.size() >= 2 || _diff(now, _ackSince) >= (int32_t)_config.ackDelay)) {
+                for (size_t i = 0; i < _acks.size(); ++i) {
+                    _appendSegment(Ack, _acks[i].second, _acks[i].first, nullptr, 0);
+                }
+                _acks.clear();
+            }
+
+            // 对方窗口为0时仍放行一个分片，兼作探测
+            uint32_t cwnd = std::min<uint32_t>(_config.sendWindow, _rmtWnd);
+            if (_config.congestionControl) {
+                cwnd = std::min(cwnd, _cwnd);
+            }
+            cwnd = std::max<uint32_t>(cwnd, 1);
+            while (!_sndQueue.empty() && _diff(_sndNxt, _sndUna + cwnd) < 0) {
+                _sndBuf.push_back(std::move(_sndQueue.front()));
+                _sndQueue.pop_front();
+                _sndBuf.back().sn = _sndNxt++;
+            }
+
+            bool lost = false, fast = false;
+            for (std::deque<_Segment>::iterator it = _sndBuf.begin(); it != _sndBuf.end(); ++it) {
+                _Segment &seg = *it;
+                bool needSend = false;
+                if (seg.xmit == 0) {
+                    needSend = true;
+                    seg.rto = _rxRto;
+                    seg.resendTs = now + seg.rto;
+                }
+                else if (_diff(now, seg.resendTs) >= 0) {
+                    needSend = true;
+                    lost = true;
+                    ++_stats.timeoutRetransmits;
+                    seg.rto += _config.rtoBackoff ? std::max(seg.rto, _rxRto) : seg.rto / 2;
+                    seg.resendTs = now + seg.rto;
+                }
+                else if (_config.fastResend != 0 && seg.fastack >= _config.fastResend) {
+                    needSend = true;
+                    fast = true;
+                    ++_stats.fastRetransmits;
+                    seg.fastack = 0;
+                    seg.resendTs = now + seg.rto;
+                }
+
+                if (needSend) {
+                    ++seg.xmit;
+                    seg.ts = now;
+                    ++_stats.sentSegments;
+                    _appendSegment(Push, seg.ts, seg.sn, seg.data.data(), seg.data.size());
+                    if (seg.xmit >= _config.deadLink) {
+                        _dead = true;
+                    }
+                }
+            }
+            _flushBuffer();
+
+            if (_config.congestionControl) {
+                if (fast) {
+                    _ssthresh = std::max<uint32_t>((_sndNxt - _sndUna) / 2, 2);
+                    _cwnd = _ssthresh + _config.fastResend;
+                }
+                if (lost) {
+                    _ssthresh = std::max<uint32_t>(_cwnd / 2, 2);
+                    _cwnd = 1;
+                }
+            }
+        }
+
+        // 立即发出一个Close分片
+        void sendClose() {
+            _appendSegment(Close, 0, 0, nullptr, 0);
+            _flushBuffer();
+        }
+
+        // 有分片发送了deadLink次仍未确认
+        bool isDead() const { return _dead; }
+
+        // 对方发来了Close
+        bool isClosedByPeer() const { return _peerClosed; }
+
+        // 还没发出和还没被确认的分片数、字节数
+        size_t getPendingSegments() const { return _sndQueue.size() + _sndBuf.size(); }
+        size_t getPendingBytes() const { return _sndBytes; }
+
+        // 下一个按序应到的sn、最早的未确认分片，分别随按序收到数据、对方确认而前进
+        uint32_t getRecvNext() const { return _rcvNxt; }
+        uint32_t getSendUna() const { return _sndUna; }
+
+        ReliableStats getStats() const {
+            ReliableStats stats = _stats;
+            stats.srtt = _srtt;
+            stats.rto = _rxRto;
+            return stats;
+        }
+
+    private:
+        struct _Segment {
+            uint32_t sn = 0;
+            uint32_t ts = 0;  // 最近一次发出的时刻
+            uint32_t resendTs = 0;  // 到这个时刻仍未确认则超时重传
+            uint32_t rto = 0;
+            uint32_t fastack = 0;  // 被后面的分片的确认越过的次数
+            uint32_t xmit = 0;  // 发送次数
+            std::vector<char> data;
+        };
+
+        static int32_t _diff(uint32_t later, uint32_t earlier) {
+            return (int32_t)(later - earlier);
+        }
+
+        static void _putUint32(char *p, uint32_t value) {
+            p[0] = (char)((value >>  0) & 0xFF);
+            p[1] = (char)((value >>  8) & 0xFF);
+            p[2] = (char)((value >> 16) & 0xFF);
+            p[3] = (char)((value >> 24) & 0xFF);
+        }
+
+        static uint32_t _getUint32(const char *p) {
+            const unsigned char *u = (const unsigned char *)p;
+            return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+        }
+
+        // 接收窗口中还空着的分片数
+        uint16_t _unusedWindow() const {
+            return _rcvQueue.size() < _config.recvWindow ? (uint16_t)std::min<size_t>(_config.recvWindow - _rcvQueue.size(), 0xFFFF) : 0;
+        }
+
+        // 追加一个分片到待发的数据报，放不下时先发出已有的
+        void _appendSegment(Command cmd, uint32_t ts, uint32_t sn, const char *data, size_t length) {
+            if (_buffer.size() + HeaderSize + length > _config.mtu) {
+                _flushBuffer();
+            }
+            size_t offset = _buffer.size();
+            _buffer.resize(offset + HeaderSize + length);
+            char *p = &_buffer[offset];
+            uint16_t wnd = _unusedWindow();
+            _putUint32(p, _conv);
+            p[4] = (char)cmd;
+            p[5] = '\0';
+            p[6] = (char)(wnd & 0xFF);
+            p[7] = (char)(wnd >> 8);
+            _putUint32(p + 8, ts);
+            _putUint32(p + 12, sn);
+            _putUint32(p + 16, _rcvNxt);
+            _putUint32(p + 20, (uint32_t)length);
+            if (length > 0) {
+                std::copy(data, data + length, p + HeaderSize);
+            }
+        }
+
+        void _flushBuffer() {
+            if (!_buffer.empty()) {
+                _output(_buffer.data(), _buffer.size());
+                _buffer.clear();
+            }
+        }
+
+        // 对方已按序收到una之前的所有分片
+        void _parseUna(uint32_t una) {
+            while (!_sndBuf.empty() && _diff(una, _sndBuf.front().sn) > 0) {
+                _sndBytes -= _sndBuf.front().data.size();
+                _sndBuf.pop_front();
+            }
+            _sndUna = _sndBuf.empty() ? _sndNxt : _sndBuf.front().sn;
+        }
+
+        void _parseAck(uint32_t sn) {
+            if (_diff(sn, _sndUna) < 0 || _diff(sn, _sndNxt) >= 0) {
+                return;
+            }
+            for (std::deque<_Segment>::iterator it = _sndBuf.begin(); it != _sndBuf.end(); ++it) {
+                if (it->sn == sn) {
+                    _sndBytes -= it->data.size();
+                    _sndBuf.erase(it);
+                    break;
+                }
+                if (_diff(sn, it->sn) < 0) {
+                    break;
+                }
+            }
+            _sndUna = _sndBuf.empty() ? _sndNxt : _sndBuf.front().sn;
+        }
+
+        // sn之前还没确认的分片都被越过了一次
+        void _parseFastack(uint32_t sn) {
+            for (std::deque<_Segment>::iterator it = _sndBuf.begin(); it != _sndBuf.end() && _diff(sn, it->sn) > 0; ++it) {
+                ++it->fastack;
+            }
+        }
+
+        // 按RFC 6298估计RTO
+        void _updateRtt(uint32_t rtt) {
+            if (_srtt == 0) {
+                _srtt = std::max<uint32_t>(rtt, 1);
+                _rttVar = rtt / 2;
+            }
+            else {
+                uint32_t delta = rtt > _srtt ? rtt - _srtt : _srtt - rtt;
+                _rttVar = (3 * _rttVar + delta) / 4;
+                _srtt = std::max<uint32_t>((7 * _srtt + rtt) / 8, 1);
+            }
+            uint32_t rto = _srtt + std::max(_config.interval, 4 * _rttVar);
+            _rxRto = std::min<uint32_t>(std::max(rto, _config.minRto), 60000);
+        }
+
+        // 把按序到达的分片移入接收队列
+        void _moveReady() {
+            while (_rcvQueue.size() < _config.recvWindow) {
+                std::unordered_map<uint32_t, std::vector<char> >::iterator it = _rcvBuf.find(_rcvNxt);
+                if (it == _rcvBuf.end()) {
+                    break;
+                }
+                _rcvSize += it->second.size();
+                _rcvQueue.push_back(std::move(it->second));
+                _rcvBuf.erase(it);
+                ++_rcvNxt;
+            }
+        }
+
+        uint32_t _conv;
+        ReliableConfig _config;
+        OutputFunction _output;
+        std::vector<char> _buffer;  // 正在组的数据报
+
+        std::deque<_Segment> _sndQueue;  // 还没进入发送窗口的分片
+        std::deque<_Segment> _sndBuf;  // 已发出、还没确认的分片，按sn排序
+        size_t _sndBytes = 0;  // _sndQueue和_sndBuf中的字节数
+        uint32_t _sndUna = 0;  // 最早的未确认分片
+        uint32_t _sndNxt = 0;  // 下一个分片的sn
+        uint32_t _rmtWnd;
+        uint32_t _cwnd;
+        uint32_t _ssthresh;
+        uint32_t _cwndCount = 0;
+
+        std::unordered_map<uint32_t, std::vector<char> > _rcvBuf;  // 乱序到达的分片
+        std::deque<std::vector<char> > _rcvQueue;  // 按序到达、还没取出的分片
+        size_t _rcvOffset = 0;  // 第一个分片已取出的字节数
+        size_t _rcvSize = 0;
+        uint32_t _rcvNxt = 0;  // 下一个按序应到的sn
+        std::vector<std::pair<uint32_t, uint32_t> > _acks;  // 待发的确认：sn, ts
+        uint32_t _ackSince = 0;  // 最早的待发确认产生的时刻
+
+        uint32_t _srtt = 0;
+        uint32_t _rttVar = 0;
+        uint32_t _rxRto;
+        bool _dead = false;
+        bool _peerClosed = false;
+        ReliableStats _stats;
+    };
+
+    // 丢包和延迟的参数
+    struct LossPolicy {
+        double lossRate;  // 每个数据报被丢弃的概率
+        uint32_t latency;  // 单向延迟（毫秒）
+        uint32_t jitter;  // 延迟在latency上下jitter毫秒内均匀分布，因此数据报可能乱序
+
+        LossPolicy() : lossRate(0.0), latency(0), jitter(0) { }
+
+        bool isEnabled() const { return lossRate > 0.0 || latency > 0 || jitter > 0; }
+    };
+
+    // 在发出一方模拟丢包和延迟的网络，用于在本机上测试和对比（回环上不会丢包，测试环境也未必能用tc netem）
+    // 随机数由seed决定，同样的seed和同样的发送顺序丢掉同样的数据报
+    // 只在构造时指定的io_service的线程上使用
+    class LossSimulator {
+    public:
+        LossSimulator(const LossSimulator &) = delete;
+        LossSimulator &operator=(const LossSimulator &) = delete;
+
+        typedef std::function<void (const char *, size_t, const asio::ip::udp::endpoint &)> SendFunction;
+
+        LossSimulator(asio::io_service &service, const LossPolicy &policy, uint32_t seed, const SendFunction &send)
+            : _policy(policy), _rng(seed), _timer(service), _send(send) {
+        }
+
+        void submit(const char *data, size_t length, const asio::ip::udp::endpoint &to) {
+            ++_submitted;
+            if (_policy.lossRate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(_rng) < _policy.lossRate) {
+                ++_dropped;
+                return;
+            }
+            int64_t delay = _policy.latency;
+            if (_policy.jitter > 0) {
+                delay += std::uniform_int_distribution<int64_t>(-(int64_t)_policy.jitter, (int64_t)_policy.jitter)(_rng);
+            }
+            if (delay <= 0) {
+                _send(data, length, to);
+                return;
+            }
+
+            std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+            bool earliest = _pending.empty() || due < _pending.begin()->first;
+            _pending.insert(std::make_pair(due, std::make_pair(std::vector<char>(data, data + length), to)));
+            if (earliest) {
+                _arm();
+            }
+        }
+
+        // 丢弃所有延迟中的数据报
+        void cancel() {
+            std::error_code ec;
+            _timer.cancel(ec);
+            _pending.clear();
+        }
+
+        uint64_t getSubmitted() const { return _submitted; }
+        uint64_t getDropped() const { return _dropped; }
+
+    private:
+        void _arm() {
+            _timer.expires_at(_pending.begin()->first);
+            _timer.async_wait([this](std::error_code ec) {
+                if (!ec) {
+                    _release();
+                }
+            });
+        }
+
+        void _release() {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            while (!_pending.empty() && _pending.begin()->first <= now) {
+                const std::pair<std::vector<char>, asio::ip::udp::endpoint> &datagram = _pending.begin()->second;
+                _send(datagram.first.data(), datagram.first.size(), datagram.second);
+                _pending.erase(_pending.begin());
+            }
+            if (!_pending.empty()) {
+                _arm();
+            }
+        }
+
+        LossPolicy _policy;
+        std::mt19937 _rng;
+        asio::steady_timer _timer;
+        SendFunction _send;
+        std::multimap<std::chrono::steady_clock::time_point, std::pair<std::vector<char>, asio::ip::udp::endpoint> > _pending;
+        uint64_t _submitted = 0;
+        uint64_t _dropped = 0;
+    };
+
+    // 可靠UDP服务端的统计
+    struct ReliableServerStats {
+        size_t peers;
+        uint64_t receivedDatagrams;
+        uint64_t sentDatagrams;
+        uint64_t rejectedHandshakes;  // 准入控制拒绝的握手数据报数，客户端会重发
+        uint64_t overflows;  // 因还没被确认的数据超过ReliableConfig::maxPending被断开的连接数
+        ReliableStats channels;  // 所有连接（含已断开的）的累计
+    };
+
+    // 可靠UDP的服务端：一个UDP socket上的所有客户端，以conv区分，conv由客户端随机选取
+    // 客户端的第一批数据分片建立连接（见ReliableChannel::isHandshake），设置了准入控制时须先取得名额，没取得的丢弃，由客户端重发
+    // 地址变化（如移动网络切换）时，来自新地址的数据报须格式正确且使按序收到的数据或对方的确认前进，连接才跟随新地址；
+    // 来自其他地址的Close被忽略，以免伪造的数据报改变或断开连接
+    // 连接上传输的字节流与TCP连接上完全相同（4字节包头 + 包体），收到的包体和连接的建立、断开以LinkFrame回调，
+    // 与网关的上游连接（UpstreamLink）一样，因此上层可以用同一套代码创建经转发的会话（BasicSession::startRelay），_Session为会话的类型
+    // 所有收发和定时flush都在构造时指定的io_service上进行；relaySend/relayClose可以在任意线程调用，有数据要发时立即投递一次flush
+    template <class _Session>
+    class ReliableUdpServer : public RelaySessionMap<_Session>, public std::enable_shared_from_this<ReliableUdpServer<_Session> > {
+    public:
+        ReliableUdpServer<_Session>(const ReliableUdpServer<_Session> &) = delete;
+        ReliableUdpServer<_Session> &operator=(const ReliableUdpServer<_Session> &) = delete;
+
+        // 在io_service的线程上调用，data[length]为'\0'
+        //   Open：新客户端，内容为客户端的"IP:端口"
+        //   Data：客户端的一个包体（不含包头）
+        //   Close：客户端断开或长时间不回应，之后不再回调这个id
+        typedef std::function<void (ReliableUdpServer<_Session> &, uint32_t, LinkFrame, const char *, size_t)> PeerCallback;
+
+        // 在port上收发，失败时抛出异常；loss不为空时发出的数据报经LossSimulator，仅用于测试
+        // 连接数达到maxPeers后不再接受新的客户端
+        ReliableUdpServer<_Session>(asio::io_service &service, unsigned short port, const ReliableConfig &config = ReliableConfig(),
+            const LossPolicy &loss = LossPolicy(), size_t maxPeers = 8192)
+            : _socket(service, asio::ip::udp::endpoint(asio::ip::udp::v4(), port)), _timer(service), _config(config), _maxPeers(maxPeers), _recvBuf(65536) {
+            if (loss.isEnabled()) {
+                _simulator.reset(new LossSimulator(service, loss, port, [this](const char *data, size_t length, const asio::ip::udp::endpoint &to) {
+                    _rawSend(data, length, to);
+                }));
+            }
+        }
+
+        ~ReliableUdpServer<_Session>() {
+            LOG_DEBUG("ReliableUdpServer<_Session>::~ReliableUdpServer<_Session>");
+        }
+
+        // 新客户端的握手经过admission（不排队），取得的名额由上层在Open回调中用takeTicket取走，否则随连接移除归还
+        // 在start之前调用
+        void setAdmissionControl(const std::shared_ptr<AdmissionControl> &admission) { _admission = admission; }
+
+        // 开始收发，只调用一次
+        void start(const PeerCallback &callback) {
+            _callback = callback;
+            _doReceive();
+            _scheduleTick();
+        }
+
+        // 关闭socket，不再回调；连接上的会话由上层断开
+        void stop() {
+            // 会话持有本对象，解除映射即断开引用环
+            this->unbindAll();
+            std::shared_ptr<ReliableUdpServer<_Session> > thiz = this->shared_from_this();
+            _socket.get_io_service().post([thiz]() {
+                thiz->_stopped = true;
+                std::error_code ec;
+                thiz->_timer.cancel(ec);
+                thiz->_socket.close(ec);
+                if (thiz->_simulator) {
+                    thiz->_simulator->cancel();
+                }
+                std::lock_guard<jw::QuickMutex> g(thiz->_peersMutex);
+                (void)g;
+                thiz->_peers.clear();
+            });
+        }
+
+        asio::io_service &getIOService() { return _socket.get_io_service(); }
+
+        unsigned short getLocalPort() const {
+            std::error_code ec;
+            return _socket.local_endpoint(ec).port();
+        }
+
+        ReliableServerStats getStats() {
+            ReliableServerStats stats;
+            stats.receivedDatagrams = _receivedDatagrams;
+            stats.sentDatagrams = _sentDatagrams;
+            stats.rejectedHandshakes = _rejectedHandshakes;
+            stats.overflows = _overflows;
+            std::lock_guard<jw::QuickMutex> g(_peersMutex);
+            (void)g;
+            stats.peers = _peers.size();
+            stats.channels = _closedStats;
+            for (typename std::unordered_map<uint32_t, std::shared_ptr<_Peer> >::iterator it = _peers.begin(); it != _peers.end(); ++it) {
+                std::lock_guard<jw::QuickMutex> g(it->second->mutex);
+                (void)g;
+                stats.channels.accumulate(it->second->channel->getStats());
+            }
+            return stats;
+        }
+
+        // 取走连接id握手时取得的准入名额，在Open回调中调用
+        AdmissionTicket takeTicket(uint32_t id) {
+            AdmissionTicket ticket;
+            std::shared_ptr<_Peer> peer = _findPeer(id);
+            if (peer != nullptr) {
+                std::lock_guard<jw::QuickMutex> g(peer->mutex);
+                (void)g;
+                std::swap(ticket, peer->ticket);
+            }
+            return ticket;
+        }
+
+        // RelayChannel，会话发给客户端的数据，追加到连接的发送队列
+        // 还没被确认的数据超过maxPending时（客户端长时间不确认）不再追加，断开连接，与TCP连接的发送队列超过硬上限一样
+        virtual void relaySend(uint32_t id, const std::vector<asio::const_buffer> &buffers) override {
+            std::shared_ptr<_Peer> peer = _findPeer(id);
+            if (peer == nullptr) {
+                return;
+            }
+            bool post = false, overflow = false;
+            {
+                std::lock_guard<jw::QuickMutex> g(peer->mutex);
+                (void)g;
+                if (peer->overflowed) {
+                    return;
+                }
+                size_t bytes = asio::buffer_size(buffers);
+                if (_config.maxPending != 0 && peer->channel->getPendingBytes() + bytes > _config.maxPending) {
+                    peer->overflowed = true;
+                    overflow = true;
+                }
+                else {
+                    for (size_t i = 0; i < buffers.size(); ++i) {
+                        peer->channel->send(asio::buffer_cast<const char *>(buffers[i]), asio::buffer_size(buffers[i]));
+                    }
+                    post = !peer->flushPosted;
+                    peer->flushPosted = true;
+                }
+            }
+            if (overflow) {
+                ++_overflows;
+                LOG_WARN("reliable udp peer %u is not acknowledging, disconnect", id);
+                std::shared_ptr<ReliableUdpServer<_Session> > thiz = this->shared_from_this();
+                _socket.get_io_service().post([thiz, id]() {
+                    thiz->_closePeer(id, true);
+                });
+            }
+            else if (post) {
+                std::shared_ptr<ReliableUdpServer<_Session> > thiz = this->shared_from_this();
+                _socket.get_io_service().post([thiz, peer]() {
+                    thiz->_flushPeer(*peer);
+                });
+            }
+        }
+
+        // 会话断开了连接，已入队的数据发完（最多等_lingerMs）后通知客户端
+        virtual void relayClose(uint32_t id) override {
+            if (this->unbind(id) == nullptr) {
+                return;
+            }
+            std::shared_ptr<_Peer> peer = _findPeer(id);
+            if (peer != nullptr) {
+                std::lock_guard<jw::QuickMutex> g(peer->mutex);
+                (void)g;
+                if (!peer->closing) {
+                    peer->closing = true;
+                    peer->closingSince = reliableNow();
+                }
+            }
+        }
+
+    private:
+        static const uint32_t _lingerMs = 5000;
+
+        struct _Peer {
+            PacketSplitter splitter;  // 只在io_service的线程上访问
+            std::unique_ptr<ReliableChannel> channel;  // 以下由mutex保护
+            asio::ip::udp::endpoint endpoint;  // 发往的地址，channel发出数据报时使用
+            AdmissionTicket ticket;  // 握手时取得的准入名额，交给上层之前由连接持有
+            bool flushPosted = false;
+            bool closing = false;  // 上层已断开，发完即关闭
+            bool overflowed = false;  // 还没被确认的数据超过上限，即将断开
+            uint32_t closingSince = 0;
+            jw::QuickMutex mutex;
+        };
+
+        std::shared_ptr<_Peer> _findPeer(uint32_t conv) {
+            std::lock_guard<jw::QuickMutex> g(_peersMutex);
+            (void)g;
+            typename std::unordered_map<uint32_t, std::shared_ptr<_Peer> >::iterator it = _peers.find(conv);
+            return it != _peers.end() ? it->second : std::shared_ptr<_Peer>();
+        }
+
+        void _rawSend(const char *data, size_t length, const asio::ip::udp::endpoint &to) {
+            if (_stopped) {
+                return;
+            }
+            // 发送缓冲区满时丢弃，由重传补上
+            std::error_code ec;
+            _socket.send_to(asio::buffer(data, length), to, 0, ec);
+            ++_sentDatagrams;
+        }
+
+        void _sendTo(const char *data, size_t length, const asio::ip::udp::endpoint &to) {
+            if (_simulator) {
+                _simulator->submit(data, length, to);
+            }
+            else {
+                _rawSend(data, length, to);
+            }
+        }
+
+        void _doReceive() {
+            std::shared_ptr<ReliableUdpServer<_Session> > thiz = this->shared_from_this();
+            _socket.async_receive_from(asio::buffer(_recvBuf), _recvFrom, [thiz](std::error_code ec, size_t length) {
+                if (thiz->_stopped || ec == asio::error::operation_aborted) {
+                    return;
+                }
+                // 其它错误（如Windows上对端端口不可达）只影响这一次接收
+                if (!ec) {
+                    ++thiz->_receivedDatagrams;
+                    thiz->_onDatagram(&thiz->_recvBuf[0], length, thiz->_recvFrom);
+                }
+                thiz->_doReceive();
+            });
+        }
+
+        void _onDatagram(const char *data, size_t length, const asio::ip::udp::endpoint &from) {
+            uint32_t conv;
+            if (!ReliableChannel::peekConv(data, length, conv)) {
+                return;
+            }
+
+            std::shared_ptr<_Peer> peer = _findPeer(conv);
+            if (peer == nullptr) {
+                if (!ReliableChannel::isHandshake(data, length, _config.recvWindow)) {
+                    // 不认识的连接（如服务器重启过），让客户端断开重连；不回复Close，以免两端互相回复
+                    if ((uint8_t)data[4] == ReliableChannel::Close) {
+                        return;
+                    }
+                    std::vector<char> close = ReliableChannel::encodeClose(conv);
+                    _sendTo(close.data(), close.size(), from);
+                    return;
+                }
+                AdmissionTicket ticket;
+                if (_admission != nullptr) {
+                    if (!_admission->onHandshake(from.address())) {
+                        ++_rejectedHandshakes;
+                        return;
+                    }
+                    ticket = _admission->makeTicket(from.address());
+                }
+                peer = _addPeer(conv, from, ticket);
+                if (peer == nullptr) {
+                    return;
+                }
+                char address[64];
+                snprintf(address, sizeof(address), "%s:%hu", from.address().to_string().c_str(), from.port());
+                _callback(*this, conv, LinkFrame::Open, address, strlen(address));
+            }
+
+            // 回调可能再调用relaySend，须在锁外
+            bool valid, peerClosed, closing;
+            {
+                std::lock_guard<jw::QuickMutex> g(peer->mutex);
+                (void)g;
+                uint32_t now = reliableNow();
+                bool known = from == peer->endpoint;
+                uint32_t recvNext = peer->channel->getRecvNext(), sendUna = peer->channel->getSendUna();
+                valid = peer->channel->input(data, length, now, known);
+                if (!known && valid && (peer->channel->getRecvNext() != recvNext || peer->channel->getSendUna() != sendUna)) {
+                    LOG_DEBUG("reliable udp peer %u moved to %s:%hu", conv, from.address().to_string().c_str(), from.port());
+                    peer->endpoint = from;
+                }
+                size_t size = peer->channel->getRecvSize();
+                if (peer->closing) {
+                    // 上层已断开，收到的数据不再交给splitter
+                    peer->channel->discardRecv();
+                }
+                else if (size > 0) {
+                    std::pair<char *, size_t> buf = peer->splitter.prepareRecvBuffer(size);
+                    peer->splitter.commitRecvBuffer(peer->channel->recv(buf.first, size));
+                }
+                // 立即回复确认
+                peer->channel->flush(now);
+                peerClosed = peer->channel->isClosedByPeer();
+                closing = peer->closing;
+            }
+            if (!valid) {
+                LOG_DEBUG("malformed datagram from %s:%hu", from.address().to_string().c_str(), from.port());
+            }
+            if (peerClosed) {
+                _closePeer(conv, !closing);
+                return;
+            }
+            if (closing) {
+                // 上层已断开的连接不再回调数据
+                return;
+            }
+
+            bool ok = peer->splitter.splitRecvPackets([this, conv](const char *data, size_t length) {
+                _callback(*this, conv, LinkFrame::Data, data, length);
+            });
+            if (!ok) {
+                _closePeer(conv, true);
+            }
+        }
+
+        std::shared_ptr<_Peer> _addPeer(uint32_t conv, const asio::ip::udp::endpoint &from, const AdmissionTicket &ticket) {
+            std::shared_ptr<_Peer> peer = std::make_shared<_Peer>();
+            _Peer *p = peer.get();
+            peer->endpoint = from;
+            peer->ticket = ticket;
+            peer->channel.reset(new ReliableChannel(conv, _config, [this, p](const char *data, size_t length) {
+                _sendTo(data, length, p->endpoint);
+            }));
+            std::lock_guard<jw::QuickMutex> g(_peersMutex);
+            (void)g;
+            if (_peers.size() >= _maxPeers) {
+                LOG_WARN("too many reliable udp peers, drop %s:%hu", from.address().to_string().c_str(), from.port());
+                return std::shared_ptr<_Peer>();
+            }
+            _peers[conv] = peer;
+            return peer;
+        }
+
+        // 移除连接并通知客户端；notify为true时回调Close
+        void _closePeer(uint32_t conv, bool notify) {
+            std::shared_ptr<_Peer> peer;
+            {
+                std::lock_guard<jw::QuickMutex> g(_peersMutex);
+                (void)g;
+                typename std::unordered_map<uint32_t, std::shared_ptr<_Peer> >::iterator it = _peers.find(conv);
+                if (it == _peers.end()) {
+                    return;
+                }
+                peer.swap(it->second);
+                _peers.erase(it);
+                std::lock_guard<jw::QuickMutex> g2(peer->mutex);
+                (void)g2;
+                _closedStats.accumulate(peer->channel->getStats());
+                if (!peer->channel->isClosedByPeer()) {
+                    peer->channel->sendClose();
+                }
+            }
+            if (notify) {
+                _callback(*this, conv, LinkFrame::Close, "", 0);
+            }
+        }
+
+        void _flushPeer(_Peer &peer) {
+            std::lock_guard<jw::QuickMutex> g(peer.mutex);
+            (void)g;
+            peer.flushPosted = false;
+            if (!_stopped) {
+                peer.channel->flush(reliableNow());
+            }
+        }
+
+        void _scheduleTick() {
+            std::shared_ptr<ReliableUdpServer<_Session> > thiz = this->shared_from_this();
+            _timer.expires_from_now(std::chrono::milliseconds(_config.interval));
+            _timer.async_wait([thiz](std::error_code ec) {
+                if (!ec && !thiz->_stopped) {
+                    thiz->_tick();
+                    thiz->_scheduleTick();
+                }
+            });
+        }
+
+        // 定时flush所有连接，处理超时重传，移除断开的连接
+        void _tick() {
+            {
+                std::lock_guard<jw::QuickMutex> g(_peersMutex);
+                (void)g;
+                _tickPeers.reserve(_peers.size());
+                for (typename std::unordered_map<uint32_t, std::shared_ptr<_Peer> >::iterator it = _peers.begin(); it != _peers.end(); ++it) {
+                    _tickPeers.push_back(it->second);
+                }
+            }
+
+            uint32_t now = reliableNow();
+            std::vector<std::pair<uint32_t, bool> > finished;
+            for (size_t i = 0; i < _tickPeers.size(); ++i) {
+                _Peer &peer = *_tickPeers[i];
+                std::lock_guard<jw::QuickMutex> g(peer.mutex);
+                (void)g;
+                peer.channel->flush(now);
+                if (peer.channel->isDead()) {
+                    finished.push_back(std::make_pair(peer.channel->getConv(), !peer.closing));
+                }
+                else if (peer.closing && (peer.channel->getPendingSegments() == 0 || now - peer.closingSince >= _lingerMs)) {
+                    finished.push_back(std::make_pair(peer.channel->getConv(), false));
+                }
+            }
+            _tickPeers.clear();
+
+            for (size_t i = 0; i < finished.size(); ++i) {
+                if (finished[i].second) {
+                    LOG_DEBUG("reliable udp peer %u timed out", finished[i].first);
+                }
+                _closePeer(finished[i].first, finished[i].second);
+            }
+        }
+
+        asio::ip::udp::socket _socket;
+        asio::steady_timer _timer;
+        ReliableConfig _config;
+        size_t _maxPeers;
+        std::unique_ptr<LossSimulator> _simulator;
+        std::shared_ptr<AdmissionControl> _admission;
+        PeerCallback _callback;
+        std::vector<char> _recvBuf;
+        asio::ip::udp::endpoint _recvFrom;
+        std::unordered_map<uint32_t, std::shared_ptr<_Peer> > _peers;
+        jw::QuickMutex _peersMutex;
+        ReliableStats _closedStats;  // 由_peersMutex保护
+        std::vector<std::shared_ptr<_Peer> > _tickPeers;  // _tick用，避免每次分配
+        std::atomic<bool> _stopped{ false };
+        std::atomic<uint64_t> _receivedDatagrams{ 0 };
+        std::atomic<uint64_t> _sentDatagrams{ 0 };
+        std::atomic<uint64_t> _rejectedHandshakes{ 0 };
+        std::atomic<uint64_t> _overflows{ 0 };
+    };
+
+    // 可靠UDP的客户端，收发与TCP连接相同格式的包，用于测试和对比
+    // 收发都在构造时指定的io_service上进行，deliver可以在任意线程调用
+    class ReliableUdpClient : public std::enable_shared_from_this<ReliableUdpClient> {
+    public:
+        ReliableUdpClient(const ReliableUdpClient &) = delete;
+        ReliableUdpClient &operator=(const ReliableUdpClient &) = delete;
+
+        // 收到一个包体，data[length]为'\0'；data为nullptr表示连接断开（服务端断开或长时间不回应），之后不再回调
+        typedef std::function<void (const char *, size_t)> RecvCallback;
+
+        ReliableUdpClient(asio::io_service &service, const ReliableConfig &config = ReliableConfig(), const LossPolicy &loss = LossPolicy(), uint32_t seed = 0)
+            : _socket(service), _timer(service), _config(config), _recvBuf(65536) {
+            if (loss.isEnabled()) {
+                _simulator.reset(new LossSimulator(service, loss, seed, [this](const char *data, size_t length, const asio::ip::udp::endpoint &to) {
+                    std::error_code ec;
+                    _socket.send_to(asio::buffer(data, length), to, 0, ec);
+                }));
+            }
+        }
+
+        // 以conv（不为0，同一服务端上唯一）连接server，失败时抛出异常，只调用一次
+        // 不需要握手，第一次deliver即建立连接
+        void connect(const asio::ip::udp::endpoint &server, uint32_t conv, const RecvCallback &callback) {
+            _server = server;
+            _callback = callback;
+            _socket.open(server.protocol());
+            _socket.bind(asio::ip::udp::endpoint(server.protocol(), 0));
+            _channel.reset(new ReliableChannel(conv, _config, [this](const char *data, size_t length) {
+                if (_simulator) {
+                    _simulator->submit(data, length, _server);
+                }
+                else {
+                    std::error_code ec;
+                    _socket.send_to(asio::buffer(data, length), _server, 0, ec);
+                }
+            }));
+            _doReceive();
+            _scheduleTick();
+        }
+
+        // 发送一个或多个带包头的包
+        void deliver(const char *data, size_t length) {
+            bool post = false;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (_closed) {
+                    return;
+                }
+                _channel->send(data, length);
+                post = !_flushPosted;
+                _flushPosted = true;
+            }
+            if (post) {
+                std::shared_ptr<ReliableUdpClient> thiz = shared_from_this();
+                _socket.get_io_service().post([thiz]() {
+                    std::lock_guard<jw::QuickMutex> g(thiz->_mutex);
+                    (void)g;
+                    thiz->_flushPosted = false;
+                    if (!thiz->_closed) {
+                        thiz->_channel->flush(reliableNow());
+                    }
+                });
+            }
+        }
+
+        void deliver(const std::vector<char> &buf) {
+            deliver(buf.data(), buf.size());
+        }
+
+        // 立即断开并通知服务端，不再回调，须在connect之后调用
+        void close() {
+            std::shared_ptr<ReliableUdpClient> thiz = shared_from_this();
+            _socket.get_io_service().post([thiz]() {
+                thiz->_finish(false);
+            });
+        }
+
+        ReliableStats getStats() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _channel ? _channel->getStats() : ReliableStats();
+        }
+
+    private:
+        void _doReceive() {
+            std::shared_ptr<ReliableUdpClient> thiz = shared_from_this();
+            _socket.async_receive_from(asio::buffer(_recvBuf), _recvFrom, [thiz](std::error_code ec, size_t length) {
+                if (thiz->_closed || ec == asio::error::operation_aborted) {
+                    return;
+                }
+                if (!ec && thiz->_recvFrom == thiz->_server) {
+                    thiz->_onDatagram(&thiz->_recvBuf[0], length);
+                }
+                if (!thiz->_closed) {
+                    thiz->_doReceive();
+                }
+            });
+        }
+
+        void _onDatagram(const char *data, size_t length) {
+            bool closed;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                uint32_t now = reliableNow();
+                _channel->input(data, length, now);
+                size_t size = _channel->getRecvSize();
+                if (size > 0) {
+                    std::pair<char *, size_t> buf = _splitter.prepareRecvBuffer(size);
+                    _splitter.commitRecvBuffer(_channel->recv(buf.first, size));
+                }
+                _channel->flush(now);
+                closed = _channel->isClosedByPeer();
+            }
+            bool ok = _splitter.splitRecvPackets([this](const char *data, size_t length) {
+                if (!_closed) {
+                    _callback(data, length);
+                }
+            });
+            if (closed || !ok) {
+                _finish(true);
+            }
+        }
+
+        void _scheduleTick() {
+            std::shared_ptr<ReliableUdpClient> thiz = shared_from_this();
+            _timer.expires_from_now(std::chrono::milliseconds(_config.interval));
+            _timer.async_wait([thiz](std::error_code ec) {
+                if (ec || thiz->_closed) {
+                    return;
+                }
+                bool dead;
+                {
+                    std::lock_guard<jw::QuickMutex> g(thiz->_mutex);
+                    (void)g;
+                    thiz->_channel->flush(reliableNow());
+                    dead = thiz->_channel->isDead();
+                }
+                if (dead) {
+                    thiz->_finish(true);
+                }
+                else {
+                    thiz->_scheduleTick();
+                }
+            });
+        }
+
+        // 在io_service的线程上调用
+        void _finish(bool notify) {
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (_closed) {
+                    return;
+                }
+                _closed = true;
+                if (!_channel->isClosedByPeer()) {
+                    _channel->sendClose();
+                }
+            }
+            std::error_code ec;
+            _timer.cancel(ec);
+            if (_simulator) {
+                // 延迟中的Close也一起丢弃，服务端靠超时发现
+                _simulator->cancel();
+            }
+            _socket.close(ec);
+            if (notify) {
+                _callback(nullptr, 0);
+            }
+        }
+
+        asio::ip::udp::socket _socket;
+        asio::steady_timer _timer;
+        ReliableConfig _config;
+        std::unique_ptr<LossSimulator> _simulator;
+        asio::ip::udp::endpoint _server;
+        RecvCallback _callback;
+        std::unique_ptr<ReliableChannel> _channel;  // 由_mutex保护
+        PacketSplitter _splitter;  // 只在io_service的线程上访问
+        std::vector<char> _recvBuf;
+        asio::ip::udp::endpoint _recvFrom;
+        bool _flushPosted = false;
+        std::atomic<bool> _closed{ false };
+        jw::QuickMutex _mutex;
+    };
+}
+
+#endif
@@ -0,0 +1,130 @@
+﻿#ifndef _SESSION_POOL_HPP_
+#define _SESSION_POOL_HPP_
+
+#include "asio_header.hpp"
+#include "QuickMutex.h"
+#include "IntrusivePtr.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace jw {
+
+    // 连接池的统计
+    struct SessionPoolStats {
+        uint64_t acquired;  // 取出的连接数
+        uint64_t hits;  // 其中复用空闲对象的次数
+        uint64_t released;  // 归还的连接数
+        uint64_t discarded;  // 因空闲数已满而直接释放的对象数
+        size_t idle;  // 当前空闲的对象数
+
+        double hitRate() const { return acquired != 0 ? (double)hits / acquired : 0.0; }
+    };
+
+    // 会话对象池，连接断开后对象连同其中的缓冲区回收，下次accept时复用，减少频繁断线重连时的分配和内存碎片
+    // _Session须提供：
+    //   构造函数_Session(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback)
+    //   void reuse(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback)，重新绑定连接
+    //   void recycle()，关闭连接并丢弃未发送的数据
+    //   void setRecycler(const std::shared_ptr<ObjectRecycler<_Session> > &)，引用计数归零时交给回收者
+    // 取出的会话最后一个引用释放时回到池中，池本身可以先于这些会话销毁
+    template <class _Session>
+    class SessionPool {
+    public:
+        SessionPool<_Session>(const SessionPool<_Session> &) = delete;
+        SessionPool<_Session> &operator=(const SessionPool<_Session> &) = delete;
+
+        typedef IntrusivePtr<_Session> SessionPtr;
+
+        // maxIdle为最多保留的空闲对象数
+        explicit SessionPool<_Session>(size_t maxIdle = 4096U) : _impl(std::make_shared<_Impl>(maxIdle)) {
+        }
+
+        template <class _Callable>
+        SessionPtr acquire(asio::ip::tcp::socket &&socket, _Callable &&sessionCallback) {
+            _Session *s = _impl->take();
+            if (s != nullptr) {
+                s->reuse(std::move(socket), sessionCallback);
+            }
+            else {
+                s = new _Session(std::move(socket), sessionCallback);
+            }
+
+            s->setRecycler(_impl);
+            return SessionPtr(s);
+        }
+
+        SessionPoolStats getStats() const {
+            SessionPoolStats stats;
+            stats.acquired = _impl->acquired;
+            stats.hits = _impl->hits;
+            stats.released = _impl->released;
+            stats.discarded = _impl->discarded;
+            stats.idle = _impl->getIdleCount();
+            return stats;
+        }
+
+    private:
+        // 空闲列表，由池和所有取出的会话共同持有
+        struct _Impl : ObjectRecycler<_Session> {
+            std::vector<_Session *> idleList;
+            size_t maxIdle;
+            jw::QuickMutex mutex;
+            std::atomic<uint64_t> acquired{ 0 };
+            std::atomic<uint64_t> hits{ 0 };
+            std::atomic<uint64_t> released{ 0 };
+            std::atomic<uint64_t> discarded{ 0 };
+
+            explicit _Impl(size_t maxIdle) : maxIdle(maxIdle) {
+                idleList.reserve(maxIdle);
+            }
+
+            ~_Impl() {
+                for (typename std::vector<_Session *>::iterator it = idleList.begin(); it != idleList.end(); ++it) {
+                    delete *it;
+                }
+            }
+
+            _Session *take() {
+                ++acquired;
+                std::lock_guard<jw::QuickMutex> g(mutex);
+                (void)g;
+                if (idleList.empty()) {
+                    return nullptr;
+                }
+                ++hits;
+                _Session *s = idleList.back();
+                idleList.pop_back();
+                return s;
+            }
+
+            virtual void giveBack(_Session *s) override {
+                ++released;
+                s->recycle();
+                {
+                    std::lock_guard<jw::QuickMutex> g(mutex);
+                    (void)g;
+                    if (idleList.size() < maxIdle) {
+                        idleList.push_back(s);
+                        return;
+                    }
+                }
+                ++discarded;
+                delete s;
+            }
+
+            size_t getIdleCount() {
+                std::lock_guard<jw::QuickMutex> g(mutex);
+                (void)g;
+                return idleList.size();
+            }
+        };
+
+        std::shared_ptr<_Impl> _impl;
+    };
+}
+
+#endif
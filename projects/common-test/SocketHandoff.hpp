@@ -0,0 +1,238 @@
+﻿#ifndef _SOCKET_HANDOFF_HPP_
+#define _SOCKET_HANDOFF_HPP_
+
+#include "DebugConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__linux__)
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <poll.h>
+#   include <unistd.h>
+#   include <errno.h>
+#   include <string.h>
+#endif
+
+namespace jw {
+
+    // 在进程间交接socket：通过Unix域socket以SCM_RIGHTS传递文件描述符，附带一段任意内容
+    // 一条消息为：8字节头（内容长度、fd个数，各4字节小端），内容，然后每批最多_MaxFdsPerChunk个fd各随1个字节发送
+    // 仅Linux，其他平台上所有函数都失败
+    // 函数都是阻塞的，timeoutMs为0表示不限时
+
+#if defined(__linux__)
+
+    static const size_t _MaxFdsPerChunk = 250U;  // 小于内核的SCM_MAX_FD（253）
+
+    // 在path上监听，已存在的同名文件先删除，失败时返回-1
+    inline int listenHandoffSocket(const std::string &path) {
+        sockaddr_un addr;
+        if (path.length() >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.length());
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    inline int connectHandoffSocket(const std::string &path) {
+        sockaddr_un addr;
+        if (path.length() >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.length());
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // 等待可读，超时返回false
+    inline bool _waitHandoffReadable(int sock, int timeoutMs) {
+        if (timeoutMs == 0) {
+            return true;
+        }
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret;
+        do {
+            ret = poll(&pfd, 1, timeoutMs);
+        } while (ret < 0 && errno == EINTR);
+        return ret > 0;
+    }
+
+    inline bool _sendAll(int sock, const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            length -= (size_t)n;
+        }
+        return true;
+    }
+
+    // 不会读到后面带fd的字节：调用者总是按头中的长度精确地读
+    inline bool _recvAll(int sock, char *data, size_t length, int timeoutMs) {
+        while (length > 0) {
+            if (!_waitHandoffReadable(sock, timeoutMs)) {
+                return false;
+            }
+            ssize_t n = recv(sock, data, length, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            length -= (size_t)n;
+        }
+        return true;
+    }
+
+    // 发送一条消息，fds在本进程中仍然有效，由调用者关闭
+    inline bool sendHandoffMessage(int sock, const std::string &payload, const std::vector<int> &fds) {
+        unsigned char header[8];
+        uint32_t length = (uint32_t)payload.length();
+        uint32_t count = (uint32_t)fds.size();
+        for (int i = 0; i < 4; ++i) {
+            header[i] = (unsigned char)(length >> (i * 8));
+            header[4 + i] = (unsigned char)(count >> (i * 8));
+        }
+        if (!_sendAll(sock, (const char *)header, sizeof(header)) || !_sendAll(sock, payload.data(), payload.length())) {
+            return false;
+        }
+
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * _MaxFdsPerChunk));
+        for (size_t sent = 0; sent < fds.size(); ) {
+            size_t chunk = std::min(fds.size() - sent, _MaxFdsPerChunk);
+            char byte = 'F';
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * chunk);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * chunk);
+            memcpy(CMSG_DATA(cmsg), &fds[sent], sizeof(int) * chunk);
+
+            ssize_t n;
+            do {
+                n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+            if (n != 1) {
+                LOG_ERROR("sendmsg SCM_RIGHTS failed: %d", errno);
+                return false;
+            }
+            sent += chunk;
+        }
+        return true;
+    }
+
+    // 接收一条消息，收到的fd带有FD_CLOEXEC，归调用者所有；失败时已收到的fd都被关闭
+    inline bool recvHandoffMessage(int sock, std::string &payload, std::vector<int> &fds, int timeoutMs = 0) {
+        fds.clear();
+        unsigned char header[8];
+        if (!_recvAll(sock, (char *)header, sizeof(header), timeoutMs)) {
+            return false;
+        }
+        uint32_t length = 0, count = 0;
+        for (int i = 0; i < 4; ++i) {
+            length |= (uint32_t)header[i] << (i * 8);
+            count |= (uint32_t)header[4 + i] << (i * 8);
+        }
+        payload.resize(length);
+        if (length > 0 && !_recvAll(sock, &payload[0], length, timeoutMs)) {
+            return false;
+        }
+
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * _MaxFdsPerChunk));
+        bool ok = true;
+        while (ok && fds.size() < count) {
+            if (!_waitHandoffReadable(sock, timeoutMs)) {
+                ok = false;
+                break;
+            }
+            char byte;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = control.size();
+            ssize_t n;
+            do {
+                n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            } while (n < 0 && errno == EINTR);
+            if (n != 1 || (msg.msg_flags & MSG_CTRUNC) != 0) {
+                ok = false;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    size_t offset = fds.size();
+                    fds.resize(offset + received);
+                    memcpy(&fds[offset], CMSG_DATA(cmsg), sizeof(int) * received);
+                }
+            }
+        }
+
+        if (!ok || fds.size() != count) {
+            LOG_ERROR("handoff message truncated: %lu of %u fds", (unsigned long)fds.size(), count);
+            for (size_t i = 0; i < fds.size(); ++i) {
+                ::close(fds[i]);
+            }
+            fds.clear();
+            return false;
+        }
+        return true;
+    }
+
+#else
+
+    inline int listenHandoffSocket(const std::string &) { return -1; }
+    inline int connectHandoffSocket(const std::string &) { return -1; }
+    inline bool sendHandoffMessage(int, const std::string &, const std::vector<int> &) { return false; }
+    inline bool recvHandoffMessage(int, std::string &, std::vector<int> &, int = 0) { return false; }
+
+#endif
+}
+
+#endif
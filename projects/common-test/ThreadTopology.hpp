@@ -0,0 +1,215 @@
+﻿#ifndef _THREAD_TOPOLOGY_HPP_
+#define _THREAD_TOPOLOGY_HPP_
+
+#include "DebugConfig.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <algorithm>
+
+#if defined(_WIN32)
+#   include "asio_header.hpp"  // 须先于windows.h包含winsock2.h，由asio引入
+#elif defined(__linux__)
+#   include <pthread.h>
+#   include <sched.h>
+#   include <time.h>
+#   include <unistd.h>
+#endif
+
+namespace jw {
+
+    // 一组CPU编号，为空表示不绑定
+    typedef std::vector<unsigned> CpuSet;
+
+    // CPU编号的上限（不含）：Linux下为配置的CPU数（含离线的），其他平台为硬件线程数
+    inline unsigned getCpuLimit() {
+#if defined(__linux__)
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+        if (n > 0) {
+            return (unsigned)n;
+        }
+#endif
+        unsigned hc = std::thread::hardware_concurrency();
+        return hc > 0 ? hc : 1;
+    }
+
+    // 解析"0-3,8,10-11"形式的CPU列表（Linux的cpulist格式），非法的部分和不小于getCpuLimit()的编号被忽略
+    inline CpuSet parseCpuList(const char *list) {
+        CpuSet cpus;
+        unsigned long limit = getCpuLimit();
+        const char *p = list;
+        while (*p != '\0') {
+            char *end = nullptr;
+            unsigned long first = strtoul(p, &end, 10);
+            if (end == p) {
+                ++p;
+                continue;
+            }
+            unsigned long last = first;
+            p = end;
+            if (*p == '-') {
+                last = strtoul(p + 1, &end, 10);
+                p = end;
+            }
+            for (unsigned long cpu = first; cpu <= last && cpu < limit; ++cpu) {
+                cpus.push_back((unsigned)cpu);
+            }
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return cpus;
+    }
+
+    inline std::string formatCpuList(const CpuSet &cpus) {
+        std::string str;
+        for (size_t i = 0; i < cpus.size(); ) {
+            size_t k = i;
+            while (k + 1 < cpus.size() && cpus[k + 1] == cpus[k] + 1) {
+                ++k;
+            }
+            if (!str.empty()) {
+                str += ',';
+            }
+            str += std::to_string(cpus[i]);
+            if (k != i) {
+                str += '-';
+                str += std::to_string(cpus[k]);
+            }
+            i = k + 1;
+        }
+        return str.empty() ? "*" : str;
+    }
+
+    // 把线程绑定到cpus上，cpus为空时不做任何事；不支持的平台返回false
+    // Windows下只支持前64个CPU（一个处理器组）
+    inline bool setThreadAffinity(std::thread::native_handle_type handle, const CpuSet &cpus) {
+        if (cpus.empty()) {
+            return true;
+        }
+#if defined(_WIN32)
+        DWORD_PTR mask = 0;
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            if (cpus[i] < sizeof(DWORD_PTR) * 8) {
+                mask |= (DWORD_PTR)1 << cpus[i];
+            }
+        }
+        return mask != 0 && ::SetThreadAffinityMask((HANDLE)handle, mask) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            if (cpus[i] < CPU_SETSIZE) {
+                CPU_SET(cpus[i], &set);
+            }
+        }
+        return pthread_setaffinity_np((pthread_t)handle, sizeof(set), &set) == 0;
+#else
+        (void)handle;
+        return false;
+#endif
+    }
+
+    inline bool setCurrentThreadAffinity(const CpuSet &cpus) {
+        if (cpus.empty()) {
+            return true;
+        }
+#if defined(_WIN32)
+        return setThreadAffinity(::GetCurrentThread(), cpus);
+#elif defined(__linux__)
+        return setThreadAffinity(pthread_self(), cpus);
+#else
+        return false;
+#endif
+    }
+
+    // 线程累计占用的CPU时间（用户态加内核态，微秒），用来计算io线程的利用率；不支持的平台返回-1
+    inline int64_t getThreadCpuTime(std::thread::native_handle_type handle) {
+#if defined(_WIN32)
+        FILETIME creation, exit, kernel, user;
+        if (!::GetThreadTimes((HANDLE)handle, &creation, &exit, &kernel, &user)) {
+            return -1;
+        }
+        uint64_t ticks = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+        return (int64_t)(ticks / 10);  // 100ns为单位
+#elif defined(__linux__)
+        clockid_t clock;
+        struct timespec ts;
+        if (pthread_getcpuclockid((pthread_t)handle, &clock) != 0 || clock_gettime(clock, &ts) != 0) {
+            return -1;
+        }
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+        (void)handle;
+        return -1;
+#endif
+    }
+
+    // 各NUMA节点的CPU，Linux下读/sys/devices/system/node，其他平台或读不到时返回一个包含所有CPU的节点
+    inline std::vector<CpuSet> getNumaNodes() {
+        std::vector<CpuSet> nodes;
+#if defined(__linux__)
+        for (unsigned node = 0; ; ++node) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            FILE *fp = fopen(path, "r");
+            if (fp == nullptr) {
+                break;
+            }
+            char buf[1024];
+            size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+            fclose(fp);
+            buf[len] = '\0';
+            CpuSet cpus = parseCpuList(buf);
+            if (!cpus.empty()) {
+                nodes.push_back(cpus);
+            }
+        }
+#endif
+        if (nodes.empty()) {
+            unsigned hc = std::thread::hardware_concurrency();
+            CpuSet cpus;
+            for (unsigned cpu = 0; cpu < (hc > 0 ? hc : 1); ++cpu) {
+                cpus.push_back(cpu);
+            }
+            nodes.push_back(cpus);
+        }
+        return nodes;
+    }
+
+    // io线程和定时器线程的数量与放置
+    // 第i个io线程（按io_service依次编号，每个io_service的线程相邻）绑定到ioCpus[i % ioCpus.size()]，ioCpus为空则都不绑定
+    struct ThreadTopology {
+        size_t serviceCount;  // io_service的个数，0表示按IOServiceMode取默认值，SharedService时忽略
+        size_t threadsPerService;  // 每个io_service的线程数（SharedService时即总线程数），0表示按IOServiceMode取默认值
+        size_t maxServiceCount;  // io_service个数的上限，多出serviceCount的先不运行，由伸缩（见IOServicePool::startScaling）启用；仅用于ServicePerCore
+        std::vector<CpuSet> ioCpus;
+        CpuSet timerCpus;  // TimerEngine的线程
+        bool ioUring;  // io线程上的连接改用io_uring收发（见IOServicePool::enableUring），不支持时照常走asio
+
+        ThreadTopology() : serviceCount(0), threadsPerService(0), maxServiceCount(0), ioUring(false) { }
+
+        // 每个CPU一个io_service和一个线程，各自绑定到该CPU上
+        // 定时器线程不绑定：cpus都给了io线程，绑到其中一个上会与那个io线程争同一个CPU；需要时另行设置timerCpus
+        static ThreadTopology servicePerCpu(const CpuSet &cpus) {
+            ThreadTopology topology;
+            topology.serviceCount = cpus.size();
+            topology.threadsPerService = 1;
+            for (size_t i = 0; i < cpus.size(); ++i) {
+                topology.ioCpus.push_back(CpuSet(1, cpus[i]));
+            }
+            return topology;
+        }
+
+        // 只用第node个NUMA节点：每个CPU一个io_service和一个线程，连接的缓存、socket缓冲区都留在这个节点上
+        static ThreadTopology singleNumaNode(size_t node) {
+            std::vector<CpuSet> nodes = getNumaNodes();
+            return servicePerCpu(nodes[node < nodes.size() ? node : 0]);
+        }
+    };
+}
+
+#endif
@@ -1,5 +1,6 @@
 ﻿#include "TimerEngine.h"
 #include "DebugConfig.h"
+#include "ThreadTopology.hpp"
 #include <algorithm>
 #include <inttypes.h>  // for PRIu64
 
@@ -43,6 +44,14 @@ namespace jw {
         }
     }
 
+    bool TimerEngine::setAffinity(const std::vector<unsigned> &cpus) {
+        if (_thread == nullptr || !setThreadAffinity(_thread->native_handle(), cpus)) {
+            LOG_WARN("failed to bind timer thread to cpu %s", formatCpuList(cpus).c_str());
+            return false;
+        }
+        return true;
+    }
+
     template <class _Function>
     uintptr_t TimerEngine::_RegisterTimer(uintptr_t timerId, std::chrono::milliseconds elapse, uint32_t repeatTimes, _Function &&callback) {
         LOG_ASSERT(timerId != 0);
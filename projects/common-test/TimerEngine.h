@@ -30,6 +30,9 @@ namespace jw {
 
         bool unregisterTimer(uintptr_t timerId);
 
+        // 把定时器线程绑定到一组CPU上（CpuSet，见ThreadTopology.hpp），为空时不绑定
+        bool setAffinity(const std::vector<unsigned> &cpus);
+
     private:
         TimerEngine();
         ~TimerEngine();
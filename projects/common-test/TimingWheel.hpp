@@ -0,0 +1,129 @@
+﻿#ifndef _TIMING_WHEEL_HPP_
+#define _TIMING_WHEEL_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+namespace jw {
+
+    // 分层时间轮，时间以tick为单位，从0开始
+    // 第0层256个槽，每槽1个tick；之上3层各64个槽，每槽覆盖下一层一整圈，共可表示2^26个tick
+    // 元素直接存放在槽的数组里，不为每个元素分配定时器对象
+    // 每推进一个tick只处理一个槽，上层的槽每转过下一层一圈才下放一次，每个元素最多被下放3次
+    // 不加锁，由使用者保证串行访问
+    template <class _T>
+    class TimingWheel {
+    public:
+        TimingWheel<_T>(const TimingWheel<_T> &) = delete;
+        TimingWheel<_T> &operator=(const TimingWheel<_T> &) = delete;
+
+        TimingWheel<_T>() : _current(0), _size(0) { }
+
+        // 在第expires个tick到期，已过期的在下一个tick到期，超出范围的按最远的时刻算
+        void add(uint64_t expires, _T &&value) {
+            _Entry entry;
+            entry.expires = expires;
+            entry.value = std::move(value);
+            _insert(std::move(entry), _current + 1U);
+            ++_size;
+        }
+
+        // 推进到第tick个tick，对每个到期的元素调用onExpire(_T &value)
+        // 回调中可以再add（包括把同一个元素移回去），新加的元素不会在本次推进中被重复处理
+        template <class _Func>
+        void advance(uint64_t tick, _Func &&onExpire) {
+            while (_current < tick) {
+                ++_current;
+                size_t index = (size_t)(_current & _Level0Mask);
+                if (index == 0) {
+                    _cascade();
+                }
+
+                std::vector<_Entry> &slot = _level0[index];
+                if (slot.empty()) {
+                    continue;
+                }
+
+                std::vector<_Entry> expired;
+                expired.swap(slot);
+                _size -= expired.size();
+                for (typename std::vector<_Entry>::iterator it = expired.begin(); it != expired.end(); ++it) {
+                    onExpire(it->value);
+                }
+
+                // 保留数组的容量给之后落在这个槽的元素
+                expired.clear();
+                if (slot.empty()) {
+                    slot.swap(expired);
+                }
+            }
+        }
+
+        uint64_t getCurrentTick() const { return _current; }
+        size_t size() const { return _size; }
+
+    private:
+        struct _Entry {
+            uint64_t expires;
+            _T value;
+        };
+
+        static const unsigned _Level0Bits = 8U;
+        static const unsigned _LevelBits = 6U;
+        static const size_t _UpperLevels = 3U;
+        static const uint64_t _Level0Mask = (1U << _Level0Bits) - 1U;
+        static const uint64_t _LevelMask = (1U << _LevelBits) - 1U;
+        static const uint64_t _MaxDelay = ((uint64_t)1U << (_Level0Bits + _LevelBits * _UpperLevels)) - 1U;
+
+        // 第level层（1开始）槽的位移
+        static unsigned _shift(size_t level) {
+            return _Level0Bits + _LevelBits * (unsigned)(level - 1U);
+        }
+
+        // 早于earliest的按earliest算：add时当前tick已处理过，最早是下一个；下放时当前tick还没处理
+        void _insert(_Entry &&entry, uint64_t earliest) {
+            if (entry.expires < earliest) {
+                entry.expires = earliest;
+            }
+            else if (entry.expires - _current > _MaxDelay) {
+                entry.expires = _current + _MaxDelay;
+            }
+
+            uint64_t delay = entry.expires - _current;
+            if (delay <= _Level0Mask) {
+                _level0[(size_t)(entry.expires & _Level0Mask)].push_back(std::move(entry));
+                return;
+            }
+            for (size_t level = 1; level <= _UpperLevels; ++level) {
+                if (level == _UpperLevels || (delay >> _shift(level + 1U)) == 0) {
+                    _levels[level - 1U][(size_t)((entry.expires >> _shift(level)) & _LevelMask)].push_back(std::move(entry));
+                    return;
+                }
+            }
+        }
+
+        // 第0层转完一圈，把上层对应槽中的元素按剩余时间重新放入下层
+        void _cascade() {
+            for (size_t level = 1; level <= _UpperLevels; ++level) {
+                size_t index = (size_t)((_current >> _shift(level)) & _LevelMask);
+                std::vector<_Entry> entries;
+                entries.swap(_levels[level - 1U][index]);
+                for (typename std::vector<_Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+                    _insert(std::move(*it), _current);
+                }
+                if (index != 0) {
+                    break;
+                }
+            }
+        }
+
+        std::vector<_Entry> _level0[1U << _Level0Bits];
+        std::vector<_Entry> _levels[_UpperLevels][1U << _LevelBits];
+        uint64_t _current;  // 已处理到的tick
+        size_t _size;
+    };
+}
+
+#endif
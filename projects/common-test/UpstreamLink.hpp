@@ -0,0 +1,391 @@
+﻿#ifndef _UPSTREAM_LINK_HPP_
+#define _UPSTREAM_LINK_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "BasicSession.hpp"
+#include "IOServicePool.hpp"
+#include "QuickMutex.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace jw {
+
+    // 网关与游戏服之间的上游连接：一条TCP连接上复用多个客户端会话，会话id由网关分配，在一条连接内唯一
+    // 每帧是一个PacketSplitter格式的包，包体为：4字节小端会话id + 4字节小端帧类型 + 内容
+    //   Open：网关收到新客户端，内容为客户端的"IP:端口"
+    //   Data：网关到游戏服是客户端的一个包体（不含包头）；游戏服到网关是发给客户端的原始数据（可含多个带包头的包）
+    //   Close：一方断开了这个会话，另一方随之断开，不再回复Close
+    enum class LinkFrame : uint32_t {
+        Open = 1,
+        Data,
+        Close
+    };
+
+    typedef BasicSession<PacketSplitter, 16U * 1024U> LinkSession;
+
+    // 上游连接的统计，sentFrames / sentBatches即平均每次写合并的帧数
+    struct LinkStats {
+        uint64_t sentFrames;
+        uint64_t sentBatches;
+        uint64_t sentBytes;
+        uint64_t receivedFrames;
+        size_t sessions;  // 当前绑定的会话数
+    };
+
+    // 转发通道上会话id到会话的映射，各函数都是线程安全的
+    template <class _Session>
+    class RelaySessionMap : public RelayChannel {
+    public:
+        typedef typename _Session::SessionPtr SessionPtr;
+
+        void bind(uint32_t id, const SessionPtr &session) {
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            _sessions[id] = session;
+        }
+
+        // id已在映射中时不绑定，返回false
+        bool tryBind(uint32_t id, const SessionPtr &session) {
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            return _sessions.insert(std::make_pair(id, session)).second;
+        }
+
+        SessionPtr find(uint32_t id) {
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            typename std::unordered_map<uint32_t, SessionPtr>::iterator it = _sessions.find(id);
+            return it != _sessions.end() ? it->second : SessionPtr();
+        }
+
+        // 移除映射，返回移除的会话，已不在映射中时返回空
+        SessionPtr unbind(uint32_t id) {
+            SessionPtr session;
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            typename std::unordered_map<uint32_t, SessionPtr>::iterator it = _sessions.find(id);
+            if (it != _sessions.end()) {
+                session.swap(it->second);
+                _sessions.erase(it);
+            }
+            return session;
+        }
+
+        std::vector<SessionPtr> unbindAll() {
+            std::vector<SessionPtr> sessions;
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            sessions.reserve(_sessions.size());
+            for (typename std::unordered_map<uint32_t, SessionPtr>::iterator it = _sessions.begin(); it != _sessions.end(); ++it) {
+                sessions.push_back(std::move(it->second));
+            }
+            _sessions.clear();
+            return sessions;
+        }
+
+        size_t getSessionCount() {
+            std::lock_guard<jw::QuickMutex> g(_sessionsMutex);
+            (void)g;
+            return _sessions.size();
+        }
+
+    private:
+        std::unordered_map<uint32_t, SessionPtr> _sessions;
+        jw::QuickMutex _sessionsMutex;
+    };
+
+    // 上游连接的一端，网关和游戏服共用，_Session为这条连接上转发的会话的类型
+    // 发出的帧先追加到一块连续的缓冲区里，再投递一次刷新到连接所属的io_service上，
+    // 刷新之前各线程追加的帧由一次deliver（一次write）发出
+    // 同时保存会话id到会话的映射（RelaySessionMap），各函数都是线程安全的
+    template <class _Session>
+    class UpstreamLink : public RelaySessionMap<_Session>, public std::enable_shared_from_this<UpstreamLink<_Session> > {
+    public:
+        UpstreamLink<_Session>(const UpstreamLink<_Session> &) = delete;
+        UpstreamLink<_Session> &operator=(const UpstreamLink<_Session> &) = delete;
+
+        typedef typename _Session::SessionPtr SessionPtr;
+
+        // 收到一帧，在连接的读线程上调用，data[length]为'\0'；data为nullptr表示连接断开，之后不再回调
+        typedef std::function<void (UpstreamLink<_Session> &, uint32_t, LinkFrame, const char *, size_t)> FrameCallback;
+
+        UpstreamLink<_Session>() { }
+
+        ~UpstreamLink<_Session>() {
+            LOG_DEBUG("UpstreamLink<_Session>::~UpstreamLink<_Session>");
+        }
+
+        // 开始在已连接的socket上收发，只调用一次
+        // 帧已由本对象合并，关闭Nagle；转发所有客户端的数据，发送队列的上限比客户端连接高得多，超过时整条连接断开
+        void start(asio::ip::tcp::socket &&socket, const FrameCallback &callback) {
+            _callback = callback;
+            _service = &socket.get_io_service();
+            std::error_code ec;
+            socket.set_option(asio::ip::tcp::no_delay(true), ec);
+            std::shared_ptr<UpstreamLink<_Session> > thiz = this->shared_from_this();
+            LinkSession::SessionPtr session(new LinkSession(std::move(socket), [thiz](const LinkSession::SessionPtr &, SessionEvent event, const char *data, size_t length) {
+                if (event == SessionEvent::Recv && data != nullptr) {
+                    thiz->_onFrame(data, length);
+                }
+                else {
+                    thiz->_onDisconnect();
+                }
+            }));
+
+            SendLimits limits;
+            limits.lowWaterMark = 4U * 1024U * 1024U;
+            limits.highWaterMark = 16U * 1024U * 1024U;
+            limits.hardLimit = 64U * 1024U * 1024U;
+            session->setSendLimits(limits);
+            _remoteIP = session->getRemoteIP();
+            _remotePort = session->getRemotePort();
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                _session = session;
+            }
+            session->start();
+        }
+
+        // 断开连接，之后由FrameCallback通知
+        void close() {
+            LinkSession::SessionPtr session = _getSession();
+            if (session != nullptr) {
+                session->close();
+            }
+        }
+
+        bool isConnected() {
+            LinkSession::SessionPtr session = _getSession();
+            return session != nullptr && session->isConnected();
+        }
+
+        asio::io_service &getIOService() { return *_service; }
+
+        const std::string &getRemoteIP() const { return _remoteIP; }
+        unsigned short getRemotePort() const { return _remotePort; }
+
+        void sendFrame(uint32_t id, LinkFrame type, const char *data, size_t length) {
+            asio::const_buffer buffer(data, length);
+            _appendFrame(id, type, &buffer, 1);
+        }
+
+        void sendFrame(uint32_t id, LinkFrame type, const std::string &str) {
+            sendFrame(id, type, str.data(), str.length());
+        }
+
+        LinkStats getStats() {
+            LinkStats stats;
+            stats.sentFrames = _sentFrames;
+            stats.sentBatches = _sentBatches;
+            stats.sentBytes = _sentBytes;
+            stats.receivedFrames = _receivedFrames;
+            stats.sessions = this->getSessionCount();
+            return stats;
+        }
+
+        // RelayChannel，游戏服一方经网关转发的会话调用
+        virtual void relaySend(uint32_t id, const std::vector<asio::const_buffer> &buffers) override {
+            _appendFrame(id, LinkFrame::Data, buffers.data(), buffers.size());
+        }
+
+        virtual void relayClose(uint32_t id) override {
+            if (this->unbind(id) != nullptr) {
+                sendFrame(id, LinkFrame::Close, nullptr, 0);
+            }
+        }
+
+    private:
+        LinkSession::SessionPtr _getSession() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _session;
+        }
+
+        static void _putUint32(char *p, uint32_t value) {
+            p[0] = (char)((value >>  0) & 0xFF);
+            p[1] = (char)((value >>  8) & 0xFF);
+            p[2] = (char)((value >> 16) & 0xFF);
+            p[3] = (char)((value >> 24) & 0xFF);
+        }
+
+        static uint32_t _getUint32(const char *p) {
+            const unsigned char *u = (const unsigned char *)p;
+            return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+        }
+
+        // 追加一帧，缓冲区原本为空时投递一次刷新
+        void _appendFrame(uint32_t id, LinkFrame type, const asio::const_buffer *buffers, size_t count) {
+            size_t length = 8;
+            for (size_t i = 0; i < count; ++i) {
+                length += asio::buffer_size(buffers[i]);
+            }
+
+            bool post = false;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (_session == nullptr) {
+                    return;
+                }
+                size_t offset = _batch.size();
+                _batch.resize(offset + 4 + length);
+                char *p = &_batch[offset];
+                _putUint32(p, (uint32_t)length);
+                _putUint32(p + 4, id);
+                _putUint32(p + 8, (uint32_t)type);
+                p += 12;
+                for (size_t i = 0; i < count; ++i) {
+                    size_t size = asio::buffer_size(buffers[i]);
+                    if (size > 0) {
+                        const char *data = asio::buffer_cast<const char *>(buffers[i]);
+                        std::copy(data, data + size, p);
+                        p += size;
+                    }
+                }
+                ++_batchFrames;
+                post = !_flushPosted;
+                _flushPosted = true;
+            }
+
+            if (post) {
+                std::shared_ptr<UpstreamLink<_Session> > thiz = this->shared_from_this();
+                _service->post([thiz]() {
+                    thiz->_flush();
+                });
+            }
+        }
+
+        // 把攒下的帧作为一个缓冲区投递给连接
+        void _flush() {
+            std::vector<char> batch;
+            size_t frames;
+            LinkSession::SessionPtr session;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                batch.swap(_batch);
+                frames = _batchFrames;
+                _batchFrames = 0;
+                _flushPosted = false;
+                session = _session;
+            }
+            if (session == nullptr || batch.empty()) {
+                return;
+            }
+
+            _sentFrames += frames;
+            ++_sentBatches;
+            _sentBytes += batch.size();
+            session->deliver(std::move(batch));
+        }
+
+        void _onFrame(const char *data, size_t length) {
+            if (_disconnected) {
+                return;
+            }
+            if (length < 8) {
+                LOG_ERROR("malformed link frame from %s:%hu, %lu bytes", _remoteIP.c_str(), _remotePort, (unsigned long)length);
+                close();
+                return;
+            }
+            ++_receivedFrames;
+            _callback(*this, _getUint32(data), (LinkFrame)_getUint32(data + 4), data + 8, length - 8);
+        }
+
+        void _onDisconnect() {
+            LinkSession::SessionPtr session;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                session.swap(_session);
+                _batch.clear();
+            }
+            if (session == nullptr) {
+                // 读、写都失败时只通知一次
+                return;
+            }
+            // 连接的回调持有本对象，释放_session即断开引用环
+            _disconnected = true;
+            _callback(*this, 0, LinkFrame::Close, nullptr, 0);
+        }
+
+        FrameCallback _callback;
+        asio::io_service *_service = nullptr;
+        LinkSession::SessionPtr _session;  // 断开后为空
+        std::string _remoteIP;
+        unsigned short _remotePort = 0;
+        std::vector<char> _batch;  // 待发送的帧
+        size_t _batchFrames = 0;
+        bool _flushPosted = false;
+        jw::QuickMutex _mutex;
+
+        std::atomic<uint64_t> _sentFrames{ 0 };
+        std::atomic<uint64_t> _sentBatches{ 0 };
+        std::atomic<uint64_t> _sentBytes{ 0 };
+        std::atomic<uint64_t> _receivedFrames{ 0 };
+        std::atomic<bool> _disconnected{ false };
+    };
+
+    // 接受网关的上游连接（游戏服一方），连接数很少，不经过AdmissionControl
+    // 监听socket带SO_REUSEPORT（仅Linux），热重启时新进程可以在旧进程退出前监听同一个端口
+    // 新连接轮询创建在池中各个io_service上
+    class LinkListener {
+    public:
+        LinkListener(const LinkListener &) = delete;
+        LinkListener &operator=(const LinkListener &) = delete;
+
+        typedef std::function<void (asio::ip::tcp::socket &&)> AcceptCallback;
+
+        // 监听失败时抛出异常
+        LinkListener(IOServicePool &pool, unsigned short port, const AcceptCallback &callback)
+            : _pool(pool), _acceptor(pool.getService(0)), _socket(pool.getNextService()), _callback(callback) {
+            asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+            _acceptor.open(endpoint.protocol());
+            _acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+            _acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+            _acceptor.bind(endpoint);
+            _acceptor.listen();
+            LOG_INFO("LinkListener listening on port %hu", port);
+            _doAccept();
+        }
+
+        ~LinkListener() {
+            std::error_code ec;
+            _acceptor.close(ec);
+        }
+
+    private:
+        void _doAccept() {
+            _acceptor.async_accept(_socket, [this](std::error_code ec) {
+                if (ec == asio::error::operation_aborted) {
+                    return;
+                }
+                if (!ec) {
+                    // 上游连接不能迁移，它所在的io_service不再因缩容退役
+                    _pool.pinService(_socket.get_io_service());
+                    _callback(std::move(_socket));
+                }
+                _socket = asio::ip::tcp::socket(_pool.getNextService());
+                _doAccept();
+            });
+        }
+
+        IOServicePool &_pool;
+        asio::ip::tcp::acceptor _acceptor;
+        asio::ip::tcp::socket _socket;
+        AcceptCallback _callback;
+    };
+}
+
+#endif
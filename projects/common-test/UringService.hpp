@@ -0,0 +1,694 @@
+﻿#ifndef _URING_SERVICE_HPP_
+#define _URING_SERVICE_HPP_
+
+#include "asio_header.hpp"
+#include "DebugConfig.h"
+#include "QuickMutex.h"
+#include "HandlerAllocator.hpp"
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#if defined(__linux__)
+#   include <linux/io_uring.h>
+#   include <sys/syscall.h>
+#   include <sys/mman.h>
+#   include <sys/socket.h>
+#   include <sys/uio.h>
+#   include <netinet/in.h>
+#   include <unistd.h>
+#   include <string.h>
+#endif
+
+namespace jw {
+
+#if defined(__linux__)
+
+    // io_uring的最小封装，直接使用系统调用，不依赖liburing
+    // 不加锁：提交一侧（getSqe、submit）和完成一侧（forEachCompletion、缓冲区的放回）各自同一时刻只能有一个线程使用
+    class UringRing {
+    public:
+        UringRing(const UringRing &) = delete;
+        UringRing &operator=(const UringRing &) = delete;
+
+        UringRing() { }
+
+        ~UringRing() {
+            if (_bufRing != nullptr) {
+                munmap(_bufRing, _bufCount * sizeof(io_uring_buf));
+            }
+            if (_sqes != nullptr) {
+                munmap(_sqes, _sqEntries * sizeof(io_uring_sqe));
+            }
+            if (_cqRing != nullptr && _cqRing != _sqRing) {
+                munmap(_cqRing, _cqRingSize);
+            }
+            if (_sqRing != nullptr) {
+                munmap(_sqRing, _sqRingSize);
+            }
+            if (_fd >= 0) {
+                ::close(_fd);
+            }
+        }
+
+        // entries为提交队列的大小，失败时返回false，errno为原因（ENOSYS：内核不支持，EPERM：被禁用或被seccomp拦截）
+        // 不用IORING_SETUP_COOP_TASKRUN：环由asio的epoll等待，完成项要靠task work打断epoll_wait才能产生
+        bool init(unsigned entries) {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            _fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+            if (_fd < 0) {
+                return false;
+            }
+
+            _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMmap) {
+                _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+            }
+            _sqRing = _map(_sqRingSize, IORING_OFF_SQ_RING);
+            if (_sqRing == nullptr) {
+                return false;
+            }
+            _cqRing = singleMmap ? _sqRing : _map(_cqRingSize, IORING_OFF_CQ_RING);
+            if (_cqRing == nullptr) {
+                return false;
+            }
+            _sqEntries = params.sq_entries;
+            _sqes = (io_uring_sqe *)_map(_sqEntries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+            if (_sqes == nullptr) {
+                return false;
+            }
+
+            char *sq = (char *)_sqRing;
+            _sqHead = (unsigned *)(sq + params.sq_off.head);
+            _sqTail = (unsigned *)(sq + params.sq_off.tail);
+            _sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+            unsigned *sqArray = (unsigned *)(sq + params.sq_off.array);
+            for (unsigned i = 0; i < _sqEntries; ++i) {
+                sqArray[i] = i;
+            }
+            _sqeTail = *_sqTail;
+
+            char *cq = (char *)_cqRing;
+            _cqHead = (unsigned *)(cq + params.cq_off.head);
+            _cqTail = (unsigned *)(cq + params.cq_off.tail);
+            _cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+            _cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        // 注册提供缓冲区环：count个（2的幂，不超过32768）size字节的缓冲区，带IOSQE_BUFFER_SELECT的recv由内核从中挑选
+        bool registerBuffers(uint16_t group, unsigned count, unsigned size) {
+            void *ring = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ring == MAP_FAILED) {
+                return false;
+            }
+            io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.ring_addr = (uint64_t)(uintptr_t)ring;
+            reg.ring_entries = count;
+            reg.bgid = group;
+            if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+                munmap(ring, count * sizeof(io_uring_buf));
+                return false;
+            }
+
+            _bufRing = (io_uring_buf_ring *)ring;
+            _bufCount = count;
+            _bufSize = size;
+            _bufGroup = group;
+            _bufMemory.resize((size_t)count * size);
+            for (unsigned i = 0; i < count; ++i) {
+                recycleBuffer((uint16_t)i);
+            }
+            publishBuffers();
+            return true;
+        }
+
+        uint16_t getBufferGroup() const { return _bufGroup; }
+        char *getBuffer(uint16_t bid) { return &_bufMemory[(size_t)bid * _bufSize]; }
+
+        // 把用完的缓冲区放回环中，publishBuffers之后内核才能再次挑选
+        void recycleBuffer(uint16_t bid) {
+            // 不用bufs成员：头文件中的柔性数组在C++下前面多了一个空结构体，偏移不对
+            io_uring_buf *buf = (io_uring_buf *)_bufRing + (_bufTail & (_bufCount - 1));
+            buf->addr = (uint64_t)(uintptr_t)getBuffer(bid);
+            buf->len = _bufSize;
+            buf->bid = bid;
+            ++_bufTail;
+        }
+
+        void publishBuffers() {
+            __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+        }
+
+        // 取一个空的SQE，提交队列满时先提交已有的；仍然满（内核暂不接受新的提交）时返回nullptr，调用者须稍后重试
+        io_uring_sqe *getSqe() {
+            if (_sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+                submit(0);
+                if (_sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+                    return nullptr;
+                }
+            }
+            io_uring_sqe *sqe = &_sqes[_sqeTail & _sqMask];
+            ++_sqeTail;
+            memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        // 用一次io_uring_enter提交所有新的SQE，并等待至少waitCount个完成
+        int submit(unsigned waitCount) {
+            __atomic_store_n(_sqTail, _sqeTail, __ATOMIC_RELEASE);
+            unsigned toSubmit = _sqeTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+            if (toSubmit == 0 && waitCount == 0) {
+                return 0;
+            }
+            int ret;
+            do {
+                ret = (int)syscall(__NR_io_uring_enter, _fd, toSubmit, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            } while (ret < 0 && errno == EINTR);
+            ++_enterCount;
+            return ret;
+        }
+
+        // 对每个已完成的CQE调用func(const io_uring_cqe &)，返回处理的个数
+        // func中可以取新的SQE
+        template <class _Func>
+        unsigned forEachCompletion(_Func &&func) {
+            unsigned head = *_cqHead;
+            unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+            unsigned count = 0;
+            for (; head != tail; ++head, ++count) {
+                func(_cqes[head & _cqMask]);
+            }
+            __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        // 完成队列中是否有未处理的完成项
+        bool hasCompletions() const {
+            return *_cqHead != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        }
+
+        int getFd() const { return _fd; }
+        uint64_t getEnterCount() const { return _enterCount; }
+
+    private:
+        void *_map(size_t size, uint64_t offset) {
+            void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, (off_t)offset);
+            return p != MAP_FAILED ? p : nullptr;
+        }
+
+        int _fd = -1;
+        void *_sqRing = nullptr;
+        void *_cqRing = nullptr;
+        size_t _sqRingSize = 0;
+        size_t _cqRingSize = 0;
+        io_uring_sqe *_sqes = nullptr;
+        unsigned *_sqHead = nullptr;
+        unsigned *_sqTail = nullptr;
+        unsigned _sqMask = 0;
+        unsigned _sqEntries = 0;
+        unsigned _sqeTail = 0;  // 已取出的SQE，submit时才对内核可见
+        unsigned *_cqHead = nullptr;
+        unsigned *_cqTail = nullptr;
+        unsigned _cqMask = 0;
+        io_uring_cqe *_cqes = nullptr;
+
+        io_uring_buf_ring *_bufRing = nullptr;
+        unsigned _bufCount = 0;
+        unsigned _bufSize = 0;
+        uint16_t _bufGroup = 0;
+        uint16_t _bufTail = 0;
+        std::vector<char> _bufMemory;
+
+        uint64_t _enterCount = 0;
+    };
+
+    // 在回环上实际走一遍多发accept和带提供缓冲区的多发recv，能收到数据才算支持
+    // 内核太旧（需要6.0以上）、io_uring被禁用或被seccomp拦截时返回false
+    inline bool _probeUring() {
+        UringRing ring;
+        if (!ring.init(8)) {
+            LOG_INFO("io_uring_setup failed: %s", strerror(errno));
+            return false;
+        }
+        if (!ring.registerBuffers(0, 8, 64)) {
+            LOG_INFO("io_uring provided buffer rings are not supported: %s", strerror(errno));
+            return false;
+        }
+
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int accepted = -1;
+        bool ok = false;
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrLen = sizeof(addr);
+        if (listener >= 0 && client >= 0 && bind(listener, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0
+            && getsockname(listener, (sockaddr *)&addr, &addrLen) == 0) {
+            io_uring_sqe *sqe = ring.getSqe();
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->fd = listener;
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe->user_data = 1;
+            }
+            if (sqe != nullptr && connect(client, (sockaddr *)&addr, sizeof(addr)) == 0 && ring.submit(1) >= 0) {
+                ring.forEachCompletion([&accepted](const io_uring_cqe &cqe) {
+                    if (cqe.user_data == 1 && cqe.res >= 0) {
+                        accepted = cqe.res;
+                    }
+                });
+            }
+            sqe = accepted >= 0 ? ring.getSqe() : nullptr;
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = accepted;
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = ring.getBufferGroup();
+                sqe->user_data = 2;
+                if (write(client, "x", 1) == 1 && ring.submit(1) >= 0) {
+                    ring.forEachCompletion([&ok](const io_uring_cqe &cqe) {
+                        if (cqe.user_data == 2 && cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+                            ok = true;
+                        }
+                    });
+                }
+            }
+        }
+
+        if (accepted >= 0) {
+            ::close(accepted);
+        }
+        if (client >= 0) {
+            ::close(client);
+        }
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        return ok;
+    }
+
+    // 是否可以使用UringService，只探测一次
+    inline bool isUringSupported() {
+        static const bool supported = _probeUring();
+        return supported;
+    }
+
+    // io_uring上的一个操作，由使用者嵌入在自己的对象中（如BasicSession），不单独分配
+    // 完成项在所属io_service的线程上回调，同一个UringService的完成项不会并发回调
+    class UringOp {
+    public:
+        // result为操作的返回值，失败时为负的errno；more为false时是这个操作的最后一个完成项，之后才能再次发起
+        // 多发recv收到数据时data指向提供缓冲区中的数据，回调返回后缓冲区即被放回环中
+        virtual void complete(int result, bool more, const char *data) = 0;
+
+        // io_service析构时还在途的操作，不会再有完成项
+        virtual void abandon() = 0;
+
+    protected:
+        ~UringOp() { }
+
+    private:
+        friend class UringService;
+        UringOp *_prev = nullptr;  // UringService的在途列表
+        UringOp *_next = nullptr;
+    };
+
+    // 一次sendmsg，发出一部分时由advance推进到剩下的数据再发
+    // 数据在发起前由setBuffers设置，须保持有效直到最后一次完成
+    class UringSendOp : public UringOp {
+    public:
+        void setBuffers(const asio::const_buffer *buffers, size_t count) {
+            _iov.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                _iov[i].iov_base = const_cast<void *>(asio::buffer_cast<const void *>(buffers[i]));
+                _iov[i].iov_len = asio::buffer_size(buffers[i]);
+            }
+            _iovIndex = 0;
+        }
+
+        // 发出了length字节，还有剩余时返回true
+        bool advance(size_t length) {
+            while (_iovIndex < _iov.size() && length >= _iov[_iovIndex].iov_len) {
+                length -= _iov[_iovIndex].iov_len;
+                ++_iovIndex;
+            }
+            if (_iovIndex == _iov.size()) {
+                return false;
+            }
+            _iov[_iovIndex].iov_base = (char *)_iov[_iovIndex].iov_base + length;
+            _iov[_iovIndex].iov_len -= length;
+            return true;
+        }
+
+    protected:
+        ~UringSendOp() { }
+
+    private:
+        friend class UringService;
+
+        msghdr *_prepareMsg() {
+            memset(&_msg, 0, sizeof(_msg));
+            _msg.msg_iov = &_iov[_iovIndex];
+            _msg.msg_iovlen = _iov.size() - _iovIndex;
+            return &_msg;
+        }
+
+        std::vector<iovec> _iov;
+        size_t _iovIndex = 0;
+        msghdr _msg;
+    };
+
+    // 挂在一个io_service上的io_uring，由enable创建，之后在这个io_service上开始的连接（BasicSession）和accept（BasicServer）改用它
+    // 读用带提供缓冲区的多发recv，accept用多发accept，写用sendmsg
+    // 提交不立即进入内核：各处发起的操作先排进提交队列，由投递到io_service的一个handler用一次io_uring_enter一起提交
+    // 完成项的通知经asio的epoll等待环的句柄，醒来后一次处理所有完成项
+    // 提交队列满时操作先记下，下一次提交时再排进去
+    class UringService : public asio::detail::service_base<UringService> {
+    public:
+        static const unsigned QueueEntries = 1024U;  // 提交队列的大小
+        static const unsigned BufferCount = 1024U;  // 接收用的提供缓冲区：1024个2KB，同一个io_service上的连接共用
+        static const unsigned BufferSize = 2048U;
+
+        explicit UringService(asio::io_service &service) : asio::detail::service_base<UringService>(service), _wait(service) { }
+
+        // 在service上启用io_uring，已启用时返回true
+        // 内核不支持（ENOSYS）、被禁用（EPERM）或建环失败时返回false，连接和accept照常走asio
+        // 须在service上开始连接之前调用
+        static bool enable(asio::io_service &service) {
+            if (asio::has_service<UringService>(service)) {
+                return true;
+            }
+            if (!isUringSupported()) {
+                return false;
+            }
+            std::unique_ptr<UringService> uring(new UringService(service));
+            if (!uring->_init()) {
+                return false;
+            }
+            UringService *p = uring.get();
+            asio::add_service(service, uring.release());
+            p->_armWait();
+            return true;
+        }
+
+        // service上启用了io_uring时返回它，否则返回nullptr
+        static UringService *find(asio::io_service &service) {
+            return asio::has_service<UringService>(service) ? &asio::use_service<UringService>(service) : nullptr;
+        }
+
+        // 以下可在任意线程调用，op在最后一个完成项之前不能再次发起
+
+        // 多发recv：每次收到数据回调一次，直到对端关闭（result为0）、出错、提供缓冲区用完（-ENOBUFS）或被取消
+        void recv(UringOp *op, int fd) {
+            _submit(op, _Kind::Recv, fd);
+        }
+
+        void send(UringSendOp *op, int fd) {
+            _submit(op, _Kind::Send, fd);
+        }
+
+        // 多发accept：每个新连接回调一次，result为它的句柄
+        void accept(UringOp *op, int fd) {
+            _submit(op, _Kind::Accept, fd);
+        }
+
+        // 取消op，它随后以-ECANCELED结束；op不在途时没有效果
+        void cancel(UringOp *op) {
+            _submit(op, _Kind::Cancel, -1);
+        }
+
+        // 调用io_uring_enter的次数
+        uint64_t getEnterCount() const {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            return _ring ? _ring->getEnterCount() : 0;
+        }
+
+    private:
+        enum class _Kind {
+            Recv,
+            Send,
+            Accept,
+            Cancel
+        };
+
+        // 提交队列满时没排进去的操作
+        struct _Pending {
+            UringOp *op;
+            _Kind kind;
+            int fd;
+        };
+
+        bool _init() {
+            _ring.reset(new UringRing());
+            if (!_ring->init(QueueEntries) || !_ring->registerBuffers(0, BufferCount, BufferSize)) {
+                LOG_ERROR("io_uring setup failed: %s", strerror(errno));
+                return false;
+            }
+            // 环的句柄由_ring关闭，asio等待的是它的副本
+            std::error_code ec;
+            _wait.assign(::dup(_ring->getFd()), ec);
+            if (ec) {
+                LOG_ERROR("failed to watch io_uring: %s", ec.message().c_str());
+                return false;
+            }
+            return true;
+        }
+
+        // io_service析构时调用：关闭环（内核取消所有在途的操作），再通知还在途的操作不会有完成项了
+        void shutdown_service() {
+            std::error_code ec;
+            _wait.close(ec);
+            std::vector<UringOp *> abandoned;
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                for (UringOp *op = _inflight; op != nullptr; op = op->_next) {
+                    abandoned.push_back(op);
+                }
+                _inflight = nullptr;
+                _deferred.clear();
+                _ring.reset();
+            }
+            for (size_t i = 0; i < abandoned.size(); ++i) {
+                abandoned[i]->abandon();
+            }
+        }
+
+        void _submit(UringOp *op, _Kind kind, int fd) {
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (!_ring) {
+                    return;
+                }
+                if (kind != _Kind::Cancel) {
+                    _link(op);
+                }
+                _Pending pending = { op, kind, fd };
+                io_uring_sqe *sqe = _deferred.empty() ? _ring->getSqe() : nullptr;
+                if (sqe != nullptr) {
+                    _fillSqe(sqe, pending);
+                }
+                else {
+                    _deferred.push_back(pending);
+                }
+            }
+            if (!_flushPosted.exchange(true)) {
+                get_io_service().post(makeCustomAllocHandler(_flushMemory, [this]() {
+                    _flushPosted = false;
+                    _flush();
+                }));
+            }
+        }
+
+        void _fillSqe(io_uring_sqe *sqe, const _Pending &pending) {
+            sqe->user_data = (uint64_t)(uintptr_t)pending.op;
+            switch (pending.kind) {
+            case _Kind::Recv:
+                sqe->opcode = IORING_OP_RECV;
+                sqe->fd = pending.fd;
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = _ring->getBufferGroup();
+                break;
+            case _Kind::Send:
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = pending.fd;
+                sqe->addr = (uint64_t)(uintptr_t)static_cast<UringSendOp *>(pending.op)->_prepareMsg();
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                break;
+            case _Kind::Accept:
+                sqe->opcode = IORING_OP_ACCEPT;
+                sqe->fd = pending.fd;
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe->accept_flags = SOCK_CLOEXEC;
+                break;
+            case _Kind::Cancel:
+                // 取消操作自己的完成项不回调
+                sqe->user_data = 0;
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uint64_t)(uintptr_t)pending.op;
+                break;
+            }
+        }
+
+        // 把排好的操作一次提交给内核
+        void _flush() {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            if (!_ring) {
+                return;
+            }
+            while (!_deferred.empty()) {
+                io_uring_sqe *sqe = _ring->getSqe();
+                if (sqe == nullptr) {
+                    break;
+                }
+                _fillSqe(sqe, _deferred.front());
+                _deferred.pop_front();
+            }
+            // EBUSY：完成队列溢出，处理完成项之后再提交
+            if (_ring->submit(0) < 0 && errno != EBUSY && errno != EAGAIN) {
+                LOG_ERROR("io_uring_enter failed: %s", strerror(errno));
+            }
+        }
+
+        // 先挂上下一次等待再处理完成项：处理期间到达的完成项会触发这次等待，不会因为epoll是边沿触发而漏掉
+        void _armWait() {
+            _wait.async_read_some(asio::null_buffers(), makeCustomAllocHandler(_waitMemory, [this](std::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                _armWait();
+                _reap();
+            }));
+        }
+
+        // 处理所有完成项；多个线程运行io_service时只有一个在处理，其余的直接返回，由它退出前再检查一次
+        void _reap() {
+            if (_reaping.exchange(true)) {
+                return;
+            }
+            for (;;) {
+                _ring->forEachCompletion([this](const io_uring_cqe &cqe) {
+                    _dispatch(cqe);
+                });
+                _ring->publishBuffers();
+                _reaping = false;
+                if (!_ring->hasCompletions() || _reaping.exchange(true)) {
+                    break;
+                }
+            }
+        }
+
+        void _dispatch(const io_uring_cqe &cqe) {
+            UringOp *op = (UringOp *)(uintptr_t)cqe.user_data;
+            if (op == nullptr) {
+                return;
+            }
+            bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+            bool buffered = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+            uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!more) {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                _unlink(op);
+            }
+            // 回调中可能再次发起op，或释放op所在的对象，之后不再访问op
+            op->complete(cqe.res, more, buffered && cqe.res > 0 ? _ring->getBuffer(bid) : nullptr);
+            if (buffered) {
+                _ring->recycleBuffer(bid);
+            }
+        }
+
+        // 以下在持有_mutex时调用
+        void _link(UringOp *op) {
+            op->_prev = nullptr;
+            op->_next = _inflight;
+            if (_inflight != nullptr) {
+                _inflight->_prev = op;
+            }
+            _inflight = op;
+        }
+
+        void _unlink(UringOp *op) {
+            if (op->_prev != nullptr) {
+                op->_prev->_next = op->_next;
+            }
+            else if (_inflight == op) {
+                _inflight = op->_next;
+            }
+            if (op->_next != nullptr) {
+                op->_next->_prev = op->_prev;
+            }
+            op->_prev = op->_next = nullptr;
+        }
+
+        std::unique_ptr<UringRing> _ring;
+        mutable jw::QuickMutex _mutex;  // 保护提交队列、_deferred和_inflight
+        std::deque<_Pending> _deferred;
+        UringOp *_inflight = nullptr;  // 在途的操作，io_service析构时逐个通知
+        std::atomic<bool> _flushPosted{ false };
+        std::atomic<bool> _reaping{ false };
+        asio::posix::stream_descriptor _wait;  // 环的句柄的副本，可读即有完成项
+        HandlerMemory<256U> _waitMemory;
+        HandlerMemory<256U> _flushMemory;
+    };
+
+#else
+
+    // 只在Linux上可用
+    inline bool isUringSupported() {
+        return false;
+    }
+
+    class UringOp {
+    public:
+        virtual void complete(int result, bool more, const char *data) = 0;
+        virtual void abandon() = 0;
+
+    protected:
+        ~UringOp() { }
+    };
+
+    class UringSendOp : public UringOp {
+    public:
+        void setBuffers(const asio::const_buffer *, size_t) { }
+        bool advance(size_t) { return false; }
+
+    protected:
+        ~UringSendOp() { }
+    };
+
+    // enable总是返回false，find总是返回nullptr，连接和accept都走asio
+    class UringService {
+    public:
+        static bool enable(asio::io_service &) { return false; }
+        static UringService *find(asio::io_service &) { return nullptr; }
+        void recv(UringOp *, int) { }
+        void send(UringSendOp *, int) { }
+        void accept(UringOp *, int) { }
+        void cancel(UringOp *) { }
+        uint64_t getEnterCount() const { return 0; }
+    };
+
+#endif
+}
+
+#endif
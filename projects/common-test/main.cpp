@@ -11,10 +11,1468 @@
 #include <stdio.h>
 
 #include "TimerEngine.h"
+#include "MPSCQueue.hpp"
+#include "QuickMutex.h"
+#include "RateLimiter.hpp"
+#include "IdleReaper.hpp"
+#include "LoopLagMonitor.hpp"
+#include "UringService.hpp"
+#include "ReliableUdp.hpp"
+#include "LoopbackTransport.hpp"
 
 #include <iostream>
+#include <deque>
+#include <atomic>
+#include <string.h>
+#include <new>
+
+#if defined(__linux__)
+#   include <sys/wait.h>
+#endif
+
+// 加锁的deque，BasicSession原先的发送队列
+class LockedDequeQueue {
+    std::deque<jw::SharedBuffer> _queue;
+    jw::QuickMutex _mutex;
+
+public:
+    void push(const jw::SharedBuffer &buf) {
+        std::lock_guard<jw::QuickMutex> g(_mutex);
+        (void)g;
+        _queue.push_back(buf);
+    }
+
+    size_t drain() {
+        std::lock_guard<jw::QuickMutex> g(_mutex);
+        (void)g;
+        size_t cnt = _queue.size();
+        _queue.clear();
+        return cnt;
+    }
+};
+
+// 无锁MPSC队列，BasicSession现在的发送队列
+class LockFreeQueue {
+    jw::MPSCQueue<jw::SharedBuffer> _queue;
+
+public:
+    void push(const jw::SharedBuffer &buf) {
+        _queue.push(buf);
+    }
+
+    size_t drain() {
+        size_t cnt = 0;
+        while (_queue.front() != nullptr) {
+            _queue.pop();
+            ++cnt;
+        }
+        return cnt;
+    }
+};
+
+// 发送队列争用测试：producers个线程各入队countPerProducer个包，一个消费者线程全部取出
+template <class _Queue>
+static double _BenchmarkSendQueue(size_t producers, size_t countPerProducer) {
+    _Queue queue;
+    jw::SharedBuffer buf = jw::makeSharedBuffer(std::vector<char>(64));
+    size_t total = producers * countPerProducer;
+
+    std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+    std::thread consumer([&queue, total]() {
+        size_t received = 0;
+        while (received < total) {
+            received += queue.drain();
+        }
+    });
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < producers; ++i) {
+        threads.push_back(std::thread([&queue, &buf, countPerProducer]() {
+            for (size_t k = 0; k < countPerProducer; ++k) {
+                queue.push(buf);
+            }
+        }));
+    }
+    std::for_each(threads.begin(), threads.end(), [](std::thread &t) { t.join(); });
+    consumer.join();
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::duration<double, std::nano> >(end - begin).count() / total;
+}
+
+static void _BenchmarkSendQueues() {
+    const size_t producerCounts[] = { 1, 4, 16 };
+    for (size_t producers : producerCounts) {
+        size_t countPerProducer = 1600000 / producers;
+        double locked = _BenchmarkSendQueue<LockedDequeQueue>(producers, countPerProducer);
+        double lockFree = _BenchmarkSendQueue<LockFreeQueue>(producers, countPerProducer);
+        printf("producers = %2lu | locked deque %7.1f ns/op | mpsc %7.1f ns/op\n", (unsigned long)producers, locked, lockFree);
+    }
+}
+
+// 为1时替换全局operator new，统计调用次数，用于检查收发路径上的堆分配（count-handler-alloc）
+// 替换对整个程序生效，会改变其他测试的分配行为，所以默认不开启，需要时单独编译：-DCOUNT_HEAP_ALLOC=1
+#ifndef COUNT_HEAP_ALLOC
+#define COUNT_HEAP_ALLOC 0
+#endif
+
+#if COUNT_HEAP_ALLOC
+static std::atomic<uint64_t> g_heapAllocCount{ 0 };
+
+void *operator new(size_t size) {
+    ++g_heapAllocCount;
+    void *p = malloc(size != 0 ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) throw() {
+    free(p);
+}
+
+// 在本机回环上建立一个BasicSession，统计稳态收发时的堆分配次数
+// 收：每轮客户端发一个包，等会话回调收到，不应有分配
+// 发：每轮投递同一个SharedBuffer，客户端读完，发送队列的节点被复用，不应有分配
+// handler都应落在HandlerMemory里，不应退回到operator new
+static int _CountHandlerAllocations() {
+    typedef jw::BasicSession<jw::PacketSplitter, 1024U> CountingSession;
+    const size_t warmup = 100, rounds = 10000;
+
+    asio::io_service service;
+    asio::ip::tcp::acceptor acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket client(service);
+    asio::ip::tcp::socket server(service);
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    client.set_option(asio::ip::tcp::no_delay(true));
+
+    std::atomic<size_t> received{ 0 };
+    CountingSession::SessionPtr session(new CountingSession(std::move(server), [&received](const CountingSession::SessionPtr &, jw::SessionEvent event, const char *data, size_t) {
+        if (event == jw::SessionEvent::Recv && data != nullptr) {
+            ++received;
+        }
+    }));
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::thread worker([&service]() { service.run(); });
+    session->start();
+
+    std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    jw::SharedBuffer buf = jw::makeSharedBuffer(std::vector<char>(packet));
+    std::vector<char> readBuf(packet.size());
+
+    auto recvRound = [&](size_t i) {
+        asio::write(client, asio::buffer(packet));
+        while (received <= i) {
+            std::this_thread::yield();
+        }
+    };
+    auto sendRound = [&]() {
+        session->deliver(buf);
+        asio::read(client, asio::buffer(readBuf));
+    };
+
+    size_t i = 0;
+    for (; i < warmup; ++i) {
+        recvRound(i);
+        sendRound();
+    }
+
+    uint64_t begin = g_heapAllocCount;
+    for (size_t k = 0; k < rounds; ++k, ++i) {
+        recvRound(i);
+    }
+    uint64_t recvAllocs = g_heapAllocCount - begin;
+
+    begin = g_heapAllocCount;
+    for (size_t k = 0; k < rounds; ++k) {
+        sendRound();
+    }
+    uint64_t sendAllocs = g_heapAllocCount - begin;
+    uint64_t fallbacks = jw::HandlerMemory<512U>::getFallbackCount();
+
+    std::error_code ec;
+    client.close(ec);
+    work.reset();
+    worker.join();
+    session.reset();
+
+    bool ok = recvAllocs == 0 && sendAllocs == 0 && fallbacks == 0;
+    printf("recv: %.2f allocs/op | send: %.2f allocs/op | handler memory fallbacks: %lu | %s\n",
+        (double)recvAllocs / rounds, (double)sendAllocs / rounds, (unsigned long)fallbacks, ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
+#endif
+
+// 本机回环上的echo压测：connections个客户端连接各自循环发一个包、等回显，统计每秒往返次数
+// 服务端会话和客户端各用一个io_service线程
+template <class _Handlers>
+static double _BenchmarkEcho(size_t connections, std::chrono::milliseconds duration) {
+    typedef jw::BasicSession<jw::PacketSplitter, 4096U, _Handlers> EchoSession;
+
+    struct EchoClient {
+        asio::ip::tcp::socket socket;
+        std::vector<char> readBuf;
+        explicit EchoClient(asio::io_service &service) : socket(service) { }
+    };
+
+    asio::io_service serverService(1), clientService(1);
+    asio::ip::tcp::acceptor acceptor(serverService, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::vector<typename EchoSession::SessionPtr> sessions;
+    std::vector<std::unique_ptr<EchoClient> > clients;
+    for (size_t i = 0; i < connections; ++i) {
+        clients.push_back(std::unique_ptr<EchoClient>(new EchoClient(clientService)));
+        clients.back()->socket.connect(acceptor.local_endpoint());
+        clients.back()->socket.set_option(asio::ip::tcp::no_delay(true));
+
+        asio::ip::tcp::socket server(serverService);
+        acceptor.accept(server);
+        server.set_option(asio::ip::tcp::no_delay(true));
+        sessions.push_back(typename EchoSession::SessionPtr(new EchoSession(std::move(server), [](const typename EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+            if (event == jw::SessionEvent::Recv && data != nullptr) {
+                std::vector<char> buf(4 + length);
+                buf[0] = (char)(length & 0xFF);
+                buf[1] = (char)((length >> 8) & 0xFF);
+                buf[2] = (char)((length >> 16) & 0xFF);
+                buf[3] = (char)((length >> 24) & 0xFF);
+                std::copy(data, data + length, buf.begin() + 4);
+                s->deliver(std::move(buf));
+            }
+        })));
+        sessions.back()->start();
+    }
+
+    const std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    std::atomic<bool> running{ true };
+    std::atomic<uint64_t> roundTrips{ 0 };
+    std::function<void (EchoClient *)> ping = [&](EchoClient *c) {
+        asio::async_write(c->socket, asio::buffer(packet), [&, c](std::error_code ec, size_t) {
+            if (ec) {
+                return;
+            }
+            c->readBuf.resize(packet.size());
+            asio::async_read(c->socket, asio::buffer(c->readBuf), [&, c](std::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                ++roundTrips;
+                if (running) {
+                    ping(c);
+                }
+            });
+        });
+    };
+    for (size_t i = 0; i < connections; ++i) {
+        ping(clients[i].get());
+    }
+
+    std::unique_ptr<asio::io_service::work> serverWork(new asio::io_service::work(serverService));
+    std::thread serverThread([&serverService]() { serverService.run(); });
+    std::thread clientThread([&clientService]() { clientService.run(); });
+
+    std::this_thread::sleep_for(duration);
+    running = false;
+    clientThread.join();
+    uint64_t count = roundTrips;
+
+    for (size_t i = 0; i < connections; ++i) {
+        std::error_code ec;
+        clients[i]->socket.close(ec);
+    }
+    serverWork.reset();
+    serverThread.join();
+    sessions.clear();
+
+    return count / std::chrono::duration_cast<std::chrono::duration<double> >(duration).count();
+}
+
+static void _BenchmarkEchoes() {
+    const size_t connectionCounts[] = { 1, 16, 128 };
+    const std::chrono::milliseconds duration(3000);
+    for (size_t connections : connectionCounts) {
+        double callback = _BenchmarkEcho<jw::CallbackHandlers>(connections, duration);
+        double coroutine = _BenchmarkEcho<jw::CoroutineHandlers>(connections, duration);
+        printf("connections = %3lu | callback %8.0f msg/s | coroutine %8.0f msg/s\n", (unsigned long)connections, callback, coroutine);
+    }
+}
+
+// 发送通道测试：客户端限速读取（约2MB/s），会话持续收到1KB的聊天包（约4MB/s）和每25个聊天包一个的游戏包
+// lanes为false时所有包都走Game通道，相当于原来的单个FIFO；为true时聊天包走Bulk通道
+// 在客户端统计游戏包从投递到读出的延迟
+static void _BenchmarkSendLane(bool lanes) {
+    typedef jw::BasicSession<jw::PacketSplitter, 1024U> LaneSession;
+    typedef std::chrono::steady_clock Clock;
+
+    asio::io_service service;
+    asio::ip::tcp::acceptor acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket client(service);
+    asio::ip::tcp::socket server(service);
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    client.set_option(asio::socket_base::receive_buffer_size(32 * 1024));
+    server.set_option(asio::socket_base::send_buffer_size(32 * 1024));
+
+    LaneSession::SessionPtr session(new LaneSession(std::move(server), [](const LaneSession::SessionPtr &, jw::SessionEvent, const char *, size_t) { }));
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::thread worker([&service]() { service.run(); });
+    session->start();
+
+    const jw::SharedBuffer chat = jw::makeSharedBuffer(jw::PacketSplitter::encodeSendPacket(std::string(1020, 'c')));
+    const jw::SendPriority chatPriority = lanes ? jw::SendPriority::Bulk : jw::SendPriority::Game;
+    const size_t gameCount = 400;
+
+    std::atomic<size_t> gameReceived{ 0 };
+    std::atomic<size_t> chatReceived{ 0 };
+    std::vector<double> latencies;
+    std::thread reader([&]() {
+        std::vector<char> pending;
+        char buf[2048];
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+        while (gameReceived < gameCount && Clock::now() < deadline) {
+            std::error_code ec;
+            size_t length = client.read_some(asio::buffer(buf), ec);
+            if (ec) {
+                break;
+            }
+            pending.insert(pending.end(), buf, buf + length);
+            size_t pos = 0;
+            while (pending.size() - pos >= 4) {
+                const unsigned char *p = (const unsigned char *)&pending[pos];
+                size_t size = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+                if (pending.size() - pos - 4 < size) {
+                    break;
+                }
+                if (pending[pos + 4] == 'g') {
+                    int64_t sent;
+                    memcpy(&sent, &pending[pos + 5], sizeof(sent));
+                    latencies.push_back((Clock::now().time_since_epoch().count() - sent) / 1000.0);
+                    ++gameReceived;
+                }
+                else {
+                    ++chatReceived;
+                }
+                pos += 4 + size;
+            }
+            pending.erase(pending.begin(), pending.begin() + pos);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    for (size_t i = 0; i < gameCount * 25; ++i) {
+        session->deliver(chat, chatPriority);
+        if (i % 25 == 0) {
+            std::string body(1 + sizeof(int64_t), 'g');
+            int64_t now = Clock::now().time_since_epoch().count();
+            memcpy(&body[1], &now, sizeof(now));
+            session->deliver(jw::PacketSplitter::encodeSendPacket(body));
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    reader.join();
+
+    std::error_code ec;
+    client.close(ec);
+    work.reset();
+    worker.join();
+    session.reset();
+
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies.empty() ? 0.0 : latencies[latencies.size() / 2];
+    double p99 = latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    double maxLatency = latencies.empty() ? 0.0 : latencies.back();
+    printf("%-12s | game %3lu/%lu latency p50 %8.0f us p99 %8.0f us max %8.0f us | chat received %lu\n",
+        lanes ? "two lanes" : "single lane", (unsigned long)gameReceived, (unsigned long)gameCount, p50, p99, maxLatency, (unsigned long)chatReceived);
+}
+
+static void _BenchmarkSendLanes() {
+    _BenchmarkSendLane(false);
+    _BenchmarkSendLane(true);
+
+    const jw::SendStats &stats = jw::BasicSession<jw::PacketSplitter, 1024U>::getSendStats();
+    const char *names[] = { "game", "bulk" };
+    for (size_t i = 0; i < 2; ++i) {
+        const jw::SendLaneStats &lane = stats.lanes[i];
+        printf("lane %s: sent %llu dropped %llu, latency avg %.0f us max %llu us\n", names[i],
+            (unsigned long long)lane.sentPackets, (unsigned long long)lane.droppedPackets, lane.averageLatencyUs(), (unsigned long long)lane.maxLatencyUs);
+    }
+}
+
+// 可替换快照测试：客户端先不读，会话以每1ms一个的频率收到count个2KB的状态快照，之后客户端一次读完
+// latest为false时用deliver逐个追加，为true时用deliverLatest以同一个key替换未发送的旧快照
+// 快照中带序号，客户端检查收到的最后一个是否为最新的
+static void _BenchmarkLatestWin(bool latest) {
+    typedef jw::BasicSession<jw::PacketSplitter, 1024U> SnapshotSession;
+
+    asio::io_service service;
+    asio::ip::tcp::acceptor acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket client(service);
+    asio::ip::tcp::socket server(service);
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    client.set_option(asio::socket_base::receive_buffer_size(32 * 1024));
+    server.set_option(asio::socket_base::send_buffer_size(32 * 1024));
+
+    SnapshotSession::SessionPtr session(new SnapshotSession(std::move(server), [](const SnapshotSession::SessionPtr &, jw::SessionEvent, const char *, size_t) { }));
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::thread worker([&service]() { service.run(); });
+    session->start();
+
+    const uint32_t count = 500;
+    for (uint32_t i = 1; i <= count; ++i) {
+        std::string body(2048, 's');
+        memcpy(&body[0], &i, sizeof(i));
+        std::vector<char> buf = jw::PacketSplitter::encodeSendPacket(body);
+        if (latest) {
+            session->deliverLatest(std::move(buf), 1);
+        }
+        else {
+            session->deliver(std::move(buf));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // 读到最新的快照为止
+    size_t received = 0;
+    size_t bytes = 0;
+    uint32_t last = 0;
+    std::vector<char> pending;
+    char buf[16384];
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    while (last != count) {
+        std::error_code ec;
+        size_t length = client.read_some(asio::buffer(buf), ec);
+        if (ec) {
+            break;
+        }
+        bytes += length;
+        pending.insert(pending.end(), buf, buf + length);
+        size_t pos = 0;
+        while (pending.size() - pos >= 4) {
+            const unsigned char *p = (const unsigned char *)&pending[pos];
+            size_t size = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+            if (pending.size() - pos - 4 < size) {
+                break;
+            }
+            memcpy(&last, &pending[pos + 4], sizeof(last));
+            ++received;
+            pos += 4 + size;
+        }
+        pending.erase(pending.begin(), pending.begin() + pos);
+    }
+    double catchUpMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0;
+
+    std::error_code ec;
+    client.close(ec);
+    work.reset();
+    worker.join();
+    session.reset();
+
+    printf("%-14s | snapshots received %3lu/%u, %7lu bytes, catch up %6.2f ms, last %u %s\n",
+        latest ? "deliverLatest" : "deliver", (unsigned long)received, count, (unsigned long)bytes, catchUpMs, last, last == count ? "OK" : "FAIL");
+}
+
+// 一批写满时的可替换快照：io线程被挡住时先投递64个1KB的普通包，再用deliverLatest投递1号快照
+// io线程上依次排着：第一道闸、发送、第二道闸；放行第一道闸后发送取满64个普通包，快照留在队列中
+// 在第二道闸挡住这一批的完成回调时再替换count-1次，之后客户端读完，快照应只收到1个，且是最新的
+static void _BenchmarkLatestWinBatchFull() {
+    typedef jw::BasicSession<jw::PacketSplitter, 1024U> SnapshotSession;
+
+    asio::io_service service;
+    asio::ip::tcp::acceptor acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::ip::tcp::socket client(service);
+    asio::ip::tcp::socket server(service);
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    client.set_option(asio::socket_base::receive_buffer_size(16 * 1024));
+    server.set_option(asio::socket_base::send_buffer_size(16 * 1024));
+
+    SnapshotSession::SessionPtr session(new SnapshotSession(std::move(server), [](const SnapshotSession::SessionPtr &, jw::SessionEvent, const char *, size_t) { }));
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::thread worker([&service]() { service.run(); });
+    session->start();
+
+    // 前4字节为序号，普通包为0
+    auto makePacket = [](uint32_t seq, size_t size) {
+        std::string body(size, 's');
+        memcpy(&body[0], &seq, sizeof(seq));
+        return jw::PacketSplitter::encodeSendPacket(body);
+    };
+
+    std::atomic<int> gate{ 0 };  // 0：第一道闸挡住，1：第一道闸放行，2：已到第二道闸，3：第二道闸放行
+    service.post([&gate]() {
+        while (gate < 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    for (size_t i = 0; i < 64; ++i) {
+        session->deliver(makePacket(0, 1000));
+    }
+    const uint32_t count = 100;
+    session->deliverLatest(makePacket(1, 2048), 1);
+    service.post([&gate]() {
+        gate = 2;
+        while (gate < 3) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    gate = 1;
+    while (gate < 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (uint32_t i = 2; i <= count; ++i) {
+        session->deliverLatest(makePacket(i, 2048), 1);
+    }
+    gate = 3;
+
+    size_t snapshots = 0;
+    uint32_t last = 0;
+    std::vector<char> pending;
+    char buf[16384];
+    while (last != count) {
+        std::error_code ec;
+        size_t length = client.read_some(asio::buffer(buf), ec);
+        if (ec) {
+            break;
+        }
+        pending.insert(pending.end(), buf, buf + length);
+        size_t pos = 0;
+        while (pending.size() - pos >= 4) {
+            const unsigned char *p = (const unsigned char *)&pending[pos];
+            size_t size = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+            if (pending.size() - pos - 4 < size) {
+                break;
+            }
+            uint32_t seq;
+            memcpy(&seq, &pending[pos + 4], sizeof(seq));
+            if (seq != 0) {
+                ++snapshots;
+                last = seq;
+            }
+            pos += 4 + size;
+        }
+        pending.erase(pending.begin(), pending.begin() + pos);
+    }
+
+    std::error_code ec;
+    client.close(ec);
+    work.reset();
+    worker.join();
+    session.reset();
+
+    printf("%-14s | batch full before the snapshot, snapshots received %lu, last %u %s\n",
+        "deliverLatest", (unsigned long)snapshots, last, snapshots == 1 && last == count ? "OK" : "FAIL");
+}
+
+static void _BenchmarkLatestWins() {
+    _BenchmarkLatestWin(false);
+    _BenchmarkLatestWin(true);
+    _BenchmarkLatestWinBatchFull();
+
+    const jw::SendStats &stats = jw::BasicSession<jw::PacketSplitter, 1024U>::getSendStats();
+    printf("superseded %llu packets, %llu bytes\n", (unsigned long long)stats.supersededPackets, (unsigned long long)stats.supersededBytes);
+}
+
+// 限流检查的开销：每次检查前取一次时钟（与ServerProxy中相同），以及不取时钟的纯检查
+// 再模拟一个每1ms发一条命令、持续2秒的客户端，核对放行数与被判定滥用的时刻
+static void _BenchmarkRateLimit() {
+    typedef std::chrono::steady_clock Clock;
+    const size_t iterations = 10000000;
+
+    jw::RateLimitPolicy<4> policy;
+    policy.limits[0] = jw::RateLimit(1000000, 1000);
+    policy.limits[1] = jw::RateLimit(2, 5);
+    policy.abuse = jw::RateLimit(10, 50);
+    jw::CommandRateLimiter<4> limiter;
+
+    size_t allowed = 0;
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        allowed += limiter.check(policy, 0, jw::rateLimiterNow()) == jw::RateLimitResult::Allowed;
+    }
+    double withClock = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count() / (double)iterations;
+
+    int64_t now = jw::rateLimiterNow();
+    begin = Clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        allowed += limiter.check(policy, 2, now + (int64_t)i) == jw::RateLimitResult::Allowed;
+    }
+    double withoutClock = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count() / (double)iterations;
+    printf("check with clock %.1f ns/op, without clock %.1f ns/op (allowed %lu)\n", withClock, withoutClock, (unsigned long)allowed);
+
+    // 聊天类2条/秒、突发5条；被拒绝的超过突发50条后按10条/秒容忍
+    jw::CommandRateLimiter<4> flood;
+    size_t counts[3] = { 0, 0, 0 };
+    int64_t abusiveAt = -1;
+    for (int64_t ms = 0; ms < 2000; ++ms) {
+        jw::RateLimitResult result = flood.check(policy, 1, ms * 1000000LL);
+        ++counts[(size_t)result];
+        if (result == jw::RateLimitResult::Abusive && abusiveAt < 0) {
+            abusiveAt = ms;
+        }
+    }
+    printf("flood 1000/s for 2s: allowed %lu, throttled %lu, abusive %lu, first abusive at %lld ms\n",
+        (unsigned long)counts[0], (unsigned long)counts[1], (unsigned long)counts[2], (long long)abusiveAt);
+}
+
+// IdleReaper测试用的会话，时间由测试推进
+struct _FakeIdleSession : jw::RefCounted<_FakeIdleSession> {
+    std::chrono::steady_clock::time_point lastRecv;
+    bool connected = true;
+    bool answersPing = false;
+    int64_t closedAt = -1;  // 被断开时的秒数
+    static int64_t s_now;
+
+    std::chrono::steady_clock::time_point getLastRecvTime() const { return lastRecv; }
+    bool isConnected() const { return connected; }
+    bool close() {
+        connected = false;
+        closedAt = s_now;
+        return true;
+    }
+    std::string getRemoteIP() const { return "0.0.0.0"; }
+    unsigned short getRemotePort() const { return 0; }
+};
+
+int64_t _FakeIdleSession::s_now = 0;
+
+// 空闲回收测试：10万个连接，10%每秒都有数据，10%只回应ping，其余不再有数据
+// 空闲60秒后ping，再过20秒断开，按秒推进模拟时钟，统计每个tick的耗时
+static void _BenchmarkIdleReaper() {
+    typedef jw::IntrusivePtr<_FakeIdleSession> FakePtr;
+    typedef std::chrono::steady_clock Clock;
+    const size_t count = 100000;
+
+    Clock::time_point now;
+    jw::IdleReaper<_FakeIdleSession> reaper(std::chrono::seconds(1), std::chrono::seconds(60), std::chrono::seconds(20), [&now](const FakePtr &s) {
+        if (s->answersPing) {
+            s->lastRecv = now;
+        }
+    });
+
+    Clock::time_point begin = Clock::now();
+    now = begin;
+    std::vector<FakePtr> sessions;
+    sessions.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        FakePtr s(new _FakeIdleSession());
+        s->lastRecv = now;
+        s->answersPing = i % 10 == 1;
+        sessions.push_back(s);
+        reaper.watch(s);
+    }
+
+    double totalUs = 0.0;
+    double maxUs = 0.0;
+    const int64_t seconds = 300;
+    for (int64_t sec = 1; sec <= seconds; ++sec) {
+        now = begin + std::chrono::seconds(sec);
+        _FakeIdleSession::s_now = sec;
+        for (size_t i = 0; i < count; i += 10) {
+            sessions[i]->lastRecv = now;
+        }
+
+        Clock::time_point t0 = Clock::now();
+        reaper.tick(now);
+        double us = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count() / 1000.0;
+        totalUs += us;
+        maxUs = std::max(maxUs, us);
+    }
+
+    size_t reaped[3] = { 0, 0, 0 };  // 活跃、回应ping、无数据
+    int64_t firstReap = -1, lastReap = -1;
+    for (size_t i = 0; i < count; ++i) {
+        const FakePtr &s = sessions[i];
+        if (s->closedAt >= 0) {
+            ++reaped[i % 10 == 0 ? 0 : (s->answersPing ? 1 : 2)];
+            firstReap = firstReap < 0 ? s->closedAt : std::min(firstReap, s->closedAt);
+            lastReap = std::max(lastReap, s->closedAt);
+        }
+    }
+
+    jw::IdleReaperStats stats = reaper.getStats();
+    printf("%lu sessions, %lld ticks: avg %.1f us/tick, max %.1f us/tick\n", (unsigned long)count, (long long)seconds, totalUs / seconds, maxUs);
+    printf("reaped active %lu, ping answering %lu, silent %lu/%lu (at %lld..%lld s), pinged %llu, still watched %lu\n",
+        (unsigned long)reaped[0], (unsigned long)reaped[1], (unsigned long)reaped[2], (unsigned long)(count * 8 / 10),
+        (long long)firstReap, (long long)lastReap, (unsigned long long)stats.pinged, (unsigned long)stats.watched);
+}
+
+static void _Spin(std::chrono::microseconds duration) {
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+// 事件循环延迟测试：一个线程运行的io_service，每秒到达800个事件，每个事件必做的处理0.2ms，可选的广播2ms
+// 不卸载时处理能力不足，排队越来越长；卸载时负载等级不为Normal就跳过广播
+// 统计事件从post到执行的实际等待时间，以及监测到的延迟
+static void _BenchmarkLoopLag(bool shed) {
+    typedef std::chrono::steady_clock Clock;
+    asio::io_service service;
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::thread worker([&service]() { service.run(); });
+
+    jw::LoopLagMonitor monitor;
+    monitor.attach(service);
+
+    std::vector<int64_t> waits;
+    std::atomic<size_t> shedCount{ 0 };
+    std::atomic<size_t> doneCount{ 0 };
+    const size_t rate = 800;
+    const std::chrono::seconds duration(3);
+    const size_t total = rate * (size_t)duration.count();
+    waits.reserve(total);
+    std::vector<char> levelsSeen(3, 0);
+    std::chrono::microseconds maxObserved(0);
+
+    Clock::time_point begin = Clock::now();
+    for (size_t i = 0; i < total; ++i) {
+        Clock::time_point due = begin + std::chrono::microseconds(1000000 / rate * i);
+        std::this_thread::sleep_until(due);
+        Clock::time_point posted = Clock::now();
+        service.post([&, posted, shed]() {
+            waits.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - posted).count());
+            _Spin(std::chrono::microseconds(200));
+            if (shed && monitor.level() != jw::LoadLevel::Normal) {
+                ++shedCount;
+            }
+            else {
+                _Spin(std::chrono::microseconds(2000));
+            }
+            ++doneCount;
+        });
+        if (i % (rate / 10) == 0) {
+            jw::LoopLagStats stats = monitor.getStats();
+            levelsSeen[(size_t)stats.level] = 1;
+            maxObserved = std::max(maxObserved, stats.lag);
+        }
+    }
+    while (doneCount < total) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // 等延迟回落
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    jw::LoopLagStats stats = monitor.getStats();
+    work.reset();
+    service.stop();
+    worker.join();
+
+    std::sort(waits.begin(), waits.end());
+    printf("%s: wait p50 %.1f ms, p99 %.1f ms, max %.1f ms; shed %lu/%lu; monitored lag max %.1f ms, peak %.1f ms, after recovery %.1f ms, level changes %llu (seen %s%s%s)\n",
+        shed ? "shed optional work" : "no shedding",
+        waits[waits.size() / 2] / 1000.0, waits[waits.size() * 99 / 100] / 1000.0, waits.back() / 1000.0,
+        (unsigned long)shedCount.load(), (unsigned long)total,
+        maxObserved.count() / 1000.0, stats.peakLag.count() / 1000.0, stats.lag.count() / 1000.0, (unsigned long long)stats.levelChanges,
+        levelsSeen[0] ? "Normal " : "", levelsSeen[1] ? "Shedding " : "", levelsSeen[2] ? "Overloaded" : "");
+}
+
+static void _BenchmarkLoopLags() {
+    _BenchmarkLoopLag(false);
+    _BenchmarkLoopLag(true);
+}
+
+// 线程拓扑测试：echo服务端的会话轮询分配在按topology建立的IOServicePool上，客户端用一个独立的io_service线程
+// 64个连接各自循环发一个包、等回显，统计每秒往返次数
+static double _BenchmarkTopology(size_t serviceCount, size_t threadsPerService, const std::vector<jw::CpuSet> &threadCpus, std::chrono::milliseconds duration) {
+    typedef jw::BasicSession<jw::PacketSplitter, 4096U> EchoSession;
+    const size_t connections = 64;
+
+    struct EchoClient {
+        asio::ip::tcp::socket socket;
+        std::vector<char> readBuf;
+        explicit EchoClient(asio::io_service &service) : socket(service) { }
+    };
+
+    jw::IOServicePool pool(serviceCount, threadsPerService, threadCpus);
+    asio::io_service clientService(1);
+    asio::ip::tcp::acceptor acceptor(clientService, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::vector<EchoSession::SessionPtr> sessions;
+    std::vector<std::unique_ptr<EchoClient> > clients;
+    for (size_t i = 0; i < connections; ++i) {
+        clients.push_back(std::unique_ptr<EchoClient>(new EchoClient(clientService)));
+        clients.back()->socket.connect(acceptor.local_endpoint());
+        clients.back()->socket.set_option(asio::ip::tcp::no_delay(true));
+
+        asio::ip::tcp::socket server(pool.getNextService());
+        acceptor.accept(server);
+        server.set_option(asio::ip::tcp::no_delay(true));
+        sessions.push_back(EchoSession::SessionPtr(new EchoSession(std::move(server), [](const EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+            if (event == jw::SessionEvent::Recv && data != nullptr) {
+                std::vector<char> buf(4 + length);
+                buf[0] = (char)(length & 0xFF);
+                buf[1] = (char)((length >> 8) & 0xFF);
+                buf[2] = (char)((length >> 16) & 0xFF);
+                buf[3] = (char)((length >> 24) & 0xFF);
+                std::copy(data, data + length, buf.begin() + 4);
+                s->deliver(std::move(buf));
+            }
+        })));
+        sessions.back()->start();
+    }
+
+    const std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    std::atomic<bool> running{ true };
+    std::atomic<uint64_t> roundTrips{ 0 };
+    std::function<void (EchoClient *)> ping = [&](EchoClient *c) {
+        asio::async_write(c->socket, asio::buffer(packet), [&, c](std::error_code ec, size_t) {
+            if (ec) {
+                return;
+            }
+            c->readBuf.resize(packet.size());
+            asio::async_read(c->socket, asio::buffer(c->readBuf), [&, c](std::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                ++roundTrips;
+                if (running) {
+                    ping(c);
+                }
+            });
+        });
+    };
+    for (size_t i = 0; i < connections; ++i) {
+        ping(clients[i].get());
+    }
+
+    pool.start();
+    std::thread clientThread([&clientService]() { clientService.run(); });
+    std::this_thread::sleep_for(duration);
+    running = false;
+    clientThread.join();
+    uint64_t count = roundTrips;
+
+    for (size_t i = 0; i < connections; ++i) {
+        std::error_code ec;
+        clients[i]->socket.close(ec);
+    }
+    pool.stop();
+    sessions.clear();
+
+    return count / std::chrono::duration_cast<std::chrono::duration<double> >(duration).count();
+}
+
+static void _BenchmarkTopologies() {
+    const std::chrono::milliseconds duration(3000);
+    std::vector<jw::CpuSet> nodes = jw::getNumaNodes();
+    jw::CpuSet allCpus;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        allCpus.insert(allCpus.end(), nodes[i].begin(), nodes[i].end());
+    }
+    size_t hc = allCpus.size();
+    printf("%lu cpu(s) in %lu NUMA node(s)\n", (unsigned long)hc, (unsigned long)nodes.size());
+
+    printf("shared service, %2lu threads, unpinned | %8.0f msg/s\n", (unsigned long)(hc * 2 + 2),
+        _BenchmarkTopology(1, hc * 2 + 2, std::vector<jw::CpuSet>(), duration));
+    printf("shared service, %2lu threads, unpinned | %8.0f msg/s\n", (unsigned long)hc,
+        _BenchmarkTopology(1, hc, std::vector<jw::CpuSet>(), duration));
+    printf("service per cpu, %2lu threads, unpinned | %8.0f msg/s\n", (unsigned long)hc,
+        _BenchmarkTopology(hc, 1, std::vector<jw::CpuSet>(), duration));
+    jw::ThreadTopology pinned = jw::ThreadTopology::servicePerCpu(allCpus);
+    printf("service per cpu, %2lu threads, pinned   | %8.0f msg/s\n", (unsigned long)hc,
+        _BenchmarkTopology(pinned.serviceCount, 1, pinned.ioCpus, duration));
+    for (size_t node = 0; nodes.size() > 1 && node < nodes.size(); ++node) {
+        jw::ThreadTopology local = jw::ThreadTopology::singleNumaNode(node);
+        printf("NUMA node %lu (cpu %s), pinned          | %8.0f msg/s\n", (unsigned long)node, jw::formatCpuList(nodes[node]).c_str(),
+            _BenchmarkTopology(local.serviceCount, 1, local.ioCpus, duration));
+    }
+}
+
+// 在包体前加4字节长度，原样发回
+static std::vector<char> _EchoPacket(const char *data, size_t length) {
+    std::vector<char> buf(4 + length);
+    buf[0] = (char)(length & 0xFF);
+    buf[1] = (char)((length >> 8) & 0xFF);
+    buf[2] = (char)((length >> 16) & 0xFF);
+    buf[3] = (char)((length >> 24) & 0xFF);
+    std::copy(data, data + length, buf.begin() + 4);
+    return buf;
+}
+
+// io线程池伸缩测试：echo服务端的会话轮询分配在IOServicePool上，按缩短了采样间隔的ScalingPolicy在1到maxWorkers之间伸缩
+// 64个连接先各自循环发包、等回显，1秒后开始伸缩，再过3秒后空闲3秒，最后每个连接再往返一次，检查缩容时迁移过的连接仍然可用
+// serviceCount为1时伸缩运行它的线程数，否则伸缩运行的io_service个数；都从initialWorkers开始，连接分布在开始时运行的io_service上
+// blockingWork不为0时服务端每个回显先阻塞这么久（模拟阻塞的处理，单核上也能靠加线程提高吞吐），并检查扩容后最后1秒的吞吐高于伸缩之前
+// 按io_service伸缩时已有的连接不随扩容移动，扩容只分担新连接，所以只在serviceCount为1时检查吞吐
+static void _BenchmarkScaling(size_t serviceCount, size_t initialWorkers, size_t maxWorkers, std::chrono::microseconds blockingWork) {
+    typedef jw::BasicSession<jw::PacketSplitter, 4096U> EchoSession;
+    typedef std::chrono::steady_clock Clock;
+    const size_t connections = 64;
+
+    struct EchoClient {
+        asio::ip::tcp::socket socket;
+        std::vector<char> readBuf;
+        explicit EchoClient(asio::io_service &service) : socket(service) { }
+    };
+
+    jw::IOServicePool pool(serviceCount, serviceCount == 1 ? initialWorkers : 1, std::vector<jw::CpuSet>(), serviceCount == 1 ? 1 : initialWorkers, maxWorkers);
+    asio::io_service clientService(1);
+    asio::ip::tcp::acceptor acceptor(clientService, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::vector<EchoSession::SessionPtr> sessions;
+    std::vector<std::unique_ptr<EchoClient> > clients;
+    for (size_t i = 0; i < connections; ++i) {
+        clients.push_back(std::unique_ptr<EchoClient>(new EchoClient(clientService)));
+        clients.back()->socket.connect(acceptor.local_endpoint());
+        clients.back()->socket.set_option(asio::ip::tcp::no_delay(true));
+
+        asio::ip::tcp::socket server(pool.getNextService());
+        acceptor.accept(server);
+        server.set_option(asio::ip::tcp::no_delay(true));
+        sessions.push_back(EchoSession::SessionPtr(new EchoSession(std::move(server), [blockingWork](const EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+            if (event == jw::SessionEvent::Recv && data != nullptr) {
+                if (blockingWork.count() != 0) {
+                    std::this_thread::sleep_for(blockingWork);
+                }
+                s->deliver(_EchoPacket(data, length));
+            }
+        })));
+        sessions.back()->start();
+    }
+
+    std::atomic<uint64_t> migrated{ 0 };
+    jw::ScalingHooks hooks;
+    hooks.migrate = [&](asio::io_service &service) {
+        size_t remaining = 0;
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            const EchoSession::SessionPtr &s = sessions[i];
+            if (&s->getIOService() != &service || !s->isConnected()) {
+                continue;
+            }
+            ++remaining;
+            if (!s->isMigrating()) {
+                s->migrate(pool.getNextService(), [&migrated](bool moved) {
+                    if (moved) {
+                        ++migrated;
+                    }
+                });
+            }
+        }
+        return remaining;
+    };
+    jw::ScalingPolicy policy;
+    policy.maxWorkers = maxWorkers;
+    policy.interval = std::chrono::milliseconds(100);
+    policy.scaleUpUtilization = 0.4;
+    policy.scaleDownUtilization = 0.1;
+    policy.scaleUpSamples = 2;
+    policy.scaleDownSamples = 5;
+    policy.cooldown = std::chrono::milliseconds(200);
+    pool.start();
+
+    const std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    std::atomic<bool> running{ true };
+    std::atomic<uint64_t> roundTrips{ 0 };
+    std::function<void (EchoClient *)> ping = [&](EchoClient *c) {
+        asio::async_write(c->socket, asio::buffer(packet), [&, c](std::error_code ec, size_t) {
+            if (ec) {
+                return;
+            }
+            c->readBuf.resize(packet.size());
+            asio::async_read(c->socket, asio::buffer(c->readBuf), [&, c](std::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                ++roundTrips;
+                if (running) {
+                    ping(c);
+                }
+            });
+        });
+    };
+    for (size_t i = 0; i < connections; ++i) {
+        ping(clients[i].get());
+    }
+
+    std::unique_ptr<asio::io_service::work> clientWork(new asio::io_service::work(clientService));
+    std::thread clientThread([&clientService]() { clientService.run(); });
+    // 伸缩之前和扩容之后各取1秒的吞吐
+    const std::chrono::milliseconds sample(1000);
+    const std::chrono::milliseconds phase(3000);
+    std::this_thread::sleep_for(sample);
+    double baseRate = roundTrips / std::chrono::duration_cast<std::chrono::duration<double> >(sample).count();
+    pool.startScaling(policy, hooks);
+    std::this_thread::sleep_for(phase - sample);
+    uint64_t scaledBegin = roundTrips;
+    std::this_thread::sleep_for(sample);
+    double scaledRate = (roundTrips - scaledBegin) / std::chrono::duration_cast<std::chrono::duration<double> >(sample).count();
+    running = false;
+    size_t peakWorkers = pool.getScalingStats().workers;
+    std::this_thread::sleep_for(phase);
+    jw::ScalingStats idle = pool.getScalingStats();
+
+    // 空闲后每个连接往返一次
+    uint64_t before = roundTrips;
+    for (size_t i = 0; i < connections; ++i) {
+        clientService.post(std::bind(ping, clients[i].get()));
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(2);
+    while (roundTrips - before < connections && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint64_t echoed = roundTrips - before;
+    jw::ScalingStats stats = pool.getScalingStats();
+
+    for (size_t i = 0; i < connections; ++i) {
+        std::error_code ec;
+        clients[i]->socket.close(ec);
+    }
+    clientWork.reset();
+    clientThread.join();
+    pool.stop();
+    sessions.clear();
+
+    // 吞吐至少提高一半才算扩容有效
+    bool faster = blockingWork.count() == 0 || (peakWorkers > initialWorkers && scaledRate > baseRate * 1.5);
+    printf("%s | load %8.0f -> %8.0f msg/s, %lu %s | idle %lu %s, utilization %.0f%%, lag %lld us | migrated %llu | echo after idle %llu/%lu | up %llu, down %llu, aborted %llu | %s\n",
+        serviceCount == 1 ? "shared service   " : "service per core ", baseRate, scaledRate,
+        (unsigned long)peakWorkers, serviceCount == 1 ? "thread(s) " : "service(s)", (unsigned long)idle.workers, serviceCount == 1 ? "thread(s) " : "service(s)",
+        idle.utilization * 100.0, (long long)idle.lag.count(), (unsigned long long)migrated.load(), (unsigned long long)echoed, (unsigned long)connections,
+        (unsigned long long)stats.scaleUps, (unsigned long long)stats.scaleDowns, (unsigned long long)stats.abortedScaleDowns,
+        echoed == connections && idle.workers == 1 && faster ? "PASS" : "FAIL");
+}
+
+static void _BenchmarkScalings() {
+    _BenchmarkScaling(1, 1, 8, std::chrono::microseconds(2000));
+    _BenchmarkScaling(4, 2, 4, std::chrono::microseconds(0));
+}
+
+// 同一个回环上的echo负载压BasicSession，uring为true时io_service启用io_uring（不支持时照常走asio），都只用一个事件循环线程
+// 每个客户端连接一问一答，答到了再发下一个
+static double _BenchmarkUring(bool uring, size_t connections, std::chrono::milliseconds duration, double *entersPerMessage) {
+    typedef jw::BasicSession<jw::PacketSplitter, 4096U> EchoSession;
+
+    struct EchoClient {
+        asio::ip::tcp::socket socket;
+        std::vector<char> readBuf;
+        explicit EchoClient(asio::io_service &service) : socket(service) { }
+    };
+
+    jw::IOServicePool pool(1, 1);
+    jw::UringService *uringService = uring && pool.enableUring() ? jw::UringService::find(pool.getService(0)) : nullptr;
+    asio::ip::tcp::acceptor acceptor(pool.getNextService(), asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    std::vector<EchoSession::SessionPtr> sessions;
+    std::function<void ()> accept = [&]() {
+        std::shared_ptr<asio::ip::tcp::socket> socket = std::make_shared<asio::ip::tcp::socket>(pool.getNextService());
+        acceptor.async_accept(*socket, [&, socket](std::error_code ec) {
+            if (ec) {
+                return;
+            }
+            socket->set_option(asio::ip::tcp::no_delay(true));
+            sessions.push_back(EchoSession::SessionPtr(new EchoSession(std::move(*socket), [](const EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+                if (event == jw::SessionEvent::Recv && data != nullptr) {
+                    s->deliver(_EchoPacket(data, length));
+                }
+            })));
+            sessions.back()->start();
+            accept();
+        });
+    };
+    unsigned short port = acceptor.local_endpoint().port();
+    accept();
+    pool.start();
+
+    asio::io_service clientService(1);
+    std::vector<std::unique_ptr<EchoClient> > clients;
+    for (size_t i = 0; i < connections; ++i) {
+        clients.push_back(std::unique_ptr<EchoClient>(new EchoClient(clientService)));
+        clients.back()->socket.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+        clients.back()->socket.set_option(asio::ip::tcp::no_delay(true));
+    }
+
+    const std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    std::atomic<bool> running{ true };
+    std::atomic<uint64_t> roundTrips{ 0 };
+    std::function<void (EchoClient *)> ping = [&](EchoClient *c) {
+        asio::async_write(c->socket, asio::buffer(packet), [&, c](std::error_code ec, size_t) {
+            if (ec) {
+                return;
+            }
+            c->readBuf.resize(packet.size());
+            asio::async_read(c->socket, asio::buffer(c->readBuf), [&, c](std::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                ++roundTrips;
+                if (running) {
+                    ping(c);
+                }
+            });
+        });
+    };
+    for (size_t i = 0; i < connections; ++i) {
+        ping(clients[i].get());
+    }
+
+    std::thread clientThread([&clientService]() { clientService.run(); });
+    std::this_thread::sleep_for(duration);
+    running = false;
+    clientThread.join();
+    uint64_t count = roundTrips;
+
+    *entersPerMessage = uringService != nullptr && count > 0 ? (double)uringService->getEnterCount() / count : 0.0;
+    for (size_t i = 0; i < connections; ++i) {
+        std::error_code ec;
+        clients[i]->socket.close(ec);
+    }
+    pool.stop();
+    sessions.clear();
+
+    return count / std::chrono::duration_cast<std::chrono::duration<double> >(duration).count();
+}
+
+static void _BenchmarkUrings() {
+    const std::chrono::milliseconds duration(3000);
+    bool supported = jw::isUringSupported();
+    if (!supported) {
+        puts("io_uring not supported, only the asio path is measured");
+    }
+    const size_t connectionCounts[] = { 1, 16, 128 };
+    for (size_t i = 0; i < sizeof(connectionCounts) / sizeof(connectionCounts[0]); ++i) {
+        double entersPerMessage;
+        printf("asio     %3lu connections | %8.0f msg/s\n", (unsigned long)connectionCounts[i],
+            _BenchmarkUring(false, connectionCounts[i], duration, &entersPerMessage));
+        if (supported) {
+            double msgs = _BenchmarkUring(true, connectionCounts[i], duration, &entersPerMessage);
+            printf("io_uring %3lu connections | %8.0f msg/s | %.3f io_uring_enter/msg\n", (unsigned long)connectionCounts[i], msgs, entersPerMessage);
+        }
+    }
+}
+
+// 回显延迟的分布
+struct _LatencyResult {
+    double avg;
+    double p50;
+    double p99;
+    double max;
+    size_t samples;
+    size_t lost;  // 结束时仍未收到回显的包
+    uint64_t timeoutRetransmits;
+    uint64_t fastRetransmits;
+};
+
+// 多个可靠UDP客户端每20ms发一个带发出时刻的包，服务端经转发的BasicSession原样发回，统计往返延迟
+// 客户端和服务端发出的数据报都经同样参数的LossSimulator；发送结束后再等3秒收完重传的回显
+static _LatencyResult _BenchmarkReliableUdp(const jw::ReliableConfig &config, const jw::LossPolicy &loss, size_t clients, std::chrono::milliseconds duration) {
+    typedef jw::BasicSession<jw::PacketSplitter, 1024U> EchoSession;
+    typedef jw::ReliableUdpServer<EchoSession> EchoServer;
+
+    asio::io_service service(1);
+    std::shared_ptr<EchoServer> server = std::make_shared<EchoServer>(service, 0, config, loss);
+    server->start([&service](EchoServer &server, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        if (type == jw::LinkFrame::Open) {
+            EchoSession::SessionPtr s(new EchoSession(asio::ip::tcp::socket(service), [](const EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+                if (event == jw::SessionEvent::Recv && data != nullptr) {
+                    s->deliver(_EchoPacket(data, length));
+                }
+            }));
+            s->startRelay(server.shared_from_this(), id, std::string(data, length), 0);
+            server.bind(id, s);
+        }
+        else if (type == jw::LinkFrame::Data) {
+            EchoSession::SessionPtr s = server.find(id);
+            if (s != nullptr) {
+                s->relayRecv(data, length);
+            }
+        }
+        else {
+            EchoSession::SessionPtr s = server.unbind(id);
+            if (s != nullptr) {
+                s->relayClosed();
+            }
+        }
+    });
+
+    typedef std::chrono::steady_clock Clock;
+    std::vector<double> samples;
+    size_t sent = 0;
+    asio::ip::udp::endpoint endpoint(asio::ip::address_v4::loopback(), server->getLocalPort());
+    std::vector<std::shared_ptr<jw::ReliableUdpClient> > udpClients;
+    for (size_t i = 0; i < clients; ++i) {
+        udpClients.push_back(std::make_shared<jw::ReliableUdpClient>(service, config, loss, (uint32_t)(1000 + i)));
+        udpClients.back()->connect(endpoint, (uint32_t)(0x10000 + i), [&samples](const char *data, size_t length) {
+            int64_t sentAt;
+            if (data != nullptr && length >= sizeof(sentAt)) {
+                memcpy(&sentAt, data, sizeof(sentAt));
+                samples.push_back((std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count() - sentAt) / 1000.0);
+            }
+        });
+    }
+
+    Clock::time_point deadline = Clock::now() + duration;
+    asio::steady_timer sendTimer(service), stopTimer(service);
+    std::function<void ()> sendAll = [&]() {
+        if (Clock::now() >= deadline) {
+            return;
+        }
+        for (size_t i = 0; i < clients; ++i) {
+            std::string body(32, 'x');
+            int64_t sentAt = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+            memcpy(&body[0], &sentAt, sizeof(sentAt));
+            udpClients[i]->deliver(jw::PacketSplitter::encodeSendPacket(body));
+            ++sent;
+        }
+        sendTimer.expires_from_now(std::chrono::milliseconds(20));
+        sendTimer.async_wait([&](std::error_code ec) {
+            if (!ec) {
+                sendAll();
+            }
+        });
+    };
+    sendAll();
+    stopTimer.expires_at(deadline + std::chrono::seconds(3));
+    stopTimer.async_wait([&service](std::error_code) {
+        service.stop();
+    });
+    service.run();
+
+    _LatencyResult result;
+    memset(&result, 0, sizeof(result));
+    for (size_t i = 0; i < clients; ++i) {
+        jw::ReliableStats stats = udpClients[i]->getStats();
+        result.timeoutRetransmits += stats.timeoutRetransmits;
+        result.fastRetransmits += stats.fastRetransmits;
+    }
+    jw::ReliableServerStats serverStats = server->getStats();
+    result.timeoutRetransmits += serverStats.channels.timeoutRetransmits;
+    result.fastRetransmits += serverStats.channels.fastRetransmits;
+    // 会话持有服务端，断开引用环
+    server->unbindAll();
+
+    std::sort(samples.begin(), samples.end());
+    result.samples = samples.size();
+    result.lost = sent - samples.size();
+    if (!samples.empty()) {
+        double sum = 0.0;
+        for (size_t i = 0; i < samples.size(); ++i) {
+            sum += samples[i];
+        }
+        result.avg = sum / samples.size();
+        result.p50 = samples[samples.size() / 2];
+        result.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+        result.max = samples.back();
+    }
+    return result;
+}
+
+// 单向延迟20ms（抖动2ms），丢包率0~5%，对比TCP的重传参数和低延迟的重传参数
+// 回环上无法让内核的TCP丢包，两者都在同一个可靠UDP实现上运行，只有重传、确认和拥塞控制的参数不同（见ReliableConfig::tcpLike）
+static void _BenchmarkReliableUdps() {
+    const std::chrono::milliseconds duration(5000);
+    const double lossRates[] = { 0.0, 0.01, 0.03, 0.05 };
+    for (size_t i = 0; i < sizeof(lossRates) / sizeof(lossRates[0]); ++i) {
+        jw::LossPolicy loss;
+        loss.lossRate = lossRates[i];
+        loss.latency = 20;
+        loss.jitter = 2;
+        for (int k = 0; k < 2; ++k) {
+            _LatencyResult r = _BenchmarkReliableUdp(k == 0 ? jw::ReliableConfig::tcpLike() : jw::ReliableConfig(), loss, 8, duration);
+            printf("%-9s loss %2.0f%% | rtt avg %6.1fms p50 %6.1fms p99 %6.1fms max %6.1fms | %5lu samples, %lu lost | %4llu timeout + %4llu fast retransmits\n",
+                k == 0 ? "tcp-like" : "reliable", lossRates[i] * 100.0, r.avg, r.p50, r.p99, r.max, (unsigned long)r.samples, (unsigned long)r.lost,
+                (unsigned long long)r.timeoutRetransmits, (unsigned long long)r.fastRetransmits);
+        }
+    }
+}
+
+// 机器人循环：每个客户端保持window个回显在途，收到一个发一个，直到deadline；一轮什么都没收到时让出CPU
+static void _RunLoopbackBots(std::vector<std::unique_ptr<jw::LoopbackClient> > &clients, size_t window, std::chrono::steady_clock::time_point deadline) {
+    const std::vector<char> packet = jw::PacketSplitter::encodeSendPacket(std::string(60, 'x'));
+    std::vector<size_t> outstanding(clients.size(), 0);
+    while (std::chrono::steady_clock::now() < deadline) {
+        size_t received = 0;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            size_t &n = outstanding[i];
+            received += clients[i]->receive([&n](const char *, size_t) {
+                --n;
+            });
+            while (n < window && clients[i]->deliver(packet.data(), packet.size())) {
+                ++n;
+            }
+        }
+        if (received == 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// 回环传输上的echo：服务端在一个io_service线程上，经转发的BasicSession原样发回
+// 机器人在同一进程的另一个线程上（shared为false），或在fork出的子进程中经共享内存（shared为true，仅Linux）
+// 以服务端收到的包数计算吞吐
+static double _BenchmarkLoopback(bool shared, size_t clients, size_t window, std::chrono::milliseconds duration) {
+    typedef jw::BasicSession<jw::PacketSplitter, 4096U> EchoSession;
+    typedef jw::LoopbackServer<EchoSession> EchoServer;
+
+    jw::LoopbackConfig config;
+    config.slots = (uint32_t)clients;
+    config.ringCapacity = 64U * 1024U;
+    std::string name = "jw-bench-loopback-" + std::to_string((long long)
+#if defined(__linux__)
+        getpid()
+#else
+        0
+#endif
+        );
+    std::shared_ptr<jw::LoopbackRegion> region = shared ? jw::LoopbackRegion::createShared(name, config) : jw::LoopbackRegion::createPrivate(config);
+    if (region == nullptr) {
+        return 0.0;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point begin = Clock::now() + std::chrono::milliseconds(300);
+    Clock::time_point end = begin + duration;
+    Clock::time_point deadline = end + std::chrono::milliseconds(100);
+
+#if defined(__linux__)
+    pid_t child = -1;
+    if (shared) {
+        // 子进程在启动任何线程之前fork
+        child = fork();
+        if (child == 0) {
+            std::shared_ptr<jw::LoopbackRegion> childRegion = jw::LoopbackRegion::openShared(name);
+            std::vector<std::unique_ptr<jw::LoopbackClient> > bots;
+            for (size_t i = 0; childRegion != nullptr && i < clients; ++i) {
+                bots.push_back(jw::LoopbackClient::connect(childRegion, std::function<void ()>()));
+            }
+            _RunLoopbackBots(bots, window, deadline);
+            bots.clear();
+            _exit(0);
+        }
+    }
+#endif
+
+    asio::io_service service(1);
+    std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+    std::shared_ptr<EchoServer> server = std::make_shared<EchoServer>(service, region, config);
+    server->start([&service](EchoServer &server, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        if (type == jw::LinkFrame::Open) {
+            EchoSession::SessionPtr s(new EchoSession(asio::ip::tcp::socket(service), [](const EchoSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+                if (event == jw::SessionEvent::Recv && data != nullptr) {
+                    s->deliver(_EchoPacket(data, length));
+                }
+            }));
+            s->startRelay(server.shared_from_this(), id, std::string(data, length), 0);
+            server.bind(id, s);
+        }
+        else if (type == jw::LinkFrame::Data) {
+            EchoSession::SessionPtr s = server.find(id);
+            if (s != nullptr) {
+                s->relayRecv(data, length);
+            }
+        }
+        else {
+            EchoSession::SessionPtr s = server.unbind(id);
+            if (s != nullptr) {
+                s->relayClosed();
+            }
+        }
+    });
+    std::thread serverThread([&service]() { service.run(); });
+
+    std::thread botThread;
+    if (!shared) {
+        botThread = std::thread([&]() {
+            std::vector<std::unique_ptr<jw::LoopbackClient> > bots;
+            for (size_t i = 0; i < clients; ++i) {
+                bots.push_back(server->connect());
+            }
+            _RunLoopbackBots(bots, window, deadline);
+        });
+    }
+
+    std::this_thread::sleep_until(begin);
+    uint64_t first = server->getStats().receivedPackets;
+    std::this_thread::sleep_until(end);
+    uint64_t count = server->getStats().receivedPackets - first;
+
+    if (botThread.joinable()) {
+        botThread.join();
+    }
+#if defined(__linux__)
+    if (child > 0) {
+        waitpid(child, nullptr, 0);
+    }
+#endif
+    // 停止后会话的写完成和轮询都不再投递新的任务，run随之返回
+    server->stop();
+    work.reset();
+    serverThread.join();
+
+    return count / std::chrono::duration_cast<std::chrono::duration<double> >(duration).count();
+}
+
+// 同样的60字节echo分别经TCP回环（一问一答）、同一进程内的回环传输和跨进程的共享内存回环传输
+static void _BenchmarkLoopbacks() {
+    const std::chrono::milliseconds duration(3000);
+    const size_t clients = 16;
+    double entersPerMessage;
+    printf("tcp                %3lu clients, window  1 | %9.0f msg/s\n", (unsigned long)clients,
+        _BenchmarkUring(false, clients, duration, &entersPerMessage));
+    const size_t windows[] = { 1, 32 };
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i) {
+        printf("loopback in-proc   %3lu clients, window %2lu | %9.0f msg/s\n", (unsigned long)clients, (unsigned long)windows[i],
+            _BenchmarkLoopback(false, clients, windows[i], duration));
+#if defined(__linux__)
+        printf("loopback shm proc  %3lu clients, window %2lu | %9.0f msg/s\n", (unsigned long)clients, (unsigned long)windows[i],
+            _BenchmarkLoopback(true, clients, windows[i], duration));
+#endif
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench-send-queue") == 0) {
+        _BenchmarkSendQueues();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "count-handler-alloc") == 0) {
+#if COUNT_HEAP_ALLOC
+        return _CountHandlerAllocations();
+#else
+        printf("count-handler-alloc needs a build with -DCOUNT_HEAP_ALLOC=1\n");
+        return 1;
+#endif
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-send-lanes") == 0) {
+        _BenchmarkSendLanes();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-latest-wins") == 0) {
+        _BenchmarkLatestWins();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-rate-limit") == 0) {
+        _BenchmarkRateLimit();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-idle-reaper") == 0) {
+        _BenchmarkIdleReaper();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-loop-lag") == 0) {
+        _BenchmarkLoopLags();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-topology") == 0) {
+        _BenchmarkTopologies();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-uring") == 0) {
+        _BenchmarkUrings();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-reliable-udp") == 0) {
+        _BenchmarkReliableUdps();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-loopback") == 0) {
+        _BenchmarkLoopbacks();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-scaling") == 0) {
+        _BenchmarkScalings();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-echo") == 0) {
+        _BenchmarkEchoes();
+        return 0;
+    }
 
-int main() {
     auto te = jw::TimerEngine::getInstance();
     te->registerTimer(1, std::chrono::milliseconds(1000), jw::TimerEngine::REPEAT_FOREVER, [&te](int64_t dt) {
         LOG_INFO("timer dt = %I64d", dt);
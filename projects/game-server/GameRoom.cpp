@@ -7,7 +7,16 @@
 #define CMD_CHAT_IN_ROOM 3004
 #define CMD_FORCED_STAND_UP 3005
 
-void GameRoom::deliver(const std::shared_ptr<UserType> &user, unsigned cmd, unsigned tag, const jw::cppJSON &jsonRecv) {
+CommandClass GameRoom::classifyCommand(unsigned cmd) {
+    switch (cmd) {
+    case CMD_ENTER: return CommandClass::Enter;
+    case CMD_CHAT_IN_ROOM: return CommandClass::Chat;
+    case CMD_SIT_DOWN: case CMD_STAND_UP: case CMD_READY: return CommandClass::Lobby;
+    default: return CommandClass::Table;
+    }
+}
+
+void GameRoom::deliver(const UserPtr &user, unsigned cmd, unsigned tag, const jw::cppJSON &jsonRecv) {
     try {
         switch (cmd) {
         case CMD_ENTER: handleEnter(cmd, tag, user, jsonRecv); return;
@@ -23,7 +32,7 @@ void GameRoom::deliver(const std::shared_ptr<UserType> &user, unsigned cmd, unsi
     }
 }
 
-void GameRoom::addUser(const std::shared_ptr<UserType> &user) {
+void GameRoom::addUser(const UserPtr &user) {
     std::lock_guard<jw::QuickMutex> g(_mutex);
     (void)g;
     user->name = user->getRemoteIP() + ":" + std::to_string(user->getRemotePort());
@@ -32,28 +41,121 @@ void GameRoom::addUser(const std::shared_ptr<UserType> &user) {
     LOG_INFO("%I64d", user->id);
 }
 
-void GameRoom::removeUser(const std::shared_ptr<UserType> &user) {
+void GameRoom::removeUser(const UserPtr &user) {
     std::lock_guard<jw::QuickMutex> g(_mutex);
     (void)g;
+    // 读失败和写失败都会走到这里，只处理一次
+    if (_userSet.erase(user) == 0) {
+        return;
+    }
     int table = user->table;
     int seat = user->seat;
-    int64_t id = user->id;
     if (isValidTable(table, seat)) {
         _table[table].forcedStandUp(seat);
     }
-    _userSet.erase(user);
 
     jw::cppJSON jsonSend(jw::cppJSON::ValueType::Object);
     jsonSend.insert(std::make_pair("id", user->id));
     jsonSend.insert(std::make_pair("table", table));
     jsonSend.insert(std::make_pair("seat", seat));
-    std::vector<char> buf = user->encodeSendPacket(CMD_FORCED_STAND_UP, PUSH_SERVICE_TAG, jsonSend);
-    std::for_each(_userSet.begin(), _userSet.end(), [&buf](const std::shared_ptr<UserType> &s) {
+    jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(CMD_FORCED_STAND_UP, PUSH_SERVICE_TAG, jsonSend));
+    std::for_each(_userSet.begin(), _userSet.end(), [&buf](const UserPtr &s) {
         s->deliver(buf);
     });
 }
 
-void GameRoom::handleEnter(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+std::vector<GameRoom::UserPtr> GameRoom::getUsers() {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+    return std::vector<UserPtr>(_userSet.begin(), _userSet.end());
+}
+
+void GameRoom::saveState(const std::vector<UserPtr> &users, jw::cppJSON &json) {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+
+    std::pair<jw::cppJSON::iterator, bool> jsonUsers = json.insert(std::make_pair("users", jw::cppJSON(jw::cppJSON::ValueType::Array)));
+    std::for_each(users.begin(), users.end(), [&jsonUsers](const UserPtr &user) {
+        jw::cppJSON jsonUser(jw::cppJSON::ValueType::Object);
+        jsonUser.insert(std::make_pair("id", user->id));
+        jsonUser.insert(std::make_pair("name", user->name));
+        jsonUser.insert(std::make_pair("table", user->table));
+        jsonUser.insert(std::make_pair("seat", user->seat));
+        jsonUser.insert(std::make_pair("status", static_cast<int>(user->status)));
+        jsonUser.insert(std::make_pair("winCount", user->winCount));
+        jsonUser.insert(std::make_pair("tieCount", user->tieCount));
+        jsonUser.insert(std::make_pair("loseCount", user->loseCount));
+        jsonUser.insert(std::make_pair("scores", user->scores));
+        jsonUsers.first->push_back(std::move(jsonUser));
+    });
+
+    std::pair<jw::cppJSON::iterator, bool> jsonTables = json.insert(std::make_pair("tables", jw::cppJSON(jw::cppJSON::ValueType::Array)));
+    for (size_t i = 0; i < TableCount; ++i) {
+        jw::cppJSON jsonTable(jw::cppJSON::ValueType::Object);
+        _table[i].saveState(jsonTable);
+        jsonTables.first->push_back(std::move(jsonTable));
+    }
+}
+
+void GameRoom::restoreState(const jw::cppJSON &json, const std::vector<UserPtr> &users) {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+
+    // 空数组解析回来是null
+    jw::cppJSON::const_iterator jsonUsers = json.find("users");
+    if (jsonUsers != json.end() && jsonUsers->getValueType() == jw::cppJSON::ValueType::Array) {
+        size_t i = 0;
+        for (jw::cppJSON::const_iterator it = jsonUsers->begin(); it != jsonUsers->end() && i < users.size(); ++it, ++i) {
+            const UserPtr &user = users[i];
+            if (user == nullptr) {
+                continue;
+            }
+            user->id = it->getValueByKey<int64_t>("id");
+            user->name = it->getValueByKey<std::string>("name");
+            user->status = static_cast<UserStatus>(it->getValueByKey<int>("status"));
+            user->winCount = it->getValueByKey<uint32_t>("winCount");
+            user->tieCount = it->getValueByKey<uint32_t>("tieCount");
+            user->loseCount = it->getValueByKey<uint32_t>("loseCount");
+            user->scores = it->getValueByKey<int32_t>("scores");
+            int table = it->getValueByKey<int>("table");
+            int seat = it->getValueByKey<int>("seat");
+            if (isValidTable(table, seat) && _table[table].sitDown(user, seat)) {
+                user->table = table;
+                user->seat = seat;
+            }
+            _userSet.insert(user);
+        }
+    }
+
+    // 坐下会清除准备状态，牌局在玩家都坐下之后恢复
+    jw::cppJSON::const_iterator jsonTables = json.find("tables");
+    if (jsonTables != json.end()) {
+        size_t i = 0;
+        for (jw::cppJSON::const_iterator it = jsonTables->begin(); it != jsonTables->end() && i < TableCount; ++it, ++i) {
+            _table[i].restoreState(*it);
+        }
+    }
+}
+
+void GameRoom::resumeTables() {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+    for (size_t i = 0; i < TableCount; ++i) {
+        _table[i].resume();
+    }
+}
+
+// 过载时丢弃的只是发给其他人的聊天和进入时的用户列表，对请求者的回复照常发送
+// 坐下、站起、准备这些大厅广播不丢弃：座位的变化只通知一次，丢掉后其他人的桌子状态不再一致
+bool GameRoom::_shedBroadcast() {
+    if (_loadMonitor == nullptr || _loadMonitor->level() == jw::LoadLevel::Normal) {
+        return false;
+    }
+    ++_shedBroadcasts;
+    return true;
+}
+
+void GameRoom::handleEnter(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
@@ -61,7 +163,7 @@ void GameRoom::handleEnter(unsigned cmd, unsigned tag, const std::shared_ptr<Use
         jw::cppJSON jsonSend(jw::cppJSON::ValueType::Object);
         std::pair<jw::cppJSON::iterator, bool> ret = jsonSend.insert(std::make_pair("users", jw::cppJSON(jw::cppJSON::ValueType::Array)));
         if (ret.second) {
-            std::for_each(_userSet.begin(), _userSet.end(), [&ret](const std::shared_ptr<UserType> &user) {
+            std::for_each(_userSet.begin(), _userSet.end(), [&ret](const UserPtr &user) {
                 jw::cppJSON json(jw::cppJSON::ValueType::Object);
                 json.insert(std::make_pair("id", user->id));
                 json.insert(std::make_pair("name", user->name));
@@ -75,22 +177,24 @@ void GameRoom::handleEnter(unsigned cmd, unsigned tag, const std::shared_ptr<Use
                 ret.first->push_back(std::move(json));
             });
         }
-        std::vector<char> buf = user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend);
-        std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const std::shared_ptr<UserType> &s) {
-            if (s != user) {
-                s->deliver(buf);
-            }
-        });
+        // 广播的是完整的用户列表，丢掉的一次由下一次进入时的列表补上，拥塞或过载时可以丢弃
+        if (!_shedBroadcast()) {
+            jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend));
+            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const UserPtr &s) {
+                if (s != user) {
+                    s->deliver(buf, jw::SendPriority::Bulk);
+                }
+            });
+        }
         jsonSend.insert(std::make_pair("yourId", user->id));
-        buf = user->encodeSendPacket(cmd, tag, jsonSend);
-        user->deliver(buf);
+        user->deliver(user->encodeSendPacket(cmd, tag, jsonSend));
     }
     catch (std::exception &e) {
         LOG_ERROR("%s", e.what());
     }
 }
 
-void GameRoom::handleSitDown(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+void GameRoom::handleSitDown(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
@@ -119,8 +223,9 @@ void GameRoom::handleSitDown(unsigned cmd, unsigned tag, const std::shared_ptr<U
             jsonSend.insert(std::make_pair("id", user->id));
             jsonSend.insert(std::make_pair("table", table));
             jsonSend.insert(std::make_pair("seat", seat));
-            std::vector<char> buf = user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend);
-            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const std::shared_ptr<UserType> &s) {
+            // 座位的变化只通知一次，丢掉后其他人的桌子状态不再一致，所以不丢弃
+            jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend));
+            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const UserPtr &s) {
                 if (user != s) {
                     s->deliver(buf);
                 }
@@ -128,13 +233,12 @@ void GameRoom::handleSitDown(unsigned cmd, unsigned tag, const std::shared_ptr<U
 
             std::pair<jw::cppJSON::iterator, bool> ret = jsonSend.insert(std::make_pair("participants", jw::cppJSON(jw::cppJSON::ValueType::Array)));
             if (ret.second) {
-                const std::shared_ptr<UserType> (&participants)[4] = _table[table].getParticipants();
-                std::for_each(std::begin(participants), std::end(participants), [&ret](const std::shared_ptr<UserType> &user) {
+                const UserPtr (&participants)[4] = _table[table].getParticipants();
+                std::for_each(std::begin(participants), std::end(participants), [&ret](const UserPtr &user) {
                     ret.first->push_back((user != nullptr) ? user->id : 0);
                 });
             }
-            buf = user->encodeSendPacket(cmd, tag, jsonSend);
-            user->deliver(buf);
+            user->deliver(user->encodeSendPacket(cmd, tag, jsonSend));
         }
     }
     catch (std::exception &e) {
@@ -142,7 +246,7 @@ void GameRoom::handleSitDown(unsigned cmd, unsigned tag, const std::shared_ptr<U
     }
 }
 
-void GameRoom::handleStandUp(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+void GameRoom::handleStandUp(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
@@ -159,14 +263,16 @@ void GameRoom::handleStandUp(unsigned cmd, unsigned tag, const std::shared_ptr<U
             user->status = UserStatus::Free;
             jsonSend.insert(std::make_pair("result", true));
             jsonSend.insert(std::make_pair("id", user->id));
-            std::vector<char> buf = user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend);
-            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const std::shared_ptr<UserType> &s) {
+            jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend));
+            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const UserPtr &s) {
                 if (s != user) {
                     s->deliver(buf);
                 }
             });
-            user->modifyTag(buf, tag);
-            user->deliver(buf);
+            // 共享缓冲区不可修改，复制一份再改tag
+            std::vector<char> reply(*buf);
+            user->modifyTag(reply, tag);
+            user->deliver(std::move(reply));
         }
     }
     catch (std::exception &e) {
@@ -174,7 +280,7 @@ void GameRoom::handleStandUp(unsigned cmd, unsigned tag, const std::shared_ptr<U
     }
 }
 
-void GameRoom::handleReady(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+void GameRoom::handleReady(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
@@ -195,14 +301,16 @@ void GameRoom::handleReady(unsigned cmd, unsigned tag, const std::shared_ptr<Use
             user->status = UserStatus::Ready;
             jsonSend.insert(std::make_pair("result", true));
             jsonSend.insert(std::make_pair("id", user->id));
-            std::vector<char> buf = user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend);
-            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const std::shared_ptr<UserType> &s) {
+            jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend));
+            std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const UserPtr &s) {
                 if (s != user) {
                     s->deliver(buf);
                 }
             });
-            user->modifyTag(buf, tag);
-            user->deliver(buf);
+            // 共享缓冲区不可修改，复制一份再改tag
+            std::vector<char> reply(*buf);
+            user->modifyTag(reply, tag);
+            user->deliver(std::move(reply));
         }
     }
     catch (std::exception &e) {
@@ -210,7 +318,7 @@ void GameRoom::handleReady(unsigned cmd, unsigned tag, const std::shared_ptr<Use
     }
 }
 
-void GameRoom::handleChatInRoom(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+void GameRoom::handleChatInRoom(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::string content = jsonRecv.getValueByKey<std::string>("content");
 
@@ -220,11 +328,19 @@ void GameRoom::handleChatInRoom(unsigned cmd, unsigned tag, const std::shared_pt
         jsonSend.insert(std::make_pair("name", user->name));
         jsonSend.insert(std::make_pair("content", content));
 
-        std::vector<char> buf = user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend);
+        jw::SharedBuffer buf = jw::makeSharedBuffer(user->encodeSendPacket(cmd, PUSH_SERVICE_TAG, jsonSend));
+        // 发言者以这个广播作为回复，与其他请求的回复一样走Game通道，过载时也照常发送
+        user->deliver(buf);
+        if (_shedBroadcast()) {
+            return;
+        }
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
-        std::for_each(_userSet.begin(), _userSet.end(), [&buf](const std::shared_ptr<UserType> &s) {
-            s->deliver(buf);
+        // 其他人的一份走Bulk，不挡在牌局的通知前面
+        std::for_each(_userSet.begin(), _userSet.end(), [&buf, &user](const UserPtr &s) {
+            if (s != user) {
+                s->deliver(buf, jw::SendPriority::Bulk);
+            }
         });
     }
     catch (std::exception &e) {
@@ -232,7 +348,7 @@ void GameRoom::handleChatInRoom(unsigned cmd, unsigned tag, const std::shared_pt
     }
 }
 
-void GameRoom::handleTableAction(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv) {
+void GameRoom::handleTableAction(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv) {
     try {
         std::lock_guard<jw::QuickMutex> g(_mutex);
         (void)g;
@@ -241,8 +357,7 @@ void GameRoom::handleTableAction(unsigned cmd, unsigned tag, const std::shared_p
             jw::cppJSON jsonSend(jw::cppJSON::ValueType::Object);
             jsonSend.insert(std::make_pair("result", false));
             jsonSend.insert(std::make_pair("reason", u8"你不在桌子上"));
-            std::vector<char> buf = user->encodeSendPacket(cmd, tag, jsonSend);
-            user->deliver(buf);
+            user->deliver(user->encodeSendPacket(cmd, tag, jsonSend));
         }
         else {
             _table[user->table].deliver(user->seat, cmd, tag, jsonRecv);
@@ -3,27 +3,54 @@
 
 #include "GameTable.h"
 #include "../common-test/BasicRoom.hpp"
+#include "../common-test/LoopLagMonitor.hpp"
+#include <atomic>
 
 class GameRoom : public gs::BasicRoom<GameTable, 100> {
 public:
     typedef gs::BasicRoom<GameTable, 100> BasicRoomType;
     typedef BasicRoomType::UserType UserType;
+    typedef BasicRoomType::UserPtr UserPtr;
 
-    void deliver(const std::shared_ptr<UserType> &user, unsigned cmd, unsigned tag, const jw::cppJSON &jsonRecv);
-    void addUser(const std::shared_ptr<UserType> &user);
-    void removeUser(const std::shared_ptr<UserType> &user);
+    static CommandClass classifyCommand(unsigned cmd);
+
+    void deliver(const UserPtr &user, unsigned cmd, unsigned tag, const jw::cppJSON &jsonRecv);
+    void addUser(const UserPtr &user);
+    void removeUser(const UserPtr &user);
+
+    // 以下用于热重启
+    std::vector<UserPtr> getUsers();
+
+    // 保存users（与json["users"]一一对应）和所有牌桌
+    void saveState(const std::vector<UserPtr> &users, jw::cppJSON &json);
+
+    // users与json["users"]一一对应，为空的（没能接管的连接）跳过；用户保留原来的id并坐回原来的位置
+    void restoreState(const jw::cppJSON &json, const std::vector<UserPtr> &users);
+
+    // 连接都开始读写之后调用，向进行中的牌局重新推送状态
+    void resumeTables();
+
+    // 设置后，事件循环过载时不再把聊天和进入时的用户列表发给其他人，对请求者的回复（包括发言者自己的聊天）和座位变化的通知照常
+    void setLoadMonitor(const jw::LoopLagMonitor *monitor) { _loadMonitor = monitor; }
+    uint64_t getShedBroadcasts() const { return _shedBroadcasts; }
 
 private:
     static bool isValidTable(unsigned table, unsigned seat) {
         return table < BasicRoomType::TableCount && seat < BasicRoomType::TableType::ParticipantCount;
     }
 
-    void handleEnter(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
-    void handleSitDown(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
-    void handleStandUp(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
-    void handleReady(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
-    void handleChatInRoom(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
-    void handleTableAction(unsigned cmd, unsigned tag, const std::shared_ptr<UserType> &user, const jw::cppJSON &jsonRecv);
+    void handleEnter(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+    void handleSitDown(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+    void handleStandUp(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+    void handleReady(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+    void handleChatInRoom(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+    void handleTableAction(unsigned cmd, unsigned tag, const UserPtr &user, const jw::cppJSON &jsonRecv);
+
+    // 是否丢弃这次可选的广播
+    bool _shedBroadcast();
+
+    const jw::LoopLagMonitor *_loadMonitor = nullptr;
+    std::atomic<uint64_t> _shedBroadcasts{ 0 };
 };
 
 #endif
@@ -2,43 +2,455 @@
 #define _GAME_SERVER_H_
 
 #include "../common-test/BasicServer.hpp"
+#include "../common-test/SessionPool.hpp"
+#include "../common-test/IdleReaper.hpp"
+#include "../common-test/LoopLagMonitor.hpp"
+#include "../common-test/TimerEngine.h"
+#include "../common-test/UpstreamLink.hpp"
+#include "../common-test/ReliableUdp.hpp"
+#include "../common-test/LoopbackTransport.hpp"
 #include "GameRoom.h"
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <iterator>
+#include <string>
 
 class ServerProxy {
 public:
     typedef GameRoom::UserType Session;
+    typedef jw::RateLimitPolicy<(size_t)CommandClass::Count> RateLimitPolicy;
+    typedef jw::RateLimitStats<(size_t)CommandClass::Count> RateLimitStats;
+    typedef jw::UpstreamLink<Session> GatewayLink;
+    typedef jw::ReliableUdpServer<Session> UdpServer;
+    typedef jw::LoopbackServer<Session> LoopbackServer;
 
-    void acceptCallback(asio::ip::tcp::socket &&socket) {
-        std::shared_ptr<Session> s = std::make_shared<Session>(std::move(socket),
+    // 60秒没有收到数据的连接先发一个ping，再过20秒仍没有数据则断开
+    // 事件循环延迟超过50ms时不再把聊天和进入时的用户列表发给其他人，超过200ms时拒绝新的进入请求
+    ServerProxy()
+        : _pingPacket(jw::makeSharedBuffer(Session::encodeSendPacket(CMD_PING, PUSH_SERVICE_TAG, jw::cppJSON(jw::cppJSON::ValueType::Object))))
+        , _idleReaper(std::chrono::seconds(1), std::chrono::seconds(60), std::chrono::seconds(20), [this](const Session::SessionPtr &s) {
+            s->deliver(_pingPacket);
+        }) {
+        _room.setLoadMonitor(&_lagMonitor);
+
+        // 每秒的命令数和允许的突发数
+        _rateLimitPolicy.limits[(size_t)CommandClass::Enter] = jw::RateLimit(1, 3);
+        _rateLimitPolicy.limits[(size_t)CommandClass::Chat] = jw::RateLimit(2, 5);
+        _rateLimitPolicy.limits[(size_t)CommandClass::Lobby] = jw::RateLimit(5, 10);
+        _rateLimitPolicy.limits[(size_t)CommandClass::Table] = jw::RateLimit(20, 40);
+        // 每秒被拒绝超过10个、累计超过50个时断开
+        _rateLimitPolicy.abuse = jw::RateLimit(10, 50);
+
+        jw::TimerEngine::getInstance()->registerTimer(reinterpret_cast<uintptr_t>(&_idleReaper), std::chrono::seconds(1), jw::TimerEngine::REPEAT_FOREVER, [this](int64_t) {
+            // 交接期间不能shutdown任何连接
+            if (!_handingOff) {
+                _idleReaper.tick();
+            }
+        });
+    }
+
+    ~ServerProxy() {
+        jw::TimerEngine::getInstance()->unregisterTimer(reinterpret_cast<uintptr_t>(&_idleReaper));
+        if (_udpServer) {
+            _udpServer->stop();
+        }
+        if (_loopbackServer) {
+            _loopbackServer->stop();
+        }
+    }
+
+    // 须在开始accept之前设置
+    void setRateLimitPolicy(const RateLimitPolicy &policy) { _rateLimitPolicy = policy; }
+    const RateLimitStats &getRateLimitStats() const { return _rateLimitStats; }
+
+    // 事件循环延迟，以及因此被拒绝的进入请求数和被丢弃的广播数
+    jw::LoopLagStats getLoopLagStats() { return _lagMonitor.getStats(); }
+    uint64_t getRejectedEnters() const { return _rejectedEnters; }
+    uint64_t getShedBroadcasts() const { return _room.getShedBroadcasts(); }
+
+    // 重连风暴时每秒最多交给房间200个新连接，最多256个连接在等进入房间，其余的排队，排队超过10秒的断开
+    // 同一IP最多64个连接
+    jw::AdmissionPolicy getAdmissionPolicy() const {
+        jw::AdmissionPolicy policy;
+        policy.acceptRate = jw::RateLimit(200, 400);
+        policy.maxPending = 256;
+        policy.maxPerAddress = 64;
+        policy.overloadAction = jw::OverloadAction::Queue;
+        policy.maxQueued = 8192;
+        policy.maxQueueWait = std::chrono::seconds(10);
+        return policy;
+    }
+
+    void attachService(asio::io_service &service) {
+        _lagMonitor.attach(service);
+    }
+
+    void acceptCallback(asio::ip::tcp::socket &&socket, const jw::AdmissionTicket &ticket) {
+        Session::SessionPtr s = _sessionPool.acquire(std::move(socket),
             std::bind(&ServerProxy::_sessionCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+        s->admission = ticket;
         _room.addUser(s);
         s->start();
+        _idleReaper.watch(s);
+
+        jw::SessionPoolStats stats = _sessionPool.getStats();
+        if ((stats.acquired & 1023U) == 0) {
+            LOG_INFO("session pool: acquired %llu, hit rate %.1f%%, idle %lu, discarded %llu",
+                (unsigned long long)stats.acquired, stats.hitRate() * 100.0, (unsigned long)stats.idle, (unsigned long long)stats.discarded);
+        }
+    }
+
+    // 接受网关（见projects/gateway）的上游连接，经网关转发的客户端与直连的客户端进入同一个房间
+    // 这些客户端由网关做准入控制，这里不再限制；热重启时不交接，上游连接随旧进程断开，网关断开它们，由客户端重连
+    bool listenGateway(jw::IOServicePool &pool, unsigned short port) {
+        try {
+            _gatewayListener.reset(new jw::LinkListener(pool, port, [this](asio::ip::tcp::socket &&socket) {
+                std::shared_ptr<GatewayLink> link = std::make_shared<GatewayLink>();
+                link->start(std::move(socket), std::bind(&ServerProxy::_gatewayCallback, this,
+                    std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+                LOG_INFO("gateway %s:%hu connected", link->getRemoteIP().c_str(), link->getRemotePort());
+            }));
+        }
+        catch (std::exception &e) {
+            LOG_ERROR("failed to listen for gateways on port %hu: %s", port, e.what());
+            return false;
+        }
+        return true;
+    }
+
+    // 在port上接受可靠UDP（见ReliableUdp.hpp）的客户端，供丢包较多、对延迟敏感的客户端（如移动网络）使用，与TCP客户端进入同一个房间
+    // 所有UDP客户端在池中的第一个io_service上收发；握手经过与TCP同样策略的准入控制（单独计数，不排队），连接数另由ReliableUdpServer限制
+    // 热重启时不交接，新进程对不认识的连接回复Close，由客户端重连；loss仅用于测试
+    bool listenUdp(jw::IOServicePool &pool, unsigned short port, const jw::LossPolicy &loss = jw::LossPolicy()) {
+        try {
+            _udpServer = std::make_shared<UdpServer>(pool.getService(0), port, jw::ReliableConfig(), loss);
+            _udpServer->setAdmissionControl(std::make_shared<jw::AdmissionControl>(getAdmissionPolicy()));
+            _udpServer->start(std::bind(&ServerProxy::_udpCallback, this,
+                std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+        }
+        catch (std::exception &e) {
+            LOG_ERROR("failed to listen for reliable udp on port %hu: %s", port, e.what());
+            return false;
+        }
+        LOG_INFO("reliable udp listening on port %hu", port);
+        return true;
+    }
+
+    // 在名为name的共享内存上接受同一台机器上的机器人（见LoopbackTransport.hpp和client-test的shm-bots），不经过网络协议栈，与TCP客户端进入同一个房间
+    // 所有机器人在池中的第一个io_service上轮询；不经过准入控制，与其他客户端一样限流；热重启时不交接；仅Linux
+    bool listenLoopback(jw::IOServicePool &pool, const std::string &name, const jw::LoopbackConfig &config = jw::LoopbackConfig()) {
+        std::shared_ptr<jw::LoopbackRegion> region = jw::LoopbackRegion::createShared(name, config);
+        if (region == nullptr) {
+            return false;
+        }
+        _loopbackServer = std::make_shared<LoopbackServer>(pool.getService(0), region, config);
+        _loopbackServer->start(std::bind(&ServerProxy::_relayCallback<LoopbackServer>, this,
+            std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+        LOG_INFO("loopback listening on shared memory %s with %u slot(s)", name.c_str(), config.slots);
+        return true;
+    }
+
+    // io线程池按负载伸缩时（见IOService::enableAutoScaling）：退役的io_service上的直连客户端迁到其他io_service上，房间里的状态不变
+    // 经网关、可靠UDP或回环传输转发的客户端在上游连接或第0个io_service上，这些io_service不退役
+    jw::ScalingHooks getScalingHooks(jw::IOServicePool &pool) {
+        jw::ScalingHooks hooks;
+        hooks.activated = [this](asio::io_service &service) {
+            _lagMonitor.resume(service);
+        };
+        hooks.migrate = [this, &pool](asio::io_service &service) {
+            return _migrateSessions(service, pool);
+        };
+        hooks.retired = [this](asio::io_service &service) {
+            _lagMonitor.suspend(service);
+        };
+        return hooks;
+    }
+
+    // 因缩容迁移过的连接数
+    uint64_t getMigratedSessions() const { return _migratedSessions; }
+
+    // 以下用于热重启，见HotRestart.h
+    typedef asio::ip::tcp::socket::native_handle_type NativeHandle;
+    typedef std::function<asio::ip::tcp::socket (NativeHandle, jw::AdmissionTicket &)> AdoptFunction;
+
+    // 旧进程：停止所有连接的读并冻结发送，等读循环停下、已入队的数据发完，timeout内没停下的连接不交接
+    // 交接的连接和房间状态写入json，返回这些连接的socket句柄（与json["sessions"]一一对应，仍归本进程所有）
+    std::vector<NativeHandle> suspendForHandoff(std::chrono::milliseconds timeout, jw::cppJSON &json) {
+        _handingOff = true;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+        // 等正在进行的迁移结束，迁移完成时会恢复读
+        while (std::chrono::steady_clock::now() < deadline && _migratingSessions > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::vector<Session::SessionPtr> users = _room.getUsers();
+        std::copy_if(users.begin(), users.end(), std::back_inserter(_suspended), [](const Session::SessionPtr &s) {
+            return !s->isRelayed();
+        });
+        std::for_each(_suspended.begin(), _suspended.end(), [](const Session::SessionPtr &s) {
+            s->pauseRead();
+            s->freezeSend();
+        });
+
+        while (std::chrono::steady_clock::now() < deadline
+            && !std::all_of(_suspended.begin(), _suspended.end(), [](const Session::SessionPtr &s) { return !s->isConnected() || (s->isReadParked() && s->isSendIdle()); })) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        std::vector<Session::SessionPtr> handed;
+        std::vector<NativeHandle> handles;
+        std::pair<jw::cppJSON::iterator, bool> jsonSessions = json.insert(std::make_pair("sessions", jw::cppJSON(jw::cppJSON::ValueType::Array)));
+        std::for_each(_suspended.begin(), _suspended.end(), [&](const Session::SessionPtr &s) {
+            if (!s->isConnected() || !s->isReadParked() || !s->isSendIdle()) {
+                return;
+            }
+            std::vector<char> pending = s->getPendingRecvData();
+            jw::cppJSON jsonSession(jw::cppJSON::ValueType::Object);
+            jsonSession.insert(std::make_pair("entered", !s->admission.isPending()));
+            jsonSession.insert(std::make_pair("pending", std::vector<uint32_t>(reinterpret_cast<const unsigned char *>(pending.data()), reinterpret_cast<const unsigned char *>(pending.data()) + pending.size())));
+            jsonSessions.first->push_back(std::move(jsonSession));
+            handed.push_back(s);
+            handles.push_back(s->getNativeHandle());
+        });
+
+        std::pair<jw::cppJSON::iterator, bool> jsonRoom = json.insert(std::make_pair("room", jw::cppJSON(jw::cppJSON::ValueType::Object)));
+        _room.saveState(handed, *jsonRoom.first);
+
+        if (handed.size() != _suspended.size()) {
+            LOG_WARN("%lu of %lu sessions did not settle and will not be handed off", (unsigned long)(_suspended.size() - handed.size()), (unsigned long)_suspended.size());
+        }
+        return handles;
+    }
+
+    // 旧进程：交接失败时恢复所有连接
+    void resumeAfterHandoff() {
+        std::for_each(_suspended.begin(), _suspended.end(), [](const Session::SessionPtr &s) {
+            s->resumeSend();
+            s->resumeRead();
+        });
+        _suspended.clear();
+        _handingOff = false;
+    }
+
+    // 新进程：接管连接并恢复房间，handles与json["sessions"]一一对应，个数须相同
+    // adopt把句柄变成socket（取得句柄的所有权）并取得准入名额，失败时返回未打开的socket
+    // 此时还不读写这些连接，旧进程确认退出后由startAfterHandoff开始；交接中止时进程须直接退出，不能析构这些连接
+    size_t restoreHandoff(const jw::cppJSON &json, const std::vector<NativeHandle> &handles, const AdoptFunction &adopt) {
+        std::vector<Session::SessionPtr> users;
+        jw::cppJSON::const_iterator jsonSessions = json.find("sessions");
+        if (jsonSessions != json.end() && jsonSessions->getValueType() == jw::cppJSON::ValueType::Array) {
+            size_t i = 0;
+            for (jw::cppJSON::const_iterator it = jsonSessions->begin(); it != jsonSessions->end() && i < handles.size(); ++it, ++i) {
+                jw::AdmissionTicket ticket;
+                asio::ip::tcp::socket socket = adopt(handles[i], ticket);
+                if (!socket.is_open()) {
+                    users.push_back(Session::SessionPtr());
+                    continue;
+                }
+                Session::SessionPtr s = _sessionPool.acquire(std::move(socket),
+                    std::bind(&ServerProxy::_sessionCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+                s->admission = ticket;
+                if (it->getValueByKey<bool>("entered")) {
+                    s->admission.completeHandshake();
+                }
+                std::vector<uint32_t> pending = it->getValueByKey<std::vector<uint32_t> >("pending");
+                std::vector<char> data(pending.begin(), pending.end());
+                s->preloadRecvData(data.data(), data.size());
+                users.push_back(s);
+            }
+        }
+
+        jw::cppJSON::const_iterator jsonRoom = json.find("room");
+        if (jsonRoom != json.end()) {
+            _room.restoreState(*jsonRoom, users);
+        }
+        std::copy_if(users.begin(), users.end(), std::back_inserter(_adopted), [](const Session::SessionPtr &s) {
+            return s != nullptr;
+        });
+        return _adopted.size();
+    }
+
+    // 新进程：旧进程确认退出后开始读写接管的连接，恢复牌桌
+    void startAfterHandoff() {
+        std::for_each(_adopted.begin(), _adopted.end(), [this](const Session::SessionPtr &s) {
+            s->start();
+            _idleReaper.watch(s);
+        });
+        _adopted.clear();
+        _room.resumeTables();
     }
 
 private:
-    void _sessionCallback(const std::shared_ptr<Session> &s, jw::SessionEvent event, const char *data, size_t length) {
+    void _gatewayCallback(GatewayLink &link, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        if (data == nullptr) {
+            // 网关断开，它转发的客户端都断开
+            std::vector<Session::SessionPtr> sessions = link.unbindAll();
+            LOG_WARN("gateway %s:%hu disconnected, dropping %lu session(s)", link.getRemoteIP().c_str(), link.getRemotePort(), (unsigned long)sessions.size());
+            std::for_each(sessions.begin(), sessions.end(), [](const Session::SessionPtr &s) {
+                s->relayClosed();
+            });
+            return;
+        }
+        _relayCallback(link, id, type, data, length);
+    }
+
+    void _udpCallback(UdpServer &udp, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        _relayCallback(udp, id, type, data, length);
+        if (type == jw::LinkFrame::Open) {
+            // 握手时取得的准入名额，与TCP连接一样进入房间时归还握手名额，断开时全部归还
+            Session::SessionPtr s = udp.find(id);
+            if (s != nullptr) {
+                s->admission = udp.takeTicket(id);
+            }
+        }
+    }
+
+    // 经网关、可靠UDP或回环传输转发的一个会话的建立、数据和断开
+    template <class _Relay>
+    void _relayCallback(_Relay &relay, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        switch (type) {
+        case jw::LinkFrame::Open: {
+            // 内容为客户端的"IP:端口"
+            std::string address(data, length);
+            std::string::size_type pos = address.rfind(':');
+            unsigned short port = pos != std::string::npos ? (unsigned short)atoi(address.c_str() + pos + 1) : 0;
+            Session::SessionPtr s = _sessionPool.acquire(asio::ip::tcp::socket(relay.getIOService()),
+                std::bind(&ServerProxy::_sessionCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+            s->startRelay(relay.shared_from_this(), id, address.substr(0, pos), port);
+            relay.bind(id, s);
+            _room.addUser(s);
+            _idleReaper.watch(s);
+            break;
+        }
+        case jw::LinkFrame::Data: {
+            Session::SessionPtr s = relay.find(id);
+            if (s != nullptr) {
+                s->relayRecv(data, length);
+            }
+            break;
+        }
+        case jw::LinkFrame::Close: {
+            Session::SessionPtr s = relay.unbind(id);
+            if (s != nullptr) {
+                s->relayClosed();
+            }
+            break;
+        }
+        default:
+            LOG_WARN("unknown relay frame %u", (unsigned)type);
+            break;
+        }
+    }
+
+    // 读失败（Recv）和写失败（Send）都以data为空回调，处理相同：removeUser和release都只生效一次
+    void _sessionCallback(const Session::SessionPtr &s, jw::SessionEvent, const char *data, size_t length) {
         if (data != nullptr) {
+            // 在解析JSON之前按cmd限流，被拒绝的命令不做任何处理
+            unsigned cmd = Session::peekCommand(data, length);
+            if (cmd != 0 && !_checkRateLimit(s, cmd)) {
+                return;
+            }
+            if (cmd == CMD_PING) {
+                // 客户端对ping的回应，收到数据的时刻已经刷新
+                return;
+            }
             try {
                 jw::cppJSON jsonRecv;
-                unsigned cmd, tag;
+                unsigned tag;
                 s->decodeRecvPacket(jsonRecv, cmd, tag, data, length);
                 if (cmd == 0) {
                     return;
                 }
+                if (GameRoom::classifyCommand(cmd) == CommandClass::Enter && _lagMonitor.level() == jw::LoadLevel::Overloaded) {
+                    // 进入房间要把整个用户列表发给所有人，过载时拒绝，握手名额不归还，由客户端稍后重试
+                    ++_rejectedEnters;
+                    jw::cppJSON jsonSend(jw::cppJSON::ValueType::Object);
+                    jsonSend.insert(std::make_pair("result", false));
+                    jsonSend.insert(std::make_pair("reason", u8"服务器繁忙，请稍后再试"));
+                    s->deliver(s->encodeSendPacket(cmd, tag, jsonSend));
+                    return;
+                }
                 _room.deliver(s, cmd, tag, jsonRecv);
+                if (GameRoom::classifyCommand(cmd) == CommandClass::Enter) {
+                    // 进入房间即握手完成，让出名额给排队的连接
+                    s->admission.completeHandshake();
+                }
             }
             catch (std::exception &e) {
                 LOG_ERROR("%s", e.what());
+                // 同时断开连接：留下不在房间里的连接，缩容时找不到它，它所在的io_service永远迁不空
                 _room.removeUser(s);
+                s->close();
             }
         }
         else {
             _room.removeUser(s);
+            s->admission.release();
+        }
+    }
+
+    // 发起service上直连客户端的迁移，返回仍在service上的客户端数；交接期间不迁移
+    size_t _migrateSessions(asio::io_service &service, jw::IOServicePool &pool) {
+        std::vector<Session::SessionPtr> users = _room.getUsers();
+        size_t remaining = 0;
+        std::for_each(users.begin(), users.end(), [&](const Session::SessionPtr &s) {
+            if (&s->getIOService() != &service || !s->isConnected()) {
+                return;
+            }
+            ++remaining;
+            // 先计数再检查交接标志，交接一方先设标志再等计数归零
+            ++_migratingSessions;
+            if (_handingOff || s->isMigrating()) {
+                --_migratingSessions;
+                return;
+            }
+            bool started = s->migrate(pool.getNextService(), [this](bool moved) {
+                if (moved) {
+                    ++_migratedSessions;
+                }
+                --_migratingSessions;
+            });
+            if (!started) {
+                --_migratingSessions;
+            }
+        });
+        return remaining;
+    }
+
+    bool _checkRateLimit(const Session::SessionPtr &s, unsigned cmd) {
+        size_t commandClass = (size_t)GameRoom::classifyCommand(cmd);
+        jw::RateLimitResult result = s->rateLimiter.check(_rateLimitPolicy, commandClass, jw::rateLimiterNow());
+        if (result == jw::RateLimitResult::Allowed) {
+            return true;
+        }
+
+        ++_rateLimitStats.throttled[commandClass];
+        if (result == jw::RateLimitResult::Abusive && s->close()) {
+            ++_rateLimitStats.disconnected;
+            LOG_WARN("disconnect abusive session %s:%hu, cmd %u", s->getRemoteIP().c_str(), s->getRemotePort(), cmd);
         }
+        return false;
     }
 
 private:
     GameRoom _room;
+    jw::SessionPool<Session> _sessionPool;
+    RateLimitPolicy _rateLimitPolicy;
+    RateLimitStats _rateLimitStats;
+    jw::SharedBuffer _pingPacket;
+    jw::IdleReaper<Session> _idleReaper;
+    jw::LoopLagMonitor _lagMonitor;
+    std::atomic<uint64_t> _rejectedEnters{ 0 };
+    std::atomic<bool> _handingOff{ false };
+    std::atomic<size_t> _migratingSessions{ 0 };
+    std::atomic<uint64_t> _migratedSessions{ 0 };
+    std::vector<Session::SessionPtr> _suspended;  // 交接时停下的连接，交接失败时恢复
+    std::vector<Session::SessionPtr> _adopted;  // 接管后尚未开始读写的连接
+    std::unique_ptr<jw::LinkListener> _gatewayListener;
+    std::shared_ptr<UdpServer> _udpServer;
+    std::shared_ptr<LoopbackServer> _loopbackServer;
 };
 
 typedef jw::BasicServer<ServerProxy, 128> Server;
@@ -32,16 +32,7 @@ bool GameTable::ready(unsigned seat) {
                 std::lock_guard<jw::QuickMutex> g(_mutex);
                 (void)g;
                 _sendGameState();
-                jw::TimerEngine::getInstance()->registerTimer(reinterpret_cast<uintptr_t>(this), std::chrono::milliseconds(500), jw::TimerEngine::REPEAT_FOREVER, [this](int64_t) {
-                    if (_logic.checkSendEnd()) {
-                        LOG_DEBUG(u8"结束发牌");
-                        jw::TimerEngine::getInstance()->unregisterTimer(reinterpret_cast<uintptr_t>(this));
-
-                        std::lock_guard<jw::QuickMutex> g(_mutex);
-                        (void)g;
-                        _sendGameState();
-                    }
-                });
+                _watchSendEnd();
             });
         }
         return true;
@@ -49,6 +40,49 @@ bool GameTable::ready(unsigned seat) {
     return false;
 }
 
+// 每500ms检查一次发牌是否结束
+void GameTable::_watchSendEnd() {
+    jw::TimerEngine::getInstance()->registerTimer(reinterpret_cast<uintptr_t>(this), std::chrono::milliseconds(500), jw::TimerEngine::REPEAT_FOREVER, [this](int64_t) {
+        if (_logic.checkSendEnd()) {
+            LOG_DEBUG(u8"结束发牌");
+            jw::TimerEngine::getInstance()->unregisterTimer(reinterpret_cast<uintptr_t>(this));
+
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            _sendGameState();
+        }
+    });
+}
+
+void GameTable::saveState(jw::cppJSON &json) {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+    _logic.saveState(json);
+}
+
+void GameTable::restoreState(const jw::cppJSON &json) {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+    _logic.restoreState(json);
+    if (_logic.getState() != U5TKLogic::State::WAITING
+        && std::any_of(std::begin(_participants), std::end(_participants), [](const UserPtr &user) { return user == nullptr; })) {
+        LOG_WARN(u8"牌局有玩家未能接管，结束牌局");
+        _logic.forcedEnd();
+    }
+}
+
+void GameTable::resume() {
+    std::lock_guard<jw::QuickMutex> g(_mutex);
+    (void)g;
+    if (_logic.getState() == U5TKLogic::State::WAITING) {
+        return;
+    }
+    _sendGameState();
+    if (_logic.getState() == U5TKLogic::State::SENDING) {
+        _watchSendEnd();
+    }
+}
+
 void GameTable::forcedStandUp(unsigned seat) {
     LOG_DEBUG(u8"forcedStandUp %d", seat);
     std::lock_guard<jw::QuickMutex> g(_mutex);
@@ -161,7 +195,8 @@ void GameTable::_sendGameState() {
         }
         std::vector<char> buf = jw::JsonPacketSplitter::encodeSendPacket(CMD_U5TK_REFRESH, PUSH_SERVICE_TAG, json);
         //LOG_DEBUG(u8"_sendGameState: %.*s", (int)buf.size() - 4, &buf[4]);
-        _participants[i]->deliver(buf);
+        // 每张桌子的快照以桌子地址为key，慢速连接上未发出的旧快照直接被替换
+        _participants[i]->deliverLatest(std::move(buf), reinterpret_cast<uintptr_t>(this));
     }
 }
 
@@ -4,6 +4,7 @@
 #include "../common-test/BasicSession.hpp"
 #include "../common-test/BasicTable.hpp"
 #include "../common-test/ConnectedUser.hpp"
+#include "../common-test/RateLimiter.hpp"
 #include "U5TKLogic.h"
 
 enum class UserStatus {
@@ -12,6 +13,15 @@ enum class UserStatus {
     Playing = 2
 };
 
+// 限流时的命令分类，每类有各自的令牌桶
+enum class CommandClass {
+    Enter = 0,  // 进入房间，回复整个房间的用户列表
+    Chat = 1,  // 房间聊天，广播给所有人
+    Lobby = 2,  // 坐下、站起、准备，广播给所有人
+    Table = 3,  // 牌桌上的操作
+    Count
+};
+
 struct RoomUserBase : gs::ConnectedUser {
     int table = -1;
     int seat = -1;
@@ -20,6 +30,7 @@ struct RoomUserBase : gs::ConnectedUser {
     uint32_t tieCount = 0;
     uint32_t loseCount = 0;
     int32_t scores = 0;
+    jw::CommandRateLimiter<(size_t)CommandClass::Count> rateLimiter;
 };
 
 typedef jw::BasicSession<RoomUserBase, 1024U> GameUser;
@@ -30,7 +41,14 @@ public:
     void deliver(unsigned seat, unsigned cmd, unsigned tag, const jw::cppJSON &json);
     void forcedStandUp(unsigned seat);
 
+    // 热重启：在玩家都坐下之后恢复牌局，有人没能接管（座位空着）的牌局直接结束
+    // 连接都开始读写之后调用resume()，重新推送牌局状态，并续上发牌的定时器
+    void saveState(jw::cppJSON &json);
+    void restoreState(const jw::cppJSON &json);
+    void resume();
+
 private:
+    void _watchSendEnd();
     void _sendGameState();
     void _handleLogicResult(unsigned seat, unsigned cmd, unsigned tag, U5TKLogic::ErrorType errorType);
 };
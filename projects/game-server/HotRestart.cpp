@@ -0,0 +1,210 @@
+﻿#include "HotRestart.h"
+#include "../common-test/SocketHandoff.hpp"
+
+#if defined(__linux__)
+#   include <sys/socket.h>
+#   include <unistd.h>
+#   include <fcntl.h>
+#endif
+
+#define HANDOFF_VERSION 1
+
+static const int s_requestTimeoutMs = 5000;  // 等新进程发来请求
+static const int s_snapshotTimeoutMs = 10000;  // 等旧进程发来快照
+static const int s_ackTimeoutMs = 30000;  // 等新进程恢复完成，须足够长，超时后旧进程恢复服务
+static const int s_commitTimeoutMs = 5000;  // 新进程回复确认后等旧进程的最终确认，没收到时新进程退出
+static const std::chrono::milliseconds s_settleTimeout(2000);  // 等连接停下
+
+#if defined(__linux__)
+
+static void _closeAll(const std::vector<int> &fds) {
+    for (size_t i = 0; i < fds.size(); ++i) {
+        ::close(fds[i]);
+    }
+}
+
+bool HotRestart::listen(Service &service, const std::string &controlPath) {
+    stop();
+    _listenFd = jw::listenHandoffSocket(controlPath);
+    if (_listenFd < 0) {
+        LOG_ERROR("failed to listen on %s for hot restart", controlPath.c_str());
+        return false;
+    }
+    _service = &service;
+    _controlPath = controlPath;
+    _stopping = false;
+    _thread = std::thread(std::bind(&HotRestart::_run, this));
+    LOG_INFO("hot restart: waiting for takeover on %s", controlPath.c_str());
+    return true;
+}
+
+void HotRestart::stop() {
+    if (_listenFd < 0) {
+        return;
+    }
+    _stopping = true;
+    // 唤醒阻塞在accept上的线程
+    shutdown(_listenFd, SHUT_RDWR);
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    ::close(_listenFd);
+    _listenFd = -1;
+}
+
+void HotRestart::_run() {
+    while (!_stopping) {
+        int conn = accept4(_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        _handoff(conn);
+        ::close(conn);
+    }
+}
+
+void HotRestart::_handoff(int conn) {
+    std::string payload;
+    std::vector<int> fds;
+    jw::cppJSON request;
+    if (!jw::recvHandoffMessage(conn, payload, fds, s_requestTimeoutMs) || !request.Parse(payload.c_str())
+        || request.getValueByKeyNoThrow<int>("version") != HANDOFF_VERSION) {
+        LOG_WARN("hot restart: invalid takeover request");
+        _closeAll(fds);
+        return;
+    }
+
+    Server &server = _service->getServer();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // 先停accept再停连接，停accept之前accept到的连接也一起交接
+    server.pauseAccept();
+    while (!server.isAcceptPaused()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    jw::cppJSON snapshot(jw::cppJSON::ValueType::Object);
+    std::vector<int> handles = server.suspendForHandoff(s_settleTimeout, snapshot);
+    std::vector<int> listeners = server.getListenHandles();
+    snapshot.insert(std::make_pair("version", HANDOFF_VERSION));
+    snapshot.insert(std::make_pair("listeners", listeners.size()));
+
+    // 监听socket在前，连接在后；发出的是句柄的副本，交接失败时本进程的socket不受影响
+    std::vector<int> originals = listeners;
+    originals.insert(originals.end(), handles.begin(), handles.end());
+    std::vector<int> copies;
+    for (size_t i = 0; i < originals.size(); ++i) {
+        int fd = fcntl(originals[i], F_DUPFD_CLOEXEC, 0);
+        if (fd < 0) {
+            break;
+        }
+        copies.push_back(fd);
+    }
+
+    int64_t suspendMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    bool sent = copies.size() == originals.size() && jw::sendHandoffMessage(conn, snapshot.stringfiy(), copies);
+    // 在途的句柄由内核持有，发出后即可关闭副本
+    _closeAll(copies);
+
+    // 新进程恢复完成后回复确认，但在收到最终确认之前不读写任何连接；最终确认发出后本进程不再碰这些socket
+    jw::cppJSON ack, commit(jw::cppJSON::ValueType::Object);
+    commit.insert(std::make_pair("result", true));
+    if (sent && jw::recvHandoffMessage(conn, payload, fds, s_ackTimeoutMs) && ack.Parse(payload.c_str())
+        && ack.getValueByKeyNoThrow<bool>("result") && jw::sendHandoffMessage(conn, commit.stringfiy(), std::vector<int>())) {
+        int64_t totalMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG_INFO("hot restart: handed off %lu session(s), suspended in %lldms, %lldms in total, exiting",
+            (unsigned long)handles.size(), (long long)suspendMs, (long long)totalMs);
+        // 不析构任何对象，以免shutdown已交出的连接
+        _exit(0);
+    }
+
+    // 没有发出最终确认时新进程不会启动，本进程的socket一直归自己所有
+    LOG_ERROR("hot restart: takeover failed, resuming");
+    _closeAll(fds);
+    server.resumeAfterHandoff();
+    server.resumeAccept();
+}
+
+std::unique_ptr<HotRestart::Service> HotRestart::takeover(const std::string &controlPath, unsigned short port, jw::IOServiceMode mode, const jw::ThreadTopology &topology) {
+    int conn = jw::connectHandoffSocket(controlPath);
+    if (conn < 0) {
+        LOG_ERROR("hot restart: failed to connect to %s", controlPath.c_str());
+        return std::unique_ptr<Service>();
+    }
+
+    jw::cppJSON request(jw::cppJSON::ValueType::Object);
+    request.insert(std::make_pair("version", HANDOFF_VERSION));
+    std::string payload;
+    std::vector<int> fds;
+    jw::cppJSON snapshot;
+    if (!jw::sendHandoffMessage(conn, request.stringfiy(), std::vector<int>())
+        || !jw::recvHandoffMessage(conn, payload, fds, s_snapshotTimeoutMs) || !snapshot.Parse(payload.c_str())) {
+        LOG_ERROR("hot restart: failed to receive the snapshot");
+        ::close(conn);
+        return std::unique_ptr<Service>();
+    }
+
+    size_t listenerCount = snapshot.getValueByKeyNoThrow<size_t>("listeners");
+    jw::cppJSON::const_iterator sessions = snapshot.find("sessions");
+    // 没有连接时空数组解析回来是null
+    size_t sessionCount = sessions != snapshot.end() && sessions->getValueType() == jw::cppJSON::ValueType::Array ? sessions->size() : 0;
+    if (snapshot.getValueByKeyNoThrow<int>("version") != HANDOFF_VERSION || listenerCount == 0 || fds.size() != listenerCount + sessionCount) {
+        LOG_ERROR("hot restart: malformed snapshot, %lu fd(s) for %lu listener(s) and %lu session(s)",
+            (unsigned long)fds.size(), (unsigned long)listenerCount, (unsigned long)sessionCount);
+        for (size_t i = 0; i < fds.size(); ++i) {
+            ::close(fds[i]);
+        }
+        ::close(conn);
+        return std::unique_ptr<Service>();
+    }
+
+    std::vector<int> listeners(fds.begin(), fds.begin() + listenerCount);
+    std::vector<int> handles(fds.begin() + listenerCount, fds.end());
+    std::unique_ptr<Service> service(new Service(port, mode, topology, listeners));
+    Server &server = service->getServer();
+    size_t restored = server.restoreHandoff(snapshot, handles, [&server](int handle, jw::AdmissionTicket &ticket) {
+        return server.adoptSocket(handle, ticket);
+    });
+
+    // 回复确认后等旧进程的最终确认，收到后旧进程不再碰这些socket，才开始读写和accept
+    // 任一步失败时旧进程恢复服务，本进程直接退出，不析构任何对象，以免shutdown接管的连接
+    jw::cppJSON ack(jw::cppJSON::ValueType::Object), commit;
+    ack.insert(std::make_pair("result", true));
+    if (!jw::sendHandoffMessage(conn, ack.stringfiy(), std::vector<int>())
+        || !jw::recvHandoffMessage(conn, payload, fds, s_commitTimeoutMs) || !commit.Parse(payload.c_str())
+        || !commit.getValueByKeyNoThrow<bool>("result")) {
+        LOG_ERROR("hot restart: the old process did not commit, exiting");
+        _exit(1);
+    }
+    ::close(conn);
+    server.startAfterHandoff();
+    server.resumeAccept();
+    LOG_INFO("hot restart: took over %lu listener(s) and %lu of %lu session(s)", (unsigned long)listenerCount, (unsigned long)restored, (unsigned long)sessionCount);
+    return service;
+}
+
+#else
+
+bool HotRestart::listen(Service &, const std::string &) {
+    LOG_WARN("hot restart is not supported on this platform");
+    return false;
+}
+
+void HotRestart::stop() {
+}
+
+std::unique_ptr<HotRestart::Service> HotRestart::takeover(const std::string &, unsigned short, jw::IOServiceMode, const jw::ThreadTopology &) {
+    LOG_WARN("hot restart is not supported on this platform");
+    return std::unique_ptr<Service>();
+}
+
+void HotRestart::_run() {
+}
+
+void HotRestart::_handoff(int) {
+}
+
+#endif
@@ -0,0 +1,46 @@
+﻿#ifndef _HOT_RESTART_H_
+#define _HOT_RESTART_H_
+
+#include "../common-test/IOService.hpp"
+#include "GameServer.h"
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+// 热重启：新进程从旧进程接过监听socket和所有连接，连同房间、牌桌和牌局的状态，客户端不需要重连
+// 旧进程用listen()在一个Unix域socket上等待交接请求；新进程用takeover()连上去，收到监听socket、连接（均为副本）和状态后恢复，
+// 回复确认；旧进程发出最终确认后随即退出（不关闭任何socket），新进程收到最终确认后才开始读写和accept
+// 任一步失败时旧进程恢复服务，新进程退出，两个进程不会同时读写同一批连接
+// 交接期间（通常几十毫秒）新连接留在内核的监听队列中，客户端发来的数据留在各socket的接收缓冲区中
+// 仅Linux
+class HotRestart {
+public:
+    typedef jw::IOService<Server> Service;
+
+    HotRestart(const HotRestart &) = delete;
+    HotRestart &operator=(const HotRestart &) = delete;
+
+    HotRestart() { }
+    ~HotRestart() { stop(); }
+
+    // 旧进程一方：在controlPath上监听，在后台线程上处理交接请求，交接成功时进程退出
+    bool listen(Service &service, const std::string &controlPath);
+    void stop();
+
+    // 新进程一方：从controlPath上的旧进程接管，参数同IOService的构造函数
+    // 失败时返回空（旧进程恢复服务）；恢复了连接但没收到最终确认时进程直接退出，以免两个进程同时读写同一批连接
+    static std::unique_ptr<Service> takeover(const std::string &controlPath, unsigned short port, jw::IOServiceMode mode, const jw::ThreadTopology &topology);
+
+private:
+    void _run();
+    void _handoff(int conn);
+
+    Service *_service = nullptr;
+    std::string _controlPath;
+    int _listenFd = -1;
+    std::thread _thread;
+    std::atomic<bool> _stopping{ false };
+};
+
+#endif
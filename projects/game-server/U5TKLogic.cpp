@@ -170,6 +170,70 @@ void U5TKLogic::forcedEnd() {
     setup();
 }
 
+void U5TKLogic::saveState(jw::cppJSON &json) const {
+    json.insert(std::make_pair("state", static_cast<int>(_state)));
+    json.insert(std::make_pair("isGrabbing", _isGrabbing));
+    json.insert(std::make_pair("grade", _grade));
+    json.insert(std::make_pair("trump", _trump));
+    json.insert(std::make_pair("grade2", _grade2));
+    json.insert(std::make_pair("bankerPos", _bankerPos));
+    json.insert(std::make_pair("shownPos", _shownPos));
+    json.insert(std::make_pair("turnPos", _turnPos));
+    json.insert(std::make_pair("leaderPos", _leaderPos));
+    json.insert(std::make_pair("scores", _scores));
+    json.insert(std::make_pair("cycles", _cycles));
+    json.insert(std::make_pair("rounds", _rounds));
+    json.insert(std::make_pair("defeatState", static_cast<int>(_defeatState)));
+    json.insert(std::make_pair("readyState", static_cast<unsigned>(_readyState.to_ulong())));
+    json.insert(std::make_pair("passFlag", static_cast<unsigned>(_passFlag.to_ulong())));
+
+    json.insert(std::make_pair("handCards", std::vector<std::vector<CARD> >(std::begin(_handCards), std::end(_handCards))));
+    json.insert(std::make_pair("shownCards", _shownCards));
+    json.insert(std::make_pair("underCards", _underCards));
+    json.insert(std::make_pair("bringCards", std::vector<std::vector<CARD> >(std::begin(_bringCards), std::end(_bringCards))));
+    json.insert(std::make_pair("recordCards", std::vector<std::vector<CARD> >(std::begin(_recordCards), std::end(_recordCards))));
+    json.insert(std::make_pair("scoreCards", _scoreCards));
+    json.insert(std::make_pair("bringInfo", std::vector<BRING_INFO>(std::begin(_bringInfo), std::end(_bringInfo))));
+
+    // 发牌开始的时刻，两个进程用同一个系统时钟
+    json.insert(std::make_pair("sendTime", static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(_sendTime.time_since_epoch()).count())));
+}
+
+void U5TKLogic::restoreState(const jw::cppJSON &json) {
+    _state = static_cast<State>(json.getValueByKey<int>("state"));
+    _isGrabbing = json.getValueByKey<bool>("isGrabbing");
+    _grade = json.getValueByKey<unsigned>("grade");
+    _trump = json.getValueByKey<unsigned>("trump");
+    _grade2 = json.getValueByKey<unsigned>("grade2");
+    _bankerPos = json.getValueByKey<int>("bankerPos");
+    _shownPos = json.getValueByKey<int>("shownPos");
+    _turnPos = json.getValueByKey<int>("turnPos");
+    _leaderPos = json.getValueByKey<int>("leaderPos");
+    _scores = json.getValueByKey<unsigned>("scores");
+    _cycles = json.getValueByKey<unsigned>("cycles");
+    _rounds = json.getValueByKey<unsigned>("rounds");
+    _defeatState = static_cast<DefeatState>(json.getValueByKey<int>("defeatState"));
+    _readyState = std::bitset<4>(json.getValueByKey<unsigned>("readyState"));
+    _passFlag = std::bitset<4>(json.getValueByKey<unsigned>("passFlag"));
+
+    std::vector<std::vector<CARD> > handCards = json.getValueByKey<std::vector<std::vector<CARD> > >("handCards");
+    std::vector<std::vector<CARD> > bringCards = json.getValueByKey<std::vector<std::vector<CARD> > >("bringCards");
+    std::vector<std::vector<CARD> > recordCards = json.getValueByKey<std::vector<std::vector<CARD> > >("recordCards");
+    std::vector<BRING_INFO> bringInfo = json.getValueByKey<std::vector<BRING_INFO> >("bringInfo");
+    for (size_t i = 0; i < ParticipantCount; ++i) {
+        _handCards[i] = i < handCards.size() ? handCards[i] : std::vector<CARD>();
+        _bringCards[i] = i < bringCards.size() ? bringCards[i] : std::vector<CARD>();
+        _recordCards[i] = i < recordCards.size() ? recordCards[i] : std::vector<CARD>();
+        _bringInfo[i] = i < bringInfo.size() ? bringInfo[i] : 0;
+    }
+    _shownCards = json.getValueByKey<std::vector<CARD> >("shownCards");
+    _underCards = json.getValueByKey<std::vector<CARD> >("underCards");
+    _scoreCards = json.getValueByKey<std::vector<CARD> >("scoreCards");
+
+    _sendTime = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::milliseconds(json.getValueByKey<int64_t>("sendTime"))));
+}
+
 U5TKLogic::ErrorType U5TKLogic::setReady(int pos) {
     if (_readyState.none()) {
         setup();
@@ -5,6 +5,7 @@
 #include <vector>
 #include <bitset>
 #include <chrono>
+#include "../json-test/cppJSON.hpp"
 
 class U5TKLogic final
 {
@@ -77,6 +78,10 @@ public:
     ErrorType doBring(int pos, const std::vector<CARD> &cards);
     void forcedEnd();
 
+    // 热重启时保存和恢复整局的状态，牌保存为计算过的值
+    void saveState(jw::cppJSON &json) const;
+    void restoreState(const jw::cppJSON &json);
+
 private:
     void init();
     void setup();
@@ -1,19 +1,130 @@
 #include "../common-test/IOService.hpp"
 #include "GameServer.h"
 #include "../common-test/TimerEngine.h"
+#include "HotRestart.h"
 
 enum E1 { value };
 enum class E2 { value };
 
 #include <iostream>
+#include <string.h>
 
 int main(int argc, char *argv[]) {
     system("chcp 65001");
 
-    jw::TimerEngine::getInstance();
-    jw::IOService<Server> s(8899);
-    (void)s;
+    // 可选参数：io线程使用的CPU列表和定时器线程使用的CPU列表，如 0-7 8
+    // 指定io线程的CPU时每个CPU一个io_service和一个线程，各自绑定；不指定时线程不绑定；定时器线程只在给出第二个列表时绑定
+    // --handoff <path>：在path上等待热重启的交接请求；--takeover <path>：从path上的旧进程接管（见HotRestart.h）
+    // --port <port>：客户端端口，默认8899；--gateway <port>：在port上接受网关的上游连接（见projects/gateway）
+    // --udp <port>：在port上接受可靠UDP的客户端；--udp-loss <rate> --udp-latency <ms>：在UDP上模拟丢包和延迟，仅用于测试
+    // --shm <name>：在名为name的共享内存上接受同一台机器上的机器人；--shm-slots <n>：最多n个机器人，默认256
+    // --io-max <n>：io_service按负载在--io-min <n>（默认1）到n个之间伸缩，缩容时连接迁到其余的io_service上（见IOServicePool::startScaling）
+    // --io-uring：客户端连接改用io_uring收发（见UringService.hpp），内核不支持时照常走asio
+    std::string handoffPath, takeoverPath, shmName;
+    size_t ioMin = 0, ioMax = 0;
+    bool ioUring = false;
+    jw::LoopbackConfig shmConfig;
+    unsigned short port = 8899, gatewayPort = 0, udpPort = 0;
+    jw::LossPolicy udpLoss;
+    std::vector<const char *> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = (unsigned short)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--gateway") == 0 && i + 1 < argc) {
+            gatewayPort = (unsigned short)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--udp") == 0 && i + 1 < argc) {
+            udpPort = (unsigned short)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--udp-loss") == 0 && i + 1 < argc) {
+            udpLoss.lossRate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--udp-latency") == 0 && i + 1 < argc) {
+            udpLoss.latency = (uint32_t)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shmName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--shm-slots") == 0 && i + 1 < argc) {
+            char *end = nullptr;
+            long slots = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || slots < 1 || slots > (long)jw::LoopbackRegion::MaxSlots) {
+                LOG_ERROR("--shm-slots must be a number between 1 and %u", jw::LoopbackRegion::MaxSlots);
+                return 1;
+            }
+            shmConfig.slots = (uint32_t)slots;
+        }
+        else if (strcmp(argv[i], "--io-min") == 0 && i + 1 < argc) {
+            ioMin = (size_t)std::max(atoi(argv[++i]), 1);
+        }
+        else if (strcmp(argv[i], "--io-max") == 0 && i + 1 < argc) {
+            ioMax = (size_t)std::max(atoi(argv[++i]), 0);
+        }
+        else if (strcmp(argv[i], "--io-uring") == 0) {
+            ioUring = true;
+        }
+        else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            handoffPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc) {
+            takeoverPath = argv[++i];
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    jw::ThreadTopology topology;
+    if (args.size() > 0) {
+        topology = jw::ThreadTopology::servicePerCpu(jw::parseCpuList(args[0]));
+    }
+    if (args.size() > 1) {
+        topology.timerCpus = jw::parseCpuList(args[1]);
+    }
+    topology.maxServiceCount = ioMax;
+    topology.ioUring = ioUring;
+
+    jw::TimerEngine::getInstance()->setAffinity(topology.timerCpus);
+    std::unique_ptr<HotRestart::Service> s;
+    if (!takeoverPath.empty()) {
+        // 旧进程仍然占着端口，接管失败时不能自己监听
+        s = HotRestart::takeover(takeoverPath, port, jw::IOServiceMode::ServicePerCore, topology);
+        if (!s) {
+            jw::TimerEngine::destroyInstance();
+            return 1;
+        }
+    }
+    else {
+        s.reset(new HotRestart::Service(port, jw::IOServiceMode::ServicePerCore, topology));
+    }
+
+    if (ioMax == 0 && ioMin != 0) {
+        LOG_WARN("--io-min is ignored without --io-max");
+    }
+    if (ioMax != 0) {
+        jw::ScalingPolicy scaling;
+        scaling.minWorkers = ioMin;
+        scaling.maxWorkers = ioMax;
+        s->enableAutoScaling(scaling);
+    }
+    if (gatewayPort != 0) {
+        s->getServer().listenGateway(s->getPool(), gatewayPort);
+    }
+    if (udpPort != 0) {
+        s->getServer().listenUdp(s->getPool(), udpPort, udpLoss);
+    }
+    if (!shmName.empty()) {
+        s->getServer().listenLoopback(s->getPool(), shmName, shmConfig);
+    }
+
+    HotRestart hotRestart;
+    if (!handoffPath.empty()) {
+        hotRestart.listen(*s, handoffPath);
+    }
     getchar();
+    hotRestart.stop();
+    s.reset();
     jw::TimerEngine::destroyInstance();
     return 0;
 }
@@ -0,0 +1,260 @@
+﻿#ifndef _GATEWAY_H_
+#define _GATEWAY_H_
+
+#include "../common-test/BasicServer.hpp"
+#include "../common-test/BasicSession.hpp"
+#include "../common-test/SessionPool.hpp"
+#include "../common-test/UpstreamLink.hpp"
+#include "../common-test/TimerEngine.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+struct GatewayClient;
+typedef jw::BasicSession<GatewayClient, 1024U> ClientSession;
+typedef jw::UpstreamLink<ClientSession> GatewayLink;
+
+struct GatewayClient : jw::PacketSplitter {
+    jw::AdmissionTicket admission;
+    std::shared_ptr<GatewayLink> link;  // 转发到的上游连接，读循环结束时清空，用std::atomic_load/atomic_store访问
+    uint32_t relayId = 0;
+};
+
+// 网关：持有客户端连接，把客户端的包经少数几条上游连接转发给一个或多个游戏服（见UpstreamLink.hpp）
+// 游戏逻辑只在游戏服上运行，网关只做分包、准入控制和转发，连接数和游戏逻辑的CPU可以分别扩展
+// 新客户端轮询分配到一条已连上的上游连接，之后一直经这条连接转发
+// 上游连接断开时它转发的客户端都断开，之后每秒重连一次
+class GatewayProxy {
+public:
+    GatewayProxy() {
+        jw::TimerEngine::getInstance()->registerTimer(reinterpret_cast<uintptr_t>(this), std::chrono::seconds(10), jw::TimerEngine::REPEAT_FOREVER, [this](int64_t) {
+            _logStats();
+        });
+    }
+
+    ~GatewayProxy() {
+        jw::TimerEngine::getInstance()->unregisterTimer(reinterpret_cast<uintptr_t>(this));
+    }
+
+    // 网关不解析包，不知道何时握手完成，只限制速率和同一IP的连接数
+    jw::AdmissionPolicy getAdmissionPolicy() const {
+        jw::AdmissionPolicy policy;
+        policy.acceptRate = jw::RateLimit(1000, 2000);
+        policy.maxPerAddress = 64;
+        policy.overloadAction = jw::OverloadAction::Queue;
+        policy.maxQueued = 8192;
+        policy.maxQueueWait = std::chrono::seconds(10);
+        return policy;
+    }
+
+    void attachService(asio::io_service &) {
+    }
+
+    // 连接游戏服，每个地址linksPerUpstream条上游连接，分布在池中各个io_service上
+    // 须在IOService构造之后调用一次，连上之前到来的客户端直接断开
+    void connectUpstreams(jw::IOServicePool &pool, const std::vector<asio::ip::tcp::endpoint> &endpoints, size_t linksPerUpstream) {
+        std::vector<_Upstream *> upstreams;
+        {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            for (size_t i = 0; i < endpoints.size(); ++i) {
+                for (size_t k = 0; k < linksPerUpstream; ++k) {
+                    _upstreams.push_back(std::unique_ptr<_Upstream>(new _Upstream(pool.getNextService(), endpoints[i])));
+                    upstreams.push_back(_upstreams.back().get());
+                }
+            }
+        }
+        std::for_each(upstreams.begin(), upstreams.end(), [this](_Upstream *u) {
+            _connect(*u);
+        });
+    }
+
+    void acceptCallback(asio::ip::tcp::socket &&socket, const jw::AdmissionTicket &ticket) {
+        std::shared_ptr<GatewayLink> link = _pickLink();
+        if (link == nullptr) {
+            LOG_WARN("no upstream connected, drop client");
+            return;
+        }
+
+        ClientSession::SessionPtr s = _sessionPool.acquire(std::move(socket),
+            std::bind(&GatewayProxy::_clientCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+        s->admission = ticket;
+        s->admission.completeHandshake();
+        s->link = link;
+        // id回绕后可能仍被这条上游连接上的老客户端占用，跳过；0不用
+        do {
+            s->relayId = _nextRelayId++;
+        } while (s->relayId == 0 || !link->tryBind(s->relayId, s));
+        if (!link->isConnected()) {
+            // 上游连接刚刚断开，它的映射可能已经清理过
+            link->unbind(s->relayId);
+            s->link.reset();
+            s->admission.release();
+            return;
+        }
+
+        // Open须在这个客户端的任何Data之前发出，此时读还没有开始
+        char address[64];
+        snprintf(address, sizeof(address), "%s:%hu", s->getRemoteIP().c_str(), s->getRemotePort());
+        link->sendFrame(s->relayId, jw::LinkFrame::Open, address, strlen(address));
+        s->start();
+    }
+
+private:
+    // 一条上游连接
+    struct _Upstream {
+        asio::ip::tcp::endpoint endpoint;
+        asio::ip::tcp::socket socket;  // 正在连接的socket
+        asio::steady_timer retryTimer;
+        std::shared_ptr<GatewayLink> link;  // 已连上时不为空，由_mutex保护
+
+        _Upstream(asio::io_service &service, const asio::ip::tcp::endpoint &ep) : endpoint(ep), socket(service), retryTimer(service) { }
+    };
+
+    void _connect(_Upstream &u) {
+        u.socket = asio::ip::tcp::socket(u.retryTimer.get_io_service());
+        u.socket.async_connect(u.endpoint, [this, &u](std::error_code ec) {
+            if (ec) {
+                LOG_DEBUG("failed to connect upstream %s:%hu: %s", u.endpoint.address().to_string().c_str(), u.endpoint.port(), ec.message().c_str());
+                _retry(u);
+                return;
+            }
+
+            std::shared_ptr<GatewayLink> link = std::make_shared<GatewayLink>();
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                u.link = link;
+            }
+            link->start(std::move(u.socket), std::bind(&GatewayProxy::_linkCallback, this, &u,
+                std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
+            LOG_INFO("upstream %s:%hu connected", u.endpoint.address().to_string().c_str(), u.endpoint.port());
+        });
+    }
+
+    void _retry(_Upstream &u) {
+        u.retryTimer.expires_from_now(std::chrono::seconds(1));
+        u.retryTimer.async_wait([this, &u](std::error_code ec) {
+            if (!ec) {
+                _connect(u);
+            }
+        });
+    }
+
+    // 轮询取一条已连上的上游连接，都没连上时返回空
+    std::shared_ptr<GatewayLink> _pickLink() {
+        std::lock_guard<jw::QuickMutex> g(_mutex);
+        (void)g;
+        for (size_t i = 0, cnt = _upstreams.size(); i < cnt; ++i) {
+            const std::shared_ptr<GatewayLink> &link = _upstreams[_nextUpstream++ % cnt]->link;
+            if (link != nullptr) {
+                return link;
+            }
+        }
+        return std::shared_ptr<GatewayLink>();
+    }
+
+    // 读循环的回调（数据和读结束）依次执行，发送失败的回调可能在另一个线程上，所以link用原子操作读写
+    void _clientCallback(const ClientSession::SessionPtr &s, jw::SessionEvent event, const char *data, size_t length) {
+        std::shared_ptr<GatewayLink> link = std::atomic_load(&s->link);
+        if (data != nullptr) {
+            // 包体原样转发，多个客户端的包在上游连接上合并成一次写；已断开的不再转发
+            if (link != nullptr && s->isConnected()) {
+                link->sendFrame(s->relayId, jw::LinkFrame::Data, data, length);
+            }
+            return;
+        }
+        // 发送失败（Send）和读循环结束（Recv）各回调一次，两者之间还可能收到数据
+        // 只在第一次断开时通知游戏服；游戏服或上游连接先断开的已关闭过，不再通知
+        if (s->close() && link != nullptr) {
+            link->relayClose(s->relayId);
+        }
+        s->admission.release();
+        if (event == jw::SessionEvent::Recv) {
+            // 读循环结束后这个客户端不会再有数据，回收到池中的会话不再持有上游连接
+            std::atomic_store(&s->link, std::shared_ptr<GatewayLink>());
+        }
+    }
+
+    void _linkCallback(_Upstream *u, GatewayLink &link, uint32_t id, jw::LinkFrame type, const char *data, size_t length) {
+        if (data == nullptr) {
+            {
+                std::lock_guard<jw::QuickMutex> g(_mutex);
+                (void)g;
+                if (u->link.get() == &link) {
+                    u->link.reset();
+                }
+            }
+            std::vector<ClientSession::SessionPtr> sessions = link.unbindAll();
+            LOG_WARN("upstream %s:%hu disconnected, dropping %lu client(s)", u->endpoint.address().to_string().c_str(), u->endpoint.port(), (unsigned long)sessions.size());
+            std::for_each(sessions.begin(), sessions.end(), [](const ClientSession::SessionPtr &s) {
+                s->close();
+            });
+            _retry(*u);
+            return;
+        }
+
+        switch (type) {
+        case jw::LinkFrame::Data: {
+            // 游戏服发来的已是带包头的包，原样发给客户端
+            ClientSession::SessionPtr s = link.find(id);
+            if (s != nullptr) {
+                s->deliver(data, length);
+            }
+            break;
+        }
+        case jw::LinkFrame::Close: {
+            ClientSession::SessionPtr s = link.unbind(id);
+            if (s != nullptr) {
+                s->close();
+            }
+            break;
+        }
+        default:
+            LOG_WARN("unknown link frame %u from upstream %s:%hu", (unsigned)type, u->endpoint.address().to_string().c_str(), u->endpoint.port());
+            break;
+        }
+    }
+
+    void _logStats() {
+        size_t connected = 0, total = 0, clients = 0;
+        uint64_t upFrames = 0, upBatches = 0, downFrames = 0;
+        {
+            std::lock_guard<jw::QuickMutex> g(_mutex);
+            (void)g;
+            total = _upstreams.size();
+            for (size_t i = 0; i < total; ++i) {
+                if (_upstreams[i]->link != nullptr) {
+                    jw::LinkStats stats = _upstreams[i]->link->getStats();
+                    ++connected;
+                    clients += stats.sessions;
+                    upFrames += stats.sentFrames;
+                    upBatches += stats.sentBatches;
+                    downFrames += stats.receivedFrames;
+                }
+            }
+        }
+        if (total != 0) {
+            LOG_INFO("gateway: %lu client(s) on %lu of %lu upstream link(s), sent %llu frame(s) in %llu write(s), received %llu frame(s)",
+                (unsigned long)clients, (unsigned long)connected, (unsigned long)total,
+                (unsigned long long)upFrames, (unsigned long long)upBatches, (unsigned long long)downFrames);
+        }
+    }
+
+    jw::SessionPool<ClientSession> _sessionPool;
+    std::vector<std::unique_ptr<_Upstream> > _upstreams;  // connectUpstreams之后不再变化
+    size_t _nextUpstream = 0;
+    jw::QuickMutex _mutex;
+    std::atomic<uint32_t> _nextRelayId{ 1 };
+};
+
+typedef jw::BasicServer<GatewayProxy, 128> Gateway;
+
+#endif
@@ -0,0 +1,67 @@
+#include "../common-test/IOService.hpp"
+#include "Gateway.h"
+#include "../common-test/TimerEngine.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    system("chcp 65001");
+
+    // --port <port>：客户端端口，默认8899
+    // --upstream <ip:port>：游戏服接受网关的地址（游戏服的--gateway参数），可以有多个
+    // --links <n>：到每个游戏服的上游连接数，默认2
+    // 可选参数：io线程使用的CPU列表和定时器线程使用的CPU列表，同游戏服
+    unsigned short port = 8899;
+    size_t links = 2;
+    std::vector<asio::ip::tcp::endpoint> upstreams;
+    std::vector<const char *> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = (unsigned short)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--links") == 0 && i + 1 < argc) {
+            links = (size_t)std::max(atoi(argv[++i]), 1);
+        }
+        else if (strcmp(argv[i], "--upstream") == 0 && i + 1 < argc) {
+            std::string address = argv[++i];
+            std::string::size_type pos = address.rfind(':');
+            std::error_code ec;
+            asio::ip::address ip = asio::ip::address::from_string(address.substr(0, pos), ec);
+            if (pos == std::string::npos || ec) {
+                LOG_ERROR("invalid upstream address %s", address.c_str());
+                return 1;
+            }
+            upstreams.push_back(asio::ip::tcp::endpoint(ip, (unsigned short)atoi(address.c_str() + pos + 1)));
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+    if (upstreams.empty()) {
+        LOG_ERROR("usage: gateway [--port <port>] [--links <n>] --upstream <ip:port> [--upstream <ip:port> ...] [io cpus] [timer cpus]");
+        return 1;
+    }
+
+    jw::ThreadTopology topology;
+    if (args.size() > 0) {
+        topology = jw::ThreadTopology::servicePerCpu(jw::parseCpuList(args[0]));
+    }
+    if (args.size() > 1) {
+        topology.timerCpus = jw::parseCpuList(args[1]);
+    }
+
+    jw::TimerEngine::getInstance()->setAffinity(topology.timerCpus);
+    {
+        jw::IOService<Gateway> s(port, jw::IOServiceMode::ServicePerCore, topology);
+        s.getServer().connectUpstreams(s.getPool(), upstreams, links);
+        getchar();
+    }
+    jw::TimerEngine::destroyInstance();
+    return 0;
+}
+
+#include "../common-test/LogUtil.cpp"
+#include "../common-test/TimerEngine.cpp"